@@ -0,0 +1,30 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <inttypes.h>
+
+/*
+ * Large page memory
+ * Regions are mapped anonymous, backed by explicit huge pages ( hugetlb,
+ * pages must be reserved ) or by transparent huge pages asked for with
+ * madvise. Prefaulting touches every page from several threads at start,
+ * locking keeps the pages resident, so serving takes no page faults.
+ */
+#define ARENA_PREFAULT_CHUNK    (64 * 1024 * 1024)  /* Work item of a prefault thread */
+
+enum
+{
+    ARENA_PAGES_DEFAULT,            /* Base pages */
+    ARENA_PAGES_THP,                /* Transparent huge pages */
+    ARENA_PAGES_2M,                 /* hugetlb 2 MB */
+    ARENA_PAGES_1G,                 /* hugetlb 1 GB */
+};
+
+void* arena_map(uint64_t *size, int *pages);
+void arena_unmap(void *base, uint64_t size);
+int arena_advise(void *base, uint64_t size, int pages);
+int arena_prefault(void *base, uint64_t size, int threads);
+int arena_lock(void *base, uint64_t size);
+const char* arena_pages_name(int pages);
+
+#endif
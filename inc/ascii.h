@@ -0,0 +1,23 @@
+#ifndef _ASCII_H_
+#define _ASCII_H_
+
+#include <inttypes.h>
+
+/*
+ * Text protocol tokenizer
+ * Works in place on the receive buffer, a token points into it, nothing is
+ * copied. Line ends and spaces are found 16 bytes at a time with SSE2 where
+ * the compiler has it, byte by byte otherwise.
+ */
+typedef struct ascii_token_s
+{
+    uint8_t *data;
+    uint32_t len;
+} ascii_token_t;
+
+int ascii_eol(const uint8_t *buf, uint32_t len);
+int ascii_tokens(uint8_t *line, uint32_t len, ascii_token_t *tokens, int max);
+int ascii_number(const ascii_token_t *token, uint64_t *value);
+int ascii_is(const ascii_token_t *token, const char *word);
+
+#endif
@@ -1,25 +1,35 @@
 #ifndef _AVL_H_
 #define _AVL_H_
 
+#include <inttypes.h>
+
+/*
+ * Nodes are embedded in the data they index, a tree never allocates them.
+ * A tree only writes the members, the data may overlay the padding after
+ * height with its own fields
+ */
 typedef struct avl_node_s
 {
-    int height;
     struct avl_node_s *left;
     struct avl_node_s* right;
-    void *data;
+    uint8_t height;                 /* Below 64 for any tree that fits memory */
 } avl_node_t;
 
 typedef int (*avl_compare_t)(avl_node_t* node1, avl_node_t *node2);
-typedef int (*avl_free_data_t)(void* data);
-typedef void (*avl_dump_data_t)(void* data);
+typedef int (*avl_free_data_t)(avl_node_t* node);
+typedef void (*avl_dump_data_t)(avl_node_t* node);
 typedef struct avl_tree_s
 {
     int count;
     avl_node_t *head;
 } avl_tree_t;
 
-int avl_insert(avl_tree_t* tree, void *data , avl_node_t** dup);
-avl_node_t *avl_find(avl_tree_t* tree, void *data);
+int avl_insert(avl_tree_t* tree, avl_node_t *node, avl_node_t** replaced);
+int avl_replace(avl_tree_t* tree, avl_node_t *old, avl_node_t *node);
+avl_node_t *avl_find(avl_tree_t* tree, avl_node_t *key);
+int avl_delete(avl_tree_t* tree, avl_node_t *key, avl_node_t **removed);
+int avl_build(avl_tree_t* tree, avl_node_t **nodes, int count);
+int avl_walk(avl_tree_t* tree, int (*fn)(void *arg, avl_node_t *node), void *arg);
 
 int avl_init( avl_compare_t compare, avl_free_data_t free_data, avl_dump_data_t dump_data );
 avl_tree_t* avl_create( void );
@@ -2,17 +2,156 @@
 #define _CACHE_H_
 
 #include <inttypes.h>
+#include <pthread.h>
+#include <sys/types.h>
 #include "cache_data.h"
 #include "hash_table.h"
+#include "hotkeys.h"
+#include "tinylfu.h"
+#include "slab.h"
+#include "extstore.h"
+#include "compress.h"
+#include "tiny.h"
+#include "arena.h"
+#include "topo.h"
+#include "lease.h"
+#include "index.h"
+
+/* Share of memory limit for the admission window, in percent */
+#define CACHE_WINDOW_PERCENT    1
+
+/* Items looked at for a victim before taking the LRU tail as is */
+#define CACHE_EVICT_TRIES       8
+
+/* Items looked at for one of the right size when storage is full */
+#define CACHE_RECLAIM_TRIES     64
+
+/* Values of at least this size move to external store when evicted */
+#define CACHE_EXT_MIN_DEFAULT   512
+
+/* Share of memory limit for items with value in external store, in percent */
+#define CACHE_EXT_INDEX_PERCENT 25
+
+/* Compaction rewrites live values of a page at most this full, in percent,
+ * fuller pages are dropped with their items */
+#define CACHE_EXT_RESCUE_PERCENT 50
+
+/* Keys up to this size are looked up without an allocation */
+#define CACHE_KEY_STACK         256
+
+/* Stores of keys hashing to one lock are serialized, so a tiny and a
+ * general store of a key or an increment and a store do not interleave */
+#define CACHE_KEY_LOCKS         1024
+#define CACHE_INCR_DIGITS       20                  /* Of largest 64 bit value */
+
+/* Average item size assumed to size admission sketch */
+#define CACHE_ITEM_SIZE_GUESS   256
+
+/* Namespaces hash to this many flush marks, a power of two */
+#define CACHE_NS_SLOTS          4096
+
+/* Deletes a key of cachedb_prefix_delete(), returns as cachedb_delete() */
+typedef int (*cache_prefix_fn_t)(void *arg, uint8_t *key, uint32_t key_len);
+
+/* Called when a value handed out as file range is no longer read */
+typedef void (*cache_file_done_t)(void *arg, uint64_t tag);
+
+/* Value of an item as a range of a file */
+typedef struct cache_file_s
+{
+    int fd;
+    off_t off;
+    cache_file_done_t done;         /* Must be called with arg and tag */
+    void *arg;
+    uint64_t tag;
+} cache_file_t;
+
+typedef struct cache_lru_s
+{
+    int id;
+    cache_data_t *head;             /* Most recently used */
+    cache_data_t *tail;
+    uint64_t bytes;
+} cache_lru_t;
 
 typedef struct cache_s
 {
     hash_table_t *ht;
+    hotkeys_t *hot;
+    tinylfu_t *lfu;                 /* Admission filter, optional */
+    slab_t *storage;                /* Mapped item storage, optional */
+    uint64_t limit;                 /* Memory limit in bytes, 0 unlimited */
+    uint64_t window_limit;
+    pthread_mutex_t lru_lock;       /* LRU lists and counters below */
+    cache_lru_t main;
+    cache_lru_t window;
+    uint64_t items;
+    uint64_t evictions;
+    uint64_t rejections;            /* New items refused by admission */
+    extstore_t *ext;                /* Second tier for cold values, optional */
+    uint32_t ext_min;
+    uint64_t ext_limit;             /* Memory budget of ext_lru */
+    cache_lru_t ext_lru;
+    uint64_t ext_items;             /* Items with value in ext */
+    uint64_t ext_compactions;
+    uint64_t ext_rescued;
+    uint64_t ext_dropped;
+    int ext_stop;
+    pthread_t ext_tid;              /* Compaction */
+    pthread_mutex_t ext_lock;
+    pthread_cond_t ext_cond;
+    compress_t *comp;               /* Value compression, optional */
+    tiny_t *tiny;                   /* Slots for very small items, optional */
+    uint64_t tiny_promotions;       /* Tiny items that grew into an item */
+    int arena_pages;                /* ARENA_PAGES_ of storage and tables */
+    int arena_threads;              /* Prefault threads, 0 no prefault */
+    int arena_lock;                 /* Lock memory */
+    uint64_t arena_locked;          /* Bytes locked */
+    topo_t *topo;                   /* NUMA nodes, optional, not owned */
+    pthread_mutex_t key_lock[CACHE_KEY_LOCKS];
+    lease_t *lease;                 /* Leases on misses, optional */
+    uint32_t gen;                   /* Stamp of items stored now */
+    uint32_t flushed;               /* Items of this stamp and older are gone */
+    uint32_t flush_at;              /* Second of a delayed flush, 0 none */
+    uint32_t *ns_flushed;           /* Marks of namespace slots, optional */
+    uint8_t ns_delim;               /* Ends the namespace of a key */
+    uint64_t flushes;
+    uint64_t ns_flushes;
+    uint64_t flush_reclaimed;       /* Flushed items taken out as they were found */
+    uint64_t cas;                   /* Last CAS given to an item */
+    index_t *index;                 /* Keys in order, optional */
 } cachedb_t;
 
 cachedb_t* cachedb_create(int hash_size);
+int cachedb_limit(cachedb_t *cachedb, uint64_t limit, int admission);
+int cachedb_numa(cachedb_t *cachedb, topo_t *topo);
+int cachedb_arena(cachedb_t *cachedb, int pages, int threads, int lock);
+int cachedb_storage(cachedb_t *cachedb, const char *path);
+int cachedb_extstore(cachedb_t *cachedb, const char *path, uint64_t size, uint32_t min_value);
+int cachedb_compress(cachedb_t *cachedb, compress_t *comp);
+int cachedb_tiny(cachedb_t *cachedb, uint64_t size);
+int cachedb_leases(cachedb_t *cachedb, uint32_t lease_ms, uint32_t stale_ms);
+int cachedb_namespaces(cachedb_t *cachedb, uint8_t delim);
+int cachedb_index(cachedb_t *cachedb);
+int cachedb_value(cachedb_t *cachedb, cache_data_t *d, uint8_t *val, uint32_t *len, int stored);
+int cachedb_value_file(cachedb_t *cachedb, cache_data_t *d, cache_file_t *file);
+int cachedb_load(cachedb_t *cachedb, uint32_t bucket, cache_data_t **items, int count);
 int cachedb_get(cachedb_t *cachedb,  cache_data_t **centry, uint8_t *key, uint8_t *val, int key_len, int *val_len );
+int cachedb_get_many(cachedb_t *cachedb, uint8_t **keys, uint32_t *key_lens, int count, cache_data_t **found);
+int cachedb_get_tiny(cachedb_t *cachedb, uint8_t *key, int key_len, uint8_t *val, uint32_t *val_len);
 int cachedb_set(cachedb_t *cachedb, cache_data_t **centry, uint8_t *key, uint8_t *val, int key_len, int val_len  );
+int cachedb_set_extra(cachedb_t *cachedb, uint8_t *key, uint8_t *val, int key_len, int val_len,
+                      uint8_t *extra, uint8_t extra_len, uint32_t *cas);
+int cachedb_delete(cachedb_t *cachedb, uint8_t *key, int key_len);
+int cachedb_lease_get(cachedb_t *cachedb, cache_data_t **centry, uint8_t *key, int key_len, uint32_t *token);
+int cachedb_lease_set(cachedb_t *cachedb, uint8_t *key, uint8_t *val, int key_len, int val_len, uint32_t token);
+int cachedb_incr(cachedb_t *cachedb, uint8_t *key, int key_len, uint64_t delta, int decr,
+                 uint64_t initial, int create, uint64_t *value);
+int cachedb_flush(cachedb_t *cachedb, uint32_t delay);
+int cachedb_flush_ns(cachedb_t *cachedb, uint8_t *ns, int ns_len);
+int cachedb_flushed(cachedb_t *cachedb, cache_data_t *d);
+int64_t cachedb_prefix_count(cachedb_t *cachedb, uint8_t *prefix, int prefix_len);
+int64_t cachedb_prefix_delete(cachedb_t *cachedb, uint8_t *prefix, int prefix_len, cache_prefix_fn_t fn, void *arg);
 
 //int cachedb_invalidate(cachedb_t *cachedb);
 void cachedb_destroy(cachedb_t *cachedb);
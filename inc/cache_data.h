@@ -2,27 +2,84 @@
 #define _CACHE_DATA_H_
 
 #include <inttypes.h>
+#include <stddef.h>
+#include "avl.h"
+#include "slab.h"
 
 #define CACHE_KEY(x)    (&((x)->data[0]))
 #define CACHE_VAL(x)    (&((x)->data[(x)->key_len]))
 
+/* Location of value in external store, items with ext set only */
+#define CACHE_EXT_LOC(x) ((uint64_t*)&((x)->data[((x)->key_len + 7) & ~7]))
+
 #define CACHE_EXTRA_LEN 8
 
+/* Longest key of an item, key_len is 16 bits */
+#define CACHE_KEY_MAX   UINT16_MAX
+
+/* LRU list an item is on */
+enum
+{
+    CACHE_LRU_NONE,
+    CACHE_LRU_MAIN,
+    CACHE_LRU_WINDOW,
+    CACHE_LRU_EXT,                  /* Items with value in external store */
+};
+
+/*
+ * Items are reference counted, the hash table and the LRU hold one
+ * reference each and every lookup holds one until released
+ * An item is a single allocation, index and LRU links are part of its
+ * header and the key follows right after it
+ * The small fields sit in the padding of the index node, slab, ext and
+ * comp are only written before the item is published, lru under lru_lock.
+ * active and removed are updated atomically and keep a byte each
+ */
 typedef struct cache_data_s
 {
-    uint32_t key_len;
+    union
+    {
+        avl_node_t node;            /* Index links, bucket lock, must be first */
+        struct
+        {
+            uint8_t node_used[offsetof(avl_node_t, height) + sizeof(uint8_t)];
+            uint8_t lru:2;
+            uint8_t slab:1;         /* Allocated from item storage */
+            uint8_t ext:1;          /* Value is in external store */
+            uint8_t comp:2;         /* Value is compressed, COMPRESS_ type */
+            uint16_t key_len;
+            uint8_t active;         /* Accessed since last LRU pass */
+            uint8_t removed;        /* Out of hash table */
+        };
+    };
+    struct cache_data_s *prev;      /* LRU links, cachedb lru_lock */
+    struct cache_data_s *next;
+    uint32_t refcount;
     uint32_t val_len;
     uint32_t flag;
     uint32_t expire;
-    uint32_t cas[2];        
+    uint32_t gen;                   /* Stamp of store, see cachedb_flush() */
+    uint32_t cas[2];
     uint8_t data[0];
 } cache_data_t;
 
+/* Item of an index node */
+#define CACHE_NODE_DATA(n)  ((cache_data_t*)((uint8_t*)(n) - offsetof(cache_data_t, node)))
+
 int cache_data_cmpkey(cache_data_t* d1, cache_data_t* d2);
 cache_data_t* cache_data_alloc(uint32_t key_len, uint32_t val_len, uint8_t *key, uint8_t *val);
+cache_data_t* cache_data_item_alloc(uint32_t key_len, uint32_t val_len, uint8_t *key, uint8_t *val);
+cache_data_t* cache_data_key(void *mem, uint32_t key_len, uint8_t *key);
+cache_data_t* cache_data_ext_alloc(uint32_t key_len, uint32_t val_len, uint8_t *key, uint64_t loc);
+void cache_data_storage(slab_t *slab);
 void cache_data_free(cache_data_t *d);
+cache_data_t* cache_data_ref(cache_data_t *d);
+int cache_data_release(cache_data_t *d);
+uint32_t cache_data_size(cache_data_t *d);
 void cache_data_dump(cache_data_t *d);
 uint32_t cache_data_hash(cache_data_t * d, uint32_t size);
+uint64_t cache_data_key_hash(const uint8_t *key, uint32_t len);
+uint32_t cache_data_key_bucket(uint8_t *key, uint32_t len, uint32_t size);
 void cache_data_set(cache_data_t *d, uint8_t *extra, uint8_t extra_len , uint32_t* cas);
 void cache_data_get(cache_data_t *d, uint8_t *extra, uint8_t *extra_len , uint32_t* cas);
 #endif
@@ -0,0 +1,52 @@
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <inttypes.h>
+
+/*
+ * Traffic capture
+ * Sampled requests are written as fixed size records into a ring kept in
+ * a memory mapped file, so writing a record is a copy into page cache.
+ * Once the ring is full oldest records are overwritten.
+ */
+#define CAPTURE_MAGIC           0x4d434150      /* "MCAP" */
+#define CAPTURE_VERSION         1
+#define CAPTURE_RECORDS_DEFAULT (1024 * 1024)
+
+typedef struct capture_header_s
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t sample;            /* One of sample requests is captured */
+    uint64_t capacity;          /* Records in ring */
+    uint64_t head;              /* Records written since start */
+    uint64_t start_time;        /* Wall clock of capture start, ns */
+    uint8_t reserved[24];
+} capture_header_t;
+
+typedef struct capture_record_s
+{
+    uint64_t time;              /* ns since capture start, 0 while being written */
+    uint64_t key_hash;
+    uint32_t val_len;
+    uint16_t key_len;
+    uint8_t opcode;
+    uint8_t reserved;
+} capture_record_t;
+
+typedef struct capture_s
+{
+    int fd;
+    uint32_t sample;
+    uint64_t start;             /* Monotonic clock at start */
+    uint64_t size;
+    capture_header_t *header;
+    capture_record_t *records;
+} capture_t;
+
+capture_t* capture_create(const char *path, uint32_t sample, uint64_t capacity);
+void capture_record(capture_t *capture, uint64_t now, uint8_t opcode, const uint8_t *key, uint16_t key_len, uint32_t val_len);
+void capture_destroy(capture_t *capture);
+
+#endif
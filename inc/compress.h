@@ -0,0 +1,63 @@
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include <inttypes.h>
+#include <pthread.h>
+
+/*
+ * Value compression
+ * Values of at least min bytes are deflated ( zlib ) when that saves at
+ * least an eighth. A stored value is a frame of the original length and
+ * the zlib stream. With a dictionary file the first COMPRESS_TRAIN_BYTES
+ * of sampled values train a preset dictionary, it is saved to the file
+ * and taken from there on next start. Every thread keeps its own streams.
+ */
+#define COMPRESS_MIN_DEFAULT    1024
+#define COMPRESS_LEVEL_DEFAULT  1
+#define COMPRESS_DICT_SIZE      (16 * 1024)
+#define COMPRESS_TRAIN_BYTES    (256 * 1024)
+#define COMPRESS_TRAIN_SAMPLE   (4 * 1024)      /* Bytes sampled of a value */
+#define COMPRESS_TRAIN_SEGMENT  64              /* Dictionary is made of these */
+#define COMPRESS_TRAIN_STEP     16
+#define COMPRESS_TRAIN_GRAM     8
+#define COMPRESS_TRAIN_BITS     20              /* Gram count table size */
+
+/* Frame in front of a compressed value */
+#define COMPRESS_FRAME_SIZE     4
+#define COMPRESS_RAW_LEN(p)     (((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | \
+                                 ((uint32_t)(p)[2] << 8) | (uint32_t)(p)[3])
+
+/* Compression of a stored value */
+enum
+{
+    COMPRESS_NONE,
+    COMPRESS_DEFLATE,
+    COMPRESS_DICT,                  /* Deflate with preset dictionary */
+};
+
+typedef struct compress_s
+{
+    uint32_t min;
+    int level;
+    char *dict_path;                /* Dictionary file, optional */
+    uint8_t *dict;                  /* Set once trained or loaded */
+    uint32_t dict_len;
+    pthread_key_t key;              /* Streams of a thread */
+    pthread_mutex_t lock;           /* Training samples */
+    uint8_t *samples;
+    uint32_t sampled;
+    uint64_t values;                /* Values stored compressed */
+    uint64_t skipped;               /* Values not worth it */
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t inflates;
+    uint64_t failures;
+} compress_t;
+
+compress_t* compress_create(uint32_t min, int level, const char *dict_path);
+int compress_value(compress_t *comp, const uint8_t *val, uint32_t len, uint8_t **out, uint32_t *out_len, uint8_t *type);
+int compress_inflate(compress_t *comp, uint8_t type, const uint8_t *in, uint32_t in_len, uint8_t *out, uint32_t out_len);
+int compress_readable(compress_t *comp, uint8_t type);
+void compress_destroy(compress_t *comp);
+
+#endif
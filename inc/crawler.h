@@ -0,0 +1,48 @@
+#ifndef _CRAWLER_H_
+#define _CRAWLER_H_
+
+#include <inttypes.h>
+#include "cache.h"
+
+/*
+ * Keyspace crawler
+ * A cursor walks the buckets of the hash table and then the sets of the
+ * tiny table. A step goes on until count keys matched or it looked at
+ * CRAWLER_STEP_BUCKETS positions, so a step takes bounded time whatever
+ * the pattern. A bucket is read locked only while references to its items
+ * are taken, keys are matched and handed out after. Cursor 0 starts a walk
+ * and is what a step leaves once the walk is done. Keys that stay for the
+ * whole walk are seen once, keys set or deleted meanwhile may not be.
+ * Flushed items are not handed out, they are taken out of the cache as the
+ * walk comes by, so a full walk reclaims all of them.
+ */
+#define CRAWLER_STEP_BUCKETS    1024
+#define CRAWLER_COUNT_DEFAULT   100
+#define CRAWLER_COUNT_MAX       1000
+
+/* Where the value of an item is */
+enum
+{
+    CRAWLER_LOC_MEM,
+    CRAWLER_LOC_EXT,
+    CRAWLER_LOC_TINY,
+};
+
+typedef struct crawler_item_s
+{
+    const uint8_t *key;
+    uint32_t key_len;
+    uint32_t val_len;               /* As stored, compressed values smaller */
+    uint32_t expire;
+    int loc;
+} crawler_item_t;
+
+/* Called for every key that matched, non zero stops the step */
+typedef int (*crawler_fn_t)(void *arg, const crawler_item_t *item);
+
+int crawler_step(cachedb_t *cache, uint64_t *cursor, const uint8_t *pattern, uint32_t pattern_len,
+                 uint32_t count, crawler_fn_t fn, void *arg);
+int crawler_match(const uint8_t *pattern, uint32_t pattern_len, const uint8_t *key, uint32_t key_len);
+const char* crawler_loc(int loc);
+
+#endif
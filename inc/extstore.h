@@ -0,0 +1,88 @@
+#ifndef _EXTSTORE_H_
+#define _EXTSTORE_H_
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/*
+ * External value store
+ * Values are appended to large pages of a local file through a write
+ * buffer, so the device only sees big sequential writes. A value is found
+ * again by a location packing page, page version and offset. Pages are
+ * reused as a whole, freeing a page bumps its version so locations into
+ * its old content no longer match.
+ */
+#define EXTSTORE_PAGE_SIZE      (16 * 1024 * 1024)
+#define EXTSTORE_PAGES_MIN      4
+#define EXTSTORE_WBUF_SIZE      (1024 * 1024)
+
+/* Below this many free pages compaction should start */
+#define EXTSTORE_FREE_MIN       2
+
+#define EXTSTORE_LOC(page, version, offset) \
+    (((uint64_t)(page) << 48) | ((uint64_t)(version) << 32) | (uint32_t)(offset))
+#define EXTSTORE_LOC_PAGE(loc)      ((uint32_t)((loc) >> 48))
+#define EXTSTORE_LOC_VERSION(loc)   ((uint16_t)((loc) >> 32))
+#define EXTSTORE_LOC_OFFSET(loc)    ((uint32_t)(loc))
+
+enum
+{
+    EXTSTORE_PAGE_FREE,
+    EXTSTORE_PAGE_OPEN,             /* Being written */
+    EXTSTORE_PAGE_FULL,
+    EXTSTORE_PAGE_DRAINING,         /* Freed, waits for pins to go */
+};
+
+/* In front of every value in a page */
+typedef struct extstore_record_s
+{
+    uint16_t key_len;
+    uint16_t reserved;
+    uint32_t val_len;
+    uint8_t data[0];                /* Key then value */
+} extstore_record_t;
+
+typedef struct extstore_page_s
+{
+    uint16_t version;
+    uint8_t state;
+    uint32_t used;                  /* Bytes written */
+    uint32_t live;                  /* Bytes of values still referenced */
+    uint64_t seq;                   /* Fill order */
+    uint32_t pins;                  /* Values being sent from file */
+} extstore_page_t;
+
+typedef struct extstore_s
+{
+    int fd;
+    uint32_t page_size;
+    uint32_t pages;
+    uint32_t free;                  /* Pages in state free */
+    uint32_t open;                  /* Page being written */
+    uint64_t seq;
+    pthread_mutex_t lock;           /* Pages and write buffer */
+    extstore_page_t *page;
+    uint8_t *wbuf;
+    uint32_t wpos;                  /* Page offset of write buffer start */
+    uint32_t wlen;
+    uint64_t writes;
+    uint64_t bytes_written;
+    uint64_t reads;
+    uint64_t read_misses;
+    uint64_t pinned;                /* Values handed out as file ranges */
+} extstore_t;
+
+extstore_t* extstore_create(const char *path, uint64_t size);
+int extstore_write(extstore_t *ext, const uint8_t *key, uint16_t key_len, const uint8_t *val, uint32_t val_len, uint64_t *loc);
+int extstore_read(extstore_t *ext, uint64_t loc, uint8_t *val, uint32_t len);
+int extstore_pin(extstore_t *ext, uint64_t loc, int *fd, off_t *off);
+void extstore_unpin(extstore_t *ext, uint64_t loc);
+void extstore_delete(extstore_t *ext, uint64_t loc, uint32_t len);
+uint32_t extstore_free_pages(extstore_t *ext);
+int extstore_victim(extstore_t *ext, uint32_t *live, uint32_t *used);
+int extstore_page_read(extstore_t *ext, uint32_t page, uint8_t *buf, uint16_t *version, uint32_t *used);
+void extstore_page_free(extstore_t *ext, uint32_t page, uint16_t version);
+void extstore_destroy(extstore_t *ext);
+
+#endif
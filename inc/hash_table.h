@@ -23,12 +23,24 @@ typedef struct hashtable_s
     hash_node_t table[0];
 }hash_table_t;
 
+/* Lookups of hash_table_search_many() in flight at once, and keys hashed
+ * ahead of them */
+#define HASH_TABLE_INFLIGHT     8
+#define HASH_TABLE_MANY         64
+
+/* Table is mapped on its own, so it can be backed by huge pages */
+#define HASH_TABLE_BYTES(size)  (sizeof(hash_table_t) + (sizeof(hash_node_t) * (uint64_t)(size)))
+
 void hash_table_init(void);
 hash_table_t* hash_table_create( uint32_t size);
-int hash_table_insert(hash_table_t *ht, cache_data_t* data,hash_data_node_t **dup);
-hash_data_node_t* hash_table_search(hash_table_t *ht, cache_data_t* data);
+int hash_table_insert(hash_table_t *ht, cache_data_t* data, cache_data_t **old);
+cache_data_t* hash_table_search(hash_table_t *ht, cache_data_t* data);
+int hash_table_search_many(hash_table_t *ht, uint8_t **keys, uint32_t *key_lens, int count, cache_data_t **found);
+cache_data_t* hash_table_remove(hash_table_t *ht, cache_data_t* data, cache_data_t *expect);
+cache_data_t* hash_table_replace(hash_table_t *ht, cache_data_t* data, cache_data_t *expect);
+int hash_table_walk(hash_table_t *ht, uint32_t bucket, int (*fn)(void *arg, void *data), void *arg);
+int hash_table_load(hash_table_t *ht, uint32_t bucket, cache_data_t **items, int count);
 void hash_table_destroy(hash_table_t *ht);
-cache_data_t* hash_get_cache(hash_data_node_t *hnode);
 
 
 #endif
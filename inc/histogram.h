@@ -0,0 +1,33 @@
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <inttypes.h>
+
+/*
+ * Log-linear (HDR style) histogram
+ * Every power of two range is split into HIST_SUB_COUNT linear buckets,
+ * so relative error of any recorded value is below 1/HIST_SUB_COUNT
+ */
+#define HIST_SUB_BITS   5
+#define HIST_SUB_COUNT  (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS   40      /* Highest trackable value 2^40 (~18 min in ns) */
+#define HIST_BUCKETS    ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+typedef struct histogram_s
+{
+    uint64_t count;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    uint64_t counts[HIST_BUCKETS];
+} histogram_t;
+
+histogram_t* histogram_create(void);
+void histogram_destroy(histogram_t *h);
+void histogram_reset(histogram_t *h);
+void histogram_record(histogram_t *h, uint64_t value);
+void histogram_merge(histogram_t *dst, histogram_t *src);
+uint64_t histogram_percentile(histogram_t *h, double percentile);
+uint64_t histogram_mean(histogram_t *h);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef _HOTKEYS_H_
+#define _HOTKEYS_H_
+
+#include <inttypes.h>
+#include <pthread.h>
+
+/*
+ * Hot key detection
+ * Sampled accesses are counted in a Count-Min sketch, keys whose estimate
+ * beats the coldest entry of a small top list replace it. Counts are
+ * halved every HOTKEYS_DECAY_SEC so the list follows current traffic.
+ */
+#define HOTKEYS_DEPTH           4
+#define HOTKEYS_WIDTH           4096        /* Power of two */
+#define HOTKEYS_TOP             16
+#define HOTKEYS_KEY_MAX         64          /* Longer keys are kept truncated */
+#define HOTKEYS_SAMPLE_DEFAULT  16
+#define HOTKEYS_DECAY_SEC       10
+
+typedef struct hotkey_s
+{
+    uint64_t hash;
+    uint64_t count;             /* Estimated accesses, sample rate applied */
+    uint32_t bucket;            /* Hash table bucket of key */
+    uint16_t key_len;           /* Full key length */
+    uint8_t key[HOTKEYS_KEY_MAX];
+} hotkey_t;
+
+typedef struct hotkeys_s
+{
+    uint32_t sample;            /* One of sample accesses is counted */
+    uint32_t threshold;         /* Estimate needed to enter top list */
+    uint32_t decays;
+    uint64_t decayed;           /* Monotonic time of last decay, ns */
+    int used;
+    pthread_mutex_t lock;       /* Top list and decay */
+    hotkey_t top[HOTKEYS_TOP];
+    uint32_t sketch[HOTKEYS_DEPTH][HOTKEYS_WIDTH];
+} hotkeys_t;
+
+hotkeys_t* hotkeys_create(uint32_t sample);
+void hotkeys_destroy(hotkeys_t *hot);
+int hotkeys_sampled(hotkeys_t *hot);
+void hotkeys_record(hotkeys_t *hot, const uint8_t *key, uint16_t key_len, uint32_t bucket);
+int hotkeys_top(hotkeys_t *hot, hotkey_t *top, int max, uint64_t *window);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef _INDEX_H_
+#define _INDEX_H_
+
+#include <inttypes.h>
+#include <pthread.h>
+
+/*
+ * Ordered key index
+ * Keys sorted byte by byte, so the keys of a prefix are next to each
+ * other, which the hash table can not give. Keys are spread over
+ * INDEX_SHARDS skiplists by hash, each under its own lock, a prefix is
+ * looked up in all of them. Nodes hold a copy of the key, not the item.
+ * The index may hold keys that are gone, callers check what it hands out.
+ */
+#define INDEX_SHARDS        16
+#define INDEX_LEVELS        16                      /* p 1/4, enough for 4G keys */
+
+/* Key of a node, after its links */
+#define INDEX_KEY(n)        ((uint8_t*)&(n)->next[(n)->height])
+
+typedef struct index_node_s
+{
+    uint16_t key_len;
+    uint8_t height;
+    struct index_node_s *next[0];
+} index_node_t;
+
+typedef struct index_shard_s
+{
+    pthread_mutex_t lock;
+    index_node_t *head;             /* Of INDEX_LEVELS links, no key */
+    int level;                      /* Links in use */
+    uint32_t seed;
+    uint64_t keys;
+    uint64_t bytes;
+} index_shard_t;
+
+typedef struct index_s
+{
+    index_shard_t shard[INDEX_SHARDS];
+} index_t;
+
+/* Key is still stored, called with its shard locked */
+typedef int (*index_live_t)(void *arg, const uint8_t *key, uint32_t key_len);
+
+/* Called for keys of a prefix, non zero stops */
+typedef int (*index_fn_t)(void *arg, const uint8_t *key, uint32_t key_len);
+
+index_t* index_create(void);
+int index_insert(index_t *index, uint64_t hash, const uint8_t *key, uint32_t key_len);
+int index_remove(index_t *index, uint64_t hash, const uint8_t *key, uint32_t key_len, index_live_t live, void *arg);
+int64_t index_prefix(index_t *index, const uint8_t *prefix, uint32_t prefix_len, index_fn_t fn, void *arg);
+uint64_t index_keys(index_t *index);
+uint64_t index_bytes(index_t *index);
+void index_destroy(index_t *index);
+
+#endif
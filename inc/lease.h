@@ -0,0 +1,54 @@
+#ifndef _LEASE_H_
+#define _LEASE_H_
+
+#include <inttypes.h>
+#include <pthread.h>
+#include "cache_data.h"
+
+/*
+ * Lease table
+ * A miss hands out a lease on the key, a token the client sets it back
+ * with. While the lease is held other misses on the key are told to wait,
+ * or get the value the key had before it was deleted, marked stale. A
+ * delete takes the lease back, a set racing it is refused. Entries live in
+ * sets of a few ways, a full set reuses the entry that ends first.
+ * Callers hold the lock of a key around every call on it.
+ */
+#define LEASE_SETS          1024
+#define LEASE_WAYS          4
+#define LEASE_LOCKS         64
+#define LEASE_TIME_DEFAULT  2000                    /* ms a lease is held */
+#define LEASE_STALE_DEFAULT 10000                   /* ms a deleted value is kept */
+
+/* Lock of a key, covers its set as LEASE_LOCKS divides LEASE_SETS */
+#define LEASE_LOCK(l,h)     (&(l)->lock[(h) & (LEASE_LOCKS - 1)])
+
+typedef struct lease_entry_s
+{
+    uint64_t hash;                  /* Of key, 0 is a free entry */
+    uint32_t token;                 /* Lease held, 0 none */
+    uint64_t lease_end;             /* ms, monotonic */
+    uint64_t stale_end;
+    cache_data_t *stale;            /* Value before delete, a reference */
+} lease_entry_t;
+
+typedef struct lease_s
+{
+    uint32_t lease_ms;
+    uint32_t stale_ms;
+    uint32_t next_token;
+    lease_entry_t *entries;
+    pthread_mutex_t lock[LEASE_LOCKS];
+    uint64_t grants;
+    uint64_t waits;                 /* Misses told to wait */
+    uint64_t stale_hits;            /* Misses given a stale value */
+    uint64_t refused;               /* Sets with a token not held */
+} lease_t;
+
+lease_t* lease_create(uint32_t lease_ms, uint32_t stale_ms);
+int lease_acquire(lease_t *lease, uint64_t hash, const uint8_t *key, uint32_t key_len, uint32_t *token, cache_data_t **stale);
+int lease_release(lease_t *lease, uint64_t hash, uint32_t token);
+void lease_revoke(lease_t *lease, uint64_t hash, cache_data_t *stale);
+void lease_destroy(lease_t *lease);
+
+#endif
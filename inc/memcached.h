@@ -2,8 +2,17 @@
 #define _MEmemcachedD_H
 
 #include <pthread.h>
+#include <time.h>
 #include "cache.h"
 #include "server.h"
+#include "histogram.h"
+#include "capture.h"
+#include "snapshot.h"
+#include "topo.h"
+#include "ascii.h"
+#include "proxy.h"
+#include "repl.h"
+#include "crawler.h"
 
 #define MCACHE_REQ_HEADER_SIZE 24
 #define MCACHE_RSP_HEADER_SIZE 24
@@ -17,6 +26,7 @@
 #define MCACHE_GET_RSP_EXTRA(x)   (&((x)->data[0]))
 
 #define MCACHE_DATA_TYPE 0x00  /* RAW Byte */
+#define MCACHE_DATA_TYPE_DEFLATE 0x02   /* Value is a zlib stream, server extension */
 
 #define MCACHE_REQ_MAGIC 0x80
 #define MCACHE_RSP_MAGIC 0x81
@@ -26,18 +36,69 @@
 
 #define MCACHE_EXTRA_MAX_SIZE  0x08
 
+/* Values of stored items from this size are sent from file, TCP only
+ * Values in external store are always sent from file */
+#define MCACHE_SENDFILE_MIN    (16 * 1024)
+
+/* One of these GET hits looks up the node of its item */
+#define MCACHE_NUMA_SAMPLE     64
+
 #define MCACHE_MAX_BODY_SIZE(m) ((m)->max_key_len+(m)->max_val_len + MCACHE_EXTRA_MAX_SIZE)
 
 #define MCACHE_MAX_REQ_SIZE(m)  (sizeof(memcached_req_t) + MCACHE_MAX_BODY_SIZE(m))
 
 #define MCACHE_MAX_RSP_SIZE(m)  (sizeof(memcached_rsp_t) + MCACHE_MAX_BODY_SIZE(m))
 
+/* Text protocol, a command line is at most this long, a get of many keys
+ * too. Requests are read with room for a line ahead of a value */
+#define MCACHE_TEXT_LINE_MAX    2048
+#define MCACHE_TEXT_TOKENS      (MCACHE_TEXT_LINE_MAX / 2)
+#define MCACHE_MAX_READ_SIZE(m) (MCACHE_MAX_REQ_SIZE(m) + MCACHE_TEXT_LINE_MAX)
+
+/* Keys of a multi-get looked up together */
+#define MCACHE_GET_AHEAD        HASH_TABLE_MANY
+
+/* Extras of increment and decrement, delta, initial and expiration */
+#define MCACHE_INCR_EXTRA_LEN   20
+#define MCACHE_INCR_NO_CREATE   0xffffffff          /* Expiration, missing key fails */
+
+/* Flush extras, delay in seconds, optional. Key is a namespace, optional */
+#define MCACHE_FLUSH_EXTRA_LEN  4
+
+/* Scan extras, cursor and count, optional. Key is the pattern */
+#define MCACHE_SCAN_EXTRA_LEN   12
+
+/* Metadump lines are sent once there are this many bytes of them */
+#define MCACHE_METADUMP_FLUSH   (64 * 1024)
+
+/* Lease extras, flags and token in reply, token in request to set */
+#define MCACHE_LEASE_EXTRA_LEN      8
+#define MCACHE_LEASE_SET_EXTRA_LEN  4
+#define MCACHE_LEASE_WIN        0x01    /* Lease granted, set key with token */
+#define MCACHE_LEASE_STALE      0x02    /* Value is from before the key was deleted */
+#define MCACHE_LEASE_WAIT       0x04    /* Another client holds the lease, retry */
+
 enum
 {
     MCACHE_OPCODE_GET   = 0x00,
     MCACHE_OPCODE_SET   = 0x01,
+    MCACHE_OPCODE_DELETE = 0x04,
+    MCACHE_OPCODE_INCREMENT = 0x05,
+    MCACHE_OPCODE_DECREMENT = 0x06,
     MCACHE_OPCODE_QUIT  = 0x07, 
+    MCACHE_OPCODE_FLUSH = 0x08,
+    MCACHE_OPCODE_STAT  = 0x10,
+    MCACHE_OPCODE_SNAPSHOT = 0x50,  /* Server extension, write snapshot in background */
+    MCACHE_OPCODE_LEASE_GET = 0x51, /* Server extension, get taking a lease on a miss */
+    MCACHE_OPCODE_LEASE_SET = 0x52, /* Server extension, set under a lease */
+    MCACHE_OPCODE_SCAN  = 0x53,     /* Server extension, step of a keyspace walk */
+    MCACHE_OPCODE_PREFIX_COUNT = 0x54,  /* Server extension, keys starting with key */
+    MCACHE_OPCODE_PREFIX_DELETE = 0x55, /* Server extension, delete keys starting with key */
 };
+
+/* Opcodes with own latency histogram, rest are accounted as other */
+#define MCACHE_LATENCY_OPCODES  0x20
+#define MCACHE_LATENCY_SLOTS    (MCACHE_LATENCY_OPCODES + 1)
 enum
 {
     MCACHE_STATE_NULL,
@@ -85,19 +146,70 @@ typedef struct memcached_resp_s
     uint8_t data[0];
 } memcached_rsp_t;
 
-typedef struct
+struct memcached_s;
+
+/*
+ * Per thread context, only owning thread records into it
+ */
+typedef struct memcached_worker_s
+{
+    int index;
+    uint32_t latency_epoch;
+    uint32_t latency_seq;       /* Odd while histograms are written */
+    uint32_t captured;          /* Requests seen since last captured one */
+    int node;                   /* Index in topo, pinned to its cpus */
+    uint32_t numa_sample;       /* GET hits since last sampled one */
+    uint64_t numa_local;        /* Sampled items on node of thread */
+    uint64_t numa_remote;
+    int text;                   /* Connection speaks text protocol */
+    uint8_t *text_req;          /* Binary request made of a text command */
+    uint8_t *text_rsp;          /* Its reply, turned into text */
+    int ahead_pos;              /* Next of keys of a multi-get looked up ahead */
+    int ahead_count;
+    cache_data_t *ahead[MCACHE_GET_AHEAD];
+    int ahead_backend[MCACHE_GET_AHEAD];    /* Proxy, backend a GET was sent to */
+    proxy_conn_t *proxy;        /* Connections to backends */
+    struct memcached_s *memcached;
+    histogram_t *latency[MCACHE_LATENCY_SLOTS];
+} memcached_worker_t;
+
+typedef struct memcached_s
 {
     int state;
     int tcount;
     int max_key_len;
     int max_val_len;
+    time_t started;
+    uint32_t latency_epoch;     /* Bumped to reset latency histograms */
     pthread_t *tid;
+    memcached_worker_t *workers;
     server_t *server;
     cachedb_t *cache;
+    capture_t *capture;         /* Sampled request log, optional */
+    snapshot_t *snapshot;       /* Snapshot file, optional */
+    uint64_t sendfile;          /* Values sent straight from file */
+    topo_t *topo;               /* NUMA placement, optional */
+    proxy_t *proxy;             /* Backends of requests with a key, optional */
+    repl_t *repl;               /* Replication, primary or replica, optional */
 } memcached_t;
 
 memcached_t* memcached_init(server_t *server, int thread_count, int hash_size);
 int memcached_max_key_val(memcached_t *memcached, int key_len, int val_len);
+int memcached_mem_limit(memcached_t *memcached, int megabytes, int admission);
+int memcached_numa(memcached_t *memcached);
+int memcached_arena(memcached_t *memcached, int pages, int lock);
+int memcached_storage(memcached_t *memcached, const char *path);
+int memcached_extstore(memcached_t *memcached, const char *path, int megabytes, int min_value);
+int memcached_compress(memcached_t *memcached, int min_value, int level, const char *dict_path);
+int memcached_tiny(memcached_t *memcached, int megabytes);
+int memcached_leases(memcached_t *memcached, int lease_ms, int stale_ms);
+int memcached_namespaces(memcached_t *memcached, char delim);
+int memcached_index(memcached_t *memcached);
+int memcached_proxy(memcached_t *memcached, const char *backends);
+int memcached_replicate(memcached_t *memcached, int port);
+int memcached_follow(memcached_t *memcached, const char *primary);
+int memcached_capture(memcached_t *memcached, capture_t *capture);
+int memcached_snapshot(memcached_t *memcached, snapshot_t *snapshot);
 int memcached_start( memcached_t *memcached);
 int memcached_shutdown(memcached_t *memcached );
 void memcached_destroy(memcached_t *memcached);
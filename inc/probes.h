@@ -0,0 +1,33 @@
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+/*
+ * Static tracepoints ( USDT ) under provider "memcached"
+ *
+ * Built in with "make USDT=1" ( needs sys/sdt.h ), a probe is a single nop
+ * until a tracer ( bpftrace, perf, systemtap ) attaches to it.
+ * Without USDT probes compile to nothing.
+ */
+#ifdef _USDT_
+
+#include <sys/sdt.h>
+
+#define PROBE0(name)                    DTRACE_PROBE(memcached, name)
+#define PROBE1(name, a)                 DTRACE_PROBE1(memcached, name, a)
+#define PROBE2(name, a, b)              DTRACE_PROBE2(memcached, name, a, b)
+#define PROBE3(name, a, b, c)           DTRACE_PROBE3(memcached, name, a, b, c)
+#define PROBE4(name, a, b, c, d)        DTRACE_PROBE4(memcached, name, a, b, c, d)
+#define PROBE5(name, a, b, c, d, e)     DTRACE_PROBE5(memcached, name, a, b, c, d, e)
+
+#else
+
+#define PROBE0(name)                    do { } while(0)
+#define PROBE1(name, a)                 do { } while(0)
+#define PROBE2(name, a, b)              do { } while(0)
+#define PROBE3(name, a, b, c)           do { } while(0)
+#define PROBE4(name, a, b, c, d)        do { } while(0)
+#define PROBE5(name, a, b, c, d, e)     do { } while(0)
+
+#endif
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef _PROXY_H_
+#define _PROXY_H_
+
+#include <inttypes.h>
+#include <netinet/in.h>
+
+/*
+ * Consistent hashing proxy
+ * Requests with a key go to one of a pool of backends. Each backend has
+ * PROXY_POINTS points on a hash ring, a key belongs to the first point at
+ * or after its hash ( ketama style ), so a backend joining or leaving moves
+ * only the keys of its own points. A worker keeps one connection to each
+ * backend, opened on first use and again after a failure. Requests are
+ * queued per backend and written together, replies come back in order.
+ * Frames are binary protocol, only their header is looked at here.
+ */
+#define PROXY_BACKENDS_MAX  64
+#define PROXY_POINTS        160
+#define PROXY_HEADER_SIZE   24
+#define PROXY_QUEUE_SIZE    (16 * 1024)             /* Requests to a backend written at once */
+#define PROXY_TIMEOUT_MS    2000                    /* Of a backend send or reply */
+
+typedef struct proxy_point_s
+{
+    uint32_t hash;
+    int backend;
+} proxy_point_t;
+
+typedef struct proxy_s
+{
+    int count;
+    struct sockaddr_in addr[PROXY_BACKENDS_MAX];
+    char name[PROXY_BACKENDS_MAX][64];              /* host:port as given */
+    int points;
+    proxy_point_t *ring;                            /* Sorted by hash */
+    uint64_t forwarded;
+    uint64_t errors;                                /* Backend connect, send or reply failures */
+} proxy_t;
+
+/* Connections of a worker, only that thread uses them */
+typedef struct proxy_conn_s
+{
+    proxy_t *proxy;
+    int fd[PROXY_BACKENDS_MAX];                     /* -1 not connected */
+    uint32_t pending[PROXY_BACKENDS_MAX];           /* Requests sent or failed, reply not taken */
+    uint32_t queued[PROXY_BACKENDS_MAX];            /* Bytes not written yet */
+    uint8_t *queue[PROXY_BACKENDS_MAX];
+} proxy_conn_t;
+
+proxy_t* proxy_create(const char *spec);
+int proxy_backend(proxy_t *proxy, const uint8_t *key, uint32_t key_len);
+void proxy_destroy(proxy_t *proxy);
+
+proxy_conn_t* proxy_conn_create(proxy_t *proxy);
+int proxy_queue(proxy_conn_t *conn, int backend, const void *head, uint32_t head_len, const void *body, uint32_t body_len);
+int proxy_flush(proxy_conn_t *conn);
+int proxy_recv(proxy_conn_t *conn, int backend, uint8_t *frame, uint32_t size);
+void proxy_conn_destroy(proxy_conn_t *conn);
+
+#endif
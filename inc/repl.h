@@ -0,0 +1,96 @@
+#ifndef _REPL_H_
+#define _REPL_H_
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "cache.h"
+
+/*
+ * Replication stream
+ * A primary logs every SET, DELETE and FLUSH it applies. A sender thread
+ * takes the log every REPL_FLUSH_MS, or once REPL_BATCH_SIZE is reached,
+ * deflates it once and writes the batch to every replica connected to its
+ * port. A replica connects to the primary, inflates batches and applies
+ * them to its own cache. Replicas get what is logged after they connect,
+ * one that falls behind by REPL_TIMEOUT_MS is dropped and connects again.
+ * What the primary applied meanwhile is not sent, so a replica flushes its
+ * cache when it connects again, and when a batch does not follow the last.
+ */
+#define REPL_MAGIC          0x4d435232              /* "MCR2", records with flags */
+#define REPL_BATCH_SIZE     (256 * 1024)            /* Log bytes that make a batch */
+#define REPL_FLUSH_MS       5                       /* Longest a record waits */
+#define REPL_REPLICAS_MAX   16
+#define REPL_TIMEOUT_MS     2000                    /* Of a batch write to a replica */
+#define REPL_RETRY_MS       1000                    /* Replica reconnects after */
+#define REPL_FRAME_MAX      (64 * 1024 * 1024)      /* Largest batch a replica takes */
+#define REPL_LOCKS          64
+
+/* Lock of a key, held while a mutation is applied and logged */
+#define REPL_LOCK(r,h)      (&(r)->key_lock[(h) & (REPL_LOCKS - 1)])
+
+enum
+{
+    REPL_OP_SET = 1,
+    REPL_OP_DELETE,
+    REPL_OP_FLUSH,                  /* Key is namespace or empty, value delay */
+};
+
+/* Frame of a batch, big endian, deflated records follow */
+typedef struct repl_frame_s
+{
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t raw_len;
+    uint32_t comp_len;
+} repl_frame_t;
+
+/* Record in a batch, big endian, key then value follow */
+typedef struct repl_record_s
+{
+    uint8_t op;
+    uint8_t reserved;
+    uint16_t key_len;
+    uint32_t val_len;
+    uint32_t flag;                  /* Of a SET, as in the item */
+    uint8_t data[0];
+} repl_record_t;
+
+typedef struct repl_s
+{
+    cachedb_t *cache;
+    int primary;                    /* Streams to replicas, else follows a primary */
+    int sock;                       /* Listener of primary, connection of replica */
+    struct sockaddr_in addr;        /* Primary */
+    char name[64];
+    int replica[REPL_REPLICAS_MAX]; /* Connections of primary */
+    int replicas;
+    pthread_t tid;
+    int stop;
+    pthread_mutex_t key_lock[REPL_LOCKS];
+    pthread_mutex_t lock;           /* Log */
+    pthread_cond_t ready;           /* Log has a batch */
+    pthread_cond_t taken;           /* Log was taken by sender */
+    uint8_t *log[2];                /* Filled by workers, sent by sender, in turns */
+    uint32_t log_size;
+    uint32_t used;
+    int active;
+    uint8_t *comp;                  /* Deflated batch */
+    uint32_t comp_size;
+    uint32_t seq;                   /* Of last batch */
+    uint64_t records;               /* Logged, or applied by replica */
+    uint64_t batches;
+    uint64_t bytes;                 /* Of records */
+    uint64_t bytes_sent;            /* Deflated, or received by replica */
+    uint64_t dropped;               /* Replicas dropped, or connections lost */
+    uint64_t flushes;               /* Of replica, on connecting again */
+} repl_t;
+
+repl_t* repl_primary(cachedb_t *cache, int port, uint32_t max_record);
+repl_t* repl_replica(cachedb_t *cache, const char *primary);
+int repl_active(repl_t *repl);
+void repl_log(repl_t *repl, uint8_t op, const uint8_t *key, uint32_t key_len, const uint8_t *val, uint32_t val_len,
+              uint32_t flag);
+void repl_destroy(repl_t *repl);
+
+#endif
@@ -5,6 +5,7 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <inttypes.h>
 
 #define RECV_TIMEOUT_MS 100
 enum
@@ -35,6 +36,12 @@ typedef struct request_s
     int rsp_len;
     uint8_t *req;               /* Buffer */
     uint8_t *rsp;
+    int file_fd;                /* Reply goes on with file_len bytes of a file */
+    off_t file_off;
+    uint32_t file_len;
+    void (*file_done)(void *arg, uint64_t tag);     /* Called once file is sent */
+    void *file_arg;
+    uint64_t file_tag;
 } buffer_t;
 
 typedef struct server_s
@@ -64,6 +71,11 @@ int server_shutdown(server_t *server);
 void server_destroy(server_t *server);
 buffer_t* server_buffer_get(server_t *server);
 int server_buffer_read_bytes(server_t *server, buffer_t *buffer, uint32_t size);
+int server_buffer_read_some(server_t *server, buffer_t *buffer);
+int server_buffer_peek(server_t *server, buffer_t *buffer, uint8_t *byte);
 int server_buffer_send(server_t *server, buffer_t* buffer);
+int server_buffer_reserve(server_t *server, buffer_t *buffer, int size);
+int server_buffer_attach(server_t *server, buffer_t *buffer, int fd, off_t off, uint32_t len,
+                         void (*done)(void *arg, uint64_t tag), void *arg, uint64_t tag);
 void server_buffer_release(server_t *server, buffer_t* buffer);
 #endif
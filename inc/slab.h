@@ -0,0 +1,73 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <inttypes.h>
+#include <pthread.h>
+
+/*
+ * Slab allocator over one mapped region
+ * The region is split in pages, a page is handed to a size class on
+ * demand and cut into equal chunks. Everything inside the region is
+ * addressed by offsets, so a file backed region can be mapped again at
+ * any address by a later process. An anonymous region can be made of
+ * huge pages.
+ */
+#define SLAB_MAGIC          0x4d43534c      /* "MCSL" */
+#define SLAB_VERSION        5
+#define SLAB_PAGE_SIZE      (1024 * 1024)
+#define SLAB_CHUNK_MIN      64
+#define SLAB_GROWTH         1.25
+#define SLAB_CLASSES_MAX    64
+#define SLAB_ALIGN          8
+
+typedef struct slab_header_s
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;                  /* Region size */
+    uint64_t pages_offset;          /* First page */
+    uint32_t page_size;
+    uint32_t pages;
+    uint32_t pages_used;            /* Pages handed to classes */
+    uint32_t classes;
+    uint32_t clean;                 /* Set when detached in order */
+    uint32_t reserved;
+    uint32_t chunk_size[SLAB_CLASSES_MAX];
+    uint64_t free[SLAB_CLASSES_MAX];    /* Free list head offset, 0 empty */
+} slab_header_t;
+
+/* In front of every chunk */
+typedef struct slab_chunk_s
+{
+    uint8_t used;
+    uint8_t cls;
+    uint16_t reserved;
+    uint32_t len;                   /* Requested size */
+    uint64_t next;                  /* Next free chunk offset, free chunks only */
+    uint8_t data[0];
+} slab_chunk_t;
+
+typedef struct slab_s
+{
+    int fd;
+    int pages;                      /* ARENA_PAGES_ of mapping */
+    uint64_t map_size;
+    uint8_t *base;
+    slab_header_t *header;
+    uint8_t *page_class;            /* Class of every page, 0xff unused */
+    pthread_mutex_t page_lock;
+    pthread_mutex_t lock[SLAB_CLASSES_MAX];
+} slab_t;
+
+typedef int (*slab_walk_t)(void *arg, void *ptr, uint32_t len);
+
+slab_t* slab_create(const char *path, uint64_t size, int pages, int *attached);
+void slab_destroy(slab_t *slab, int clean);
+void* slab_alloc(slab_t *slab, uint32_t size);
+void slab_free(slab_t *slab, void *ptr);
+int slab_class(slab_t *slab, uint32_t size);
+int slab_class_of(slab_t *slab, void *ptr);
+uint32_t slab_chunk_size(slab_t *slab, void *ptr);
+int slab_walk(slab_t *slab, slab_walk_t walk, void *arg);
+
+#endif
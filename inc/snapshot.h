@@ -0,0 +1,71 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include "cache.h"
+
+/*
+ * Cache snapshot
+ * A writer thread walks the hash table one bucket at a time and streams
+ * live items into a file, a bucket is only locked while references to its
+ * items are taken. Every bucket becomes a section of records sorted by key
+ * with its own checksum, a table of sections follows them. Items of the
+ * tiny table make one more section after the buckets. Loading maps the
+ * file and lets several threads build whole buckets at once.
+ */
+#define SNAPSHOT_MAGIC          "MCSS"
+#define SNAPSHOT_VERSION        3       /* 2 has no tiny section, 1 no compressed values */
+
+typedef struct snapshot_header_s
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t sections;          /* Hash size of writer, a section per bucket, tiny section not counted */
+    uint32_t crc;               /* Of header and section table */
+    uint64_t items;
+    uint64_t table;             /* Offset of section table */
+    uint64_t created;           /* Unix time */
+} snapshot_header_t;
+
+typedef struct snapshot_section_s
+{
+    uint64_t offset;
+    uint64_t bytes;
+    uint32_t count;
+    uint32_t crc;               /* Of section records */
+} snapshot_section_t;
+
+typedef struct snapshot_record_s
+{
+    uint16_t key_len;
+    uint8_t comp;               /* Value is stored compressed, COMPRESS_ type */
+    uint8_t reserved;
+    uint32_t val_len;
+    uint32_t flag;
+    uint32_t expire;
+    uint8_t data[0];            /* Key then value */
+} snapshot_record_t;
+
+typedef struct snapshot_s
+{
+    char *path;
+    cachedb_t *cache;
+    pthread_t tid;
+    int running;                /* Writer thread active */
+    int joinable;
+    int stop;                   /* Writer gives up, shutdown */
+    uint64_t items;             /* Last completed snapshot */
+    uint64_t bytes;
+    uint64_t duration_ms;
+    time_t last;
+    uint32_t failures;
+} snapshot_t;
+
+snapshot_t* snapshot_create(cachedb_t *cache, const char *path);
+int snapshot_start(snapshot_t *snapshot);
+int snapshot_load(snapshot_t *snapshot, int threads);
+void snapshot_destroy(snapshot_t *snapshot);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <inttypes.h>
+#include "server.h"
+
+#define STATS_VAL_MAX 64
+#define STATS_KEY_MAX 250                   /* Of a key shown in text */
+
+/*
+ * Stats response builder
+ * Each stat is sent as separate response packet carrying the stat name as
+ * key and its value as body, list is terminated with an empty packet
+ * For text protocol each stat is a "STAT name value" line, appended to the
+ * response, list is terminated with "END"
+ * Lists of keys are built the same way, a key in place of a stat name
+ */
+typedef struct stats_s
+{
+    server_t *server;
+    buffer_t *buffer;
+    uint8_t opcode;
+    uint32_t opaque;
+    int error;
+    int text;
+} stats_t;
+
+void stats_begin(stats_t *stats, server_t *server, buffer_t *buffer, uint8_t opcode, uint32_t opaque);
+void stats_begin_text(stats_t *stats, server_t *server, buffer_t *buffer);
+int stats_add(stats_t *stats, const char *key, const char *fmt, ...);
+int stats_add_key(stats_t *stats, const uint8_t *key, int key_len, const char *fmt, ...);
+int stats_end(stats_t *stats);
+int stats_end_cursor(stats_t *stats, uint64_t cursor);
+
+#endif
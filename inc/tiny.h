@@ -0,0 +1,58 @@
+#ifndef _TINY_H_
+#define _TINY_H_
+
+#include <inttypes.h>
+#include <pthread.h>
+
+/*
+ * Tiny item table
+ * Very small items are kept in fixed size slots, key and value inline, no
+ * pointers and no item header. A key hashes to a set of slots, a full set
+ * evicts a slot not read since the last pass over it ( second chance ).
+ * Sets share a striped lock. Items that grow out of a slot go to the
+ * general store, the cache takes them out of here. A flush only moves the
+ * epoch of the table, a set from an older epoch is emptied when it is next
+ * locked.
+ */
+#define TINY_SLOT_SIZE      48
+#define TINY_DATA_SIZE      (TINY_SLOT_SIZE - 4)   /* Key and value together */
+#define TINY_WAYS           8                       /* Slots of a set */
+#define TINY_LOCKS          1024
+
+#define TINY_FITS(k, v)     (((k) > 0) && ((uint32_t)(k) + (uint32_t)(v) <= TINY_DATA_SIZE))
+
+#define TINY_KEY(s)         (&(s)->data[0])
+#define TINY_VAL(s)         (&(s)->data[(s)->key_len])
+
+typedef struct tiny_slot_s
+{
+    uint8_t tag;                    /* Hash bits, 0 is a free slot */
+    uint8_t key_len;
+    uint8_t val_len;
+    uint8_t active;                 /* Read since last pass */
+    uint8_t data[TINY_DATA_SIZE];   /* Key then value */
+} tiny_slot_t;
+
+typedef struct tiny_s
+{
+    uint32_t mask;                  /* Sets - 1, sets is a power of two */
+    tiny_slot_t *slots;             /* Mapped on their own */
+    uint64_t bytes;                 /* Of mapping */
+    pthread_mutex_t lock[TINY_LOCKS];
+    uint32_t *epoch;                /* Of every set, as of its last use */
+    uint32_t flushed;               /* Epoch of table */
+    uint64_t items;
+    uint64_t evictions;
+} tiny_t;
+
+tiny_t* tiny_create(uint64_t size);
+int tiny_get(tiny_t *tiny, uint64_t hash, const uint8_t *key, uint32_t key_len, uint8_t *val, uint32_t *val_len);
+int tiny_set(tiny_t *tiny, uint64_t hash, const uint8_t *key, uint32_t key_len, const uint8_t *val, uint32_t val_len,
+             tiny_slot_t *evicted);
+int tiny_delete(tiny_t *tiny, uint64_t hash, const uint8_t *key, uint32_t key_len);
+uint32_t tiny_sets(tiny_t *tiny);
+int tiny_copy(tiny_t *tiny, uint32_t set, tiny_slot_t *out);
+void tiny_flush(tiny_t *tiny);
+void tiny_destroy(tiny_t *tiny);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef _TINYLFU_H_
+#define _TINYLFU_H_
+
+#include <inttypes.h>
+
+/*
+ * TinyLFU frequency estimate
+ * A doorkeeper Bloom filter absorbs the first access of a key, repeated
+ * accesses are counted in a Count-Min sketch of 4 bit counters. After
+ * period accesses all counters are halved and the doorkeeper cleared, so
+ * estimates reflect recent popularity.
+ */
+#define TINYLFU_DEPTH       4
+#define TINYLFU_COUNTER_MAX 15
+#define TINYLFU_WIDTH_MIN   1024
+#define TINYLFU_WIDTH_MAX   (1 << 24)
+
+typedef struct tinylfu_s
+{
+    uint32_t mask;              /* Sketch width - 1, width is a power of two */
+    uint32_t period;            /* Accesses between aging */
+    uint32_t accesses;
+    uint8_t *sketch;            /* DEPTH rows of width counters */
+    uint64_t *doorkeeper;       /* width * 8 bits */
+} tinylfu_t;
+
+tinylfu_t* tinylfu_create(uint32_t items);
+void tinylfu_destroy(tinylfu_t *lfu);
+void tinylfu_record(tinylfu_t *lfu, uint64_t hash);
+uint32_t tinylfu_estimate(tinylfu_t *lfu, uint64_t hash);
+
+#endif
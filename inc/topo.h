@@ -0,0 +1,33 @@
+#ifndef _TOPO_H_
+#define _TOPO_H_
+
+#include <inttypes.h>
+#include <pthread.h>
+
+/*
+ * NUMA topology
+ * Nodes and their cpus as the kernel lists them in sysfs, cut down to the
+ * cpus this process may run on. Threads are pinned to all cpus of a node,
+ * not a single cpu, so the scheduler still balances inside the node.
+ * Memory shared by every node is interleaved over them. Without NUMA
+ * support it is one node of all cpus.
+ */
+#define TOPO_NODES_MAX      64
+#define TOPO_CPUS_MAX       1024
+#define TOPO_CPU_WORDS      (TOPO_CPUS_MAX / 64)
+
+typedef struct topo_s
+{
+    int nodes;
+    int id[TOPO_NODES_MAX];                         /* Kernel node number of each node */
+    int cpus[TOPO_NODES_MAX];                       /* Cpus of each node */
+    uint64_t cpu_mask[TOPO_NODES_MAX][TOPO_CPU_WORDS];
+} topo_t;
+
+topo_t* topo_create(void);
+int topo_pin(topo_t *topo, pthread_t tid, int node);
+int topo_interleave(topo_t *topo, void *base, uint64_t size, int move);
+int topo_node_of(topo_t *topo, const void *addr);
+void topo_destroy(topo_t *topo);
+
+#endif
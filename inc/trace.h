@@ -3,6 +3,7 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <inttypes.h>
 
 
 #define TRACE_LEVEL_NONE 0
@@ -24,9 +25,10 @@
 #define MODULE __FILE__
 #endif
 
-#define _PRINT(L,args,...)   dump_log(L, args ,##__VA_ARGS__ )
-#define _TRACE(P,L,args,...)    dump_log(P, #L "!!!" MODULE ":%s>[%d]" args "\n" ,__func__,__LINE__,##__VA_ARGS__ )
-#define _HEXDUMP(L,str, ptr, len)    hexdump(L, str, ptr, len)
+/* Level is checked before the call, so disabled logs cost a single compare */
+#define _PRINT(L,args,...)   do { if((L) <= trace_level) dump_log(L, args ,##__VA_ARGS__ ); } while(0)
+#define _TRACE(P,L,args,...)    do { if((P) <= trace_level) dump_log(P, #L "!!!" MODULE ":%s>[%d]" args "\n" ,__func__,__LINE__,##__VA_ARGS__ ); } while(0)
+#define _HEXDUMP(L,str, ptr, len)    do { if((L) <= trace_level) hexdump(L, str, ptr, len); } while(0)
 
 #define TRACE(L,args,...)   TRACE_##L(L, args,##__VA_ARGS__)
 #define PRINT(L,args,...)   PRINT_##L(args,##__VA_ARGS__)
@@ -136,9 +138,13 @@
 #endif
   
 
+extern int trace_level;
+
 void hexdump(int level, char * str, uint8_t* data, int len);
 int set_trace_level( int level );
 int dump_log(int level, const char *format, ...);
+int trace_async_start( void );
+void trace_async_stop( void );
 
 #endif
 
@@ -0,0 +1,221 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+#define MODULE "Arena"
+#include "trace.h"
+
+#define ALIGN_UP(x,a)       ((((x) + (a) - 1) / (a)) * (a))
+#define HUGE_2M             (2ULL * 1024 * 1024)
+#define HUGE_1G             (1024ULL * 1024 * 1024)
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT      26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB        (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB        (30 << MAP_HUGE_SHIFT)
+#endif
+
+/* Shared by prefault threads */
+typedef struct arena_prefault_s
+{
+    uint8_t *base;
+    uint64_t size;
+    uint64_t next;                  /* Next chunk to take */
+} arena_prefault_t;
+
+const char* arena_pages_name(int pages)
+{
+    switch( pages )
+    {
+        case ARENA_PAGES_THP:
+            return "thp";
+        case ARENA_PAGES_2M:
+            return "2m";
+        case ARENA_PAGES_1G:
+            return "1g";
+        default:
+            return "4k";
+    }
+}
+
+/*
+ * Map size bytes of pages, size is rounded up to the page size. Without
+ * reserved huge pages transparent huge pages are used, pages tells
+ */
+void* arena_map(uint64_t *size, int *pages)
+{
+    void *base = MAP_FAILED;
+    uint64_t len;
+
+    if( size == NULL || pages == NULL || *size == 0 )
+    {
+        TRACE(ERROR,"Invalid args");
+        return NULL;
+    }
+
+    if(( *pages == ARENA_PAGES_2M ) || ( *pages == ARENA_PAGES_1G ))
+    {
+        len = ALIGN_UP(*size, ( *pages == ARENA_PAGES_1G ) ? HUGE_1G : HUGE_2M);
+        base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                    (( *pages == ARENA_PAGES_1G ) ? MAP_HUGE_1GB : MAP_HUGE_2MB), -1, 0);
+
+        if( base == MAP_FAILED )
+        {
+            TRACE(WARN,"No %s huge pages for %lu bytes ( %s ), using transparent huge pages",
+                  arena_pages_name(*pages), (unsigned long)len, strerror(errno));
+            *pages = ARENA_PAGES_THP;
+        }
+        else
+        {
+            *size = len;
+        }
+    }
+
+    if( base == MAP_FAILED )
+    {
+        len = ALIGN_UP(*size, sysconf(_SC_PAGESIZE));
+        if(( base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED )
+        {
+            TRACE(ERROR,"Failed to map %lu bytes : %s", (unsigned long)len, strerror(errno));
+            return NULL;
+        }
+
+        *size = len;
+        arena_advise(base, len, *pages);
+    }
+
+    return base;
+}
+
+void arena_unmap(void *base, uint64_t size)
+{
+    if( base && size )
+        munmap(base, size);
+}
+
+/*
+ * Ask for transparent huge pages on a region mapped with base pages, the
+ * part of it made of whole pages
+ */
+int arena_advise(void *base, uint64_t size, int pages)
+{
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t start = ALIGN_UP((uint64_t)base, page);
+    int ret = 0;
+
+    if(( pages == ARENA_PAGES_THP ) && ( start < (uint64_t)base + size ))
+    {
+        size = (((uint64_t)base + size - start) / page) * page;
+
+        if( size && madvise((void*)start, size, MADV_HUGEPAGE))
+        {
+            TRACE(WARN,"Transparent huge pages not available : %s", strerror(errno));
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+static void* prefault(void *arg)
+{
+    arena_prefault_t *work = (arena_prefault_t*)arg;
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t off, end, i;
+    volatile uint8_t *p;
+
+    while(( off = __atomic_fetch_add(&work->next, ARENA_PREFAULT_CHUNK, __ATOMIC_RELAXED)) < work->size )
+    {
+        end = (( work->size - off ) < ARENA_PREFAULT_CHUNK ) ? work->size : off + ARENA_PREFAULT_CHUNK;
+
+#ifdef MADV_POPULATE_WRITE
+        /* Page aligned chunks of a mapped region */
+        if(( ((uint64_t)work->base + off) % page == 0 ) &&
+           ( madvise(work->base + off, ALIGN_UP(end - off, page), MADV_POPULATE_WRITE) == 0 ))
+            continue;
+#endif
+
+        /* Writing a byte back as is faults a page in without changing it */
+        for(i = off, p = work->base; i < end; i += page)
+            p[i] = p[i];
+    }
+
+    return NULL;
+}
+
+/*
+ * Fault in every page of a region with threads in parallel
+ */
+int arena_prefault(void *base, uint64_t size, int threads)
+{
+    arena_prefault_t work;
+    pthread_t *tid = NULL;
+    int i, n = 0;
+    int ret = -1;
+
+    if( base && size && ( threads > 0 ))
+    {
+        work.base = base;
+        work.size = size;
+        work.next = 0;
+
+        if(( threads > 1 ) && (( tid = calloc(threads, sizeof(pthread_t))) == NULL ))
+        {
+            TRACE(WARN,"Memory allocation failure, prefault in one thread");
+        }
+
+        for(n = 0; tid && ( n < threads - 1 ); n++)
+        {
+            if( pthread_create(&tid[n], NULL, prefault, &work) )
+            {
+                TRACE(ERROR,"Failed to create thread");
+                break;
+            }
+        }
+
+        /* Caller takes part, alone if no thread started */
+        prefault(&work);
+
+        for(i = 0; i < n; i++)
+            pthread_join(tid[i], NULL);
+
+        free(tid);
+        ret = 0;
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    return ret;
+}
+
+/*
+ * Keep pages of a region resident
+ */
+int arena_lock(void *base, uint64_t size)
+{
+    int ret = -1;
+
+    if( base && size )
+    {
+        if(( ret = mlock(base, size)))
+        {
+            TRACE(ERROR,"Failed to lock %lu bytes : %s", (unsigned long)size, strerror(errno));
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    return ret;
+}
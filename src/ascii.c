@@ -0,0 +1,145 @@
+#include <string.h>
+#include "ascii.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define MODULE "Ascii"
+#include "trace.h"
+
+#define CHUNK               16
+
+#ifdef __SSE2__
+/* Bit per byte of 16 at p which equals c */
+static inline uint32_t match(const uint8_t *p, char c)
+{
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), _mm_set1_epi8(c)));
+}
+#else
+static inline uint32_t match(const uint8_t *p, char c)
+{
+    uint32_t bits = 0;
+    int i;
+
+    for(i = 0; i < CHUNK; i++)
+        bits |= ( p[i] == c ) << i;
+
+    return bits;
+}
+#endif
+
+/*
+ * Offset of first '\n' in buf of len bytes, -1 if there is none
+ */
+int ascii_eol(const uint8_t *buf, uint32_t len)
+{
+    const uint8_t *p;
+    uint32_t i = 0;
+    uint32_t bits;
+
+    for(; i + CHUNK <= len; i += CHUNK)
+    {
+        if(( bits = match(&buf[i], '\n')))
+            return i + __builtin_ctz(bits);
+    }
+
+    if(( i < len ) && ( p = memchr(&buf[i], '\n', len - i)))
+        return p - buf;
+
+    return -1;
+}
+
+/*
+ * Split line of len bytes at spaces into tokens, at most max of them
+ * Returns tokens found, -1 if there are more than max
+ */
+int ascii_tokens(uint8_t *line, uint32_t len, ascii_token_t *tokens, int max)
+{
+    uint8_t tail[CHUNK];
+    const uint8_t *p;
+    uint32_t base, spaces, found, pos;
+    int in = 0;
+    int n = 0;
+
+    for(base = 0; base < len; base += CHUNK)
+    {
+        /* Last partial chunk is padded with spaces */
+        if( len - base < CHUNK )
+        {
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, &line[base], len - base);
+            p = tail;
+        }
+        else
+        {
+            p = &line[base];
+        }
+
+        spaces = match(p, ' ');
+
+        /* A token starts at next byte not a space and ends at next space */
+        for(pos = 0; pos < CHUNK; in = !in)
+        {
+            if(( found = ( in ? spaces : ~spaces ) & ( 0xffffU << pos ) & 0xffff ) == 0 )
+                break;
+
+            pos = __builtin_ctz(found);
+
+            if( in == 0 )
+            {
+                if( n == max )
+                    return -1;
+                tokens[n].data = &line[base + pos];
+            }
+            else
+            {
+                tokens[n].len = &line[base + pos] - tokens[n].data;
+                n++;
+            }
+        }
+    }
+
+    /* Token running to the end of a line of whole chunks */
+    if( in )
+    {
+        tokens[n].len = &line[len] - tokens[n].data;
+        n++;
+    }
+
+    return n;
+}
+
+/*
+ * Token of decimal digits to value, -1 if it is not one or does not fit
+ */
+int ascii_number(const ascii_token_t *token, uint64_t *value)
+{
+    uint64_t v = 0;
+    uint32_t i;
+    int d;
+
+    if(( token->len == 0 ) || ( token->len > 20 ))
+        return -1;
+
+    for(i = 0; i < token->len; i++)
+    {
+        d = token->data[i] - '0';
+        if(( d < 0 ) || ( d > 9 ) || ( v > ( UINT64_MAX - d ) / 10 ))
+            return -1;
+        v = ( v * 10 ) + d;
+    }
+
+    *value = v;
+    return 0;
+}
+
+/*
+ * Token is word
+ */
+int ascii_is(const ascii_token_t *token, const char *word)
+{
+    uint32_t len = strlen(word);
+
+    return ( token->len == len ) && ( memcmp(token->data, word, len) == 0 );
+}
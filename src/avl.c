@@ -1,6 +1,5 @@
 #include <malloc.h>
 #include "avl.h"
-#include "cache_data.h"
 
 #define MODULE "AVL"
 #include "trace.h"
@@ -9,29 +8,6 @@ avl_compare_t compare;
 avl_free_data_t free_data;
 avl_dump_data_t dump_data;
 
-/*
- * Allocate New Node 
- *
- */ 
-static avl_node_t* alloc( void * data )
-{
-    avl_node_t *node;
-
-    /* Allocate New Node */
-    if((node = malloc( sizeof( avl_node_t))))
-    {
-        node->left = node->right = NULL;
-        node->height = 1;
-        node->data = data;
-    }
-    else
-    {
-        TRACE(ERROR,"Failed to allocate memory");
-    }
-    
-    return node;
-}
-
 static int max( int a, int b )
 {
     return (a>b)?a:b;
@@ -97,7 +73,7 @@ static int balance_factor( avl_node_t* node )
 }
 
 
-static int avl_compare(void* a, void* b)
+static int avl_compare(avl_node_t* a, avl_node_t* b)
 {
     return compare(a,b);
 }
@@ -129,59 +105,138 @@ static avl_node_t* balance( avl_node_t* node )
     return node;
 }
 
-static avl_node_t* insert( avl_node_t* head, cache_data_t *data , avl_node_t **new_node, int *status)
+/*
+ * Link node in, a node with same key is unlinked and node takes its place
+ */
+static avl_node_t* insert( avl_node_t* head, avl_node_t *node, avl_node_t **replaced )
 {
     int dt = 0;
     if( head )
     {
         /* Compare and insert */
-        if(( dt = avl_compare(data, head->data)) > 0)
+        if(( dt = avl_compare(node, head)) > 0)
         {
-            head->right = insert( head->right, data, new_node, status );
+            head->right = insert( head->right, node, replaced );
         }
         else if( dt < 0 )
         {
-            head->left = insert( head->left, data, new_node, status );
+            head->left = insert( head->left, node, replaced );
         }
         else
         {
-            /* Return dup */
-            if(new_node)
-                *new_node = head;
-            /* Duplicate requested */
-            if(*status)
-                *status = 1;
-
-            TRACE(WARN,"Duplicate Node");
+            /* Duplicate, new node takes links of old one */
+            TRACE(DEBUG,"Duplicate Node");
+            *replaced = head;
+            node->left = head->left;
+            node->right = head->right;
+            node->height = head->height;
+            return node;
         }
 
-        /* Duplicate Entries are not created */
-
         /* Balance Tree */
         head = balance( head );
     }
     else
     {
-        /* Create a new node */
-        if((head = alloc( data )) == NULL )
+        /* New leaf */
+        node->left = node->right = NULL;
+        node->height = 1;
+        head = node;
+    }
+
+    return head;
+}
+
+/*
+ * Put node in place of old, found by key of node
+ */
+static avl_node_t* replace( avl_node_t* head, avl_node_t *old, avl_node_t *node, int *status )
+{
+    int dt;
+
+    if( head )
+    {
+        if(( dt = avl_compare(node, head)) > 0 )
         {
-            /* Memeory allocation error */
-            if(*status)
-                *status = -1;
-                
-            TRACE(ERROR,"Failed to allocate memory");
+            head->right = replace( head->right, old, node, status );
         }
-        else
+        else if( dt < 0 )
         {
-            *new_node = head;
-            if(status)
-                *status = 0;
+            head->left = replace( head->left, old, node, status );
+        }
+        else if( head == old )
+        {
+            node->left = head->left;
+            node->right = head->right;
+            node->height = head->height;
+            *status = 0;
+            return node;
         }
     }
 
     return head;
 }
 
+/*
+ * Unlink leftmost node of subtree, returned in min
+ */
+static avl_node_t* remove_min( avl_node_t* head, avl_node_t **min )
+{
+    if( head->left == NULL )
+    {
+        *min = head;
+        return head->right;
+    }
+
+    head->left = remove_min( head->left, min );
+
+    return balance( head );
+}
+
+static avl_node_t* delete( avl_node_t* head, avl_node_t *key, avl_node_t **removed )
+{
+    avl_node_t *min = NULL;
+    int dt = 0;
+
+    if( head )
+    {
+        if(( dt = avl_compare(key, head)) > 0)
+        {
+            head->right = delete( head->right, key, removed );
+        }
+        else if( dt < 0 )
+        {
+            head->left = delete( head->left, key, removed );
+        }
+        else
+        {
+            *removed = head;
+
+            if( head->left == NULL )
+            {
+                head = head->right;
+            }
+            else if( head->right == NULL )
+            {
+                head = head->left;
+            }
+            else
+            {
+                /* Successor takes place of deleted node */
+                head->right = remove_min( head->right, &min );
+                min->left = head->left;
+                min->right = head->right;
+                head = min;
+            }
+
+            (*removed)->left = (*removed)->right = NULL;
+        }
+
+        head = balance( head );
+    }
+
+    return head;
+}
 
 static void free_tree(avl_node_t* node)
 {
@@ -190,19 +245,52 @@ static void free_tree(avl_node_t* node)
         free_tree(node->left);
         free_tree(node->right);
 
-        /* Free Single Node */
-        free_data(node->data);
-        free(node);
+        /* Node is part of data */
+        free_data(node);
     }
 }
 
+/*
+ * Balanced subtree of sorted nodes[0..count-1], middle one is root
+ */
+static avl_node_t* build(avl_node_t **nodes, int count)
+{
+    avl_node_t *node = NULL;
+    int mid = count / 2;
+
+    if( count > 0 )
+    {
+        node = nodes[mid];
+        node->left = build( nodes, mid );
+        node->right = build( &nodes[mid + 1], count - mid - 1 );
+        height_set( node );
+    }
+
+    return node;
+}
+
+static int walk(avl_node_t* node, int (*fn)(void *arg, avl_node_t *node), void *arg)
+{
+    int ret = 0;
+
+    if( node )
+    {
+        if(( ret = walk(node->left, fn, arg)) == 0 )
+        {
+            if(( ret = fn(arg, node)) == 0 )
+                ret = walk(node->right, fn, arg);
+        }
+    }
+
+    return ret;
+}
 
 static void inorder(avl_node_t* node)
 {
     if( node )
     {
         inorder(node->left);
-        dump_data(node->data);
+        dump_data(node);
         inorder(node->right);
     }
 }
@@ -211,35 +299,30 @@ static void preorder(avl_node_t* node)
 {
     if( node )
     {
-        dump_data(node->data);
+        dump_data(node);
         inorder(node->left);
         inorder(node->right);
     }
 }
 
-static avl_node_t* find(avl_node_t* node, void *data)
+static avl_node_t* find(avl_node_t* node, avl_node_t *key)
 {
     int dt;
-    if( node )
-    {
-        if(( dt = avl_compare(data, node->data)) == 0 )
-            return node;
-        else if( dt > 0 )
-            return find(node->right, data);
-        else if( dt < 0 )
-            return find(node->left, data);
-    }
 
-    return NULL;
+    /* Iterative, a lookup is the hot path */
+    while( node && (( dt = avl_compare(key, node)) != 0 ))
+        node = ( dt > 0 ) ? node->right : node->left;
+
+    return node;
 }
 
-avl_node_t* avl_find(avl_tree_t* tree, void *data)
+avl_node_t* avl_find(avl_tree_t* tree, avl_node_t *key)
 {
     avl_node_t* node = NULL;
   
-    if( tree && data)
+    if( tree && key )
     {
-        node = find( tree->head, data );
+        node = find( tree->head, key );
     }
     else
     {
@@ -249,26 +332,128 @@ avl_node_t* avl_find(avl_tree_t* tree, void *data)
     return node;
 }
 
-int avl_insert(avl_tree_t* tree, void *data , avl_node_t** node)
+/*
+ * Link node in, it carries its own links so nothing is allocated
+ * A node with same key is unlinked and returned in replaced
+ */
+int avl_insert(avl_tree_t* tree, avl_node_t *node, avl_node_t** replaced)
 {
+    avl_node_t *old = NULL;
     int ret = -1;
-    avl_node_t *new_node = NULL;
     
-    if( data )
+    if( tree && node )
     {
-        if((tree->head = insert( tree->head, data, &new_node, &ret )))
+        tree->head = insert( tree->head, node, &old );
+
+        if( old )
         {
-            if( ret != -1 )
-            {
-                 if(node)
-                *node = new_node;
+            ret = 1;
+        }
+        else
+        {
+            tree->count++;
+            ret = 0;
+        }
 
-                if(ret == 0)
-                    tree->count++;
-            }
-            else
+        if( replaced )
+            *replaced = old;
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    /*  0  : Inserted
+     *  1  : Replaced
+     * -1  : Invalid args
+     */ 
+    return ret;
+}
+
+/*
+ * Put node in place of old, both with same key
+ */
+int avl_replace(avl_tree_t* tree, avl_node_t *old, avl_node_t *node)
+{
+    int ret = -1;
+
+    if( tree && old && node )
+    {
+        ret = 1;
+        tree->head = replace( tree->head, old, node, &ret );
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    /*  0  : Replaced
+     *  1  : Old not in tree
+     * -1  : Invalid args
+     */
+    return ret;
+}
+
+/*
+ * Unlink node matching key, it is returned in removed
+ */
+int avl_delete(avl_tree_t* tree, avl_node_t *key, avl_node_t **removed)
+{
+    avl_node_t *found = NULL;
+    int ret = -1;
+
+    if( tree && key )
+    {
+        tree->head = delete( tree->head, key, &found );
+
+        if( found )
+        {
+            tree->count--;
+            ret = 0;
+        }
+        else
+        {
+            ret = 1;
+        }
+
+        if( removed )
+            *removed = found;
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    /*  0  : Removed
+     *  1  : Not found
+     * -1  : Invalid args
+     */
+    return ret;
+}
+
+/*
+ * Build tree of an empty tree from nodes sorted by key in one pass,
+ * without a compare per level. Tree takes nodes only on success
+ */
+int avl_build(avl_tree_t* tree, avl_node_t **nodes, int count)
+{
+    int ret = -1;
+    int i;
+
+    if( tree && ( nodes || ( count == 0 )) && ( count >= 0 ))
+    {
+        ret = 1;
+
+        if( tree->head == NULL )
+        {
+            /* Keys must be strictly ascending, dups or disorder need insert */
+            for(i = 1; ( i < count ) && ( avl_compare(nodes[i - 1], nodes[i]) < 0 ); i++);
+
+            if( i >= count )
             {
-                TRACE(ERROR,"Failed to allocate memory");
+                tree->head = build( nodes, count );
+                tree->count = count;
+                ret = 0;
             }
         }
     }
@@ -277,14 +462,32 @@ int avl_insert(avl_tree_t* tree, void *data , avl_node_t** node)
         TRACE(ERROR,"Invalid args");
     }
 
-    /*  0  : Success
-     *  1  : Duplicate
-     * -1  : Memory Error
-     */ 
+    /*  0  : Built
+     *  1  : Tree not empty or nodes not sorted
+     * -1  : Invalid args
+     */
     return ret;
 }
 
+/*
+ * Call fn for nodes in key order until it returns non zero, which is
+ * returned
+ */
+int avl_walk(avl_tree_t* tree, int (*fn)(void *arg, avl_node_t *node), void *arg)
+{
+    int ret = -1;
+
+    if( tree && fn )
+    {
+        ret = walk(tree->head, fn, arg);
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
 
+    return ret;
+}
 
 int avl_init( avl_compare_t _compare, avl_free_data_t _free_data, avl_dump_data_t _dump_data )
 {
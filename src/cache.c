@@ -1,138 +1,2113 @@
 #include <malloc.h>
 #include <stdio.h>
 #include <string.h> 
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
 #include "cache.h"
 #include "hash_table.h"
 #include "cache_data.h"
+#include "probes.h"
 
 #define MODULE "Cachedb"
 #include "trace.h"
 
 #define MIN(a,b)    ((a)<(b)?(a):(b))
 
+/*
+ * LRU lists, all helpers below run with lru_lock held
+ */
+static void lru_link(cache_lru_t *lru, cache_data_t *d)
+{
+    d->lru = lru->id;
+    d->prev = NULL;
+    d->next = lru->head;
+    
+    if( lru->head )
+        lru->head->prev = d;
+    else
+        lru->tail = d;
+    
+    lru->head = d;
+    lru->bytes += cache_data_size(d);
+}
+
+static void lru_unlink(cache_lru_t *lru, cache_data_t *d)
+{
+    if( d->prev )
+        d->prev->next = d->next;
+    else
+        lru->head = d->next;
+    
+    if( d->next )
+        d->next->prev = d->prev;
+    else
+        lru->tail = d->prev;
+    
+    d->prev = d->next = NULL;
+    d->lru = CACHE_LRU_NONE;
+    lru->bytes -= cache_data_size(d);
+}
+
+static cache_lru_t* lru_of(cachedb_t *cdb, cache_data_t *d)
+{
+    if( d->lru == CACHE_LRU_EXT )
+        return &cdb->ext_lru;
+    
+    return ( d->lru == CACHE_LRU_WINDOW ) ? &cdb->window : &cdb->main;
+}
+
+static uint64_t lru_bytes(cachedb_t *cdb)
+{
+    return cdb->main.bytes + cdb->window.bytes + cdb->ext_lru.bytes;
+}
+
+/*
+ * Take item out of cache accounting, it is queued on reap to be
+ * removed from hash table once lru_lock is dropped
+ */
+static void lru_drop(cachedb_t *cdb, cache_data_t *d, cache_data_t **reap)
+{
+    if( d->lru != CACHE_LRU_NONE )
+        lru_unlink(lru_of(cdb, d), d);
+    
+    cdb->items--;
+    d->next = *reap;
+    *reap = d;
+}
+
+/*
+ * Eviction candidate of a list, items accessed since last pass are moved
+ * to head once ( second chance )
+ */
+static cache_data_t* lru_victim(cache_lru_t *lru)
+{
+    cache_data_t *d;
+    int i;
+    
+    for(i = 0; (( d = lru->tail )) && ( i < CACHE_EVICT_TRIES ); i++)
+    {
+        if( __atomic_load_n(&d->active, __ATOMIC_RELAXED) == 0 )
+            break;
+        
+        __atomic_store_n(&d->active, 0, __ATOMIC_RELAXED);
+        lru_unlink(lru, d);
+        lru_link(lru, d);
+    }
+    
+    return lru->tail;
+}
+
+static uint32_t frequency(cachedb_t *cdb, cache_data_t *d)
+{
+    return tinylfu_estimate(cdb->lfu, cache_data_key_hash(CACHE_KEY(d), d->key_len));
+}
+
+/*
+ * Bring memory use back under limit
+ * With admission new items wait in a small window LRU, an item leaving
+ * the window only displaces main LRU victims it is more popular than
+ */
+static void lru_evict(cachedb_t *cdb, cache_data_t **reap)
+{
+    cache_data_t *candidate, *victim;
+    int admit;
+    
+    while( cdb->lfu && ( cdb->window.bytes > cdb->window_limit ) && (( candidate = cdb->window.tail )))
+    {
+        lru_unlink(&cdb->window, candidate);
+        admit = 1;
+        
+        while( cdb->limit && ( lru_bytes(cdb) + cache_data_size(candidate) > cdb->limit ))
+        {
+            if((( victim = lru_victim(&cdb->main)) == NULL ) ||
+               ( frequency(cdb, candidate) <= frequency(cdb, victim) ))
+            {
+                admit = 0;
+                break;
+            }
+            
+            cdb->evictions++;
+            lru_drop(cdb, victim, reap);
+        }
+        
+        if( admit )
+        {
+            lru_link(&cdb->main, candidate);
+        }
+        else
+        {
+            cdb->rejections++;
+            lru_drop(cdb, candidate, reap);
+        }
+    }
+    
+    /* Items left in memory for values in external store have own budget */
+    while( cdb->ext_lru.bytes > cdb->ext_limit )
+    {
+        if(( victim = lru_victim(&cdb->ext_lru)) == NULL )
+            break;
+        
+        cdb->evictions++;
+        lru_drop(cdb, victim, reap);
+    }
+    
+    while( cdb->limit && ( lru_bytes(cdb) > cdb->limit ))
+    {
+        if((( victim = lru_victim(&cdb->main)) == NULL ) && (( victim = cdb->window.tail ) == NULL ) &&
+           (( victim = cdb->ext_lru.tail ) == NULL ))
+            break;
+        
+        cdb->evictions++;
+        lru_drop(cdb, victim, reap);
+    }
+}
+
+/*
+ * Storage has no free chunk of the size class, evict items of that class
+ * from LRU tail. Returns number evicted
+ */
+static int lru_evict_class(cachedb_t *cdb, int cls, cache_data_t **reap)
+{
+    cache_lru_t *lists[2] = { &cdb->main, &cdb->window };
+    cache_data_t *d, *prev;
+    int i, n, evicted = 0;
+    
+    for(i = 0; ( i < 2 ) && ( evicted == 0 ); i++)
+    {
+        for(d = lists[i]->tail, n = 0; d && ( n < CACHE_RECLAIM_TRIES ); d = prev, n++)
+        {
+            prev = d->prev;
+            
+            if( slab_class_of(cdb->storage, d) == cls )
+            {
+                cdb->evictions++;
+                lru_drop(cdb, d, reap);
+                evicted++;
+                break;
+            }
+        }
+    }
+    
+    return evicted;
+}
+
+/*
+ * Item left hash table, its value in external store is dead
+ */
+static void forget(cachedb_t *cdb, cache_data_t *d)
+{
+    if( d->ext )
+    {
+        extstore_delete(cdb->ext, __atomic_load_n(CACHE_EXT_LOC(d), __ATOMIC_RELAXED), d->val_len);
+        __atomic_sub_fetch(&cdb->ext_items, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Flush marks
+ * Every item is stamped with the generation it was stored in. A flush takes
+ * a new generation and marks all before it gone, a namespace flush does so
+ * for keys of its namespace only. Items are left as they are, one found
+ * flushed is taken out then, the rest leave through LRU
+ */
+static uint32_t now_sec(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    
+    return (uint32_t)ts.tv_sec;
+}
+
+/* Marks only move on, a later flush may have set one already */
+static void mark(uint32_t *flushed, uint32_t gen)
+{
+    uint32_t cur = __atomic_load_n(flushed, __ATOMIC_RELAXED);
+    
+    while(( cur < gen ) && !__atomic_compare_exchange_n(flushed, &cur, gen, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void flush_now(cachedb_t *cdb)
+{
+    mark(&cdb->flushed, __atomic_fetch_add(&cdb->gen, 1, __ATOMIC_ACQ_REL));
+    tiny_flush(cdb->tiny);
+    __atomic_add_fetch(&cdb->flushes, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Delayed flush whose time has come is done by whoever sees it first
+ */
+static void flush_due(cachedb_t *cdb)
+{
+    uint32_t at = __atomic_load_n(&cdb->flush_at, __ATOMIC_RELAXED);
+    
+    if( at && ( now_sec() >= at ) &&
+        __atomic_compare_exchange_n(&cdb->flush_at, &at, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        flush_now(cdb);
+}
+
+/*
+ * Mark of namespace of a key, bytes before the delimiter, -1 if it has none
+ */
+static int ns_slot(cachedb_t *cdb, const uint8_t *key, uint32_t key_len)
+{
+    const uint8_t *end;
+    
+    if(( cdb->ns_flushed == NULL ) || (( end = memchr(key, cdb->ns_delim, key_len)) == NULL ))
+        return -1;
+    
+    return cache_data_key_hash(key, end - key) & ( CACHE_NS_SLOTS - 1 );
+}
+
+static int flushed(cachedb_t *cdb, cache_data_t *d)
+{
+    int slot;
+    
+    if( d->gen <= __atomic_load_n(&cdb->flushed, __ATOMIC_ACQUIRE) )
+        return 1;
+    
+    return (( slot = ns_slot(cdb, CACHE_KEY(d), d->key_len)) >= 0 ) &&
+           ( d->gen <= __atomic_load_n(&cdb->ns_flushed[slot], __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Key is stored, tiny or as an item not flushed. Called by the index with
+ * a shard locked, so nothing here may go back to the index
+ */
+static int live(void *arg, const uint8_t *key, uint32_t key_len)
+{
+    cachedb_t *cdb = (cachedb_t*)arg;
+    cache_data_t *creq, *found = NULL;
+    uint8_t val[TINY_DATA_SIZE];
+    uint32_t len = sizeof(val);
+    int ret = 0;
+    union
+    {
+        cache_data_t d;
+        uint8_t mem[sizeof(cache_data_t) + CACHE_KEY_STACK];
+    } stack;
+    
+    if( cdb->tiny && ( key_len <= TINY_DATA_SIZE ) &&
+        ( tiny_get(cdb->tiny, cache_data_key_hash(key, key_len), key, key_len, val, &len) != 1 ))
+    {
+        ret = 1;
+    }
+    else if((creq = ( key_len <= CACHE_KEY_STACK ) ? cache_data_key(&stack, key_len, (uint8_t*)key) :
+                    cache_data_alloc(key_len, 0, (uint8_t*)key, NULL)))
+    {
+        if(( found = hash_table_search(cdb->ht, creq)))
+        {
+            ret = ( flushed(cdb, found) == 0 );
+            cache_data_release(found);
+        }
+        
+        if( creq != &stack.d )
+            cache_data_free(creq);
+    }
+    else
+    {
+        /* Not knowing keeps the key */
+        ret = 1;
+    }
+    
+    return ret;
+}
+
+/*
+ * Key left the cache, it leaves the index too unless stored again meanwhile
+ */
+static void unindex(cachedb_t *cdb, const uint8_t *key, uint32_t key_len)
+{
+    if( cdb->index )
+        index_remove(cdb->index, cache_data_key_hash(key, key_len), key, key_len, live, cdb);
+}
+
+/*
+ * Take a flushed item out of hash table and LRU, unless it is gone already.
+ * Caller keeps its reference
+ */
+static void drop_flushed(cachedb_t *cdb, cache_data_t *d)
+{
+    cache_data_t *removed;
+    
+    if(( removed = hash_table_remove(cdb->ht, d, d)))
+    {
+        pthread_mutex_lock(&cdb->lru_lock);
+        if( removed->lru != CACHE_LRU_NONE )
+        {
+            lru_unlink(lru_of(cdb, removed), removed);
+            cdb->items--;
+            cache_data_release(removed);
+        }
+        pthread_mutex_unlock(&cdb->lru_lock);
+        
+        unindex(cdb, CACHE_KEY(removed), removed->key_len);
+        forget(cdb, removed);
+        cache_data_release(removed);
+        __atomic_add_fetch(&cdb->flush_reclaimed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Take item of a key out of hash table and LRU, returns 0 if there was one
+ * not flushed. keep, if set, takes the reference of the table to such an
+ * item with its value in memory
+ */
+static int unlink_key(cachedb_t *cdb, uint8_t *key, int key_len, cache_data_t **keep)
+{
+    cache_data_t *creq;
+    cache_data_t *removed = NULL;
+    int gone = 0;
+    union
+    {
+        cache_data_t d;
+        uint8_t mem[sizeof(cache_data_t) + CACHE_KEY_STACK];
+    } stack;
+    
+    if((creq = ( key_len <= CACHE_KEY_STACK ) ? cache_data_key(&stack, key_len, key) :
+               cache_data_alloc(key_len, 0, key, NULL)))
+    {
+        removed = hash_table_remove(cdb->ht, creq, NULL);
+        
+        if( creq != &stack.d )
+            cache_data_free(creq);
+    }
+    
+    if( removed )
+    {
+        gone = flushed(cdb, removed);
+        
+        pthread_mutex_lock(&cdb->lru_lock);
+        if( removed->lru != CACHE_LRU_NONE )
+        {
+            lru_unlink(lru_of(cdb, removed), removed);
+            cdb->items--;
+            cache_data_release(removed);
+        }
+        pthread_mutex_unlock(&cdb->lru_lock);
+        
+        if( keep && ( removed->ext == 0 ) && ( gone == 0 ))
+        {
+            *keep = removed;
+        }
+        else
+        {
+            forget(cdb, removed);
+            cache_data_release(removed);
+        }
+    }
+    
+    return ( removed && ( gone == 0 )) ? 0 : 1;
+}
+
+static void ext_wake(cachedb_t *cdb)
+{
+    pthread_mutex_lock(&cdb->ext_lock);
+    pthread_cond_signal(&cdb->ext_cond);
+    pthread_mutex_unlock(&cdb->ext_lock);
+}
+
+/*
+ * Move value of an evicted item to external store, a small item with its
+ * location takes its place. Returns 0 when moved
+ */
+static int demote(cachedb_t *cdb, cache_data_t *d)
+{
+    cache_data_t *e, *replaced;
+    uint64_t loc;
+    int ret;
+    
+    if( d->ext || ( d->val_len < cdb->ext_min ) || __atomic_load_n(&d->removed, __ATOMIC_ACQUIRE) || flushed(cdb, d))
+        return 1;
+    
+    ret = extstore_write(cdb->ext, CACHE_KEY(d), d->key_len, CACHE_VAL(d), d->val_len, &loc);
+    
+    if( extstore_free_pages(cdb->ext) < EXTSTORE_FREE_MIN )
+        ext_wake(cdb);
+    
+    if( ret )
+        return 1;
+    
+    if(( e = cache_data_ext_alloc(d->key_len, d->val_len, CACHE_KEY(d), loc)) == NULL )
+    {
+        extstore_delete(cdb->ext, loc, d->val_len);
+        return 1;
+    }
+    
+    e->comp = d->comp;
+    e->flag = d->flag;
+    e->expire = d->expire;
+    e->gen = d->gen;
+    memcpy(e->cas, d->cas, sizeof(e->cas));
+    
+    /* Reference for LRU, table takes the initial one */
+    cache_data_ref(e);
+    
+    if(( replaced = hash_table_replace(cdb->ht, e, d)) == NULL )
+    {
+        /* Replaced or removed meanwhile */
+        extstore_delete(cdb->ext, loc, d->val_len);
+        cache_data_release(e);
+        cache_data_release(e);
+        return 1;
+    }
+    
+    cache_data_release(replaced);
+    
+    pthread_mutex_lock(&cdb->lru_lock);
+    lru_link(&cdb->ext_lru, e);
+    cdb->items++;
+    __atomic_add_fetch(&cdb->ext_items, 1, __ATOMIC_RELAXED);
+    
+    /* Replaced by a SET before it got linked */
+    if( __atomic_load_n(&e->removed, __ATOMIC_ACQUIRE) )
+    {
+        lru_unlink(&cdb->ext_lru, e);
+        cdb->items--;
+        cache_data_release(e);
+    }
+    pthread_mutex_unlock(&cdb->lru_lock);
+    
+    return 0;
+}
+
+/*
+ * Remove dropped items from hash table and release LRU reference
+ * With external store large values are moved there instead
+ */
+static void reclaim(cachedb_t *cdb, cache_data_t *reap)
+{
+    cache_data_t *next, *removed;
+    
+    while( reap )
+    {
+        next = reap->next;
+        reap->next = NULL;
+        
+        if(( cdb->ext == NULL ) || demote(cdb, reap))
+        {
+            /* Item may have been replaced meanwhile, then it is gone already */
+            if(( removed = hash_table_remove(cdb->ht, reap, reap)))
+            {
+                unindex(cdb, CACHE_KEY(removed), removed->key_len);
+                forget(cdb, removed);
+                cache_data_release(removed);
+            }
+        }
+        
+        cache_data_release(reap);
+        reap = next;
+    }
+}
+
+/*
+ * Free a page of external store, live values of a mostly dead page are
+ * written again, otherwise items of the page are evicted
+ */
+static int ext_compact(cachedb_t *cdb, uint8_t *buf)
+{
+    extstore_record_t rec;
+    cache_data_t *creq, *found;
+    cache_data_t *reap = NULL;
+    uint64_t loc, moved;
+    uint32_t live, used, off, voff;
+    uint16_t version;
+    int page, rescue;
+    
+    if((( page = extstore_victim(cdb->ext, &live, &used)) < 0 ) ||
+       extstore_page_read(cdb->ext, page, buf, &version, &used))
+    {
+        return -1;
+    }
+    
+    rescue = ((uint64_t)live * 100) <= ((uint64_t)used * CACHE_EXT_RESCUE_PERCENT);
+    
+    for(off = 0; off + sizeof(rec) <= used; off = voff + rec.val_len)
+    {
+        memcpy(&rec, &buf[off], sizeof(rec));
+        voff = off + sizeof(rec) + rec.key_len;
+        
+        if(( rec.key_len == 0 ) || ( voff + (uint64_t)rec.val_len > used ))
+            break;
+        
+        if(( creq = cache_data_alloc(rec.key_len, 0, &buf[off + sizeof(rec)], NULL)) == NULL )
+            break;
+        
+        loc = EXTSTORE_LOC(page, version, voff);
+        
+        /* Only items still pointing here are live */
+        if(( found = hash_table_search(cdb->ht, creq)) && found->ext &&
+           ( __atomic_load_n(CACHE_EXT_LOC(found), __ATOMIC_ACQUIRE) == loc ))
+        {
+            if( rescue && ( flushed(cdb, found) == 0 ) && ( extstore_write(cdb->ext, &buf[off + sizeof(rec)], rec.key_len, &buf[voff], rec.val_len, &moved) == 0 ))
+            {
+                if( __atomic_compare_exchange_n(CACHE_EXT_LOC(found), &loc, moved, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED) )
+                    __atomic_add_fetch(&cdb->ext_rescued, 1, __ATOMIC_RELAXED);
+                else
+                    extstore_delete(cdb->ext, moved, rec.val_len);
+            }
+            else
+            {
+                pthread_mutex_lock(&cdb->lru_lock);
+                if( found->lru != CACHE_LRU_NONE )
+                {
+                    cdb->evictions++;
+                    lru_drop(cdb, found, &reap);
+                }
+                pthread_mutex_unlock(&cdb->lru_lock);
+                __atomic_add_fetch(&cdb->ext_dropped, 1, __ATOMIC_RELAXED);
+            }
+        }
+        
+        cache_data_release(found);
+        cache_data_free(creq);
+    }
+    
+    reclaim(cdb, reap);
+    
+    extstore_page_free(cdb->ext, page, version);
+    __atomic_add_fetch(&cdb->ext_compactions, 1, __ATOMIC_RELAXED);
+    
+    return 0;
+}
+
+static void* ext_compact_task(void *arg)
+{
+    cachedb_t *cdb = (cachedb_t*)arg;
+    uint8_t *buf;
+    
+    if(( buf = malloc(cdb->ext->page_size)) == NULL )
+    {
+        TRACE(ERROR,"Memory allocation failure, no compaction");
+        return NULL;
+    }
+    
+    pthread_mutex_lock(&cdb->ext_lock);
+    while( cdb->ext_stop == 0 )
+    {
+        if( extstore_free_pages(cdb->ext) >= EXTSTORE_FREE_MIN )
+        {
+            pthread_cond_wait(&cdb->ext_cond, &cdb->ext_lock);
+            continue;
+        }
+        
+        pthread_mutex_unlock(&cdb->ext_lock);
+        
+        /* Nothing to compact yet, or read error, try again later */
+        if( ext_compact(cdb, buf) )
+            usleep(100 * 1000);
+        
+        pthread_mutex_lock(&cdb->ext_lock);
+    }
+    pthread_mutex_unlock(&cdb->ext_lock);
+    
+    free(buf);
+    
+    return NULL;
+}
+
 cachedb_t* cachedb_create(int hash_size)
 {
-    cachedb_t *cdb = NULL;
+    cachedb_t *cdb = NULL;
+    int i;
+    
+    if( hash_size > 0 )
+    {
+        hash_table_init();
+        
+        if((cdb = calloc(1, sizeof(cachedb_t))))
+        {        
+            if(( cdb->ht = hash_table_create(hash_size)) == NULL)
+            {
+                free(cdb);
+                cdb = NULL;
+            }
+            else
+            {
+                pthread_mutex_init(&cdb->lru_lock, NULL);
+                for(i = 0; i < CACHE_KEY_LOCKS; i++)
+                    pthread_mutex_init(&cdb->key_lock[i], NULL);
+                cdb->main.id = CACHE_LRU_MAIN;
+                cdb->window.id = CACHE_LRU_WINDOW;
+                cdb->ext_lru.id = CACHE_LRU_EXT;
+                cdb->gen = 1;
+                
+                if(( cdb->hot = hotkeys_create(HOTKEYS_SAMPLE_DEFAULT)) == NULL)
+                {
+                    /* Cache works without hot key tracking */
+                    TRACE(WARN,"Hot key tracking disabled");
+                }
+            }
+        }
+        else
+        {
+            TRACE(ERROR,"Memory allocation failure");
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    return cdb;
+}
+
+/*
+ * Place, fault in and lock a region as set by cachedb_numa() and
+ * cachedb_arena()
+ */
+static void arena_prepare(cachedb_t *cdb, void *base, uint64_t size)
+{
+    /* Before first touch, pages are placed as they fault in */
+    if( cdb->topo )
+        topo_interleave(cdb->topo, base, size, 0);
+    
+    if( cdb->arena_threads )
+        arena_prefault(base, size, cdb->arena_threads);
+    
+    if( cdb->arena_lock && ( arena_lock(base, size) == 0 ))
+        cdb->arena_locked += size;
+}
+
+/*
+ * Interleave storage and tables over the nodes of topo, every worker reads
+ * them. Must be set before arena, storage and tiny table
+ */
+int cachedb_numa(cachedb_t *cachedb, topo_t *topo)
+{
+    int ret = -1;
+    
+    if( cachedb && topo && ( cachedb->storage == NULL ) && ( cachedb->tiny == NULL ) && ( cachedb->ext == NULL ))
+    {
+        cachedb->topo = topo;
+        
+        /* Table is faulted in already, its pages move */
+        topo_interleave(topo, cachedb->ht, HASH_TABLE_BYTES(cachedb->ht->size), 1);
+        ret = 0;
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+    
+    return ret;
+}
+
+/*
+ * Back storage and tables with pages of kind ARENA_PAGES_, fault them in
+ * with threads at once and lock them if asked. Must be set before storage
+ * and tiny table, storage needs a memory limit
+ */
+int cachedb_arena(cachedb_t *cachedb, int pages, int threads, int lock)
+{
+    int ret = -1;
+    
+    if( cachedb && ( threads >= 0 ) && ( cachedb->storage == NULL ) && ( cachedb->tiny == NULL ))
+    {
+        cachedb->arena_pages = pages;
+        cachedb->arena_threads = threads;
+        cachedb->arena_lock = lock;
+        
+        /* Table is there already, it can only get transparent huge pages */
+        arena_advise(cachedb->ht, HASH_TABLE_BYTES(cachedb->ht->size), pages ? ARENA_PAGES_THP : ARENA_PAGES_DEFAULT);
+        arena_prepare(cachedb, cachedb->ht, HASH_TABLE_BYTES(cachedb->ht->size));
+        
+        ret = 0;
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+    
+    return ret;
+}
+
+/*
+ * CAS of an item stored now, big endian as sent in replies
+ */
+static void cas_next(cachedb_t *cachedb, uint32_t *cas)
+{
+    uint64_t n = __atomic_add_fetch(&cachedb->cas, 1, __ATOMIC_RELAXED);
+    
+    cas[0] = htonl((uint32_t)( n >> 32 ));
+    cas[1] = htonl((uint32_t)n);
+}
+
+/*
+ * Put items back in hash table and LRU after attaching storage
+ */
+static int restore(void *arg, void *ptr, uint32_t len)
+{
+    cachedb_t *cdb = (cachedb_t*)arg;
+    cache_data_t *d = (cache_data_t*)ptr;
+    cache_data_t *old = NULL;
+    
+    if(( len < sizeof(cache_data_t)) || ( d->key_len == 0 ) || ( d->slab == 0 ) ||
+       (( sizeof(cache_data_t) + (uint64_t)d->key_len + d->val_len ) != len ))
+    {
+        TRACE(WARN,"Dropping invalid item");
+        return 1;
+    }
+    
+    if( compress_readable(cdb->comp, d->comp) == 0 )
+    {
+        TRACE(WARN,"Dropping item compressed with other settings");
+        return 1;
+    }
+    
+    /* Runtime state is meaningless in a new process */
+    d->prev = d->next = NULL;
+    d->refcount = 2;
+    d->lru = CACHE_LRU_NONE;
+    d->active = 0;
+    d->removed = 0;
+    d->gen = cdb->gen;
+    cas_next(cdb, d->cas);
+    
+    if( hash_table_insert(cdb->ht, d, &old) == -1 )
+        return 1;
+    
+    if( old )
+    {
+        /* Same key twice, one copy is enough */
+        if( old->lru != CACHE_LRU_NONE )
+        {
+            lru_unlink(lru_of(cdb, old), old);
+            cdb->items--;
+            cache_data_release(old);
+        }
+        cache_data_release(old);
+    }
+    
+    lru_link(&cdb->main, d);
+    cdb->items++;
+    
+    if( cdb->index )
+        index_insert(cdb->index, cache_data_key_hash(CACHE_KEY(d), d->key_len), CACHE_KEY(d), d->key_len);
+    
+    return 0;
+}
+
+/*
+ * Keep items in a mapped file, path NULL maps anonymous memory
+ * Memory limit must be set before. Items of a cleanly detached file are
+ * taken over, index and LRU are rebuilt from them
+ */
+int cachedb_storage(cachedb_t *cachedb, const char *path)
+{
+    cache_data_t *reap = NULL;
+    struct timespec start, end;
+    int attached = 0;
+    int ret = -1;
+    
+    if( cachedb && cachedb->limit && ( cachedb->storage == NULL ))
+    {
+        /* Partly used pages of every class come on top of limit */
+        if(( cachedb->storage = slab_create(path, cachedb->limit + ((uint64_t)SLAB_CLASSES_MAX * SLAB_PAGE_SIZE),
+                                            cachedb->arena_pages, &attached)))
+        {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            arena_prepare(cachedb, cachedb->storage->base, cachedb->storage->map_size);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            
+            if( cachedb->arena_threads )
+                TRACE(INFO,"Item storage of %lu bytes in %s pages faulted in in %ld ms",
+                      (unsigned long)cachedb->storage->map_size, arena_pages_name(cachedb->storage->pages),
+                      ((end.tv_sec - start.tv_sec) * 1000) + ((end.tv_nsec - start.tv_nsec) / 1000000));
+            
+            cache_data_storage(cachedb->storage);
+            
+            if( attached )
+            {
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                
+                pthread_mutex_lock(&cachedb->lru_lock);
+                slab_walk(cachedb->storage, restore, cachedb);
+                lru_evict(cachedb, &reap);
+                pthread_mutex_unlock(&cachedb->lru_lock);
+                
+                reclaim(cachedb, reap);
+                
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                TRACE(INFO,"Restored %lu items in %ld ms", (unsigned long)cachedb->items,
+                      ((end.tv_sec - start.tv_sec) * 1000) + ((end.tv_nsec - start.tv_nsec) / 1000000));
+            }
+            
+            ret = 0;
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+    
+    return ret;
+}
+
+/*
+ * Add items of a hash bucket sorted by key, as read from a snapshot
+ * An empty bucket is built in one go, otherwise items are inserted one by
+ * one. Cache takes over caller's references
+ */
+int cachedb_load(cachedb_t *cachedb, uint32_t bucket, cache_data_t **items, int count)
+{
+    cache_data_t *old = NULL;
+    cache_data_t *reap = NULL;
+    int status;
+    int ret = -1;
+    int i;
+    
+    if( cachedb && items && ( count >= 0 ))
+    {
+        /* References for LRU, table takes the initial ones */
+        for(i = 0; i < count; i++)
+        {
+            items[i]->gen = __atomic_load_n(&cachedb->gen, __ATOMIC_ACQUIRE);
+            cas_next(cachedb, items[i]->cas);
+            cache_data_ref(items[i]);
+        }
+        
+        if(( status = hash_table_load(cachedb->ht, bucket % cachedb->ht->size, items, count)) == -1 )
+        {
+            for(i = 0; i < count; i++)
+            {
+                cache_data_release(items[i]);
+                cache_data_release(items[i]);
+            }
+        }
+        else
+        {
+            for(i = 0; ( status == 1 ) && ( i < count ); i++)
+            {
+                if( hash_table_insert(cachedb->ht, items[i], &old) == -1 )
+                {
+                    cache_data_release(items[i]);
+                    cache_data_release(items[i]);
+                    items[i] = NULL;
+                }
+                else if( old )
+                {
+                    /* Same key again, an item already loaded or restored */
+                    pthread_mutex_lock(&cachedb->lru_lock);
+                    if( old->lru != CACHE_LRU_NONE )
+                    {
+                        lru_unlink(lru_of(cachedb, old), old);
+                        cachedb->items--;
+                        cache_data_release(old);
+                    }
+                    pthread_mutex_unlock(&cachedb->lru_lock);
+                    forget(cachedb, old);
+                    cache_data_release(old);
+                }
+            }
+            
+            /* LRU references are still ours, items can not go meanwhile */
+            for(i = 0; cachedb->index && ( i < count ); i++)
+            {
+                if( items[i] )
+                    index_insert(cachedb->index, cache_data_key_hash(CACHE_KEY(items[i]), items[i]->key_len),
+                                 CACHE_KEY(items[i]), items[i]->key_len);
+            }
+            
+            pthread_mutex_lock(&cachedb->lru_lock);
+            
+            for(i = 0; i < count; i++)
+            {
+                if( items[i] == NULL )
+                    continue;
+                
+                lru_link(&cachedb->main, items[i]);
+                cachedb->items++;
+                
+                /* Replaced by another loader before it got linked */
+                if( __atomic_load_n(&items[i]->removed, __ATOMIC_ACQUIRE) )
+                    lru_drop(cachedb, items[i], &reap);
+            }
+            
+            lru_evict(cachedb, &reap);
+            
+            pthread_mutex_unlock(&cachedb->lru_lock);
+            
+            reclaim(cachedb, reap);
+            
+            ret = 0;
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+    
+    return ret;
+}
+
+/*
+ * Set memory limit in bytes ( 0 unlimited ) and admission filter, must be
+ * set before cache is used
+ */
+int cachedb_limit(cachedb_t *cachedb, uint64_t limit, int admission)
+{
+    int ret = -1;
+    
+    if( cachedb && ( limit || !admission ))
+    {
+        cachedb->limit = limit;
+        cachedb->window_limit = (limit * CACHE_WINDOW_PERCENT) / 100;
+        
+        if( admission && (( cachedb->lfu = tinylfu_create(limit / CACHE_ITEM_SIZE_GUESS)) == NULL ))
+        {
+            TRACE(ERROR,"Failed to create admission filter");
+        }
+        else
+        {
+            ret = 0;
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+    
+    return ret;
+}
+
+/*
+ * Evict item whose value can not be read any more, lock not held
+ */
+static void lose(cachedb_t *cachedb, cache_data_t *d)
+{
+    cache_data_t *reap = NULL;
+    
+    pthread_mutex_lock(&cachedb->lru_lock);
+    if( d->lru != CACHE_LRU_NONE )
+    {
+        cachedb->evictions++;
+        lru_drop(cachedb, d, &reap);
+    }
+    pthread_mutex_unlock(&cachedb->lru_lock);
+    
+    reclaim(cachedb, reap);
+}
+
+/*
+ * Stored bytes of a value into val, from external store if it is there
+ */
+static int stored_value(cachedb_t *cachedb, cache_data_t *d, uint8_t *val)
+{
+    uint64_t loc, now;
+    int ret = 0;
+    
+    if( d->ext == 0 )
+    {
+        memcpy(val, CACHE_VAL(d), d->val_len);
+        return 0;
+    }
+    
+    loc = __atomic_load_n(CACHE_EXT_LOC(d), __ATOMIC_ACQUIRE);
+    
+    /* Compaction may have moved it meanwhile */
+    while((( ret = extstore_read(cachedb->ext, loc, val, d->val_len)) == 1 ) &&
+          (( now = __atomic_load_n(CACHE_EXT_LOC(d), __ATOMIC_ACQUIRE)) != loc ))
+    {
+        loc = now;
+    }
+    
+    return ret;
+}
+
+/*
+ * Copy value of an item into val of len bytes, len is set to value length
+ * A compressed value is inflated unless stored bytes are asked for
+ */
+int cachedb_value(cachedb_t *cachedb, cache_data_t *d, uint8_t *val, uint32_t *len, int stored)
+{
+    uint8_t *buf = NULL;
+    uint32_t need = 0;
+    int ret = -1;
+    
+    if( cachedb && d && val && len )
+    {
+        if(( d->comp == COMPRESS_NONE ) || stored )
+        {
+            need = d->val_len;
+            if( need <= *len )
+                ret = stored_value(cachedb, d, val);
+            else
+                ret = 2;
+        }
+        else if( d->ext == 0 )
+        {
+            need = COMPRESS_RAW_LEN(CACHE_VAL(d));
+            if( need <= *len )
+                ret = compress_inflate(cachedb->comp, d->comp, CACHE_VAL(d), d->val_len, val, *len);
+            else
+                ret = 2;
+        }
+        else if(( buf = malloc(d->val_len)))
+        {
+            if(( ret = stored_value(cachedb, d, buf)) == 0 )
+            {
+                need = COMPRESS_RAW_LEN(buf);
+                if( need <= *len )
+                    ret = compress_inflate(cachedb->comp, d->comp, buf, d->val_len, val, *len);
+                else
+                    ret = 2;
+            }
+            free(buf);
+        }
+        
+        if(( ret == 0 ) || ( ret == 2 ))
+            *len = need;
+        else if( ret == 1 )
+            lose(cachedb, d);
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+    
+    /*  0  : Copied
+     *  1  : Value is gone
+     *  2  : len is too small, set to length needed
+     * -1  : Failure
+     */
+    return ret;
+}
+
+static void file_unpin(void *arg, uint64_t tag)
+{
+    extstore_unpin((extstore_t*)arg, tag);
+}
+
+static void file_release(void *arg, uint64_t tag)
+{
+    (void)tag;
+    cache_data_release((cache_data_t*)arg);
+}
+
+/*
+ * Value of an item as a range of a backing file, to be sent without copy
+ * External store page is pinned, a stored item is referenced until done
+ */
+int cachedb_value_file(cachedb_t *cachedb, cache_data_t *d, cache_file_t *file)
+{
+    uint64_t loc, now;
+    int ret = -1;
+    
+    if( cachedb && d && file )
+    {
+        if( d->ext )
+        {
+            loc = __atomic_load_n(CACHE_EXT_LOC(d), __ATOMIC_ACQUIRE);
+            
+            /* Compaction may have moved it meanwhile */
+            while((( ret = extstore_pin(cachedb->ext, loc, &file->fd, &file->off)) == 1 ) &&
+                  (( now = __atomic_load_n(CACHE_EXT_LOC(d), __ATOMIC_ACQUIRE)) != loc ))
+            {
+                loc = now;
+            }
+            
+            if( ret == 0 )
+            {
+                file->done = file_unpin;
+                file->arg = cachedb->ext;
+                file->tag = loc;
+            }
+            else if( ret > 0 )
+            {
+                /* Left to copy path, it finds a lost value too */
+                ret = 1;
+            }
+        }
+        else if( d->slab && cachedb->storage && ( cachedb->storage->fd >= 0 ))
+        {
+            file->fd = cachedb->storage->fd;
+            file->off = CACHE_VAL(d) - cachedb->storage->base;
+            file->done = file_release;
+            file->arg = cache_data_ref(d);
+            file->tag = 0;
+            ret = 0;
+        }
+        else
+        {
+            ret = 1;
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+    
+    /*  0  : Value is in file, done must be called
+     *  1  : Value only in memory or not at hand, copy it
+     * -1  : Failure
+     */
+    return ret;
+}
+
+/*
+ * Compress values stored from now on, must be set before storage
+ */
+int cachedb_compress(cachedb_t *cachedb, compress_t *comp)
+{
+    int ret = -1;
+    
+    if( cachedb && comp && ( cachedb->comp == NULL ) && ( cachedb->storage == NULL ))
+    {
+        cachedb->comp = comp;
+        ret = 0;
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+    
+    return ret;
+}
+
+/*
+ * Keep very small items in a table of size bytes, must be set before
+ * cache is used
+ */
+int cachedb_tiny(cachedb_t *cachedb, uint64_t size)
+{
+    int ret = -1;
+    
+    if( cachedb && size && ( cachedb->tiny == NULL ))
+    {
+        if(( cachedb->tiny = tiny_create(size)))
+        {
+            arena_advise(cachedb->tiny->slots, cachedb->tiny->bytes, cachedb->arena_pages ? ARENA_PAGES_THP : ARENA_PAGES_DEFAULT);
+            arena_prepare(cachedb, cachedb->tiny->slots, cachedb->tiny->bytes);
+            ret = 0;
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+    
+    return ret;
+}
+
+/*
+ * Hand out leases of lease_ms on misses of cachedb_lease_get(), deleted
+ * values are kept stale_ms for misses under a lease. Must be set before
+ * cache is used
+ */
+int cachedb_leases(cachedb_t *cachedb, uint32_t lease_ms, uint32_t stale_ms)
+{
+    int ret = -1;
+    
+    if( cachedb && lease_ms && ( cachedb->lease == NULL ))
+    {
+        if(( cachedb->lease = lease_create(lease_ms, stale_ms)))
+            ret = 0;
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+    
+    return ret;
+}
+
+/*
+ * Keys up to the first delim are a namespace, cachedb_flush_ns() drops
+ * them all. Must be set before cache is used
+ */
+int cachedb_namespaces(cachedb_t *cachedb, uint8_t delim)
+{
+    int ret = -1;
+    
+    if( cachedb && ( cachedb->ns_flushed == NULL ))
+    {
+        if(( cachedb->ns_flushed = calloc(CACHE_NS_SLOTS, sizeof(uint32_t))))
+        {
+            cachedb->ns_delim = delim;
+            ret = 0;
+        }
+        else
+        {
+            TRACE(ERROR,"Memory allocation failure");
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+    
+    return ret;
+}
+
+/*
+ * Keep keys in order too, for counting and deleting keys of a prefix. Must
+ * be set before storage is attached or a snapshot loaded
+ */
+int cachedb_index(cachedb_t *cachedb)
+{
+    int ret = -1;
+    
+    if( cachedb && ( cachedb->index == NULL ))
+    {
+        if(( cachedb->index = index_create()))
+            ret = 0;
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+    
+    return ret;
+}
+
+/*
+ * Keep cold values of evicted items in a file of size bytes, items stay
+ * in memory with the location of their value. Memory limit must be set
+ */
+int cachedb_extstore(cachedb_t *cachedb, const char *path, uint64_t size, uint32_t min_value)
+{
+    int ret = -1;
+    
+    if( cachedb && path && cachedb->limit && ( cachedb->ext == NULL ))
+    {
+        if(( cachedb->ext = extstore_create(path, size)))
+        {
+            cachedb->ext_min = min_value ? min_value : CACHE_EXT_MIN_DEFAULT;
+            cachedb->ext_limit = (cachedb->limit * CACHE_EXT_INDEX_PERCENT) / 100;
+            pthread_mutex_init(&cachedb->ext_lock, NULL);
+            pthread_cond_init(&cachedb->ext_cond, NULL);
+            
+            if( pthread_create(&cachedb->ext_tid, NULL, ext_compact_task, cachedb) )
+            {
+                TRACE(ERROR,"Failed to create thread");
+                pthread_cond_destroy(&cachedb->ext_cond);
+                pthread_mutex_destroy(&cachedb->ext_lock);
+                extstore_destroy(cachedb->ext);
+                cachedb->ext = NULL;
+            }
+            else
+            {
+                /* Maintenance runs on the first node */
+                if( cachedb->topo )
+                    topo_pin(cachedb->topo, cachedb->ext_tid, 0);
+                ret = 0;
+            }
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+    
+    return ret;
+}
+
+int cachedb_get(cachedb_t *cachedb,  cache_data_t **centry, uint8_t *key, uint8_t *val, int key_len, int *val_len )
+{
+    int ret = -1;
+    cache_data_t *creq = NULL;
+    cache_data_t *found = NULL;
+    int lost = 0;
+    uint32_t len;
+    union
+    {
+        cache_data_t d;
+        uint8_t mem[sizeof(cache_data_t) + CACHE_KEY_STACK];
+    } stack;
+    
+    if(cachedb && key && key_len > 0)
+    {
+        HEXDUMP(DEBUG,"key", key, key_len);
+        
+        flush_due(cachedb);
+        
+        if( cachedb->hot && hotkeys_sampled(cachedb->hot) )
+            hotkeys_record(cachedb->hot, key, key_len, cache_data_key_bucket(key, key_len, cachedb->ht->size));
+        
+        /* Misses count too, a key asked for often is worth admitting */
+        if( cachedb->lfu )
+            tinylfu_record(cachedb->lfu, cache_data_key_hash(key, key_len));
+        
+        if((creq = ( key_len <= CACHE_KEY_STACK ) ? cache_data_key(&stack, key_len, key) :
+                   cache_data_alloc(key_len, 0, key, NULL)))
+        {
+            /* Flushed item is a miss, it goes now */
+            if(( found = hash_table_search(cachedb->ht, creq)) && flushed(cachedb, found))
+            {
+                drop_flushed(cachedb, found);
+                cache_data_release(found);
+                found = NULL;
+            }
+            
+            if( found )
+            {
+                /* Reference keeps item alive even if replaced or evicted now */
+                if( __atomic_load_n(&found->active, __ATOMIC_RELAXED) == 0 )
+                    __atomic_store_n(&found->active, 1, __ATOMIC_RELAXED);
+                
+                if(val_len && val)
+                {
+                    TRACE(DEBUG,"Avail Buffer : %d, need : %d", *val_len, found->val_len);
+                    
+                    /* Too small a buffer gets nothing, length tells what is needed */
+                    len = *val_len;
+                    lost = ( cachedb_value(cachedb, found, val, &len, 0) == 1 );
+                    *val_len = len;
+                }
+                else
+                {
+                    TRACE(DEBUG,"Value not requested");
+                }
+
+                if( lost == 0 )
+                {
+                    PROBE3(cache__get, key_len, found->val_len, 0);
+                    
+                    /* Caller releases its reference */
+                    if(centry)
+                        *centry = found;
+                    else
+                        cache_data_release(found);
+                    ret = 0;
+                }
+                else
+                {
+                    /* Value in external store is gone */
+                    TRACE(DEBUG,"Value lost");
+                    PROBE3(cache__get, key_len, 0, 1);
+                    cache_data_release(found);
+                    ret = 1;
+                }
+            }
+            else
+            {
+                TRACE(INFO,"Key Not Found.");
+                PROBE3(cache__get, key_len, 0, 1);
+                ret = 1;
+            }
+            
+            if( creq != &stack.d )
+                cache_data_free(creq);
+        }
+        else
+        {
+            TRACE(ERROR,"Memory allocation");
+            PROBE3(cache__get, key_len, 0, -2);
+            ret = -2;
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+    return ret;
+}
+
+
+
+/*
+ * Items of count keys as cachedb_get() without values, found[i] is set to
+ * the item of keys[i] or NULL. Lookups of all keys are interleaved, see
+ * hash_table_search_many(). Returns items found
+ */
+int cachedb_get_many(cachedb_t *cachedb, uint8_t **keys, uint32_t *key_lens, int count, cache_data_t **found)
+{
+    int i;
+    int ret = -1;
+    
+    if( cachedb && keys && key_lens && ( count > 0 ) && found )
+    {
+        flush_due(cachedb);
+        
+        for(i = 0; i < count; i++)
+        {
+            if( cachedb->hot && hotkeys_sampled(cachedb->hot) )
+                hotkeys_record(cachedb->hot, keys[i], key_lens[i], cache_data_key_bucket(keys[i], key_lens[i], cachedb->ht->size));
+            
+            if( cachedb->lfu )
+                tinylfu_record(cachedb->lfu, cache_data_key_hash(keys[i], key_lens[i]));
+        }
+        
+        ret = hash_table_search_many(cachedb->ht, keys, key_lens, count, found);
+        
+        for(i = 0; i < count; i++)
+        {
+            if( found[i] && flushed(cachedb, found[i]))
+            {
+                drop_flushed(cachedb, found[i]);
+                cache_data_release(found[i]);
+                found[i] = NULL;
+                ret--;
+            }
+            
+            if( found[i] && ( __atomic_load_n(&found[i]->active, __ATOMIC_RELAXED) == 0 ))
+                __atomic_store_n(&found[i]->active, 1, __ATOMIC_RELAXED);
+            
+            PROBE3(cache__get, key_lens[i], found[i] ? found[i]->val_len : 0, found[i] ? 0 : 1);
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+    
+    return ret;
+}
+
+/*
+ * Value of a tiny item into val of val_len bytes, val_len is set to its
+ * length. Items in the general store are not looked at
+ */
+int cachedb_get_tiny(cachedb_t *cachedb, uint8_t *key, int key_len, uint8_t *val, uint32_t *val_len)
+{
+    int ret = -1;
+    
+    if( cachedb && key && ( key_len > 0 ) && val && val_len )
+    {
+        flush_due(cachedb);
+        
+        if(( cachedb->tiny == NULL ) || ( key_len > TINY_DATA_SIZE ))
+        {
+            ret = 1;
+        }
+        else if(( ret = tiny_get(cachedb->tiny, cache_data_key_hash(key, key_len), key, key_len, val, val_len)) == 0 )
+        {
+            /* Misses are recorded by the lookup in the general store */
+            if( cachedb->hot && hotkeys_sampled(cachedb->hot) )
+                hotkeys_record(cachedb->hot, key, key_len, cache_data_key_bucket(key, key_len, cachedb->ht->size));
+            
+            if( cachedb->lfu )
+                tinylfu_record(cachedb->lfu, cache_data_key_hash(key, key_len));
+            
+            PROBE3(cache__get, key_len, *val_len, 0);
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+    
+    /*  0  : Found
+     *  1  : Not a tiny item
+     *  2  : val too small, val_len is what is needed
+     * -1  : Failure
+     */
+    return ret;
+}
+
+/*
+ * Store of cachedb_set(), key lock held if taken. Flags and expiration in
+ * extra as in a SET request, cas is set to the CAS of the item
+ */
+static int store(cachedb_t *cachedb, cache_data_t **centry, uint8_t *key, uint8_t *val, int key_len, int val_len,
+                 uint8_t *extra, uint8_t extra_len, uint32_t *cas)
+{
+    int ret = -1;
+    uint32_t stamp[2];
+    uint32_t flag = 0;
+    cache_data_t *c = NULL;
+    cache_data_t *old = NULL;
+    cache_data_t *reap = NULL;
+    int old_linked = 0;
+    int evicted, cls;
+    int status;
+    uint8_t *frame;
+    uint32_t frame_len;
+    uint8_t type = COMPRESS_NONE;
+    tiny_slot_t slot;
+    
+    /* Longer keys do not fit an item, storage is not evicted for them */
+    if(cachedb && key && ( key_len > 0 ) && ( key_len <= CACHE_KEY_MAX ))
+    {
+        flush_due(cachedb);
+        
+        if( extra && ( extra_len >= sizeof(flag) ))
+            memcpy(&flag, extra, sizeof(flag));
+        if( cas )
+            memset(cas, 0, sizeof(stamp));
+        
+        if( cachedb->hot && hotkeys_sampled(cachedb->hot) )
+            hotkeys_record(cachedb->hot, key, key_len, cache_data_key_bucket(key, key_len, cachedb->ht->size));
+        
+        if( cachedb->lfu )
+            tinylfu_record(cachedb->lfu, cache_data_key_hash(key, key_len));
+        
+        /* Tiny items take a slot, an older item of the key goes. Slots have
+         * no stamp, flags or CAS, keys of a namespace and with flags are kept out */
+        if( cachedb->tiny && ( centry == NULL ) && ( flag == 0 ) && TINY_FITS(key_len, val_len) &&
+            ( ns_slot(cachedb, key, key_len) < 0 ))
+        {
+            if(( ret = tiny_set(cachedb->tiny, cache_data_key_hash(key, key_len), key, key_len, val, val_len,
+                                cachedb->index ? &slot : NULL)) == 0 )
+            {
+                unlink_key(cachedb, key, key_len, NULL);
+                
+                if( cachedb->index )
+                {
+                    index_insert(cachedb->index, cache_data_key_hash(key, key_len), key, key_len);
+                    if( slot.tag )
+                        unindex(cachedb, TINY_KEY(&slot), slot.key_len);
+                }
+            }
+        }
+        else
+        {
+            /* Compressed frame is stored in place of value */
+            if( cachedb->comp && val &&
+                ( compress_value(cachedb->comp, val, val_len, &frame, &frame_len, &type) == 0 ))
+            {
+                val = frame;
+                val_len = frame_len;
+            }
+            
+            c = cache_data_item_alloc(key_len, val_len, key, val);
+            
+            /* Storage has no room of this size, make some */
+            while(( c == NULL ) && cachedb->storage && (( cls = slab_class(cachedb->storage, sizeof(cache_data_t) + key_len + val_len)) >= 0 ))
+            {
+                pthread_mutex_lock(&cachedb->lru_lock);
+                evicted = lru_evict_class(cachedb, cls, &reap);
+                pthread_mutex_unlock(&cachedb->lru_lock);
+            
+                if( evicted == 0 )
+                    break;
+            
+                reclaim(cachedb, reap);
+                reap = NULL;
+            
+                c = cache_data_item_alloc(key_len, val_len, key, val);
+            }
+            
+            if( c )
+            {
+                c->comp = type;
+                c->gen = __atomic_load_n(&cachedb->gen, __ATOMIC_ACQUIRE);
+                
+                cas_next(cachedb, stamp);
+                if( extra && ( extra_len >= 2 * sizeof(uint32_t) ))
+                    cache_data_set(c, extra, extra_len, stamp);
+                else
+                    memcpy(c->cas, stamp, sizeof(c->cas));
+                if( cas )
+                    memcpy(cas, stamp, sizeof(stamp));
+            
+                /* References for caller and LRU, table takes the initial one */
+                if(centry)
+                    *centry = cache_data_ref(c);
+                cache_data_ref(c);
+            
+                if((status=hash_table_insert(cachedb->ht, c, &old)) != -1 )
+                {
+                    if(status == 1)
+                    {
+                        TRACE(DEBUG,"Replaced Entry");
+                    }
+                
+                    pthread_mutex_lock(&cachedb->lru_lock);
+                
+                    /* Replaced item leaves LRU unless eviction took it already */
+                    if( old && ( old->lru != CACHE_LRU_NONE ))
+                    {
+                        lru_unlink(lru_of(cachedb, old), old);
+                        cachedb->items--;
+                        old_linked = 1;
+                    }
+                
+                    lru_link(cachedb->lfu ? &cachedb->window : &cachedb->main, c);
+                    cachedb->items++;
+                
+                    /* Replaced by another SET before it got linked */
+                    if( __atomic_load_n(&c->removed, __ATOMIC_ACQUIRE) )
+                        lru_drop(cachedb, c, &reap);
+                
+                    lru_evict(cachedb, &reap);
+                
+                    pthread_mutex_unlock(&cachedb->lru_lock);
+                
+                    if( old )
+                        forget(cachedb, old);
+                    if( old_linked )
+                        cache_data_release(old);
+                    cache_data_release(old);
+                
+                    if( cachedb->index )
+                        index_insert(cachedb->index, cache_data_key_hash(key, key_len), key, key_len);
+                
+                    reclaim(cachedb, reap);
+                
+                    /* Grown out of its tiny slot */
+                    if( cachedb->tiny && ( tiny_delete(cachedb->tiny, cache_data_key_hash(key, key_len), key, key_len) == 0 ))
+                        __atomic_add_fetch(&cachedb->tiny_promotions, 1, __ATOMIC_RELAXED);
+                
+                    ret = 0;
+                }
+                else
+                {
+                    TRACE(ERROR,"Memory allocation failure");
+                
+                    if(centry)
+                    {
+                        cache_data_release(c);
+                        *centry = NULL;
+                    }
+                    cache_data_release(c);
+                    cache_data_release(c);
+                    ret = -1;
+                }
+            }
+            else
+            {
+                TRACE(ERROR,"Memory allocation failure");
+                ret = -2;
+            }
+            
+        }
+            
+        PROBE3(cache__set, key_len, val_len, ret);
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    return ret;
+}
+
+/*
+ * Stores of a key are serialized with each other, with the tiny table a
+ * key may go to either store and each takes the key out of the other, and
+ * with increments, which read and store the key
+ */
+static int store_locked(cachedb_t *cachedb, cache_data_t **centry, uint8_t *key, uint8_t *val, int key_len, int val_len,
+                        uint8_t *extra, uint8_t extra_len, uint32_t *cas)
+{
+    pthread_mutex_t *lock = NULL;
+    int ret;
     
-    if( hash_size > 0 )
+    if( cachedb && key && ( key_len > 0 ))
     {
-        hash_table_init();
+        lock = &cachedb->key_lock[cache_data_key_hash(key, key_len) % CACHE_KEY_LOCKS];
+        pthread_mutex_lock(lock);
+    }
+    
+    ret = store(cachedb, centry, key, val, key_len, val_len, extra, extra_len, cas);
+    
+    if( lock )
+        pthread_mutex_unlock(lock);
+    
+    return ret;
+}
+
+/*
+ * Store value of a key
+ */
+int cachedb_set(cachedb_t *cachedb, cache_data_t **centry, uint8_t *key, uint8_t *val, int key_len, int val_len  )
+{
+    return store_locked(cachedb, centry, key, val, key_len, val_len, NULL, 0, NULL);
+}
+
+/*
+ * Store of a SET request, extra is its flags and expiration. cas is set to
+ * the CAS of the item, 0 for a tiny item
+ */
+int cachedb_set_extra(cachedb_t *cachedb, uint8_t *key, uint8_t *val, int key_len, int val_len,
+                      uint8_t *extra, uint8_t extra_len, uint32_t *cas)
+{
+    return store_locked(cachedb, NULL, key, val, key_len, val_len, extra, extra_len, cas);
+}
+
+/*
+ * Remove item of a key, tiny or not. With leases its lease is revoked and
+ * its value kept for misses while the key is recomputed
+ */
+int cachedb_delete(cachedb_t *cachedb, uint8_t *key, int key_len)
+{
+    pthread_mutex_t *lock = NULL;
+    cache_data_t *stale = NULL;
+    uint8_t val[TINY_DATA_SIZE];
+    uint32_t len = sizeof(val);
+    uint64_t hash;
+    int ret = -1;
+    
+    if( cachedb && key && ( key_len > 0 ))
+    {
+        ret = 1;
+        hash = cache_data_key_hash(key, key_len);
+        flush_due(cachedb);
         
-        if((cdb = malloc(sizeof(cachedb_t))))
-        {        
-            if(( cdb->ht = hash_table_create(hash_size)) == NULL)
+        /* A set under the lease comes before or after all of it */
+        if( cachedb->lease )
+        {
+            lock = LEASE_LOCK(cachedb->lease, hash);
+            pthread_mutex_lock(lock);
+            
+            /* Tiny value is kept as an item of its own */
+            if( cachedb->tiny && ( key_len <= TINY_DATA_SIZE ) &&
+                ( tiny_get(cachedb->tiny, hash, key, key_len, val, &len) == 0 ))
+                stale = cache_data_alloc(key_len, len, key, val);
+        }
+        
+        if( cachedb->tiny && ( tiny_delete(cachedb->tiny, hash, key, key_len) == 0 ))
+            ret = 0;
+        
+        if( unlink_key(cachedb, key, key_len, ( lock && ( stale == NULL )) ? &stale : NULL) == 0 )
+            ret = 0;
+        
+        if( lock )
+        {
+            lease_revoke(cachedb->lease, hash, stale);
+            pthread_mutex_unlock(lock);
+        }
+        
+        unindex(cachedb, key, key_len);
+        
+        PROBE2(cache__delete, key_len, ret);
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+    
+    /*  0  : Deleted
+     *  1  : Not found
+     * -1  : Failure
+     */
+    return ret;
+}
+
+/*
+ * Item of a key as cachedb_get(), a miss takes a lease on the key. token is
+ * set to the lease if it is granted, 0 otherwise. On a miss centry is set
+ * to the value the key had before it was deleted if it is still kept,
+ * NULL otherwise. Without leases it is a plain lookup
+ */
+int cachedb_lease_get(cachedb_t *cachedb, cache_data_t **centry, uint8_t *key, int key_len, uint32_t *token)
+{
+    pthread_mutex_t *lock;
+    uint64_t hash;
+    int status;
+    int ret = -1;
+    
+    if( cachedb && centry && key && ( key_len > 0 ) && token )
+    {
+        *centry = NULL;
+        *token = 0;
+        
+        if((( ret = cachedb_get(cachedb, centry, key, NULL, key_len, NULL)) == 1 ) && cachedb->lease )
+        {
+            hash = cache_data_key_hash(key, key_len);
+            lock = LEASE_LOCK(cachedb->lease, hash);
+            pthread_mutex_lock(lock);
+            
+            /* Lease holder may have set it since */
+            if(( ret = cachedb_get(cachedb, centry, key, NULL, key_len, NULL)) == 1 )
             {
-                free(cdb);
-                cdb = NULL;
+                if(( status = lease_acquire(cachedb->lease, hash, key, key_len, token, centry)) == 0 )
+                    ret = 2;
+                else if( status == 1 )
+                    ret = *centry ? 3 : 4;
+                else
+                    ret = -1;
             }
+            
+            pthread_mutex_unlock(lock);
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+    
+    /*  0  : Found
+     *  1  : Not found, no leases
+     *  2  : Not found, lease granted, centry may be stale value
+     *  3  : Not found, lease held by another, centry is stale value
+     *  4  : Not found, lease held by another, nothing to serve
+     * -1  : Failure
+     * -2  : Memory allocation failure
+     */
+    return ret;
+}
+
+/*
+ * Set a key under lease of token, refused if the lease is no longer held.
+ * Without leases it is a plain set
+ */
+int cachedb_lease_set(cachedb_t *cachedb, uint8_t *key, uint8_t *val, int key_len, int val_len, uint32_t token)
+{
+    pthread_mutex_t *lock;
+    uint64_t hash;
+    int ret = -1;
+    
+    if( cachedb && key && ( key_len > 0 ))
+    {
+        if( cachedb->lease )
+        {
+            hash = cache_data_key_hash(key, key_len);
+            lock = LEASE_LOCK(cachedb->lease, hash);
+            pthread_mutex_lock(lock);
+            
+            if(( ret = lease_release(cachedb->lease, hash, token)) == 0 )
+                ret = cachedb_set(cachedb, NULL, key, val, key_len, val_len);
+            
+            pthread_mutex_unlock(lock);
         }
         else
         {
-            TRACE(ERROR,"Memory allocation failure");
+            ret = cachedb_set(cachedb, NULL, key, val, key_len, val_len);
         }
     }
     else
     {
         TRACE(ERROR,"Invalid args");
     }
-
-    return cdb;
+    
+    /*  0  : Set
+     *  1  : Lease not held
+     * -1  : Failure
+     * -2  : Memory allocation failure
+     */
+    return ret;
 }
 
-int cachedb_get(cachedb_t *cachedb,  cache_data_t **centry, uint8_t *key, uint8_t *val, int key_len, int *val_len )
+/*
+ * Add delta to, or take it from, a value of decimal digits, value is set to
+ * the result. Decrement stops at 0, increment wraps at 64 bits. A missing
+ * key is set to initial if create is set
+ */
+int cachedb_incr(cachedb_t *cachedb, uint8_t *key, int key_len, uint64_t delta, int decr,
+                 uint64_t initial, int create, uint64_t *value)
 {
+    pthread_mutex_t *lock;
+    cache_data_t *c = NULL;
+    uint8_t num[CACHE_INCR_DIGITS + 1];
+    uint8_t extra[2 * sizeof(uint32_t)] = { 0 };
+    uint32_t len = CACHE_INCR_DIGITS;
+    uint32_t expire;
+    uint64_t v = 0;
+    int found, i;
     int ret = -1;
-    cache_data_t *creq = NULL;
-    cache_data_t *found = NULL;
-    hash_data_node_t *node;
     
-    uint8_t *ptr;
-    
-    if(cachedb && key && key_len > 0)
+    if( cachedb && key && ( key_len > 0 ) && value )
     {
-        HEXDUMP(DEBUG,"key", key, key_len);
+        lock = &cachedb->key_lock[cache_data_key_hash(key, key_len) % CACHE_KEY_LOCKS];
+        pthread_mutex_lock(lock);
         
-        if((creq = cache_data_alloc(key_len, 0, key, NULL)))
+        /* 0 found, 1 not found, 2 too long to be a number */
+        if(( found = cachedb_get_tiny(cachedb, key, key_len, num, &len)) == 1 )
         {
-            if((node=hash_table_search(cachedb->ht, creq)))
+            if( cachedb_get(cachedb, &c, key, NULL, key_len, NULL) == 0 )
             {
-                found = hash_get_cache(node);
-                if(val_len && val)
-                {
-                    TRACE(DEBUG,"Avail Buffer : %d, need : %d", *val_len, found->val_len);
-                    *val_len = MIN(*val_len, found->val_len);
-                    if(val && *val_len > 0)
-                    {
-                        ptr = CACHE_VAL(found);
-                        memcpy(val, ptr,*val_len);
-                        HEXDUMP(DEBUG,"Value", ptr, found->val_len);
-                        HEXDUMP(DEBUG,"Value", val, *val_len);
-                    }
-                    *val_len = found->val_len;
-                }
-                else
-                {
-                    TRACE(DEBUG,"Value not requested");
-                }
-
-                if(centry)
-                    *centry = found;
-                ret = 0;
+                len = CACHE_INCR_DIGITS;
+                found = cachedb_value(cachedb, c, num, &len, 0);
+                
+                /* New value keeps flags and expiration */
+                expire = htonl(c->expire);
+                memcpy(extra, &c->flag, sizeof(c->flag));
+                memcpy(&extra[sizeof(c->flag)], &expire, sizeof(expire));
+                cache_data_release(c);
             }
             else
             {
-                TRACE(INFO,"Key Not Found.");
-                ret = 1;
+                found = 1;
+            }
+        }
+        
+        if( found == 0 )
+        {
+            for(i = 0, ret = ( len == 0 ) ? 2 : 0; ( i < len ) && ( ret == 0 ); i++)
+            {
+                if(( num[i] < '0' ) || ( num[i] > '9' ) || ( v > ( UINT64_MAX - ( num[i] - '0' )) / 10 ))
+                    ret = 2;
+                else
+                    v = ( v * 10 ) + ( num[i] - '0' );
             }
             
-            cache_data_free(creq);
+            if( ret == 0 )
+                v = decr ? (( v > delta ) ? v - delta : 0 ) : v + delta;
         }
         else
         {
-            TRACE(ERROR,"Memory allocation");
-            ret = -2;
+            ret = ( found == 1 ) ? ( create ? 0 : 1 ) : 2;
+            v = initial;
         }
+        
+        if( ret == 0 )
+        {
+            len = snprintf((char*)num, sizeof(num), "%" PRIu64, v);
+            if( store(cachedb, NULL, key, num, key_len, len, extra, sizeof(extra), NULL) )
+                ret = -1;
+            else
+                *value = v;
+        }
+        
+        pthread_mutex_unlock(lock);
     }
     else
     {
         TRACE(ERROR,"Invalid args");
     }
+    
+    /*  0  : Done
+     *  1  : Not found
+     *  2  : Value is not a number
+     * -1  : Failure
+     */
     return ret;
 }
 
+/*
+ * Drop all items, after delay seconds if not 0. Nothing is freed here, the
+ * items become invisible and are taken out as they are found or evicted. A
+ * flush takes the place of one still pending
+ */
+int cachedb_flush(cachedb_t *cachedb, uint32_t delay)
+{
+    int ret = -1;
+    
+    if( cachedb )
+    {
+        if( delay )
+        {
+            __atomic_store_n(&cachedb->flush_at, now_sec() + delay, __ATOMIC_RELEASE);
+        }
+        else
+        {
+            __atomic_store_n(&cachedb->flush_at, 0, __ATOMIC_RELEASE);
+            flush_now(cachedb);
+        }
+        
+        ret = 0;
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+    
+    return ret;
+}
 
+/*
+ * Drop items of keys in namespace ns, as cachedb_flush(). Namespaces share
+ * CACHE_NS_SLOTS marks, one may take some keys of others along
+ */
+int cachedb_flush_ns(cachedb_t *cachedb, uint8_t *ns, int ns_len)
+{
+    int ret = -1;
+    
+    if( cachedb && ns && ( ns_len > 0 ))
+    {
+        if( cachedb->ns_flushed )
+        {
+            mark(&cachedb->ns_flushed[cache_data_key_hash(ns, ns_len) & ( CACHE_NS_SLOTS - 1 )],
+                 __atomic_fetch_add(&cachedb->gen, 1, __ATOMIC_ACQ_REL));
+            __atomic_add_fetch(&cachedb->ns_flushes, 1, __ATOMIC_RELAXED);
+            ret = 0;
+        }
+        else
+        {
+            ret = 1;
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+    
+    /*  0  : Flushed
+     *  1  : No namespaces
+     * -1  : Failure
+     */
+    return ret;
+}
 
-int cachedb_set(cachedb_t *cachedb, cache_data_t **centry, uint8_t *key, uint8_t *val, int key_len, int val_len  )
+/*
+ * Item found by other means than a lookup, a walk, was flushed. It is taken
+ * out of the cache then, caller keeps its reference
+ */
+int cachedb_flushed(cachedb_t *cachedb, cache_data_t *d)
 {
     int ret = -1;
-    cache_data_t *c = NULL;
-    hash_data_node_t *node;
+    
+    if( cachedb && d )
+    {
+        flush_due(cachedb);
+        
+        if(( ret = flushed(cachedb, d)))
+            drop_flushed(cachedb, d);
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+    
+    /*  0  : Live
+     *  1  : Flushed
+     * -1  : Failure
+     */
+    return ret;
+}
+
+/* Walk of keys of a prefix */
+typedef struct cache_prefix_s
+{
+    cachedb_t *cdb;
+    cache_prefix_fn_t fn;
+    void *arg;
+    int64_t count;
+} cache_prefix_t;
+
+static int prefix_count(void *arg, const uint8_t *key, uint32_t key_len)
+{
+    cache_prefix_t *walk = (cache_prefix_t*)arg;
+    
+    /* Keys that are gone are pruned on the way */
+    if( live(walk->cdb, key, key_len) )
+        walk->count++;
+    else
+        unindex(walk->cdb, key, key_len);
+    
+    return 0;
+}
+
+static int prefix_delete(void *arg, const uint8_t *key, uint32_t key_len)
+{
+    cache_prefix_t *walk = (cache_prefix_t*)arg;
     int status;
     
-    if(cachedb && key && key_len > 0)
+    status = walk->fn ? walk->fn(walk->arg, (uint8_t*)key, key_len) : cachedb_delete(walk->cdb, (uint8_t*)key, key_len);
+    if( status == 0 )
+        walk->count++;
+    
+    return 0;
+}
+
+/*
+ * Keys stored that start with prefix, 0 bytes of prefix counts all. Takes
+ * a lookup per key the index holds for the prefix. Returns -1 on failure,
+ * -2 without index
+ */
+int64_t cachedb_prefix_count(cachedb_t *cachedb, uint8_t *prefix, int prefix_len)
+{
+    cache_prefix_t walk;
+    int64_t ret = -1;
+    
+    if( cachedb && ( prefix || ( prefix_len == 0 )) && ( prefix_len >= 0 ))
     {
-        if((c = cache_data_alloc(key_len, val_len, key, val)))
+        if( cachedb->index )
         {
-            if((status=hash_table_insert(cachedb->ht, c, &node)) != -1 )
-            {
-                if(centry)
-                    *centry = hash_get_cache(node);
-                if(status == 1)
-                {
-                    TRACE(INFO,"Duplicate Entry");
-                }
-                
-                ret = 0;
-            }
-            else
-            {
-                TRACE(ERROR,"Memory allocation failure");
-                ret = -1;
-            }
+            flush_due(cachedb);
+            
+            memset(&walk, 0, sizeof(walk));
+            walk.cdb = cachedb;
+            
+            if( index_prefix(cachedb->index, prefix, prefix_len, prefix_count, &walk) >= 0 )
+                ret = walk.count;
         }
         else
         {
-            TRACE(ERROR,"Memory allocation failure");
             ret = -2;
         }
     }
@@ -140,17 +2115,129 @@ int cachedb_set(cachedb_t *cachedb, cache_data_t **centry, uint8_t *key, uint8_t
     {
         TRACE(ERROR,"Invalid args");
     }
+    
+    return ret;
+}
 
+/*
+ * Delete keys that start with prefix, by fn if given, by cachedb_delete()
+ * otherwise. Keys stored meanwhile may stay. Returns keys deleted, -1 on
+ * failure, -2 without index
+ */
+int64_t cachedb_prefix_delete(cachedb_t *cachedb, uint8_t *prefix, int prefix_len, cache_prefix_fn_t fn, void *arg)
+{
+    cache_prefix_t walk;
+    int64_t ret = -1;
+    
+    if( cachedb && ( prefix || ( prefix_len == 0 )) && ( prefix_len >= 0 ))
+    {
+        if( cachedb->index )
+        {
+            memset(&walk, 0, sizeof(walk));
+            walk.cdb = cachedb;
+            walk.fn = fn;
+            walk.arg = arg;
+            
+            if( index_prefix(cachedb->index, prefix, prefix_len, prefix_delete, &walk) >= 0 )
+                ret = walk.count;
+        }
+        else
+        {
+            ret = -2;
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+    
     return ret;
 }
 
 void cachedb_destroy(cachedb_t *cachedb)
 {
+    cache_data_t *d, *next;
+    int i;
+    
     if(cachedb)
     {
         TRACE(INFO,"Destroy");
+        
+        if( cachedb->ext )
+        {
+            pthread_mutex_lock(&cachedb->ext_lock);
+            cachedb->ext_stop = 1;
+            pthread_cond_signal(&cachedb->ext_cond);
+            pthread_mutex_unlock(&cachedb->ext_lock);
+            pthread_join(cachedb->ext_tid, NULL);
+        }
+        
+        /* Deleted values kept stale go for good, storage still frees them */
+        lease_destroy(cachedb->lease);
+        cachedb->lease = NULL;
+        
+        /* Flushed items are not handed to the next process */
+        if( cachedb->storage && ( cachedb->flushes || cachedb->ns_flushes ))
+        {
+            for(d = cachedb->main.head; d; d = next)
+            {
+                next = d->next;
+                if( flushed(cachedb, d))
+                    drop_flushed(cachedb, d);
+            }
+            for(d = cachedb->window.head; d; d = next)
+            {
+                next = d->next;
+                if( flushed(cachedb, d))
+                    drop_flushed(cachedb, d);
+            }
+        }
+        
+        /* Items stay in storage for the next process */
+        cache_data_storage(NULL);
+        
+        /* Drop LRU references, table holds the last ones */
+        while(( d = cachedb->main.head ))
+        {
+            lru_unlink(&cachedb->main, d);
+            cache_data_release(d);
+        }
+        while(( d = cachedb->window.head ))
+        {
+            lru_unlink(&cachedb->window, d);
+            cache_data_release(d);
+        }
+        while(( d = cachedb->ext_lru.head ))
+        {
+            lru_unlink(&cachedb->ext_lru, d);
+            cache_data_release(d);
+        }
+        
         hash_table_destroy(cachedb->ht);
         cachedb->ht = NULL;
+        hotkeys_destroy(cachedb->hot);
+        cachedb->hot = NULL;
+        tinylfu_destroy(cachedb->lfu);
+        cachedb->lfu = NULL;
+        slab_destroy(cachedb->storage, 1);
+        cachedb->storage = NULL;
+        if( cachedb->ext )
+        {
+            extstore_destroy(cachedb->ext);
+            cachedb->ext = NULL;
+            pthread_cond_destroy(&cachedb->ext_cond);
+            pthread_mutex_destroy(&cachedb->ext_lock);
+        }
+        compress_destroy(cachedb->comp);
+        cachedb->comp = NULL;
+        tiny_destroy(cachedb->tiny);
+        cachedb->tiny = NULL;
+        free(cachedb->ns_flushed);
+        index_destroy(cachedb->index);
+        cachedb->index = NULL;
+        pthread_mutex_destroy(&cachedb->lru_lock);
+        for(i = 0; i < CACHE_KEY_LOCKS; i++)
+            pthread_mutex_destroy(&cachedb->key_lock[i]);
         free(cachedb);
     }
     else
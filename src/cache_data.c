@@ -4,12 +4,18 @@
 #include <string.h>
 #include <arpa/inet.h>
 
-#include "avl.h"
 #include "cache_data.h"
+#include "slab.h"
 
 #define MODULE "CacheData"
 #include "trace.h"
 
+/* Small fields must not grow the item past its index node */
+_Static_assert(offsetof(cache_data_t, prev) == sizeof(avl_node_t), "item fields overflow index node");
+
+/* Item storage, items are malloc'd without it */
+static slab_t *storage;
+
 
 static int min( int a, int b )
 {
@@ -39,23 +45,155 @@ void cache_data_free(cache_data_t *d)
 {
     if( d )
     {
-        free(d);
+        /* Items of detached storage stay where they are */
+        if( d->slab )
+        {
+            if( storage )
+                slab_free(storage, d);
+        }
+        else
+        {
+            free(d);
+        }
     }
 }
 
-cache_data_t* cache_data_alloc(uint32_t key_len, uint32_t val_len, uint8_t *key, uint8_t* val)
+/*
+ * Set storage for items created by cache_data_item_alloc(), NULL detaches
+ */
+void cache_data_storage(slab_t *slab)
 {
-    cache_data_t *d = malloc(sizeof(cache_data_t) + key_len + val_len);
+    storage = slab;
+}
 
+/*
+ * Take a reference
+ */
+cache_data_t* cache_data_ref(cache_data_t *d)
+{
     if( d )
-    {
-        d->key_len = key_len;
-        d->val_len = val_len;
+        __atomic_add_fetch(&d->refcount, 1, __ATOMIC_RELAXED);
+
+    return d;
+}
+
+/*
+ * Drop a reference, last one frees the item
+ */
+int cache_data_release(cache_data_t *d)
+{
+    if( d && (__atomic_sub_fetch(&d->refcount, 1, __ATOMIC_ACQ_REL) == 0))
+        cache_data_free(d);
+
+    return 0;
+}
 
-        memcpy(CACHE_KEY(d), key, key_len);
+/*
+ * Memory accounted for an item, index links included
+ */
+uint32_t cache_data_size(cache_data_t *d)
+{
+    if( d->slab && storage )
+        return slab_chunk_size(storage, d);
+
+    if( d->ext )
+        return sizeof(cache_data_t) + ((d->key_len + 7) & ~7) + sizeof(uint64_t);
+
+    return sizeof(cache_data_t) + d->key_len + d->val_len;
+}
+
+static void init(cache_data_t *d, uint32_t key_len, uint32_t val_len, uint8_t *key, uint8_t* val)
+{
+    d->node.left = d->node.right = NULL;
+    d->node.height = 0;
+    d->prev = d->next = NULL;
+    d->refcount = 1;
+    d->lru = CACHE_LRU_NONE;
+    d->active = 0;
+    d->removed = 0;
+    d->slab = 0;
+    d->ext = 0;
+    d->comp = 0;
+    d->flag = 0;
+    d->expire = 0;
+    d->gen = 0;
+    d->cas[0] = d->cas[1] = 0;
+    d->key_len = key_len;
+    d->val_len = val_len;
+
+    memcpy(CACHE_KEY(d), key, key_len);
+    if( val )
         memcpy(CACHE_VAL(d), val, val_len);
+}
+
+/*
+ * New item to be stored, taken from item storage if there is one
+ */
+cache_data_t* cache_data_item_alloc(uint32_t key_len, uint32_t val_len, uint8_t *key, uint8_t* val)
+{
+    cache_data_t *d;
+
+    if( storage == NULL )
+        return cache_data_alloc(key_len, val_len, key, val);
+
+    if( key_len > CACHE_KEY_MAX )
+    {
+        TRACE(ERROR,"Key of %u bytes too long", key_len);
+        return NULL;
+    }
+
+    if(( d = slab_alloc(storage, sizeof(cache_data_t) + key_len + val_len)))
+    {
+        init(d, key_len, val_len, key, val);
+        d->slab = 1;
+    }
 
-        //printf("%d %d\n", key_len, val_len);
+    return d;
+}
+
+/*
+ * New item with one reference held by caller
+ */
+cache_data_t* cache_data_alloc(uint32_t key_len, uint32_t val_len, uint8_t *key, uint8_t* val)
+{
+    cache_data_t *d = NULL;
+
+    if( key_len > CACHE_KEY_MAX )
+        TRACE(ERROR,"Key of %u bytes too long", key_len);
+    else if(( d = malloc(sizeof(cache_data_t) + key_len + val_len)))
+        init(d, key_len, val_len, key, val);
+
+    return d;
+}
+
+/*
+ * Search key in caller's memory of sizeof(cache_data_t) + key_len bytes
+ */
+cache_data_t* cache_data_key(void *mem, uint32_t key_len, uint8_t *key)
+{
+    cache_data_t *d = ( key_len <= CACHE_KEY_MAX ) ? (cache_data_t*)mem : NULL;
+
+    if( d )
+        init(d, key_len, 0, key, NULL);
+
+    return d;
+}
+
+/*
+ * Item whose value of val_len bytes is kept in external store at loc
+ */
+cache_data_t* cache_data_ext_alloc(uint32_t key_len, uint32_t val_len, uint8_t *key, uint64_t loc)
+{
+    cache_data_t *d = NULL;
+
+    if( key_len <= CACHE_KEY_MAX )
+        d = malloc(sizeof(cache_data_t) + ((key_len + 7) & ~7) + sizeof(uint64_t));
+
+    if( d )
+    {
+        init(d, key_len, val_len, key, NULL);
+        d->ext = 1;
+        *CACHE_EXT_LOC(d) = loc;
     }
 
     return d;
@@ -68,11 +206,34 @@ void cache_data_dump(cache_data_t *d)
     
     HEXDUMP(DEBUG, "Key:",CACHE_KEY(d), d->key_len);
     
-    HEXDUMP(DEBUG, "Value:",CACHE_VAL(d), d->val_len);
+    if( d->ext == 0 )
+        HEXDUMP(DEBUG, "Value:",CACHE_VAL(d), d->val_len);
 }
+/*
+ * Full key hash ( 64 bit FNV-1a ), for uses which need to tell keys apart
+ */
+uint64_t cache_data_key_hash(const uint8_t *key, uint32_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    uint32_t i;
+
+    for(i = 0; i < len; i++)
+    {
+        h ^= key[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+/*
+ * Bucket hash over whole key, keys with a common prefix spread over buckets
+ */
 static uint32_t hash(uint8_t *data, uint32_t len)
 {
-    return data[0];
+    uint64_t h = cache_data_key_hash(data, len);
+
+    return (uint32_t)(h ^ (h >> 32));
 }
 
 uint32_t cache_data_hash(cache_data_t * d, uint32_t size)
@@ -88,6 +249,14 @@ uint32_t cache_data_hash(cache_data_t * d, uint32_t size)
     return h;
 }
 
+/*
+ * Bucket of a key which is not in a cache_data_t
+ */
+uint32_t cache_data_key_bucket(uint8_t *key, uint32_t len, uint32_t size)
+{
+    return ( key && len && size ) ? (hash(key, len) % size) : 0;
+}
+
 void cache_data_set(cache_data_t *d, uint8_t *extra, uint8_t extra_len , uint32_t* cas)
 {
     if( d )
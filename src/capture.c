@@ -0,0 +1,109 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "capture.h"
+#include "cache_data.h"
+
+#define MODULE "Capture"
+#include "trace.h"
+
+capture_t* capture_create(const char *path, uint32_t sample, uint64_t capacity)
+{
+    capture_t *capture = NULL;
+    struct timespec ts;
+    void *map;
+
+    if( path && sample > 0 && capacity > 0 )
+    {
+        if((capture = calloc(1, sizeof(capture_t))))
+        {
+            capture->sample = sample;
+            capture->size = sizeof(capture_header_t) + (capacity * sizeof(capture_record_t));
+
+            if((capture->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+            {
+                TRACE(ERROR,"Failed to open %s : %s", path, strerror(errno));
+                free(capture);
+                return NULL;
+            }
+
+            if( ftruncate(capture->fd, capture->size) ||
+                ((map = mmap(NULL, capture->size, PROT_READ | PROT_WRITE, MAP_SHARED, capture->fd, 0)) == MAP_FAILED))
+            {
+                TRACE(ERROR,"Failed to map %s : %s", path, strerror(errno));
+                close(capture->fd);
+                free(capture);
+                return NULL;
+            }
+
+            capture->header = (capture_header_t*)map;
+            capture->records = (capture_record_t*)&capture->header[1];
+
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            capture->start = ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+            clock_gettime(CLOCK_REALTIME, &ts);
+
+            capture->header->magic = CAPTURE_MAGIC;
+            capture->header->version = CAPTURE_VERSION;
+            capture->header->record_size = sizeof(capture_record_t);
+            capture->header->sample = sample;
+            capture->header->capacity = capacity;
+            capture->header->head = 0;
+            capture->header->start_time = ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+
+            TRACE(INFO,"Capture to %s, 1 of %u requests, %lu records", path, sample, (unsigned long)capacity);
+        }
+        else
+        {
+            TRACE(ERROR,"Failed to allocate memory");
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    return capture;
+}
+
+/*
+ * Write one record, now is the monotonic clock in ns
+ * Slot is claimed atomically so any thread may call this
+ */
+void capture_record(capture_t *capture, uint64_t now, uint8_t opcode, const uint8_t *key, uint16_t key_len, uint32_t val_len)
+{
+    capture_record_t *rec;
+    uint64_t index;
+
+    index = __atomic_fetch_add(&capture->header->head, 1, __ATOMIC_RELAXED);
+    rec = &capture->records[index % capture->header->capacity];
+
+    /* Invalidate slot while it is rewritten */
+    __atomic_store_n(&rec->time, 0, __ATOMIC_RELAXED);
+
+    rec->key_hash = cache_data_key_hash(key, key_len);
+    rec->val_len = val_len;
+    rec->key_len = key_len;
+    rec->opcode = opcode;
+    rec->reserved = 0;
+
+    /* Time 0 is reserved for slots being written */
+    __atomic_store_n(&rec->time, (now > capture->start) ? now - capture->start : 1, __ATOMIC_RELEASE);
+}
+
+void capture_destroy(capture_t *capture)
+{
+    if( capture )
+    {
+        TRACE(INFO,"Capture stopped, %lu records", (unsigned long)capture->header->head);
+
+        msync(capture->header, capture->size, MS_SYNC);
+        munmap(capture->header, capture->size);
+        close(capture->fd);
+        free(capture);
+    }
+}
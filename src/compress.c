@@ -0,0 +1,484 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "compress.h"
+
+#define MODULE "Compress"
+#include "trace.h"
+
+#define MIN(a,b)    ((a)<(b)?(a):(b))
+
+/* Streams of a thread */
+typedef struct context_s
+{
+    z_stream def;
+    z_stream inf;
+    uint8_t *buf;                   /* Frame of last compressed value */
+    uint32_t size;
+} context_t;
+
+typedef struct segment_s
+{
+    uint32_t score;
+    uint32_t start;
+} segment_t;
+
+static void context_free(void *arg)
+{
+    context_t *ctx = (context_t*)arg;
+
+    if( ctx )
+    {
+        deflateEnd(&ctx->def);
+        inflateEnd(&ctx->inf);
+        free(ctx->buf);
+        free(ctx);
+    }
+}
+
+static context_t* context(compress_t *comp)
+{
+    context_t *ctx = pthread_getspecific(comp->key);
+
+    if( ctx == NULL )
+    {
+        if(( ctx = calloc(1, sizeof(context_t))) == NULL )
+            return NULL;
+
+        if( deflateInit(&ctx->def, comp->level) != Z_OK )
+        {
+            free(ctx);
+            return NULL;
+        }
+
+        if( inflateInit(&ctx->inf) != Z_OK )
+        {
+            deflateEnd(&ctx->def);
+            free(ctx);
+            return NULL;
+        }
+
+        pthread_setspecific(comp->key, ctx);
+    }
+
+    return ctx;
+}
+
+static uint32_t gram(const uint8_t *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+
+    return (uint32_t)((v * 0x9e3779b97f4a7c15ULL) >> (64 - COMPRESS_TRAIN_BITS));
+}
+
+static uint32_t score(const uint16_t *count, const uint8_t *seg)
+{
+    uint32_t s = 0;
+    int i;
+
+    for(i = 0; i <= COMPRESS_TRAIN_SEGMENT - COMPRESS_TRAIN_GRAM; i++)
+        s += count[gram(&seg[i])];
+
+    return s;
+}
+
+static int by_score(const void *a, const void *b)
+{
+    const segment_t *x = (const segment_t*)a;
+    const segment_t *y = (const segment_t*)b;
+
+    return ( x->score < y->score ) ? 1 : ( x->score > y->score ) ? -1 : 0;
+}
+
+/*
+ * Build dictionary of segments whose 8 byte grams are seen most often in
+ * samples. Grams of a taken segment stop counting, so segments saying the
+ * same are not taken twice. Best segments go last, nearest to the data.
+ * Lock held
+ */
+static uint8_t* train(compress_t *comp, uint32_t *dict_len)
+{
+    uint32_t grams = COMPRESS_TRAIN_SEGMENT - COMPRESS_TRAIN_GRAM + 1;
+    uint32_t n = comp->sampled;
+    uint32_t segments, taken = 0, i, j, s;
+    segment_t *seg = NULL;
+    uint16_t *count = NULL;
+    uint8_t *dict = NULL;
+
+    if(( n < COMPRESS_TRAIN_SEGMENT ) ||
+       (( count = calloc(1 << COMPRESS_TRAIN_BITS, sizeof(uint16_t))) == NULL ) ||
+       (( seg = calloc(n / COMPRESS_TRAIN_STEP, sizeof(segment_t))) == NULL ) ||
+       (( dict = malloc(COMPRESS_DICT_SIZE)) == NULL ))
+    {
+        free(count);
+        free(seg);
+        return NULL;
+    }
+
+    for(i = 0; i + COMPRESS_TRAIN_GRAM <= n; i++)
+    {
+        j = gram(&comp->samples[i]);
+        if( count[j] < UINT16_MAX )
+            count[j]++;
+    }
+
+    for(i = 0, segments = 0; i + COMPRESS_TRAIN_SEGMENT <= n; i += COMPRESS_TRAIN_STEP, segments++)
+    {
+        seg[segments].start = i;
+        seg[segments].score = score(count, &comp->samples[i]);
+    }
+
+    qsort(seg, segments, sizeof(segment_t), by_score);
+
+    for(i = 0; ( i < segments ) && (( taken + 1) * COMPRESS_TRAIN_SEGMENT <= COMPRESS_DICT_SIZE ); i++)
+    {
+        /* Only grams seen at least twice are worth a place */
+        s = score(count, &comp->samples[seg[i].start]);
+        if(( s < 2 * grams ) || ( 2 * s < seg[i].score ))
+            continue;
+
+        taken++;
+        memcpy(&dict[COMPRESS_DICT_SIZE - (taken * COMPRESS_TRAIN_SEGMENT)], &comp->samples[seg[i].start], COMPRESS_TRAIN_SEGMENT);
+
+        for(j = 0; j < grams; j++)
+            count[gram(&comp->samples[seg[i].start + j])] = 0;
+    }
+
+    free(count);
+    free(seg);
+
+    if( taken == 0 )
+    {
+        /* Nothing repeats, latest values are the best guess */
+        taken = MIN(n, COMPRESS_DICT_SIZE) / COMPRESS_TRAIN_SEGMENT;
+        memcpy(&dict[COMPRESS_DICT_SIZE - (taken * COMPRESS_TRAIN_SEGMENT)],
+               &comp->samples[n - (taken * COMPRESS_TRAIN_SEGMENT)], taken * COMPRESS_TRAIN_SEGMENT);
+    }
+
+    *dict_len = taken * COMPRESS_TRAIN_SEGMENT;
+    memmove(dict, &dict[COMPRESS_DICT_SIZE - *dict_len], *dict_len);
+
+    return dict;
+}
+
+static int save(const char *path, const uint8_t *dict, uint32_t len)
+{
+    char *tmp = NULL;
+    FILE *f = NULL;
+    int ret = -1;
+
+    if(( tmp = malloc(strlen(path) + 5)))
+    {
+        sprintf(tmp, "%s.tmp", path);
+
+        if(( f = fopen(tmp, "wb")) && ( fwrite(dict, len, 1, f) == 1 ) && ( fclose(f) == 0 ))
+        {
+            f = NULL;
+            ret = rename(tmp, path);
+        }
+
+        if( f )
+            fclose(f);
+
+        if( ret )
+        {
+            TRACE(ERROR,"Failed to save dictionary %s : %s", path, strerror(errno));
+            unlink(tmp);
+        }
+
+        free(tmp);
+    }
+
+    return ret;
+}
+
+static int load(compress_t *comp)
+{
+    uint8_t *dict = NULL;
+    FILE *f = NULL;
+    long len;
+    int ret = -1;
+
+    if(( f = fopen(comp->dict_path, "rb")) == NULL )
+        return ( errno == ENOENT ) ? 1 : -1;
+
+    if(( fseek(f, 0, SEEK_END) == 0 ) && (( len = ftell(f)) > 0 ) && ( len <= COMPRESS_DICT_SIZE ) &&
+       ( fseek(f, 0, SEEK_SET) == 0 ) && (( dict = malloc(len))) && ( fread(dict, len, 1, f) == 1 ))
+    {
+        comp->dict = dict;
+        comp->dict_len = len;
+        ret = 0;
+    }
+    else
+    {
+        free(dict);
+    }
+
+    fclose(f);
+
+    /*  0  : Loaded
+     *  1  : No dictionary yet
+     * -1  : Failure
+     */
+    return ret;
+}
+
+/*
+ * Keep part of a value for training, the last sample trains
+ */
+static void sample(compress_t *comp, const uint8_t *val, uint32_t len)
+{
+    uint8_t *dict;
+    uint32_t dict_len = 0;
+
+    pthread_mutex_lock(&comp->lock);
+
+    if( comp->samples && ( comp->dict == NULL ))
+    {
+        len = MIN(MIN(len, COMPRESS_TRAIN_SAMPLE), COMPRESS_TRAIN_BYTES - comp->sampled);
+        memcpy(&comp->samples[comp->sampled], val, len);
+        comp->sampled += len;
+
+        if( comp->sampled == COMPRESS_TRAIN_BYTES )
+        {
+            if(( dict = train(comp, &dict_len)))
+            {
+                TRACE(INFO,"Trained dictionary of %u bytes", dict_len);
+                save(comp->dict_path, dict, dict_len);
+                comp->dict_len = dict_len;
+                __atomic_store_n(&comp->dict, dict, __ATOMIC_RELEASE);
+            }
+            else
+            {
+                TRACE(ERROR,"Failed to train dictionary");
+            }
+
+            free(comp->samples);
+            comp->samples = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&comp->lock);
+}
+
+/*
+ * Compress values of at least min bytes at level, dictionary is trained
+ * into dict_path unless it is there already, NULL for none
+ */
+compress_t* compress_create(uint32_t min, int level, const char *dict_path)
+{
+    compress_t *comp = NULL;
+    int ret;
+
+    if(( level >= 1 ) && ( level <= 9 ))
+    {
+        if(( comp = calloc(1, sizeof(compress_t))))
+        {
+            comp->min = min ? min : COMPRESS_MIN_DEFAULT;
+            comp->level = level;
+            pthread_mutex_init(&comp->lock, NULL);
+
+            if( pthread_key_create(&comp->key, context_free) )
+            {
+                TRACE(ERROR,"Failed to create key");
+                pthread_mutex_destroy(&comp->lock);
+                free(comp);
+                return NULL;
+            }
+
+            if( dict_path )
+            {
+                if((( comp->dict_path = strdup(dict_path)) == NULL ) || (( ret = load(comp)) < 0 ))
+                {
+                    TRACE(ERROR,"Failed to read dictionary %s", dict_path);
+                    compress_destroy(comp);
+                    comp = NULL;
+                }
+                else if( ret == 0 )
+                {
+                    TRACE(INFO,"Dictionary of %u bytes", comp->dict_len);
+                }
+                else if(( comp->samples = malloc(COMPRESS_TRAIN_BYTES)) == NULL )
+                {
+                    TRACE(ERROR,"Memory allocation failure");
+                    compress_destroy(comp);
+                    comp = NULL;
+                }
+            }
+        }
+        else
+        {
+            TRACE(ERROR,"Memory allocation failure");
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    return comp;
+}
+
+/*
+ * Frame of compressed value in out, valid until next call of this thread
+ */
+int compress_value(compress_t *comp, const uint8_t *val, uint32_t len, uint8_t **out, uint32_t *out_len, uint8_t *type)
+{
+    context_t *ctx;
+    uint8_t *dict;
+    uint8_t *buf;
+    uLong bound;
+    int ret = -1;
+
+    if( comp && val && out && out_len && type )
+    {
+        if( len < comp->min )
+            return 1;
+
+        if(( dict = __atomic_load_n(&comp->dict, __ATOMIC_ACQUIRE)) == NULL && comp->dict_path )
+            sample(comp, val, len);
+
+        if(( ctx = context(comp)) == NULL )
+            return -1;
+
+        bound = COMPRESS_FRAME_SIZE + deflateBound(&ctx->def, len);
+        if( bound > ctx->size )
+        {
+            if(( buf = realloc(ctx->buf, bound)) == NULL )
+                return -1;
+            ctx->buf = buf;
+            ctx->size = bound;
+        }
+
+        deflateReset(&ctx->def);
+        if( dict && ( deflateSetDictionary(&ctx->def, dict, comp->dict_len) != Z_OK ))
+            return -1;
+
+        ctx->def.next_in = (Bytef*)val;
+        ctx->def.avail_in = len;
+        ctx->def.next_out = &ctx->buf[COMPRESS_FRAME_SIZE];
+        ctx->def.avail_out = ctx->size - COMPRESS_FRAME_SIZE;
+
+        if( deflate(&ctx->def, Z_FINISH) != Z_STREAM_END )
+            return -1;
+
+        __atomic_add_fetch(&comp->bytes_in, len, __ATOMIC_RELAXED);
+
+        if( COMPRESS_FRAME_SIZE + ctx->def.total_out > len - ( len / 8 ))
+        {
+            /* Not worth it, stored as is */
+            __atomic_add_fetch(&comp->skipped, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&comp->bytes_out, len, __ATOMIC_RELAXED);
+            ret = 1;
+        }
+        else
+        {
+            ctx->buf[0] = len >> 24;
+            ctx->buf[1] = len >> 16;
+            ctx->buf[2] = len >> 8;
+            ctx->buf[3] = len;
+
+            *out = ctx->buf;
+            *out_len = COMPRESS_FRAME_SIZE + ctx->def.total_out;
+            *type = dict ? COMPRESS_DICT : COMPRESS_DEFLATE;
+
+            __atomic_add_fetch(&comp->values, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&comp->bytes_out, *out_len, __ATOMIC_RELAXED);
+            ret = 0;
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    /*  0  : Compressed
+     *  1  : Stored as is
+     * -1  : Failure
+     */
+    return ret;
+}
+
+/*
+ * Inflate frame of type into out of at least its original length
+ */
+int compress_inflate(compress_t *comp, uint8_t type, const uint8_t *in, uint32_t in_len, uint8_t *out, uint32_t out_len)
+{
+    context_t *ctx;
+    uint32_t len;
+    int ret = -1;
+    int z;
+
+    if( comp && in && ( in_len >= COMPRESS_FRAME_SIZE ) && (( len = COMPRESS_RAW_LEN(in)) <= out_len ))
+    {
+        if(( ctx = context(comp)) == NULL )
+            return -1;
+
+        __atomic_add_fetch(&comp->inflates, 1, __ATOMIC_RELAXED);
+
+        inflateReset(&ctx->inf);
+        ctx->inf.next_in = (Bytef*)&in[COMPRESS_FRAME_SIZE];
+        ctx->inf.avail_in = in_len - COMPRESS_FRAME_SIZE;
+        ctx->inf.next_out = out;
+        ctx->inf.avail_out = len;
+
+        if((( z = inflate(&ctx->inf, Z_FINISH)) == Z_NEED_DICT ) && ( type == COMPRESS_DICT ) && comp->dict &&
+           ( inflateSetDictionary(&ctx->inf, comp->dict, comp->dict_len) == Z_OK ))
+        {
+            z = inflate(&ctx->inf, Z_FINISH);
+        }
+
+        if(( z == Z_STREAM_END ) && ( ctx->inf.total_out == len ))
+        {
+            ret = 0;
+        }
+        else
+        {
+            TRACE(WARN,"Corrupt value");
+            __atomic_add_fetch(&comp->failures, 1, __ATOMIC_RELAXED);
+            ret = 1;
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    /*  0  : Inflated
+     *  1  : Corrupt or other dictionary
+     * -1  : Failure
+     */
+    return ret;
+}
+
+/*
+ * Values of type can be inflated
+ */
+int compress_readable(compress_t *comp, uint8_t type)
+{
+    if( type == COMPRESS_NONE )
+        return 1;
+
+    if( comp == NULL )
+        return 0;
+
+    return ( type == COMPRESS_DEFLATE ) || (( type == COMPRESS_DICT ) && __atomic_load_n(&comp->dict, __ATOMIC_ACQUIRE));
+}
+
+void compress_destroy(compress_t *comp)
+{
+    if( comp )
+    {
+        pthread_key_delete(comp->key);
+        pthread_mutex_destroy(&comp->lock);
+        free(comp->samples);
+        free(comp->dict);
+        free(comp->dict_path);
+        free(comp);
+    }
+}
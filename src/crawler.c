@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <string.h>
+#include "crawler.h"
+
+#define MODULE "Crawler"
+#include "trace.h"
+
+/* Items of one bucket, references */
+typedef struct crawler_batch_s
+{
+    cache_data_t **items;
+    int count;
+    int size;
+} crawler_batch_t;
+
+static int batch_add(void *arg, void *data)
+{
+    crawler_batch_t *batch = (crawler_batch_t*)arg;
+    cache_data_t **items;
+    int size;
+
+    if( batch->count == batch->size )
+    {
+        size = batch->size ? batch->size * 2 : 64;
+        if(( items = realloc(batch->items, size * sizeof(cache_data_t*))) == NULL )
+        {
+            TRACE(ERROR,"Memory allocation failure");
+            return -1;
+        }
+
+        batch->items = items;
+        batch->size = size;
+    }
+
+    batch->items[batch->count++] = cache_data_ref((cache_data_t*)data);
+
+    return 0;
+}
+
+/*
+ * Key matches glob pattern, '*' is any run of bytes, '?' any one byte
+ */
+int crawler_match(const uint8_t *pattern, uint32_t pattern_len, const uint8_t *key, uint32_t key_len)
+{
+    uint32_t p = 0, k = 0;
+    uint32_t star = UINT32_MAX, mark = 0;
+
+    while( k < key_len )
+    {
+        if(( p < pattern_len ) && ( pattern[p] == '*' ))
+        {
+            /* Star takes nothing first, one more byte on every retry */
+            star = p++;
+            mark = k;
+        }
+        else if(( p < pattern_len ) && (( pattern[p] == '?' ) || ( pattern[p] == key[k] )))
+        {
+            p++;
+            k++;
+        }
+        else if( star != UINT32_MAX )
+        {
+            p = star + 1;
+            k = ++mark;
+        }
+        else
+        {
+            return 0;
+        }
+    }
+
+    while(( p < pattern_len ) && ( pattern[p] == '*' ))
+        p++;
+
+    return ( p == pattern_len );
+}
+
+const char* crawler_loc(int loc)
+{
+    return ( loc == CRAWLER_LOC_EXT ) ? "ext" : ( loc == CRAWLER_LOC_TINY ) ? "tiny" : "mem";
+}
+
+/*
+ * One step of a walk from cursor, which is moved on. pattern of 0 bytes
+ * matches every key. Returns keys handed to fn, -1 on failure
+ */
+int crawler_step(cachedb_t *cache, uint64_t *cursor, const uint8_t *pattern, uint32_t pattern_len,
+                 uint32_t count, crawler_fn_t fn, void *arg)
+{
+    crawler_batch_t batch;
+    crawler_item_t item;
+    tiny_slot_t slots[TINY_WAYS];
+    cache_data_t *d;
+    uint64_t pos, end;
+    uint32_t looked;
+    int i, n;
+    int ret = -1;
+
+    if( cache && cursor && fn && ( pattern || ( pattern_len == 0 )))
+    {
+        memset(&batch, 0, sizeof(batch));
+        end = (uint64_t)cache->ht->size + ( cache->tiny ? tiny_sets(cache->tiny) : 0 );
+
+        for(pos = *cursor, looked = 0, ret = 0; ( pos < end ) && ( looked < CRAWLER_STEP_BUCKETS ) &&
+            ( ret >= 0 ) && ( ret < (int)count ); pos++, looked++)
+        {
+            if( pos < cache->ht->size )
+            {
+                batch.count = 0;
+                if( hash_table_walk(cache->ht, pos, batch_add, &batch) )
+                    ret = -1;
+
+                for(i = 0; i < batch.count; i++)
+                {
+                    d = batch.items[i];
+
+                    if(( ret >= 0 ) && ( d->removed == 0 ) && ( cachedb_flushed(cache, d) == 0 ) &&
+                       (( pattern_len == 0 ) || crawler_match(pattern, pattern_len, CACHE_KEY(d), d->key_len)))
+                    {
+                        item.key = CACHE_KEY(d);
+                        item.key_len = d->key_len;
+                        item.val_len = d->val_len;
+                        item.expire = d->expire;
+                        item.loc = d->ext ? CRAWLER_LOC_EXT : CRAWLER_LOC_MEM;
+                        ret = fn(arg, &item) ? -1 : ret + 1;
+                    }
+
+                    cache_data_release(d);
+                }
+            }
+            else
+            {
+                n = tiny_copy(cache->tiny, pos - cache->ht->size, slots);
+
+                for(i = 0; ( i < n ) && ( ret >= 0 ); i++)
+                {
+                    if(( pattern_len == 0 ) || crawler_match(pattern, pattern_len, TINY_KEY(&slots[i]), slots[i].key_len))
+                    {
+                        item.key = TINY_KEY(&slots[i]);
+                        item.key_len = slots[i].key_len;
+                        item.val_len = slots[i].val_len;
+                        item.expire = 0;
+                        item.loc = CRAWLER_LOC_TINY;
+                        ret = fn(arg, &item) ? -1 : ret + 1;
+                    }
+                }
+            }
+        }
+
+        *cursor = ( pos < end ) ? pos : 0;
+        free(batch.items);
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    /* >=0 : Keys handed out, cursor is where next step starts, 0 done
+     * -1  : Failure
+     */
+    return ret;
+}
@@ -0,0 +1,489 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "extstore.h"
+
+#define MODULE "Extstore"
+#include "trace.h"
+
+static off_t position(extstore_t *ext, uint32_t page, uint32_t offset)
+{
+    return ((off_t)page * ext->page_size) + offset;
+}
+
+static int write_all(int fd, const uint8_t *buf, uint32_t len, off_t off)
+{
+    ssize_t n;
+
+    while( len )
+    {
+        if(( n = pwrite(fd, buf, len, off)) <= 0 )
+        {
+            if(( n < 0 ) && ( errno == EINTR ))
+                continue;
+            TRACE(ERROR,"Write failed : %s", strerror(errno));
+            return -1;
+        }
+
+        buf += n;
+        len -= n;
+        off += n;
+    }
+
+    return 0;
+}
+
+static int read_all(int fd, uint8_t *buf, uint32_t len, off_t off)
+{
+    ssize_t n;
+
+    while( len )
+    {
+        if(( n = pread(fd, buf, len, off)) <= 0 )
+        {
+            if(( n < 0 ) && ( errno == EINTR ))
+                continue;
+            TRACE(ERROR,"Read failed : %s", ( n < 0 ) ? strerror(errno) : "short file");
+            return -1;
+        }
+
+        buf += n;
+        len -= n;
+        off += n;
+    }
+
+    return 0;
+}
+
+/*
+ * Write out buffered records of open page, lock held
+ */
+static int flush(extstore_t *ext)
+{
+    int ret = 0;
+
+    if( ext->wlen )
+    {
+        ret = write_all(ext->fd, ext->wbuf, ext->wlen, position(ext, ext->open, ext->wpos));
+        ext->wpos += ext->wlen;
+        ext->wlen = 0;
+    }
+
+    return ret;
+}
+
+/*
+ * Close open page and take a free one, lock held
+ */
+static int next_page(extstore_t *ext)
+{
+    uint32_t i;
+
+    if( flush(ext) )
+        return -1;
+
+    for(i = 0; ( i < ext->pages ) && ( ext->page[i].state != EXTSTORE_PAGE_FREE ); i++);
+
+    if( i == ext->pages )
+        return 1;
+
+    if( ext->page[ext->open].state == EXTSTORE_PAGE_OPEN )
+        ext->page[ext->open].state = EXTSTORE_PAGE_FULL;
+
+    ext->page[i].state = EXTSTORE_PAGE_OPEN;
+    ext->page[i].used = 0;
+    ext->page[i].live = 0;
+    ext->page[i].seq = ++ext->seq;
+    ext->free--;
+    ext->open = i;
+    ext->wpos = 0;
+
+    return 0;
+}
+
+/*
+ * Store file of size bytes, content of an existing file is not used
+ */
+extstore_t* extstore_create(const char *path, uint64_t size)
+{
+    extstore_t *ext = NULL;
+    uint64_t pages = size / EXTSTORE_PAGE_SIZE;
+
+    if( path && ( pages >= EXTSTORE_PAGES_MIN ) && ( pages <= 0xffff ))
+    {
+        if(( ext = calloc(1, sizeof(extstore_t))) &&
+           (( ext->page = calloc(pages, sizeof(extstore_page_t)))) &&
+           (( ext->wbuf = malloc(EXTSTORE_WBUF_SIZE))))
+        {
+            ext->page_size = EXTSTORE_PAGE_SIZE;
+            ext->pages = pages;
+            ext->free = pages;
+            pthread_mutex_init(&ext->lock, NULL);
+
+            if((( ext->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 ) ||
+               ftruncate(ext->fd, pages * EXTSTORE_PAGE_SIZE) || next_page(ext))
+            {
+                TRACE(ERROR,"Failed to create %s : %s", path, strerror(errno));
+                extstore_destroy(ext);
+                ext = NULL;
+            }
+        }
+        else
+        {
+            TRACE(ERROR,"Memory allocation failure");
+            if( ext )
+            {
+                free(ext->page);
+                free(ext);
+                ext = NULL;
+            }
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    return ext;
+}
+
+/*
+ * Append value, location of value is returned in loc
+ */
+int extstore_write(extstore_t *ext, const uint8_t *key, uint16_t key_len, const uint8_t *val, uint32_t val_len, uint64_t *loc)
+{
+    extstore_record_t rec;
+    uint32_t len = sizeof(rec) + key_len + val_len;
+    extstore_page_t *page;
+    int ret = -1;
+
+    if( ext && key && val && loc && ( len <= ext->page_size ))
+    {
+        memset(&rec, 0, sizeof(rec));
+        rec.key_len = key_len;
+        rec.val_len = val_len;
+
+        pthread_mutex_lock(&ext->lock);
+
+        page = &ext->page[ext->open];
+
+        if(( page->used + len > ext->page_size ) && (( ret = next_page(ext)) != 0 ))
+        {
+            /* No free page, compaction is behind */
+            pthread_mutex_unlock(&ext->lock);
+            return ret;
+        }
+
+        page = &ext->page[ext->open];
+
+        if(( ext->wlen + len > EXTSTORE_WBUF_SIZE ) && flush(ext))
+        {
+            pthread_mutex_unlock(&ext->lock);
+            return -1;
+        }
+
+        *loc = EXTSTORE_LOC(ext->open, page->version, page->used + sizeof(rec) + key_len);
+
+        if( len > EXTSTORE_WBUF_SIZE )
+        {
+            /* Too large to buffer, write as is */
+            memcpy(ext->wbuf, &rec, sizeof(rec));
+            memcpy(&ext->wbuf[sizeof(rec)], key, key_len);
+            ret = write_all(ext->fd, ext->wbuf, sizeof(rec) + key_len, position(ext, ext->open, page->used));
+            if( ret == 0 )
+                ret = write_all(ext->fd, val, val_len, position(ext, ext->open, page->used + sizeof(rec) + key_len));
+            ext->wpos += len;
+        }
+        else
+        {
+            memcpy(&ext->wbuf[ext->wlen], &rec, sizeof(rec));
+            memcpy(&ext->wbuf[ext->wlen + sizeof(rec)], key, key_len);
+            memcpy(&ext->wbuf[ext->wlen + sizeof(rec) + key_len], val, val_len);
+            ext->wlen += len;
+            ret = 0;
+        }
+
+        page->used += len;
+
+        if( ret == 0 )
+        {
+            page->live += val_len;
+            ext->writes++;
+            ext->bytes_written += len;
+        }
+
+        pthread_mutex_unlock(&ext->lock);
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    /*  0  : Written
+     *  1  : No free page
+     * -1  : Failure
+     */
+    return ret;
+}
+
+/*
+ * Read value of len bytes at loc
+ * Page may be freed while reading unlocked, version is checked again after
+ */
+int extstore_read(extstore_t *ext, uint64_t loc, uint8_t *val, uint32_t len)
+{
+    uint32_t p = EXTSTORE_LOC_PAGE(loc);
+    uint32_t offset = EXTSTORE_LOC_OFFSET(loc);
+    int ret = -1;
+
+    if( ext && val && ( p < ext->pages ))
+    {
+        pthread_mutex_lock(&ext->lock);
+        ext->reads++;
+
+        if( ext->page[p].version != EXTSTORE_LOC_VERSION(loc) )
+        {
+            ret = 1;
+        }
+        else if(( p == ext->open ) && ( offset >= ext->wpos ))
+        {
+            /* Still in write buffer */
+            memcpy(val, &ext->wbuf[offset - ext->wpos], len);
+            ret = 0;
+        }
+
+        pthread_mutex_unlock(&ext->lock);
+
+        if( ret == -1 )
+        {
+            if(( ret = read_all(ext->fd, val, len, position(ext, p, offset))) == 0 )
+            {
+                pthread_mutex_lock(&ext->lock);
+                if( ext->page[p].version != EXTSTORE_LOC_VERSION(loc) )
+                    ret = 1;
+                pthread_mutex_unlock(&ext->lock);
+            }
+        }
+
+        if( ret == 1 )
+            __atomic_add_fetch(&ext->read_misses, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    /*  0  : Read
+     *  1  : Page reused, value is gone
+     * -1  : Failure
+     */
+    return ret;
+}
+
+/*
+ * Keep page of loc from reuse while value is sent straight from file
+ * Only values already written out can be pinned
+ */
+int extstore_pin(extstore_t *ext, uint64_t loc, int *fd, off_t *off)
+{
+    uint32_t p = EXTSTORE_LOC_PAGE(loc);
+    uint32_t offset = EXTSTORE_LOC_OFFSET(loc);
+    extstore_page_t *page;
+    int ret = -1;
+
+    if( ext && fd && off && ( p < ext->pages ))
+    {
+        pthread_mutex_lock(&ext->lock);
+        page = &ext->page[p];
+
+        if( page->version != EXTSTORE_LOC_VERSION(loc) )
+        {
+            ret = 1;
+        }
+        else if(( p == ext->open ) && ( offset >= ext->wpos ))
+        {
+            /* Still in write buffer */
+            ret = 2;
+        }
+        else
+        {
+            page->pins++;
+            ext->pinned++;
+            *fd = ext->fd;
+            *off = position(ext, p, offset);
+            ret = 0;
+        }
+
+        pthread_mutex_unlock(&ext->lock);
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    /*  0  : Pinned
+     *  1  : Page reused, value is gone
+     *  2  : Not written out yet
+     * -1  : Failure
+     */
+    return ret;
+}
+
+/*
+ * Drop pin taken by extstore_pin, a draining page becomes free with the last
+ */
+void extstore_unpin(extstore_t *ext, uint64_t loc)
+{
+    extstore_page_t *page;
+
+    if( ext && ( EXTSTORE_LOC_PAGE(loc) < ext->pages ))
+    {
+        pthread_mutex_lock(&ext->lock);
+        page = &ext->page[EXTSTORE_LOC_PAGE(loc)];
+        if( page->pins && ( --page->pins == 0 ) && ( page->state == EXTSTORE_PAGE_DRAINING ))
+        {
+            page->state = EXTSTORE_PAGE_FREE;
+            ext->free++;
+        }
+        pthread_mutex_unlock(&ext->lock);
+    }
+}
+
+/*
+ * Value at loc is no longer referenced
+ */
+void extstore_delete(extstore_t *ext, uint64_t loc, uint32_t len)
+{
+    extstore_page_t *page;
+
+    if( ext && ( EXTSTORE_LOC_PAGE(loc) < ext->pages ))
+    {
+        pthread_mutex_lock(&ext->lock);
+        page = &ext->page[EXTSTORE_LOC_PAGE(loc)];
+        if(( page->version == EXTSTORE_LOC_VERSION(loc)) && ( page->live >= len ))
+            page->live -= len;
+        pthread_mutex_unlock(&ext->lock);
+    }
+}
+
+uint32_t extstore_free_pages(extstore_t *ext)
+{
+    uint32_t free = 0;
+
+    if( ext )
+    {
+        pthread_mutex_lock(&ext->lock);
+        free = ext->free;
+        pthread_mutex_unlock(&ext->lock);
+    }
+
+    return free;
+}
+
+/*
+ * Full page with least live data, oldest on a tie, or -1
+ */
+int extstore_victim(extstore_t *ext, uint32_t *live, uint32_t *used)
+{
+    extstore_page_t *page;
+    int victim = -1;
+    uint32_t i;
+
+    if( ext )
+    {
+        pthread_mutex_lock(&ext->lock);
+
+        for(i = 0; i < ext->pages; i++)
+        {
+            page = &ext->page[i];
+
+            if(( page->state == EXTSTORE_PAGE_FULL ) &&
+               (( victim < 0 ) || ( page->live < ext->page[victim].live ) ||
+                (( page->live == ext->page[victim].live ) && ( page->seq < ext->page[victim].seq ))))
+            {
+                victim = i;
+            }
+        }
+
+        if( victim >= 0 )
+        {
+            *live = ext->page[victim].live;
+            *used = ext->page[victim].used;
+        }
+
+        pthread_mutex_unlock(&ext->lock);
+    }
+
+    return victim;
+}
+
+/*
+ * Read whole content of a full page, buf holds page_size bytes
+ */
+int extstore_page_read(extstore_t *ext, uint32_t page, uint8_t *buf, uint16_t *version, uint32_t *used)
+{
+    int ret = -1;
+
+    if( ext && buf && ( page < ext->pages ))
+    {
+        pthread_mutex_lock(&ext->lock);
+        *version = ext->page[page].version;
+        *used = ext->page[page].used;
+        ret = ( ext->page[page].state == EXTSTORE_PAGE_FULL ) ? 0 : -1;
+        pthread_mutex_unlock(&ext->lock);
+
+        if( ret == 0 )
+            ret = read_all(ext->fd, buf, *used, position(ext, page, 0));
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    return ret;
+}
+
+/*
+ * Return page of given version to free pages, its locations go stale
+ * A pinned page is only reused once unpinned
+ */
+void extstore_page_free(extstore_t *ext, uint32_t page, uint16_t version)
+{
+    if( ext && ( page < ext->pages ))
+    {
+        pthread_mutex_lock(&ext->lock);
+        if(( ext->page[page].state == EXTSTORE_PAGE_FULL ) && ( ext->page[page].version == version ))
+        {
+            ext->page[page].version++;
+            ext->page[page].used = 0;
+            ext->page[page].live = 0;
+
+            /* Pinned content is still being sent, page is reused after */
+            if( ext->page[page].pins )
+            {
+                ext->page[page].state = EXTSTORE_PAGE_DRAINING;
+            }
+            else
+            {
+                ext->page[page].state = EXTSTORE_PAGE_FREE;
+                ext->free++;
+            }
+        }
+        pthread_mutex_unlock(&ext->lock);
+    }
+}
+
+void extstore_destroy(extstore_t *ext)
+{
+    if( ext )
+    {
+        if( ext->fd >= 0 )
+            close(ext->fd);
+        pthread_mutex_destroy(&ext->lock);
+        free(ext->wbuf);
+        free(ext->page);
+        free(ext);
+    }
+}
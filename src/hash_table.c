@@ -1,23 +1,38 @@
 #include <malloc.h>
+#include <string.h>
 #include "hash_table.h"
+#include "arena.h"
+#include "probes.h"
 
 #define MODULE "HashTable"
 #include "trace.h"
 
+/* Items and their nodes are passed to tree as the same pointers */
+_Static_assert(offsetof(cache_data_t, node) == 0, "index node must start item");
+
+static int node_compare(avl_node_t *n1, avl_node_t *n2)
+{
+    return cache_data_cmpkey(CACHE_NODE_DATA(n1), CACHE_NODE_DATA(n2));
+}
+
+static int node_release(avl_node_t *node)
+{
+    return cache_data_release(CACHE_NODE_DATA(node));
+}
+
+static void node_dump(avl_node_t *node)
+{
+    cache_data_dump(CACHE_NODE_DATA(node));
+}
+
 void hash_table_init(void)
 {
     /* Initialize AVL Tree */
-    avl_init((avl_compare_t)cache_data_cmpkey, (avl_free_data_t)cache_data_free,
-             (avl_dump_data_t)cache_data_dump);
+    avl_init(node_compare, node_release, node_dump);
              
     TRACE(DEBUG,"AVL Init Done");
 }
 
-cache_data_t* hash_get_cache(hash_data_node_t *hnode)
-{
-    return (cache_data_t*)hnode->data;
-}
-
 static int read_write_lock_init(hash_node_t *hnode)
 {
     int ret = 0; 
@@ -48,11 +63,13 @@ static int read_write_lock_init(hash_node_t *hnode)
 
 static void read_lock(hash_node_t *hnode)
 {
+    PROBE2(bucket__lock__wait, hnode->index, 0);
     pthread_mutex_lock(&hnode->lock);
     while(hnode->writer_here==1)
         pthread_cond_wait(&hnode->reader_can_enter,&hnode->lock);
     hnode->reader_count++;
     pthread_mutex_unlock(&hnode->lock);
+    PROBE2(bucket__lock__acquired, hnode->index, 0);
 }
 
 
@@ -60,7 +77,8 @@ static void read_unlock(hash_node_t *hnode)
 {
     pthread_mutex_lock(&hnode->lock);
     hnode->reader_count--;
-    if(hnode->reader_count!=0)
+    /* Last reader lets a waiting writer in */
+    if(hnode->reader_count==0)
         pthread_cond_signal(&hnode->writer_can_enter);
     
     pthread_mutex_unlock(&hnode->lock);
@@ -68,11 +86,13 @@ static void read_unlock(hash_node_t *hnode)
 
 static void write_lock(hash_node_t *hnode)
 {
+    PROBE2(bucket__lock__wait, hnode->index, 1);
     pthread_mutex_lock(&hnode->lock);
     while((hnode->reader_count>0) || (hnode->writer_here==1))
         pthread_cond_wait(&hnode->writer_can_enter,&hnode->lock);
     hnode->writer_here=1;
     pthread_mutex_unlock(&hnode->lock);
+    PROBE2(bucket__lock__acquired, hnode->index, 1);
 }
 
 static void write_unlock(hash_node_t *hnode)
@@ -87,11 +107,13 @@ static void write_unlock(hash_node_t *hnode)
 hash_table_t* hash_table_create( uint32_t size)
 {
     hash_table_t *ht = NULL;
+    uint64_t bytes = HASH_TABLE_BYTES(size);
+    int pages = ARENA_PAGES_DEFAULT;
     int i = 0;
 
     if( size > 0 )
     {
-        if((ht = malloc(sizeof(hash_table_t) + (sizeof(hash_node_t) * size))))
+        if((ht = arena_map(&bytes, &pages)))
         {
             ht->size = size;
 
@@ -106,7 +128,8 @@ hash_table_t* hash_table_create( uint32_t size)
                     {
                         avl_destroy(ht->table[--i].tree);
                     }
-                    free(ht);
+                    arena_unmap(ht, bytes);
+                    ht = NULL;
                     break;
                 }
                 else
@@ -121,7 +144,8 @@ hash_table_t* hash_table_create( uint32_t size)
                         {
                             avl_destroy(ht->table[--i].tree);
                         }
-                        free(ht);
+                        arena_unmap(ht, bytes);
+                        ht = NULL;
                         break;
                     }
                    
@@ -141,12 +165,18 @@ hash_table_t* hash_table_create( uint32_t size)
 
     return ht;
 }
-int hash_table_insert(hash_table_t *ht, cache_data_t* data,hash_data_node_t **new_node)
+/*
+ * Insert data, table takes over caller's reference
+ * An existing item with same key is replaced, it is returned in old with
+ * the table's reference, or released if old is NULL
+ */
+int hash_table_insert(hash_table_t *ht, cache_data_t* data, cache_data_t **old)
 {
     uint32_t hash = 0;
     int ret = -1;
     avl_node_t* node = NULL;
     avl_tree_t* tree  = NULL;
+    cache_data_t *replaced = NULL;
     
     if( ht && data )
     {
@@ -154,45 +184,317 @@ int hash_table_insert(hash_table_t *ht, cache_data_t* data,hash_data_node_t **ne
         
         write_lock(&ht->table[hash]);
         tree = ht->table[hash].tree;
-        if(( ret = avl_insert(tree, data, &node)) != -1)
+        if(( ret = avl_insert(tree, &data->node, &node)) == 1)
         {
-            if( new_node )
-                *new_node = node;
+            /* Same key, new item took its place */
+            replaced = CACHE_NODE_DATA(node);
+            __atomic_store_n(&replaced->removed, 1, __ATOMIC_RELEASE);
         }
         
         write_unlock(&ht->table[hash]);
+        
+        if( old )
+            *old = replaced;
+        else
+            cache_data_release(replaced);
+        
+        PROBE4(hash__insert, hash, data->key_len, data->val_len, ret);
     }
     else
     {
         TRACE(ERROR,"Invalid args");
     }
 
+    /*  0  : Inserted
+     *  1  : Replaced
+     * -1  : Failure
+     */
     return ret;
 }
-hash_data_node_t* hash_table_search(hash_table_t *ht, cache_data_t* data)
+
+/*
+ * Find item with key of data, returned item holds a reference which
+ * caller releases with cache_data_release()
+ */
+cache_data_t* hash_table_search(hash_table_t *ht, cache_data_t* data)
 {
     uint32_t hash = 0;
     avl_node_t* node = NULL;
     avl_tree_t* tree  = NULL;
-    hash_data_node_t *dnode = NULL;
+    cache_data_t *found = NULL;
     
     if( ht && data )
     {
         hash = cache_data_hash(data, ht->size);
         tree = ht->table[hash].tree;
         read_lock(&ht->table[hash]);
-        if(( node = avl_find(tree, data)))
+        if(( node = avl_find(tree, &data->node)))
         {
-            dnode = node;
+            found = cache_data_ref(CACHE_NODE_DATA(node));
         }
         read_unlock(&ht->table[hash]);
+        
+        PROBE3(hash__search, hash, data->key_len, found != NULL);
     }
     else
     {
         TRACE(ERROR,"Invalid args");
     }
 
-    return dnode;
+    return found;
+}
+
+/* Steps of one lookup in hash_table_search_many() */
+enum
+{
+    STEP_BUCKET,                    /* Bucket is being fetched */
+    STEP_TREE,                      /* Its tree */
+    STEP_NODE,                      /* A node of the tree */
+};
+
+typedef struct lookup_s
+{
+    int key;                        /* Index of key, -1 slot is free */
+    int step;
+    hash_node_t *bucket;
+    avl_node_t *node;
+} lookup_t;
+
+/* Order of a key against an item, as cache_data_cmpkey() */
+static int key_compare(const uint8_t *key, uint32_t key_len, cache_data_t *d)
+{
+    int ret;
+    
+    if(( ret = memcmp(key, CACHE_KEY(d), ( key_len < d->key_len ) ? key_len : d->key_len )) == 0 )
+        ret = (int)key_len - (int)d->key_len;
+    
+    return ret;
+}
+
+static void prefetch_node(avl_node_t *node)
+{
+    /* Header and key, key starts past the first line */
+    __builtin_prefetch(node);
+    __builtin_prefetch(CACHE_KEY(CACHE_NODE_DATA(node)));
+}
+
+/*
+ * Find items of count keys, found[i] is set to the item of keys[i] with a
+ * reference, NULL if there is none. Up to HASH_TABLE_INFLIGHT lookups run
+ * interleaved, each step prefetches what its lookup reads next and moves on
+ * to the next lookup, so their cache misses overlap. Returns items found
+ */
+int hash_table_search_many(hash_table_t *ht, uint8_t **keys, uint32_t *key_lens, int count, cache_data_t **found)
+{
+    lookup_t slot[HASH_TABLE_INFLIGHT];
+    lookup_t *l;
+    uint32_t bucket[HASH_TABLE_MANY];
+    int base, n, next, active, i, cmp;
+    int ret = -1;
+    
+    if( ht && keys && key_lens && ( count >= 0 ) && found )
+    {
+        ret = 0;
+        
+        for(base = 0; base < count; base += n)
+        {
+            n = (( count - base ) < HASH_TABLE_MANY ) ? ( count - base ) : HASH_TABLE_MANY;
+            
+            /* All hashes first, their buckets are fetched meanwhile */
+            for(i = 0; i < n; i++)
+            {
+                bucket[i] = cache_data_key_bucket(keys[base + i], key_lens[base + i], ht->size);
+                __builtin_prefetch(&ht->table[bucket[i]]);
+            }
+            
+            for(i = next = active = 0; i < HASH_TABLE_INFLIGHT; i++)
+            {
+                slot[i].key = ( next < n ) ? next++ : -1;
+                slot[i].step = STEP_BUCKET;
+                active += ( slot[i].key >= 0 );
+            }
+            
+            for(i = 0; active; i = ( i + 1 ) % HASH_TABLE_INFLIGHT)
+            {
+                if(( l = &slot[i])->key < 0 )
+                    continue;
+                
+                switch(l->step)
+                {
+                    case STEP_BUCKET:
+                        l->bucket = &ht->table[bucket[l->key]];
+                        __builtin_prefetch(l->bucket->tree);
+                        l->step = STEP_TREE;
+                        continue;
+                    case STEP_TREE:
+                        read_lock(l->bucket);
+                        if(( l->node = l->bucket->tree->head ))
+                        {
+                            prefetch_node(l->node);
+                            l->step = STEP_NODE;
+                            continue;
+                        }
+                        break;
+                    case STEP_NODE:
+                        if(( cmp = key_compare(keys[base + l->key], key_lens[base + l->key], CACHE_NODE_DATA(l->node))) == 0 )
+                            break;
+                        
+                        if(( l->node = ( cmp > 0 ) ? l->node->right : l->node->left ))
+                        {
+                            prefetch_node(l->node);
+                            continue;
+                        }
+                        break;
+                }
+                
+                /* Lookup is done, slot takes the next key */
+                found[base + l->key] = l->node ? cache_data_ref(CACHE_NODE_DATA(l->node)) : NULL;
+                ret += ( l->node != NULL );
+                read_unlock(l->bucket);
+                
+                PROBE3(hash__search, bucket[l->key], key_lens[base + l->key], l->node != NULL);
+                
+                if( next < n )
+                {
+                    l->key = next++;
+                    l->step = STEP_BUCKET;
+                }
+                else
+                {
+                    l->key = -1;
+                    active--;
+                }
+            }
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+    
+    return ret;
+}
+
+/*
+ * Remove item with key of data, if expect is given only when it is the
+ * stored item. Removed item is returned with the table's reference
+ */
+cache_data_t* hash_table_remove(hash_table_t *ht, cache_data_t* data, cache_data_t *expect)
+{
+    uint32_t hash = 0;
+    avl_node_t* node = NULL;
+    avl_tree_t* tree  = NULL;
+    cache_data_t *removed = NULL;
+    
+    if( ht && data )
+    {
+        hash = cache_data_hash(data, ht->size);
+        
+        write_lock(&ht->table[hash]);
+        tree = ht->table[hash].tree;
+        if(( node = avl_find(tree, &data->node)) && (( expect == NULL ) || ( CACHE_NODE_DATA(node) == expect )))
+        {
+            avl_delete(tree, &data->node, &node);
+            removed = CACHE_NODE_DATA(node);
+            __atomic_store_n(&removed->removed, 1, __ATOMIC_RELEASE);
+        }
+        write_unlock(&ht->table[hash]);
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    return removed;
+}
+
+/*
+ * Put data in place of expect if that is the stored item, table takes
+ * over caller's reference. Replaced item is returned with the table's
+ * reference, NULL if expect is not stored
+ */
+cache_data_t* hash_table_replace(hash_table_t *ht, cache_data_t* data, cache_data_t *expect)
+{
+    uint32_t hash = 0;
+    cache_data_t *replaced = NULL;
+
+    if( ht && data && expect )
+    {
+        hash = cache_data_hash(data, ht->size);
+
+        write_lock(&ht->table[hash]);
+        if( avl_replace(ht->table[hash].tree, &expect->node, &data->node) == 0 )
+        {
+            replaced = expect;
+            __atomic_store_n(&replaced->removed, 1, __ATOMIC_RELEASE);
+        }
+        write_unlock(&ht->table[hash]);
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    return replaced;
+}
+
+/*
+ * Call fn for every item of a bucket in key order, bucket is read locked
+ * meanwhile so fn should only take references
+ */
+int hash_table_walk(hash_table_t *ht, uint32_t bucket, int (*fn)(void *arg, void *data), void *arg)
+{
+    int ret = -1;
+
+    if( ht && fn && ( bucket < ht->size ))
+    {
+        read_lock(&ht->table[bucket]);
+        ret = avl_walk(ht->table[bucket].tree, (int (*)(void*, avl_node_t*))fn, arg);
+        read_unlock(&ht->table[bucket]);
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    return ret;
+}
+
+/*
+ * Fill an empty bucket from items sorted by key, table takes over
+ * caller's references on success. Items of other buckets, unsorted items
+ * or a used bucket return 1 and caller inserts one by one
+ */
+int hash_table_load(hash_table_t *ht, uint32_t bucket, cache_data_t **items, int count)
+{
+    int ret = -1;
+    int i;
+
+    if( ht && items && ( bucket < ht->size ))
+    {
+        for(i = 0; ( i < count ) && ( cache_data_hash(items[i], ht->size) == bucket ); i++);
+
+        if( i < count )
+        {
+            ret = 1;
+        }
+        else
+        {
+            write_lock(&ht->table[bucket]);
+            ret = avl_build(ht->table[bucket].tree, (avl_node_t**)items, count);
+            write_unlock(&ht->table[bucket]);
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    /*  0  : Loaded
+     *  1  : Insert one by one
+     * -1  : Failure
+     */
+    return ret;
 }
 
 void hash_table_destroy(hash_table_t *ht)
@@ -206,7 +508,7 @@ void hash_table_destroy(hash_table_t *ht)
          {
              avl_destroy(ht->table[i].tree);
          }
-         free(ht);
+         arena_unmap(ht, HASH_TABLE_BYTES(ht->size));
     }
     else
     {
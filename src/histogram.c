@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+#include "histogram.h"
+
+#define MODULE "Histogram"
+#include "trace.h"
+
+/*
+ * Bucket index of a value
+ * Values below HIST_SUB_COUNT map one to one, above it only the
+ * HIST_SUB_BITS bits below the leading bit are kept
+ */
+static uint32_t bucket_index(uint64_t value)
+{
+    uint32_t shift;
+
+    if( value < HIST_SUB_COUNT )
+        return value;
+
+    if( value >= (1ULL << HIST_MAX_BITS) )
+        return HIST_BUCKETS - 1;
+
+    shift = (63 - __builtin_clzll(value)) - HIST_SUB_BITS;
+
+    return (shift * HIST_SUB_COUNT) + (value >> shift);
+}
+
+/*
+ * Highest value which falls into the bucket
+ */
+static uint64_t bucket_value(uint32_t index)
+{
+    uint32_t shift = 0;
+
+    if( index >= HIST_SUB_COUNT )
+        shift = (index / HIST_SUB_COUNT) - 1;
+
+    return ((uint64_t)(index - (shift * HIST_SUB_COUNT)) << shift) + ((1ULL << shift) - 1);
+}
+
+histogram_t* histogram_create(void)
+{
+    histogram_t *h = NULL;
+
+    if((h = malloc(sizeof(histogram_t))))
+    {
+        histogram_reset(h);
+    }
+    else
+    {
+        TRACE(ERROR,"Failed to allocate memory");
+    }
+
+    return h;
+}
+
+void histogram_destroy(histogram_t *h)
+{
+    if( h )
+        free(h);
+}
+
+void histogram_reset(histogram_t *h)
+{
+    if( h )
+    {
+        memset(h, 0, sizeof(histogram_t));
+        h->min = UINT64_MAX;
+    }
+}
+
+void histogram_record(histogram_t *h, uint64_t value)
+{
+    h->counts[bucket_index(value)]++;
+    h->count++;
+    h->total += value;
+
+    if( value < h->min )
+        h->min = value;
+    if( value > h->max )
+        h->max = value;
+}
+
+void histogram_merge(histogram_t *dst, histogram_t *src)
+{
+    int i;
+
+    if( dst && src && src->count )
+    {
+        for(i = 0; i < HIST_BUCKETS; i++)
+            dst->counts[i] += src->counts[i];
+
+        dst->count += src->count;
+        dst->total += src->total;
+
+        if( src->min < dst->min )
+            dst->min = src->min;
+        if( src->max > dst->max )
+            dst->max = src->max;
+    }
+}
+
+/*
+ * Value below which given percentile (0-100) of recorded values fall
+ */
+uint64_t histogram_percentile(histogram_t *h, double percentile)
+{
+    uint64_t target, seen = 0;
+    uint64_t value = 0;
+    int i;
+
+    if( h && h->count )
+    {
+        if( percentile > 100.0 )
+            percentile = 100.0;
+
+        /* Rank of requested value, at least first value */
+        target = (uint64_t)((percentile / 100.0) * h->count + 0.5);
+        if( target == 0 )
+            target = 1;
+
+        for(i = 0; i < HIST_BUCKETS; i++)
+        {
+            seen += h->counts[i];
+            if( seen >= target )
+            {
+                value = bucket_value(i);
+                break;
+            }
+        }
+
+        /* Bucket bounds are approximate, exact extremes are known */
+        if( value > h->max )
+            value = h->max;
+        if( value < h->min )
+            value = h->min;
+    }
+
+    return value;
+}
+
+uint64_t histogram_mean(histogram_t *h)
+{
+    return ( h && h->count ) ? (h->total / h->count) : 0;
+}
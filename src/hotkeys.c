@@ -0,0 +1,232 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "hotkeys.h"
+#include "cache_data.h"
+
+#define MODULE "Hotkeys"
+#include "trace.h"
+
+#define DECAY_NS    ((uint64_t)HOTKEYS_DECAY_SEC * 1000000000ULL)
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/*
+ * Recompute entry threshold, lock held
+ */
+static void update_threshold(hotkeys_t *hot)
+{
+    uint32_t min = UINT32_MAX;
+    int i;
+
+    if( hot->used < HOTKEYS_TOP )
+    {
+        min = 0;
+    }
+    else
+    {
+        for(i = 0; i < hot->used; i++)
+            if( hot->top[i].count < min )
+                min = hot->top[i].count;
+    }
+
+    __atomic_store_n(&hot->threshold, min, __ATOMIC_RELAXED);
+}
+
+/*
+ * Halve all counts, lock held
+ * Sketch counters are updated concurrently, an increment lost to the
+ * race is well within the sketch error
+ */
+static void decay(hotkeys_t *hot, uint64_t now)
+{
+    uint32_t c;
+    int i, j;
+
+    for(i = 0; i < HOTKEYS_DEPTH; i++)
+    {
+        for(j = 0; j < HOTKEYS_WIDTH; j++)
+        {
+            c = __atomic_load_n(&hot->sketch[i][j], __ATOMIC_RELAXED);
+            __atomic_store_n(&hot->sketch[i][j], c >> 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    for(i = 0; i < hot->used; i++)
+        hot->top[i].count >>= 1;
+
+    update_threshold(hot);
+    hot->decays++;
+    __atomic_store_n(&hot->decayed, now, __ATOMIC_RELEASE);
+}
+
+hotkeys_t* hotkeys_create(uint32_t sample)
+{
+    hotkeys_t *hot = NULL;
+
+    if( sample > 0 )
+    {
+        if((hot = calloc(1, sizeof(hotkeys_t))))
+        {
+            hot->sample = sample;
+            hot->decayed = now_ns();
+            pthread_mutex_init(&hot->lock, NULL);
+        }
+        else
+        {
+            TRACE(ERROR,"Failed to allocate memory");
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    return hot;
+}
+
+void hotkeys_destroy(hotkeys_t *hot)
+{
+    if( hot )
+    {
+        pthread_mutex_destroy(&hot->lock);
+        free(hot);
+    }
+}
+
+/*
+ * Returns 1 when this access should be recorded
+ * Sampling is per thread so the fast path shares no cache line
+ */
+int hotkeys_sampled(hotkeys_t *hot)
+{
+    static __thread uint32_t skipped;
+
+    if( ++skipped < hot->sample )
+        return 0;
+
+    skipped = 0;
+
+    return 1;
+}
+
+void hotkeys_record(hotkeys_t *hot, const uint8_t *key, uint16_t key_len, uint32_t bucket)
+{
+    uint64_t hash = cache_data_key_hash(key, key_len);
+    uint32_t h1 = (uint32_t)hash, h2 = (uint32_t)(hash >> 32) | 1;
+    uint32_t est = UINT32_MAX, c;
+    uint64_t now = now_ns();
+    hotkey_t *entry = NULL;
+    int i;
+
+    /* Whoever notices the period is over does the decay, others go on */
+    if(( now - __atomic_load_n(&hot->decayed, __ATOMIC_ACQUIRE) > DECAY_NS ) &&
+       ( pthread_mutex_trylock(&hot->lock) == 0 ))
+    {
+        if( now - hot->decayed > DECAY_NS )
+            decay(hot, now);
+        pthread_mutex_unlock(&hot->lock);
+    }
+
+    for(i = 0; i < HOTKEYS_DEPTH; i++)
+    {
+        c = __atomic_add_fetch(&hot->sketch[i][(h1 + i * h2) & (HOTKEYS_WIDTH - 1)], 1, __ATOMIC_RELAXED);
+        if( c < est )
+            est = c;
+    }
+
+    /* Most keys are cold, skip the lock */
+    if( est <= __atomic_load_n(&hot->threshold, __ATOMIC_RELAXED) )
+        return;
+
+    pthread_mutex_lock(&hot->lock);
+
+    for(i = 0; i < hot->used; i++)
+    {
+        if( hot->top[i].hash == hash )
+        {
+            entry = &hot->top[i];
+            break;
+        }
+    }
+
+    if( entry == NULL )
+    {
+        if( hot->used < HOTKEYS_TOP )
+        {
+            entry = &hot->top[hot->used++];
+        }
+        else
+        {
+            /* Replace the coldest entry */
+            entry = &hot->top[0];
+            for(i = 1; i < hot->used; i++)
+                if( hot->top[i].count < entry->count )
+                    entry = &hot->top[i];
+        }
+
+        entry->hash = hash;
+        entry->bucket = bucket;
+        entry->key_len = key_len;
+        memcpy(entry->key, key, ( key_len < HOTKEYS_KEY_MAX ) ? key_len : HOTKEYS_KEY_MAX);
+    }
+
+    if( est > entry->count )
+        entry->count = est;
+
+    update_threshold(hot);
+
+    pthread_mutex_unlock(&hot->lock);
+}
+
+static int compare_count(const void *a, const void *b)
+{
+    const hotkey_t *ha = a, *hb = b;
+
+    return ( ha->count < hb->count ) - ( ha->count > hb->count );
+}
+
+/*
+ * Copy top list hottest first, counts scaled by sample rate
+ * window is the time span counts roughly cover, in ns
+ */
+int hotkeys_top(hotkeys_t *hot, hotkey_t *top, int max, uint64_t *window)
+{
+    hotkey_t all[HOTKEYS_TOP];
+    int i, n = 0;
+
+    if( hot && top && max > 0 )
+    {
+        pthread_mutex_lock(&hot->lock);
+
+        /*
+         * After a decay half of the previous period's count is kept, in
+         * steady state counts span about one period plus time since decay
+         */
+        if( window )
+            *window = (( hot->decays ) ? DECAY_NS : 0) + (now_ns() - hot->decayed);
+
+        n = hot->used;
+        memcpy(all, hot->top, n * sizeof(hotkey_t));
+
+        pthread_mutex_unlock(&hot->lock);
+
+        qsort(all, n, sizeof(hotkey_t), compare_count);
+
+        if( n > max )
+            n = max;
+
+        for(i = 0; i < n; i++)
+        {
+            top[i] = all[i];
+            top[i].count *= hot->sample;
+        }
+    }
+
+    return n;
+}
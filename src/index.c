@@ -0,0 +1,341 @@
+#include <stdlib.h>
+#include <string.h>
+#include "index.h"
+
+#define MODULE "Index"
+#include "trace.h"
+
+#define SHARD(x,h)          (&(x)->shard[(h) & (INDEX_SHARDS - 1)])
+#define NODE_SIZE(h,k)      (sizeof(index_node_t) + ((h) * sizeof(index_node_t*)) + (k))
+
+/* Keys copied out of a shard */
+typedef struct index_batch_s
+{
+    uint8_t *data;
+    uint32_t used;
+    uint32_t size;
+} index_batch_t;
+
+static int compare(const uint8_t *a, uint32_t a_len, const uint8_t *b, uint32_t b_len)
+{
+    int c = memcmp(a, b, ( a_len < b_len ) ? a_len : b_len);
+
+    return c ? c : ( a_len > b_len ) - ( a_len < b_len );
+}
+
+/*
+ * Links of a new node, one more with a chance of 1 in 4
+ */
+static int height(index_shard_t *shard)
+{
+    uint32_t x = shard->seed;
+    int h = 1;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    shard->seed = x;
+
+    while(( h < INDEX_LEVELS ) && (( x & 3 ) == 0 ))
+    {
+        h++;
+        x >>= 2;
+    }
+
+    return h;
+}
+
+/*
+ * First node of key or after it, pred is set to the node before it on
+ * every level in use. Shard lock held
+ */
+static index_node_t* find(index_shard_t *shard, const uint8_t *key, uint32_t key_len, index_node_t **pred)
+{
+    index_node_t *n = shard->head;
+    index_node_t *next;
+    int i;
+
+    for(i = shard->level - 1; i >= 0; i--)
+    {
+        while(( next = n->next[i] ) && ( compare(INDEX_KEY(next), next->key_len, key, key_len) < 0 ))
+            n = next;
+
+        if( pred )
+            pred[i] = n;
+    }
+
+    return n->next[0];
+}
+
+index_t* index_create(void)
+{
+    index_t *index = NULL;
+    int i;
+
+    if(( index = calloc(1, sizeof(index_t))))
+    {
+        for(i = 0; i < INDEX_SHARDS; i++)
+        {
+            if(( index->shard[i].head = calloc(1, NODE_SIZE(INDEX_LEVELS, 0))) == NULL )
+                break;
+
+            index->shard[i].head->height = INDEX_LEVELS;
+            index->shard[i].level = 1;
+            index->shard[i].seed = 0x9e3779b9 ^ ( i + 1 );
+            pthread_mutex_init(&index->shard[i].lock, NULL);
+        }
+
+        if( i < INDEX_SHARDS )
+        {
+            TRACE(ERROR,"Memory allocation failure");
+            while( i-- )
+            {
+                pthread_mutex_destroy(&index->shard[i].lock);
+                free(index->shard[i].head);
+            }
+            free(index);
+            index = NULL;
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Memory allocation failure");
+    }
+
+    return index;
+}
+
+void index_destroy(index_t *index)
+{
+    index_node_t *n, *next;
+    int i;
+
+    if( index )
+    {
+        for(i = 0; i < INDEX_SHARDS; i++)
+        {
+            for(n = index->shard[i].head; n; n = next)
+            {
+                next = n->next[0];
+                free(n);
+            }
+            pthread_mutex_destroy(&index->shard[i].lock);
+        }
+        free(index);
+    }
+}
+
+/*
+ * Add key of hash, one already there stays
+ */
+int index_insert(index_t *index, uint64_t hash, const uint8_t *key, uint32_t key_len)
+{
+    index_node_t *pred[INDEX_LEVELS];
+    index_shard_t *shard;
+    index_node_t *n;
+    int h, i;
+    int ret = -1;
+
+    if( index && key && ( key_len > 0 ) && ( key_len <= UINT16_MAX ))
+    {
+        shard = SHARD(index, hash);
+
+        pthread_mutex_lock(&shard->lock);
+
+        if(( n = find(shard, key, key_len, pred)) && ( compare(INDEX_KEY(n), n->key_len, key, key_len) == 0 ))
+        {
+            ret = 1;
+        }
+        else if(( n = malloc(NODE_SIZE(( h = height(shard)), key_len))))
+        {
+            n->key_len = key_len;
+            n->height = h;
+            memcpy(INDEX_KEY(n), key, key_len);
+
+            for(i = 0; i < h; i++)
+            {
+                if( i >= shard->level )
+                    pred[i] = shard->head;
+
+                n->next[i] = pred[i]->next[i];
+                pred[i]->next[i] = n;
+            }
+
+            if( h > shard->level )
+                shard->level = h;
+
+            __atomic_add_fetch(&shard->keys, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&shard->bytes, NODE_SIZE(h, key_len), __ATOMIC_RELAXED);
+            ret = 0;
+        }
+        else
+        {
+            TRACE(ERROR,"Memory allocation failure");
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    /*  0  : Added
+     *  1  : Already there
+     * -1  : Failure
+     */
+    return ret;
+}
+
+/*
+ * Remove key of hash, unless live, if given, tells it is stored again. A
+ * store adds its key after the item, so one racing this is not lost
+ */
+int index_remove(index_t *index, uint64_t hash, const uint8_t *key, uint32_t key_len, index_live_t live, void *arg)
+{
+    index_node_t *pred[INDEX_LEVELS];
+    index_shard_t *shard;
+    index_node_t *n;
+    int i;
+    int ret = -1;
+
+    if( index && key )
+    {
+        ret = 1;
+        shard = SHARD(index, hash);
+
+        pthread_mutex_lock(&shard->lock);
+
+        if(( n = find(shard, key, key_len, pred)) && ( compare(INDEX_KEY(n), n->key_len, key, key_len) == 0 ) &&
+           (( live == NULL ) || ( live(arg, key, key_len) == 0 )))
+        {
+            for(i = 0; i < n->height; i++)
+                pred[i]->next[i] = n->next[i];
+
+            while(( shard->level > 1 ) && ( shard->head->next[shard->level - 1] == NULL ))
+                shard->level--;
+
+            __atomic_sub_fetch(&shard->keys, 1, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&shard->bytes, NODE_SIZE(n->height, n->key_len), __ATOMIC_RELAXED);
+            free(n);
+            ret = 0;
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    /*  0  : Removed
+     *  1  : Not there, or live
+     * -1  : Failure
+     */
+    return ret;
+}
+
+static int batch_add(index_batch_t *batch, index_node_t *n)
+{
+    uint32_t need = sizeof(uint16_t) + n->key_len;
+    uint32_t size;
+    uint8_t *data;
+
+    if( batch->used + need > batch->size )
+    {
+        for(size = batch->size ? batch->size : 4096; size < batch->used + need; size *= 2);
+
+        if(( data = realloc(batch->data, size)) == NULL )
+        {
+            TRACE(ERROR,"Memory allocation failure");
+            return -1;
+        }
+
+        batch->data = data;
+        batch->size = size;
+    }
+
+    memcpy(&batch->data[batch->used], &n->key_len, sizeof(uint16_t));
+    memcpy(&batch->data[batch->used + sizeof(uint16_t)], INDEX_KEY(n), n->key_len);
+    batch->used += need;
+
+    return 0;
+}
+
+/*
+ * Hand keys starting with prefix to fn, shard by shard. Keys of a shard are
+ * copied out under its lock, fn runs with no lock held and may change the
+ * index. Returns keys handed out, -1 on failure
+ */
+int64_t index_prefix(index_t *index, const uint8_t *prefix, uint32_t prefix_len, index_fn_t fn, void *arg)
+{
+    index_batch_t batch;
+    index_shard_t *shard;
+    index_node_t *n;
+    uint32_t off;
+    uint16_t len;
+    int i, stop = 0;
+    int64_t ret = -1;
+
+    if( index && fn && ( prefix || ( prefix_len == 0 )))
+    {
+        memset(&batch, 0, sizeof(batch));
+        if( prefix == NULL )
+            prefix = (const uint8_t*)"";
+
+        for(i = 0, ret = 0; ( i < INDEX_SHARDS ) && ( ret >= 0 ) && ( stop == 0 ); i++)
+        {
+            shard = &index->shard[i];
+            batch.used = 0;
+
+            pthread_mutex_lock(&shard->lock);
+            for(n = find(shard, prefix, prefix_len, NULL);
+                n && ( n->key_len >= prefix_len ) && ( memcmp(INDEX_KEY(n), prefix, prefix_len) == 0 ); n = n->next[0])
+            {
+                if( batch_add(&batch, n))
+                {
+                    ret = -1;
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&shard->lock);
+
+            for(off = 0; ( ret >= 0 ) && ( stop == 0 ) && ( off < batch.used ); off += sizeof(uint16_t) + len)
+            {
+                memcpy(&len, &batch.data[off], sizeof(uint16_t));
+                stop = fn(arg, &batch.data[off + sizeof(uint16_t)], len);
+                ret++;
+            }
+        }
+
+        free(batch.data);
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    return ret;
+}
+
+uint64_t index_keys(index_t *index)
+{
+    uint64_t keys = 0;
+    int i;
+
+    for(i = 0; index && ( i < INDEX_SHARDS ); i++)
+        keys += __atomic_load_n(&index->shard[i].keys, __ATOMIC_RELAXED);
+
+    return keys;
+}
+
+uint64_t index_bytes(index_t *index)
+{
+    uint64_t bytes = 0;
+    int i;
+
+    for(i = 0; index && ( i < INDEX_SHARDS ); i++)
+        bytes += __atomic_load_n(&index->shard[i].bytes, __ATOMIC_RELAXED);
+
+    return bytes;
+}
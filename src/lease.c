@@ -0,0 +1,262 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lease.h"
+
+#define MODULE "Lease"
+#include "trace.h"
+
+#define SET_ENTRIES(l,h)    (&(l)->entries[((h) & (LEASE_SETS - 1)) * LEASE_WAYS])
+
+/* 0 marks a free entry */
+#define HASH_ID(h)          ((h) ? (h) : 1)
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+lease_t* lease_create(uint32_t lease_ms, uint32_t stale_ms)
+{
+    lease_t *lease = NULL;
+    int i;
+
+    if( lease_ms > 0 )
+    {
+        if(( lease = calloc(1, sizeof(lease_t))) &&
+           ( lease->entries = calloc(LEASE_SETS * LEASE_WAYS, sizeof(lease_entry_t))))
+        {
+            lease->lease_ms = lease_ms;
+            lease->stale_ms = stale_ms;
+
+            for(i = 0; i < LEASE_LOCKS; i++)
+                pthread_mutex_init(&lease->lock[i], NULL);
+
+            TRACE(INFO,"Leases of %u ms, stale values kept %u ms", lease_ms, stale_ms);
+        }
+        else
+        {
+            TRACE(ERROR,"Memory allocation failure");
+            free(lease);
+            lease = NULL;
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    return lease;
+}
+
+void lease_destroy(lease_t *lease)
+{
+    int i;
+
+    if( lease )
+    {
+        for(i = 0; i < LEASE_SETS * LEASE_WAYS; i++)
+            cache_data_release(lease->entries[i].stale);
+
+        for(i = 0; i < LEASE_LOCKS; i++)
+            pthread_mutex_destroy(&lease->lock[i]);
+
+        free(lease->entries);
+        free(lease);
+    }
+}
+
+static void clear(lease_entry_t *e)
+{
+    cache_data_release(e->stale);
+    memset(e, 0, sizeof(*e));
+}
+
+/*
+ * Entry of hash in its set, entries past both their ends are cleared on
+ * the way
+ */
+static lease_entry_t* find(lease_entry_t *set, uint64_t hash, uint64_t now)
+{
+    lease_entry_t *found = NULL;
+    int i;
+
+    for(i = 0; i < LEASE_WAYS; i++)
+    {
+        if( set[i].hash && ( set[i].lease_end <= now ) && ( set[i].stale_end <= now ))
+            clear(&set[i]);
+
+        if( set[i].hash == hash )
+            found = &set[i];
+    }
+
+    return found;
+}
+
+/*
+ * Free entry of a set, else the one ending first
+ */
+static lease_entry_t* victim(lease_entry_t *set)
+{
+    lease_entry_t *v = &set[0];
+    uint64_t end, v_end = UINT64_MAX;
+    int i;
+
+    for(i = 0; i < LEASE_WAYS; i++)
+    {
+        if( set[i].hash == 0 )
+            return &set[i];
+
+        end = ( set[i].lease_end > set[i].stale_end ) ? set[i].lease_end : set[i].stale_end;
+        if( end < v_end )
+        {
+            v = &set[i];
+            v_end = end;
+        }
+    }
+
+    clear(v);
+    return v;
+}
+
+/*
+ * Lease on a key that missed, token is set if it is granted. stale is set
+ * to a reference to the value the key had before it was deleted, NULL if
+ * there is none
+ */
+int lease_acquire(lease_t *lease, uint64_t hash, const uint8_t *key, uint32_t key_len, uint32_t *token, cache_data_t **stale)
+{
+    lease_entry_t *e;
+    uint64_t now;
+    int ret = -1;
+
+    if( lease && key && token && stale )
+    {
+        now = now_ms();
+        hash = HASH_ID(hash);
+        *token = 0;
+        *stale = NULL;
+
+        if((( e = find(SET_ENTRIES(lease, hash), hash, now)) == NULL ) || ( e->token == 0 ) || ( e->lease_end <= now ))
+        {
+            if( e == NULL )
+            {
+                e = victim(SET_ENTRIES(lease, hash));
+                e->hash = hash;
+            }
+
+            while(( e->token = __atomic_add_fetch(&lease->next_token, 1, __ATOMIC_RELAXED)) == 0 );
+            e->lease_end = now + lease->lease_ms;
+            *token = e->token;
+            __atomic_add_fetch(&lease->grants, 1, __ATOMIC_RELAXED);
+            ret = 0;
+        }
+        else
+        {
+            ret = 1;
+        }
+
+        /* Hash may be shared, stale value is of this key only */
+        if( e->stale && ( e->stale_end > now ) && ( e->stale->key_len == key_len ) &&
+            ( memcmp(CACHE_KEY(e->stale), key, key_len) == 0 ))
+            *stale = cache_data_ref(e->stale);
+
+        if( ret == 1 )
+        {
+            if( *stale )
+                __atomic_add_fetch(&lease->stale_hits, 1, __ATOMIC_RELAXED);
+            else
+                __atomic_add_fetch(&lease->waits, 1, __ATOMIC_RELAXED);
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    /*  0  : Granted, token is set
+     *  1  : Held by another client
+     * -1  : Failure
+     */
+    return ret;
+}
+
+/*
+ * Give lease back as the key is set, the entry goes with its stale value
+ */
+int lease_release(lease_t *lease, uint64_t hash, uint32_t token)
+{
+    lease_entry_t *e;
+    int ret = -1;
+
+    if( lease )
+    {
+        hash = HASH_ID(hash);
+
+        if( token && ( e = find(SET_ENTRIES(lease, hash), hash, now_ms())) && ( e->token == token ))
+        {
+            clear(e);
+            ret = 0;
+        }
+        else
+        {
+            __atomic_add_fetch(&lease->refused, 1, __ATOMIC_RELAXED);
+            ret = 1;
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    /*  0  : Token was the lease of the key
+     *  1  : It is not, lease was revoked or taken over
+     * -1  : Failure
+     */
+    return ret;
+}
+
+/*
+ * Key is deleted, its lease is void. stale is the reference to the deleted
+ * value, taken over, NULL keeps the one there is
+ */
+void lease_revoke(lease_t *lease, uint64_t hash, cache_data_t *stale)
+{
+    lease_entry_t *e;
+    uint64_t now;
+
+    if( lease )
+    {
+        now = now_ms();
+        hash = HASH_ID(hash);
+
+        if((( e = find(SET_ENTRIES(lease, hash), hash, now)) == NULL ) && stale )
+        {
+            e = victim(SET_ENTRIES(lease, hash));
+            e->hash = hash;
+        }
+
+        if( e )
+        {
+            e->token = 0;
+            if( stale )
+            {
+                cache_data_release(e->stale);
+                e->stale = stale;
+                e->stale_end = now + lease->stale_ms;
+            }
+        }
+        else
+        {
+            cache_data_release(stale);
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+        cache_data_release(stale);
+    }
+}
@@ -2,6 +2,7 @@
 #include <signal.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include "memcached.h"
 #include "server.h"
 
@@ -17,6 +18,8 @@ static int ver_patch = 1;
 
 static memcached_t *mc;
 static server_t *server;
+static capture_t *capture;
+static snapshot_t *snapshot;
 
 static int port = 5000;
 static int hash_size = 256;
@@ -25,6 +28,33 @@ static int max_key = 0;
 static int max_val = 0;
 static int verbose = 2;
 static int udp = 0;
+static int sync_log = 0;
+static int mem_limit = 0;
+static int admission = 0;
+static int numa = 0;
+static char *storage_path = NULL;
+static char *ext_path = NULL;
+static int ext_size = 1024;
+static int ext_min = CACHE_EXT_MIN_DEFAULT;
+static int compress_min = -1;
+static int compress_level = COMPRESS_LEVEL_DEFAULT;
+static char *compress_dict = NULL;
+static int tiny_size = 0;
+static char *arena_spec = NULL;
+static int arena_pages = ARENA_PAGES_DEFAULT;
+static int arena_locked = 0;
+static char *capture_path = NULL;
+static unsigned int capture_sample = 100;
+static unsigned long capture_records = CAPTURE_RECORDS_DEFAULT;
+static char *snapshot_path = NULL;
+static int load_threads = 0;
+static char *proxy_spec = NULL;
+static int repl_port = 0;
+static char *primary = NULL;
+static int lease_ms = 0;
+static int stale_ms = LEASE_STALE_DEFAULT;
+static char *ns_delim = NULL;
+static int prefix_index = 0;
 char *app_name = NULL;
 
 
@@ -55,12 +85,25 @@ const static char* get_version( void )
 static void cleanup(void)
 {
     TRACE(INFO,"Start Cleanup");
+    
+    /* Stop requests, then snapshot writer before cache goes */
+    memcached_shutdown(mc);
+    snapshot_destroy(snapshot);
+    snapshot = NULL;
+    
     /* Destory Instance */
     memcached_destroy(mc);
     server = NULL;
     mc = NULL;
+    
+    /* Threads are gone, flush capture log */
+    capture_destroy(capture);
+    capture = NULL;
     TRACE(INFO,"Cleanup Done");
     
+    /* Write pending logs */
+    trace_async_stop();
+
 }
 
 /*
@@ -104,11 +147,28 @@ static void usage( void )
     printf("-V      : Print Version\n");
     printf("-v      : verbose\n");
     printf("-u      : udp connection, default, 0\n");
+    printf("-s      : synchronous logging, default, 0\n");
     printf("-p port : port, default %d\n", port);
     printf("-k key_len : Max Key Len, default, %d\n", MCACHE_KEY_LEN_DEFAULT );
     printf("-l val_len : Max Value Len, default, %d\n", MCACHE_KEY_LEN_DEFAULT );
     printf("-t thread count : Parallel Threads, default, %d\n", tcount);
     printf("-H Hash size : Hash Size, default, %d\n", hash_size);
+    printf("-m megabytes : Memory limit for items, default, %d ( unlimited )\n", mem_limit);
+    printf("-a      : TinyLFU admission in front of eviction, needs -m, default, 0\n");
+    printf("-N      : Pin threads to NUMA nodes, workers round robin, shared memory interleaved, default, 0\n");
+    printf("-e file : Keep items in file, reused after clean restart, needs -m\n");
+    printf("-E file[,megabytes[,min_value]] : Move evicted values of min_value bytes to file, needs -m, default, %d MB, %d\n", ext_size, ext_min);
+    printf("-z min_value[,level[,dict]] : Compress values of min_value bytes, dictionary trained into dict, default, %d, level %d\n", COMPRESS_MIN_DEFAULT, COMPRESS_LEVEL_DEFAULT);
+    printf("-G pages[,lock] : Items and tables in pages of 4k, thp, 2m or 1g, faulted in at start, lock keeps them resident, needs -m\n");
+    printf("-T megabytes : Table for items of key and value up to %d bytes, on top of -m, default, %d ( none )\n", TINY_DATA_SIZE, tiny_size);
+    printf("-P host:port[,host:port...] : Proxy, requests with a key go to these backends by consistent hashing, also --proxy, backends need more -t than the proxy\n");
+    printf("-R port : Primary, replicas connect to port for a stream of sets and deletes\n");
+    printf("-F host:port : Replica, follow primary at its replication port, cache flushed on reconnect\n");
+    printf("-W lease_ms[,stale_ms] : Leases on misses of lease gets, deleted values served stale meanwhile, default, %d ( none ), %d\n", lease_ms, stale_ms);
+    printf("-D char : Keys up to char are a namespace, flush_ns drops one, keys of a namespace stay out of tiny table\n");
+    printf("-I      : Keep keys in order too, for count_prefix and delete_prefix, default, 0\n");
+    printf("-L file[,threads] : Load snapshot at start, snapshot requests write it, default, a thread per cpu\n");
+    printf("-C file[,sample[,records]] : Capture 1 of sample requests, default, %u, %lu records\n", capture_sample, capture_records);
 }
 
 /* 
@@ -147,6 +207,154 @@ int parse_int(char* str, char *next,char *msg, int *val)
     return ret;
 }
 
+/*
+ * Parse String Argument
+ */
+int parse_str(char* str, char *next, char *msg, char **val)
+{
+    int ret = 0;
+
+    if(str[1])
+    {
+        *val = &str[1];
+    }
+    else
+    {
+        *val = next;
+        ret = 1;
+    }
+
+    if(*val == NULL)
+    {
+        invalid_args(msg);
+    }
+
+    return ret;
+}
+
+/*
+ * Parse capture spec, file[,sample[,records]]
+ */
+static void parse_capture(char *spec)
+{
+    char *ptr;
+
+    if((ptr = strchr(spec, ',')))
+    {
+        *ptr++ = '\0';
+        if(sscanf(ptr, "%u,%lu", &capture_sample, &capture_records) < 1 ||
+           capture_sample == 0 || capture_records == 0)
+        {
+            invalid_args("invalid capture\n");
+        }
+    }
+
+    capture_path = spec;
+}
+
+/*
+ * Parse external store spec, file[,megabytes[,min_value]]
+ */
+static void parse_extstore(char *spec)
+{
+    char *ptr;
+
+    if((ptr = strchr(spec, ',')))
+    {
+        *ptr++ = '\0';
+        if(sscanf(ptr, "%d,%d", &ext_size, &ext_min) < 1 || ext_size <= 0 || ext_min < 0)
+        {
+            invalid_args("invalid external store\n");
+        }
+    }
+
+    ext_path = spec;
+}
+
+/*
+ * Parse compression spec, min_value[,level[,dict]]
+ */
+static void parse_compress(char *spec)
+{
+    char *ptr;
+
+    if((ptr = strchr(spec, ',')))
+    {
+        *ptr++ = '\0';
+        if((compress_dict = strchr(ptr, ',')))
+            *compress_dict++ = '\0';
+        if(sscanf(ptr, "%d", &compress_level) != 1 || compress_level < 1 || compress_level > 9 ||
+           ( compress_dict && ( *compress_dict == '\0' )))
+        {
+            invalid_args("invalid compression\n");
+        }
+    }
+
+    if(sscanf(spec, "%d", &compress_min) != 1 || compress_min < 0)
+    {
+        invalid_args("invalid compression\n");
+    }
+}
+
+/*
+ * Parse arena spec, pages[,lock]
+ */
+static void parse_arena(char *spec)
+{
+    const char *names[] = { "4k", "thp", "2m", "1g" };
+    char *ptr;
+    int i;
+
+    if((ptr = strchr(spec, ',')))
+    {
+        *ptr++ = '\0';
+        if( strcmp(ptr, "lock"))
+        {
+            invalid_args("invalid arena\n");
+        }
+        arena_locked = 1;
+    }
+
+    for(i = 0; ( i < sizeof(names) / sizeof(names[0])) && strcmp(spec, names[i]); i++);
+
+    if( i == sizeof(names) / sizeof(names[0]))
+    {
+        invalid_args("invalid arena\n");
+    }
+
+    /* Same order as ARENA_PAGES_ */
+    arena_pages = i;
+}
+
+/*
+ * Parse lease spec, lease_ms[,stale_ms]
+ */
+static void parse_lease(char *spec)
+{
+    if(sscanf(spec, "%d,%d", &lease_ms, &stale_ms) < 1 || lease_ms <= 0 || stale_ms < 0)
+    {
+        invalid_args("invalid lease\n");
+    }
+}
+
+/*
+ * Parse snapshot spec, file[,threads]
+ */
+static void parse_snapshot(char *spec)
+{
+    char *ptr;
+
+    if((ptr = strchr(spec, ',')))
+    {
+        *ptr++ = '\0';
+        if(sscanf(ptr, "%d", &load_threads) != 1 || load_threads <= 0)
+        {
+            invalid_args("invalid snapshot\n");
+        }
+    }
+
+    snapshot_path = spec;
+}
 
 /*
  * Parse Command line arguments 
@@ -156,6 +364,7 @@ static void parse_args(int argc, char *argv[])
     int i = 0;
     int j=0;
     char *str;
+    char *spec;
     int veb  = 0;
     
     /* Set App Name */
@@ -175,6 +384,15 @@ static void parse_args(int argc, char *argv[])
                 case 'u':
                     udp=1;
                 break;
+                case 's':
+                    sync_log=1;
+                break;
+                case 'a':
+                    admission=1;
+                break;
+                case 'N':
+                    numa=1;
+                break;
                 case 'V':
                     printf("%s Current Version : %s\n",app_name, get_version());
                     exit(0);
@@ -202,6 +420,64 @@ static void parse_args(int argc, char *argv[])
                 case 'H':
                     i+=parse_int(&str[1], NEXT_ARGV(i), "invalid port\n",&hash_size );                   
                 break;
+                case 'm':
+                    i+=parse_int(&str[1], NEXT_ARGV(i), "invalid memory limit\n",&mem_limit );
+                break;
+                case 'e':
+                    i+=parse_str(&str[1], NEXT_ARGV(i), "invalid storage file\n",&storage_path );
+                break;
+                case 'E':
+                    i+=parse_str(&str[1], NEXT_ARGV(i), "invalid external store\n",&ext_path );
+                    parse_extstore(ext_path);
+                break;
+                case 'z':
+                    i+=parse_str(&str[1], NEXT_ARGV(i), "invalid compression\n",&spec );
+                    parse_compress(spec);
+                break;
+                case 'G':
+                    i+=parse_str(&str[1], NEXT_ARGV(i), "invalid arena\n",&arena_spec );
+                    parse_arena(arena_spec);
+                break;
+                case 'T':
+                    i+=parse_int(&str[1], NEXT_ARGV(i), "invalid tiny table size\n",&tiny_size );
+                break;
+                case 'P':
+                    i+=parse_str(&str[1], NEXT_ARGV(i), "invalid proxy\n",&proxy_spec );
+                break;
+                case '-':
+                    /* Long form of -P */
+                    if( strcmp(str, "--proxy") || (( proxy_spec = NEXT_ARGV(i)) == NULL ))
+                    {
+                        invalid_args("invalid option\n");
+                    }
+                    i++;
+                break;
+                case 'R':
+                    i+=parse_int(&str[1], NEXT_ARGV(i), "invalid replication port\n",&repl_port );
+                break;
+                case 'F':
+                    i+=parse_str(&str[1], NEXT_ARGV(i), "invalid primary\n",&primary );
+                break;
+                case 'W':
+                    i+=parse_str(&str[1], NEXT_ARGV(i), "invalid lease\n",&spec );
+                    parse_lease(spec);
+                break;
+                case 'D':
+                    i+=parse_str(&str[1], NEXT_ARGV(i), "invalid namespace delimiter\n",&ns_delim );
+                    if( strlen(ns_delim) != 1 )
+                        invalid_args("invalid namespace delimiter\n");
+                break;
+                case 'I':
+                    prefix_index=1;
+                break;
+                case 'L':
+                    i+=parse_str(&str[1], NEXT_ARGV(i), "invalid snapshot\n",&snapshot_path );
+                    parse_snapshot(snapshot_path);
+                break;
+                case 'C':
+                    i+=parse_str(&str[1], NEXT_ARGV(i), "invalid capture\n",&capture_path );
+                    parse_capture(capture_path);
+                break;
                 default:
                         usage();
                         exit(0);
@@ -227,19 +503,138 @@ int main( int argc, char *argv[])
     
     verbose = set_trace_level(verbose);
     
+    /* Move log formatting and output off the request threads */
+    if(( sync_log == 0 ) && trace_async_start())
+    {
+        TRACE(ERROR,"Failed to start logging thread");
+    }
+    
     TRACE(INFO,"Conection : %s",( udp ? "udp" : "tcp"));
     TRACE(INFO,"Port : %d", port);
     TRACE(INFO,"Hash Size : %d", hash_size);
+    TRACE(INFO,"Memory Limit : %d MB%s", mem_limit, ( admission ? ", TinyLFU admission" : ""));
     TRACE(INFO,"Thead Count : %d",tcount);
     
     /* Enable Cleanup */
     set_cleanup();
     
-    TRACE(DEBUG,"Init Server : %s");
+    TRACE(DEBUG,"Init Server : %s", ( udp ? "udp" : "tcp"));
     server = server_init(port,tcount,udp);
 
     TRACE(DEBUG,"Memcached init");
     mc = memcached_init(server,tcount,hash_size);
+    
+    if(( max_key || max_val ) && memcached_max_key_val(mc, max_key, max_val))
+    {
+        TRACE(ERROR,"Failed to set key/value len");
+    }
+    
+    if(( mem_limit || admission ) && memcached_mem_limit(mc, mem_limit, admission))
+    {
+        TRACE(ERROR,"Failed to set memory limit");
+    }
+    
+    /* Before storage, its items may be compressed */
+    if(( compress_min >= 0 ) && memcached_compress(mc, compress_min, compress_level, compress_dict))
+    {
+        TRACE(ERROR,"Failed to set compression");
+    }
+    
+    /* Before arena and storage, they are placed as they fault in */
+    if( numa && memcached_numa(mc))
+    {
+        TRACE(ERROR,"Failed to set NUMA placement");
+    }
+    
+    /* Before storage and tiny table, they are mapped accordingly */
+    if( arena_spec && memcached_arena(mc, arena_pages, arena_locked))
+    {
+        TRACE(ERROR,"Failed to set arena");
+    }
+    
+    if(( tiny_size > 0 ) && memcached_tiny(mc, tiny_size))
+    {
+        TRACE(ERROR,"Failed to set tiny table");
+    }
+    
+    if( proxy_spec && memcached_proxy(mc, proxy_spec))
+    {
+        TRACE(ERROR,"Failed to set proxy");
+    }
+    
+    if(( lease_ms > 0 ) && memcached_leases(mc, lease_ms, stale_ms))
+    {
+        TRACE(ERROR,"Failed to set leases");
+    }
+    
+    if( ns_delim && memcached_namespaces(mc, ns_delim[0]))
+    {
+        TRACE(ERROR,"Failed to set namespaces");
+    }
+    
+    /* Before storage and snapshot, their keys are indexed as they come in */
+    if( prefix_index && memcached_index(mc))
+    {
+        TRACE(ERROR,"Failed to set prefix index");
+    }
+    
+    /* Arena without file is anonymous item storage */
+    if( storage_path || arena_spec )
+    {
+        TRACE(DEBUG,"Item Storage : %s", storage_path ? storage_path : "anonymous");
+        if( memcached_storage(mc, storage_path) )
+        {
+            TRACE(ERROR,"Failed to set item storage");
+        }
+    }
+    
+    if( ext_path )
+    {
+        TRACE(DEBUG,"External Store : %s, %d MB", ext_path, ext_size);
+        if( memcached_extstore(mc, ext_path, ext_size, ext_min) )
+        {
+            TRACE(ERROR,"Failed to set external store");
+        }
+    }
+    
+    if( snapshot_path )
+    {
+        if( load_threads == 0 )
+            load_threads = ( sysconf(_SC_NPROCESSORS_ONLN) > 0 ) ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+        
+        TRACE(DEBUG,"Snapshot : %s", snapshot_path);
+        if(((snapshot = snapshot_create(mc->cache, snapshot_path)) == NULL) ||
+           memcached_snapshot(mc, snapshot))
+        {
+            TRACE(ERROR,"Failed to set snapshot");
+        }
+        else if( snapshot_load(snapshot, load_threads) )
+        {
+            /* Next snapshot replaces it */
+            TRACE(ERROR,"Failed to load snapshot");
+        }
+    }
+    
+    /* Replica applies stream to cache as it is set up and loaded */
+    if(( repl_port > 0 ) && memcached_replicate(mc, repl_port))
+    {
+        TRACE(ERROR,"Failed to set replication");
+    }
+    
+    if( primary && memcached_follow(mc, primary))
+    {
+        TRACE(ERROR,"Failed to follow primary");
+    }
+    
+    if( capture_path )
+    {
+        TRACE(DEBUG,"Start Capture : %s", capture_path);
+        if(((capture = capture_create(capture_path, capture_sample, capture_records)) == NULL) ||
+           memcached_capture(mc, capture))
+        {
+            TRACE(ERROR,"Failed to start capture");
+        }
+    }
 
     TRACE(DEBUG,"Start Memcached");
     if(memcached_start(mc))
@@ -3,11 +3,30 @@
 #include <malloc.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <time.h>
 #include "memcached.h"
+#include "stats.h"
+#include "probes.h"
 
 #define MODULE "Memcached"
 #include "trace.h"
 
+/* process() results */
+enum
+{
+    PROCESS_REPLY,          /* Single response in rsp, host byte order */
+    PROCESS_FAILED,
+    PROCESS_CLOSE,
+    PROCESS_SERIALIZED,     /* Complete response already in buffer */
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
 void dump_req(memcached_req_t *req)
 {
     PRINT(DEBUG,"Magic : %02x\n", req->magic);
@@ -29,6 +48,25 @@ void dump_rsp(memcached_rsp_t *rsp)
     //HEXDUMP(DEBUG,"body",rsp->data, rsp->len);
 }
 
+static uint64_t get_be64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    int i;
+    
+    for(i = 0; i < 8; i++)
+        v = ( v << 8 ) | p[i];
+    
+    return v;
+}
+
+static void put_be64(uint8_t *p, uint64_t v)
+{
+    int i;
+    
+    for(i = 7; i >= 0; i--, v >>= 8)
+        p[i] = v & 0xff;
+}
+
 static void ntoh_req(memcached_req_t* req)
 {
     req->key_len = ntohs(req->key_len);
@@ -43,6 +81,13 @@ static void hton_rsp(memcached_rsp_t* rsp)
     rsp->status = htons(rsp->status);
 }
 
+static void ntoh_rsp(memcached_rsp_t* rsp)
+{
+    rsp->key_len = ntohs(rsp->key_len);
+    rsp->len = ntohl(rsp->len);
+    rsp->status = ntohs(rsp->status);
+}
+
 static int validate(memcached_req_t* req, buffer_t* buffer )
 {
     int ret = 0;
@@ -77,6 +122,79 @@ static int validate(memcached_req_t* req, buffer_t* buffer )
                 ret =-2;
             }
             break;
+        case MCACHE_OPCODE_DELETE:
+        case MCACHE_OPCODE_INCREMENT:
+        case MCACHE_OPCODE_DECREMENT:
+            if(buffer->req_len < (sizeof(memcached_req_t) + req->len ))
+            {
+                TRACE(DEBUG,"Length Mismatch %d: %lu",buffer->req_len, (sizeof(memcached_req_t) + req->len ));
+                ret = -2;
+            }
+            else if(( req->key_len == 0 ) || (( req->key_len + req->extra_len ) > req->len ))
+            {
+                TRACE(DEBUG,"Invalid key len");
+                ret = -2;
+            }
+            else if(( req->opcode != MCACHE_OPCODE_DELETE ) && ( req->extra_len != MCACHE_INCR_EXTRA_LEN ))
+            {
+                TRACE(DEBUG,"Invalid extra len");
+                ret = -2;
+            }
+            break;
+        case MCACHE_OPCODE_LEASE_GET:
+        case MCACHE_OPCODE_LEASE_SET:
+            if(buffer->req_len < (sizeof(memcached_req_t) + req->len ))
+            {
+                TRACE(DEBUG,"Length Mismatch %d: %lu",buffer->req_len, (sizeof(memcached_req_t) + req->len ));
+                ret = -2;
+            }
+            else if(( req->key_len == 0 ) || (( req->key_len + req->extra_len ) > req->len ))
+            {
+                TRACE(DEBUG,"Invalid key len");
+                ret = -2;
+            }
+            else if( req->extra_len != (( req->opcode == MCACHE_OPCODE_LEASE_SET ) ? MCACHE_LEASE_SET_EXTRA_LEN : 0 ))
+            {
+                TRACE(DEBUG,"Invalid extra len");
+                ret = -2;
+            }
+            break;
+        case MCACHE_OPCODE_STAT:
+        case MCACHE_OPCODE_SNAPSHOT:
+            if(buffer->req_len < (sizeof(memcached_req_t) + req->len ))
+            {
+                TRACE(DEBUG,"Length Mismatch %d: %lu",buffer->req_len, (sizeof(memcached_req_t) + req->len ));
+                ret = -2;
+            }
+            break;
+        case MCACHE_OPCODE_PREFIX_COUNT:
+        case MCACHE_OPCODE_PREFIX_DELETE:
+            if(buffer->req_len < (sizeof(memcached_req_t) + req->len ))
+            {
+                TRACE(DEBUG,"Length Mismatch %d: %lu",buffer->req_len, (sizeof(memcached_req_t) + req->len ));
+                ret = -2;
+            }
+            else if(( req->extra_len != 0 ) || ( req->key_len > req->len ))
+            {
+                TRACE(DEBUG,"Invalid key len");
+                ret = -2;
+            }
+            break;
+        case MCACHE_OPCODE_FLUSH:
+        case MCACHE_OPCODE_SCAN:
+            if(buffer->req_len < (sizeof(memcached_req_t) + req->len ))
+            {
+                TRACE(DEBUG,"Length Mismatch %d: %lu",buffer->req_len, (sizeof(memcached_req_t) + req->len ));
+                ret = -2;
+            }
+            else if((( req->extra_len != 0 ) &&
+                     ( req->extra_len != (( req->opcode == MCACHE_OPCODE_SCAN ) ? MCACHE_SCAN_EXTRA_LEN : MCACHE_FLUSH_EXTRA_LEN ))) ||
+                    (( req->key_len + req->extra_len ) > req->len ))
+            {
+                TRACE(DEBUG,"Invalid extra len");
+                ret = -2;
+            }
+            break;
         default:
             TRACE(DEBUG,"Unsupported cmd");
             ret = -1;
@@ -85,83 +203,1607 @@ static int validate(memcached_req_t* req, buffer_t* buffer )
     return ret;
 }
 
-static int process(memcached_t *memcached, memcached_req_t* req, memcached_rsp_t *rsp)
+static const char* opcode_name(int slot)
 {
-    cache_data_t *centry = NULL;
-    int status = 0;
-    int val_len = 0;
-    rsp->magic = MCACHE_RSP_MAGIC;
-    rsp->opcode = req->opcode;
-    rsp->data_type = MCACHE_DATA_TYPE;
-    uint8_t *val, *key;
-    switch(req->opcode)
+    switch(slot)
+    {
+        case MCACHE_OPCODE_GET:     return "get";
+        case MCACHE_OPCODE_SET:     return "set";
+        case MCACHE_OPCODE_DELETE:  return "delete";
+        case MCACHE_OPCODE_INCREMENT: return "incr";
+        case MCACHE_OPCODE_DECREMENT: return "decr";
+        case MCACHE_OPCODE_QUIT:    return "quit";
+        case MCACHE_OPCODE_FLUSH:   return "flush";
+        case MCACHE_OPCODE_STAT:    return "stat";
+        case MCACHE_LATENCY_OPCODES:return "other";
+        default:                    return NULL;
+    }
+}
+
+/*
+ * Histograms of a thread, made by the thread before it serves requests
+ */
+static void latency_create(memcached_worker_t *worker)
+{
+    int i;
+
+    for(i = 0; i < MCACHE_LATENCY_SLOTS; i++)
+        __atomic_store_n(&worker->latency[i], histogram_create(), __ATOMIC_RELEASE);
+}
+
+/*
+ * Record request latency in calling thread's own histogram
+ * Histograms are reset lazily by owner when a reset was requested. Both
+ * are done with latency_seq odd, readers copy a histogram while it is even
+ */
+static void latency_record(memcached_worker_t *worker, uint8_t opcode, uint64_t ns)
+{
+    uint32_t epoch = __atomic_load_n(&worker->memcached->latency_epoch, __ATOMIC_ACQUIRE);
+    int slot = (opcode < MCACHE_LATENCY_OPCODES) ? opcode : MCACHE_LATENCY_OPCODES;
+    int i;
+
+    __atomic_store_n(&worker->latency_seq, worker->latency_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    if( worker->latency_epoch != epoch )
+    {
+        for(i = 0; i < MCACHE_LATENCY_SLOTS; i++)
+            histogram_reset(worker->latency[i]);
+
+        __atomic_store_n(&worker->latency_epoch, epoch, __ATOMIC_RELEASE);
+    }
+
+    if( worker->latency[slot] )
+        histogram_record(worker->latency[slot], ns);
+
+    __atomic_store_n(&worker->latency_seq, worker->latency_seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copy of a histogram of another thread, taken between its writes
+ * Fails if thread has none or has not applied the last reset yet
+ */
+static int latency_copy(memcached_worker_t *worker, int slot, uint32_t epoch, histogram_t *copy)
+{
+    histogram_t *h = __atomic_load_n(&worker->latency[slot], __ATOMIC_ACQUIRE);
+    uint32_t seq;
+    int ret = -1;
+
+    if( h )
+    {
+        do
+        {
+            while(( seq = __atomic_load_n(&worker->latency_seq, __ATOMIC_ACQUIRE)) & 1 )
+                ;
+            ret = ( __atomic_load_n(&worker->latency_epoch, __ATOMIC_RELAXED) == epoch ) ? 0 : -1;
+            if( ret == 0 )
+                memcpy(copy, h, sizeof(*copy));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while( __atomic_load_n(&worker->latency_seq, __ATOMIC_RELAXED) != seq );
+    }
+
+    return ret;
+}
+
+/*
+ * Count a sampled item as on node of thread or on another node
+ */
+static void numa_record(memcached_worker_t *worker, const void *item)
+{
+    int node = topo_node_of(worker->memcached->topo, item);
+
+    if( node == worker->node )
+        __atomic_store_n(&worker->numa_local, worker->numa_local + 1, __ATOMIC_RELAXED);
+    else if( node >= 0 )
+        __atomic_store_n(&worker->numa_remote, worker->numa_remote + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Merge all threads histograms for every opcode and report percentiles (ns)
+ */
+static void stats_latency(memcached_t *memcached, stats_t *stats)
+{
+    histogram_t *h, *copy;
+    memcached_worker_t *worker;
+    uint32_t epoch = __atomic_load_n(&memcached->latency_epoch, __ATOMIC_ACQUIRE);
+    char key[32];
+    char name[8];
+    const char *op;
+    int slot, i;
+
+    if((h = histogram_create()) == NULL)
+        return;
+
+    if((copy = histogram_create()) == NULL)
+    {
+        histogram_destroy(h);
+        return;
+    }
+
+    for(slot = 0; slot < MCACHE_LATENCY_SLOTS; slot++)
+    {
+        histogram_reset(h);
+        for(i = 0; i < memcached->tcount; i++)
+        {
+            worker = &memcached->workers[i];
+
+            /* Skip threads which have not applied the last reset yet */
+            if( latency_copy(worker, slot, epoch, copy) == 0 )
+                histogram_merge(h, copy);
+        }
+
+        if( h->count == 0 )
+            continue;
+
+        if((op = opcode_name(slot)) == NULL)
+        {
+            snprintf(name, sizeof(name), "op%02x", slot);
+            op = name;
+        }
+
+        snprintf(key, sizeof(key), "%s:count", op);
+        stats_add(stats, key, "%" PRIu64, h->count);
+        snprintf(key, sizeof(key), "%s:mean", op);
+        stats_add(stats, key, "%" PRIu64, histogram_mean(h));
+        snprintf(key, sizeof(key), "%s:min", op);
+        stats_add(stats, key, "%" PRIu64, h->min);
+        snprintf(key, sizeof(key), "%s:p50", op);
+        stats_add(stats, key, "%" PRIu64, histogram_percentile(h, 50.0));
+        snprintf(key, sizeof(key), "%s:p90", op);
+        stats_add(stats, key, "%" PRIu64, histogram_percentile(h, 90.0));
+        snprintf(key, sizeof(key), "%s:p99", op);
+        stats_add(stats, key, "%" PRIu64, histogram_percentile(h, 99.0));
+        snprintf(key, sizeof(key), "%s:p999", op);
+        stats_add(stats, key, "%" PRIu64, histogram_percentile(h, 99.9));
+        snprintf(key, sizeof(key), "%s:max", op);
+        stats_add(stats, key, "%" PRIu64, h->max);
+    }
+
+    histogram_destroy(copy);
+    histogram_destroy(h);
+}
+
+/*
+ * Item counts and memory use
+ */
+static void stats_cache(cachedb_t *cache, stats_t *stats)
+{
+    uint64_t items, bytes, evictions, rejections;
+
+    pthread_mutex_lock(&cache->lru_lock);
+    items = cache->items;
+    bytes = cache->main.bytes + cache->window.bytes + cache->ext_lru.bytes;
+    evictions = cache->evictions;
+    rejections = cache->rejections;
+    pthread_mutex_unlock(&cache->lru_lock);
+
+    stats_add(stats, "curr_items", "%lu", (unsigned long)items);
+    stats_add(stats, "bytes", "%lu", (unsigned long)bytes);
+    stats_add(stats, "limit_maxbytes", "%lu", (unsigned long)cache->limit);
+    stats_add(stats, "evictions", "%lu", (unsigned long)evictions);
+    stats_add(stats, "admission", "%s", cache->lfu ? "tinylfu" : "none");
+    stats_add(stats, "admission_rejects", "%lu", (unsigned long)rejections);
+    stats_add(stats, "cmd_flush", "%lu", (unsigned long)__atomic_load_n(&cache->flushes, __ATOMIC_RELAXED));
+    stats_add(stats, "flush_reclaimed", "%lu", (unsigned long)__atomic_load_n(&cache->flush_reclaimed, __ATOMIC_RELAXED));
+    
+    if( cache->ns_flushed )
+        stats_add(stats, "ns_flushes", "%lu", (unsigned long)__atomic_load_n(&cache->ns_flushes, __ATOMIC_RELAXED));
+    
+    if( cache->index )
+    {
+        stats_add(stats, "index_keys", "%lu", (unsigned long)index_keys(cache->index));
+        stats_add(stats, "index_bytes", "%lu", (unsigned long)index_bytes(cache->index));
+    }
+
+    if( cache->ext )
+    {
+        stats_add(stats, "ext_items", "%lu", (unsigned long)__atomic_load_n(&cache->ext_items, __ATOMIC_RELAXED));
+        stats_add(stats, "ext_index_limit", "%lu", (unsigned long)cache->ext_limit);
+        stats_add(stats, "ext_pages", "%u", cache->ext->pages);
+        stats_add(stats, "ext_pages_free", "%u", extstore_free_pages(cache->ext));
+        stats_add(stats, "ext_writes", "%lu", (unsigned long)__atomic_load_n(&cache->ext->writes, __ATOMIC_RELAXED));
+        stats_add(stats, "ext_bytes_written", "%lu", (unsigned long)__atomic_load_n(&cache->ext->bytes_written, __ATOMIC_RELAXED));
+        stats_add(stats, "ext_reads", "%lu", (unsigned long)__atomic_load_n(&cache->ext->reads, __ATOMIC_RELAXED));
+        stats_add(stats, "ext_read_misses", "%lu", (unsigned long)__atomic_load_n(&cache->ext->read_misses, __ATOMIC_RELAXED));
+        stats_add(stats, "ext_compactions", "%lu", (unsigned long)__atomic_load_n(&cache->ext_compactions, __ATOMIC_RELAXED));
+        stats_add(stats, "ext_rescued", "%lu", (unsigned long)__atomic_load_n(&cache->ext_rescued, __ATOMIC_RELAXED));
+        stats_add(stats, "ext_dropped", "%lu", (unsigned long)__atomic_load_n(&cache->ext_dropped, __ATOMIC_RELAXED));
+    }
+
+    if( cache->storage )
+    {
+        stats_add(stats, "arena_pages", "%s", arena_pages_name(cache->storage->pages));
+        stats_add(stats, "arena_bytes", "%lu", (unsigned long)cache->storage->map_size);
+        stats_add(stats, "arena_locked", "%lu", (unsigned long)cache->arena_locked);
+    }
+    
+    if( cache->tiny )
+    {
+        stats_add(stats, "tiny_items", "%lu", (unsigned long)__atomic_load_n(&cache->tiny->items, __ATOMIC_RELAXED));
+        stats_add(stats, "tiny_slots", "%lu", (unsigned long)tiny_sets(cache->tiny) * TINY_WAYS);
+        stats_add(stats, "tiny_bytes", "%lu", (unsigned long)tiny_sets(cache->tiny) * TINY_WAYS * sizeof(tiny_slot_t));
+        stats_add(stats, "tiny_evictions", "%lu", (unsigned long)__atomic_load_n(&cache->tiny->evictions, __ATOMIC_RELAXED));
+        stats_add(stats, "tiny_promotions", "%lu", (unsigned long)__atomic_load_n(&cache->tiny_promotions, __ATOMIC_RELAXED));
+    }
+    
+    if( cache->lease )
+    {
+        stats_add(stats, "lease_grants", "%lu", (unsigned long)__atomic_load_n(&cache->lease->grants, __ATOMIC_RELAXED));
+        stats_add(stats, "lease_waits", "%lu", (unsigned long)__atomic_load_n(&cache->lease->waits, __ATOMIC_RELAXED));
+        stats_add(stats, "lease_stale_hits", "%lu", (unsigned long)__atomic_load_n(&cache->lease->stale_hits, __ATOMIC_RELAXED));
+        stats_add(stats, "lease_refused", "%lu", (unsigned long)__atomic_load_n(&cache->lease->refused, __ATOMIC_RELAXED));
+    }
+    
+    if( cache->comp )
+    {
+        stats_add(stats, "compress_values", "%lu", (unsigned long)__atomic_load_n(&cache->comp->values, __ATOMIC_RELAXED));
+        stats_add(stats, "compress_skipped", "%lu", (unsigned long)__atomic_load_n(&cache->comp->skipped, __ATOMIC_RELAXED));
+        stats_add(stats, "compress_bytes_in", "%lu", (unsigned long)__atomic_load_n(&cache->comp->bytes_in, __ATOMIC_RELAXED));
+        stats_add(stats, "compress_bytes_out", "%lu", (unsigned long)__atomic_load_n(&cache->comp->bytes_out, __ATOMIC_RELAXED));
+        stats_add(stats, "compress_inflates", "%lu", (unsigned long)__atomic_load_n(&cache->comp->inflates, __ATOMIC_RELAXED));
+        stats_add(stats, "compress_failures", "%lu", (unsigned long)__atomic_load_n(&cache->comp->failures, __ATOMIC_RELAXED));
+        stats_add(stats, "compress_dict", "%u", __atomic_load_n(&cache->comp->dict, __ATOMIC_ACQUIRE) ? cache->comp->dict_len : 0);
+    }
+}
+
+/*
+ * Replication, counts of primary are of what it sent, of replica what it
+ * received and applied
+ */
+static void stats_repl(repl_t *repl, stats_t *stats)
+{
+    stats_add(stats, "repl_role", "%s", repl->primary ? "primary" : "replica");
+    if( repl->primary )
+        stats_add(stats, "repl_replicas", "%d", __atomic_load_n(&repl->replicas, __ATOMIC_RELAXED));
+    stats_add(stats, "repl_records", "%lu", (unsigned long)__atomic_load_n(&repl->records, __ATOMIC_RELAXED));
+    stats_add(stats, "repl_batches", "%lu", (unsigned long)__atomic_load_n(&repl->batches, __ATOMIC_RELAXED));
+    stats_add(stats, "repl_seq", "%u", __atomic_load_n(&repl->seq, __ATOMIC_RELAXED));
+    stats_add(stats, "repl_bytes", "%lu", (unsigned long)__atomic_load_n(&repl->bytes, __ATOMIC_RELAXED));
+    stats_add(stats, "repl_bytes_sent", "%lu", (unsigned long)__atomic_load_n(&repl->bytes_sent, __ATOMIC_RELAXED));
+    stats_add(stats, "repl_dropped", "%lu", (unsigned long)__atomic_load_n(&repl->dropped, __ATOMIC_RELAXED));
+    if( repl->primary == 0 )
+        stats_add(stats, "repl_flushes", "%lu", (unsigned long)__atomic_load_n(&repl->flushes, __ATOMIC_RELAXED));
+}
+
+/*
+ * Last completed snapshot
+ */
+static void stats_snapshot(snapshot_t *snapshot, stats_t *stats)
+{
+    stats_add(stats, "snapshot_running", "%d", __atomic_load_n(&snapshot->running, __ATOMIC_RELAXED));
+    stats_add(stats, "snapshot_items", "%lu", (unsigned long)__atomic_load_n(&snapshot->items, __ATOMIC_RELAXED));
+    stats_add(stats, "snapshot_bytes", "%lu", (unsigned long)__atomic_load_n(&snapshot->bytes, __ATOMIC_RELAXED));
+    stats_add(stats, "snapshot_duration_ms", "%lu", (unsigned long)__atomic_load_n(&snapshot->duration_ms, __ATOMIC_RELAXED));
+    stats_add(stats, "snapshot_time", "%ld", (long)__atomic_load_n(&snapshot->last, __ATOMIC_RELAXED));
+    stats_add(stats, "snapshot_failures", "%u", __atomic_load_n(&snapshot->failures, __ATOMIC_RELAXED));
+}
+
+/*
+ * Nodes and sampled GET hits by node of item against node of thread
+ */
+static void stats_numa(memcached_t *memcached, stats_t *stats)
+{
+    uint64_t local = 0, remote = 0;
+    int i;
+
+    for(i = 0; i < memcached->tcount; i++)
+    {
+        local += __atomic_load_n(&memcached->workers[i].numa_local, __ATOMIC_RELAXED);
+        remote += __atomic_load_n(&memcached->workers[i].numa_remote, __ATOMIC_RELAXED);
+    }
+
+    stats_add(stats, "numa_nodes", "%d", memcached->topo->nodes);
+    stats_add(stats, "numa_local", "%lu", (unsigned long)local);
+    stats_add(stats, "numa_remote", "%lu", (unsigned long)remote);
+}
+
+/*
+ * Hot keys hottest first, printable keys as is, others in hex
+ */
+static void stats_hotkeys(memcached_t *memcached, stats_t *stats)
+{
+    hotkey_t top[HOTKEYS_TOP];
+    char name[(HOTKEYS_KEY_MAX * 2) + 3];
+    uint64_t window = 0;
+    int i, j, n, len, printable;
+
+    n = hotkeys_top(memcached->cache->hot, top, HOTKEYS_TOP, &window);
+
+    for(i = 0; i < n; i++)
+    {
+        len = ( top[i].key_len < HOTKEYS_KEY_MAX ) ? top[i].key_len : HOTKEYS_KEY_MAX;
+
+        for(j = 0, printable = 1; j < len; j++)
+            if( top[i].key[j] < 0x21 || top[i].key[j] > 0x7e )
+                printable = 0;
+
+        if( printable )
+        {
+            memcpy(name, top[i].key, len);
+            name[len] = '\0';
+        }
+        else
+        {
+            strcpy(name, "0x");
+            for(j = 0; j < len; j++)
+                sprintf(&name[2 + (j * 2)], "%02x", top[i].key[j]);
+        }
+
+        stats_add(stats, name, "count %lu rate %lu/s bucket %u key_len %u",
+                  (unsigned long)top[i].count,
+                  (unsigned long)( window ? (top[i].count * 1000000000ULL) / window : 0 ),
+                  top[i].bucket, top[i].key_len);
+    }
+}
+
+static int scan_key(void *arg, const crawler_item_t *item)
+{
+    return stats_add_key((stats_t*)arg, item->key, item->key_len, "exp=%u size=%u loc=%s",
+                         item->expire, item->val_len, crawler_loc(item->loc));
+}
+
+/*
+ * Handle SCAN request, a step of a walk over keys matching the pattern in
+ * key. Each key is a packet, or a "KEY" line, with its metadata, the list
+ * ends with the cursor of the next step, 0 once the walk is done
+ */
+static int process_scan(memcached_worker_t *worker, buffer_t *buffer, memcached_req_t* req)
+{
+    memcached_t *memcached = worker->memcached;
+    uint64_t cursor = 0;
+    uint32_t count = CRAWLER_COUNT_DEFAULT;
+    stats_t stats;
+    
+    if( req->extra_len == MCACHE_SCAN_EXTRA_LEN )
+    {
+        cursor = get_be64(&req->data[0]);
+        memcpy(&count, &req->data[8], sizeof(count));
+        count = ntohl(count);
+        if(( count == 0 ) || ( count > CRAWLER_COUNT_MAX ))
+            count = ( count == 0 ) ? CRAWLER_COUNT_DEFAULT : CRAWLER_COUNT_MAX;
+    }
+    
+    if( worker->text )
+        stats_begin_text(&stats, memcached->server, buffer);
+    else
+        stats_begin(&stats, memcached->server, buffer, req->opcode, req->opaque);
+    
+    if( crawler_step(memcached->cache, &cursor, &req->data[req->extra_len], req->key_len, count, scan_key, &stats) < 0 )
+        return PROCESS_FAILED;
+    
+    return ( stats_end_cursor(&stats, cursor) > 0 ) ? PROCESS_SERIALIZED : PROCESS_FAILED;
+}
+
+/*
+ * Handle STAT request, key selects the stats group
+ *  ""        : General stats
+ *  "latency" : Per opcode latency percentiles in ns
+ *  "hotkeys" : Most accessed keys with estimated access rate
+ *  "reset"   : Reset latency histograms
+ */
+static int process_stat(memcached_worker_t *worker, buffer_t *buffer, memcached_req_t* req, memcached_rsp_t *rsp)
+{
+    memcached_t *memcached = worker->memcached;
+    char *key = (char*)&req->data[req->extra_len];
+    int key_len = req->key_len;
+    stats_t stats;
+
+    if( worker->text )
+        stats_begin_text(&stats, memcached->server, buffer);
+    else
+        stats_begin(&stats, memcached->server, buffer, req->opcode, req->opaque);
+
+    if( key_len == 0 )
+    {
+        stats_add(&stats, "pid", "%d", getpid());
+        stats_add(&stats, "uptime", "%ld", (long)(time(NULL) - memcached->started));
+        stats_add(&stats, "time", "%ld", (long)time(NULL));
+        stats_add(&stats, "threads", "%d", memcached->tcount);
+        stats_add(&stats, "hash_size", "%u", memcached->cache->ht->size);
+        stats_add(&stats, "max_key_len", "%d", memcached->max_key_len);
+        stats_add(&stats, "max_val_len", "%d", memcached->max_val_len);
+        stats_add(&stats, "get_sendfile", "%lu", (unsigned long)__atomic_load_n(&memcached->sendfile, __ATOMIC_RELAXED));
+        stats_cache(memcached->cache, &stats);
+        if( memcached->snapshot )
+            stats_snapshot(memcached->snapshot, &stats);
+        if( memcached->topo )
+            stats_numa(memcached, &stats);
+        if( memcached->repl )
+            stats_repl(memcached->repl, &stats);
+        if( memcached->proxy )
+        {
+            stats_add(&stats, "proxy_backends", "%d", memcached->proxy->count);
+            stats_add(&stats, "proxy_forwarded", "%lu", (unsigned long)__atomic_load_n(&memcached->proxy->forwarded, __ATOMIC_RELAXED));
+            stats_add(&stats, "proxy_errors", "%lu", (unsigned long)__atomic_load_n(&memcached->proxy->errors, __ATOMIC_RELAXED));
+        }
+    }
+    else if(( key_len == 7 ) && (memcmp(key, "latency", 7) == 0))
+    {
+        stats_latency(memcached, &stats);
+    }
+    else if(( key_len == 7 ) && (memcmp(key, "hotkeys", 7) == 0))
+    {
+        stats_hotkeys(memcached, &stats);
+    }
+    else if(( key_len == 5 ) && (memcmp(key, "reset", 5) == 0))
+    {
+        __atomic_add_fetch(&memcached->latency_epoch, 1, __ATOMIC_RELEASE);
+    }
+    else
+    {
+        TRACE(DEBUG,"Unknown stats group");
+        rsp->status = MCACHE_STATUS_NOT_FOUND;
+        rsp->opaque = req->opaque;
+        rsp->len = 0;
+        rsp->extra_len = 0;
+        return PROCESS_REPLY;
+    }
+
+    return ( stats_end(&stats) > 0 ) ? PROCESS_SERIALIZED : PROCESS_FAILED;
+}
+
+/*
+ * Value of item into reply after its extras, or attached from file, TCP
+ * only. Returns length of value, -1 if it is gone
+ */
+static int item_value(memcached_worker_t *worker, buffer_t *buffer, memcached_req_t *req, memcached_rsp_t *rsp, cache_data_t *centry)
+{
+    memcached_t *memcached = worker->memcached;
+    uint8_t *val = MCACHE_GET_RSP_VAL(rsp);
+    cache_file_t file;
+    uint32_t len;
+    int stored;
+    int val_len;
+    
+    if( memcached->topo && ( ++worker->numa_sample >= MCACHE_NUMA_SAMPLE ))
+    {
+        worker->numa_sample = 0;
+        numa_record(worker, centry);
+    }
+    
+    /* Client takes a plain zlib stream as it is */
+    stored = ( centry->comp == COMPRESS_DEFLATE ) && ( req->data_type & MCACHE_DATA_TYPE_DEFLATE );
+    val_len = centry->val_len;
+    
+    /* Text replies take values in line, no file part */
+    if(( memcached->server->udp == 0 ) && ( worker->text == 0 ) && ( val_len > 0 ) && (( centry->comp == COMPRESS_NONE ) || stored ) &&
+       ( centry->ext || ( val_len >= MCACHE_SENDFILE_MIN )) &&
+       ( cachedb_value_file(memcached->cache, centry, &file) == 0 ))
+    {
+        /* Value follows header straight from file */
+        if( stored )
+        {
+            file.off += COMPRESS_FRAME_SIZE;
+            val_len -= COMPRESS_FRAME_SIZE;
+        }
+        server_buffer_attach(memcached->server, buffer, file.fd, file.off, val_len, file.done, file.arg, file.tag);
+        __atomic_add_fetch(&memcached->sendfile, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        /* Frame is copied too, its length is skipped below */
+        len = memcached->max_val_len + COMPRESS_FRAME_SIZE;
+        if( cachedb_value(memcached->cache, centry, val, &len, stored) )
+        {
+            /* Value is gone */
+            val_len = -1;
+        }
+        else if( stored )
+        {
+            memmove(val, &val[COMPRESS_FRAME_SIZE], len - COMPRESS_FRAME_SIZE);
+            val_len = len - COMPRESS_FRAME_SIZE;
+        }
+        else
+        {
+            val_len = len;
+        }
+    }
+    
+    if( stored && ( val_len >= 0 ))
+        rsp->data_type = MCACHE_DATA_TYPE_DEFLATE;
+    
+    return val_len;
+}
+
+/*
+ * Opcodes of requests on a key, a proxy forwards them
+ */
+static int keyed(uint8_t opcode)
+{
+    switch(opcode)
     {
         case MCACHE_OPCODE_GET:
-            
-            val_len = memcached->max_val_len;
-            rsp->extra_len = 4;
-            val = MCACHE_GET_RSP_VAL(rsp);
+        case MCACHE_OPCODE_SET:
+        case MCACHE_OPCODE_DELETE:
+        case MCACHE_OPCODE_INCREMENT:
+        case MCACHE_OPCODE_DECREMENT:
+        case MCACHE_OPCODE_LEASE_GET:
+        case MCACHE_OPCODE_LEASE_SET:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Request goes to the backend of its key, the backend's reply is the reply.
+ * A GET of a multi-get may be sent already
+ */
+static int proxy_process(memcached_worker_t *worker, memcached_req_t *req, memcached_rsp_t *rsp)
+{
+    memcached_t *memcached = worker->memcached;
+    memcached_req_t head;
+    int backend, len;
+    
+    if(( worker->proxy == NULL ) && (( worker->proxy = proxy_conn_create(memcached->proxy)) == NULL ))
+        return PROCESS_FAILED;
+    
+    if(( req->opcode == MCACHE_OPCODE_GET ) && ( worker->ahead_pos < worker->ahead_count ))
+    {
+        backend = worker->ahead_backend[worker->ahead_pos++];
+    }
+    else
+    {
+        backend = proxy_backend(memcached->proxy, MCACHE_SET_REQ_KEY(req), req->key_len);
+        
+        /* Body is sent as it came */
+        memcpy(&head, req, sizeof(head));
+        head.key_len = htons(req->key_len);
+        head.len = htonl(req->len);
+        proxy_queue(worker->proxy, backend, &head, sizeof(head), req->data, req->len);
+    }
+    
+    if(( len = proxy_recv(worker->proxy, backend, (uint8_t*)rsp, MCACHE_MAX_RSP_SIZE(memcached))) > 0 )
+    {
+        ntoh_rsp(rsp);
+    }
+    else
+    {
+        /* Backend down is a miss to readers, they go to the source */
+        rsp->key_len = 0;
+        rsp->extra_len = 0;
+        rsp->len = 0;
+        memset(rsp->cas, 0, sizeof(rsp->cas));
+        if( len == -2 )
+            rsp->status = MCACHE_STATUS_TOO_LARGE;
+        else if(( req->opcode == MCACHE_OPCODE_GET ) || ( req->opcode == MCACHE_OPCODE_LEASE_GET ))
+            rsp->status = MCACHE_STATUS_NOT_FOUND;
+        else
+            rsp->status = MCACHE_STATUS_NOT_STORED;
+    }
+    
+    return PROCESS_REPLY;
+}
+
+/*
+ * Request without a key goes to every backend, the reply is a success if
+ * it was one from all of them. Counts of prefix requests are added up
+ */
+static int proxy_all(memcached_worker_t *worker, memcached_req_t *req, memcached_rsp_t *rsp)
+{
+    memcached_t *memcached = worker->memcached;
+    memcached_req_t head;
+    uint16_t status = MCACHE_STATUS_SUCCESS;
+    uint64_t count = 0;
+    int i;
+    
+    if(( worker->proxy == NULL ) && (( worker->proxy = proxy_conn_create(memcached->proxy)) == NULL ))
+        return PROCESS_FAILED;
+    
+    memcpy(&head, req, sizeof(head));
+    head.key_len = htons(req->key_len);
+    head.len = htonl(req->len);
+    
+    for(i = 0; i < memcached->proxy->count; i++)
+        proxy_queue(worker->proxy, i, &head, sizeof(head), req->data, req->len);
+    
+    for(i = 0; i < memcached->proxy->count; i++)
+    {
+        if( proxy_recv(worker->proxy, i, (uint8_t*)rsp, MCACHE_MAX_RSP_SIZE(memcached)) <= 0 )
+        {
+            status = MCACHE_STATUS_NOT_STORED;
+        }
+        else
+        {
+            ntoh_rsp(rsp);
+            if( rsp->status != MCACHE_STATUS_SUCCESS )
+                status = rsp->status;
+            else if( rsp->len == 8 )
+                count += get_be64(rsp->data);
+        }
+    }
+    
+    rsp->key_len = 0;
+    rsp->extra_len = 0;
+    rsp->len = 0;
+    rsp->status = status;
+    
+    if(( status == MCACHE_STATUS_SUCCESS ) &&
+       (( req->opcode == MCACHE_OPCODE_PREFIX_COUNT ) || ( req->opcode == MCACHE_OPCODE_PREFIX_DELETE )))
+    {
+        put_be64(rsp->data, count);
+        rsp->len = 8;
+    }
+    memset(rsp->cas, 0, sizeof(rsp->cas));
+    
+    return PROCESS_REPLY;
+}
+
+/*
+ * Key lock of a mutation while primary has replicas, NULL otherwise
+ */
+static pthread_mutex_t* repl_lock(memcached_t *memcached, memcached_req_t *req)
+{
+    switch(req->opcode)
+    {
+        case MCACHE_OPCODE_SET:
+        case MCACHE_OPCODE_DELETE:
+        case MCACHE_OPCODE_INCREMENT:
+        case MCACHE_OPCODE_DECREMENT:
+        case MCACHE_OPCODE_LEASE_SET:
+            if( repl_active(memcached->repl))
+                return REPL_LOCK(memcached->repl, cache_data_key_hash(MCACHE_SET_REQ_KEY(req), req->key_len));
+            return NULL;
+        default:
+            return NULL;
+    }
+}
+
+/*
+ * Mutation that succeeded to replicas, a new count is set as its digits
+ * with the flags of the item, which the key lock keeps as they are
+ */
+static void replicate(memcached_t *memcached, memcached_req_t *req, memcached_rsp_t *rsp)
+{
+    cache_data_t *centry = NULL;
+    uint32_t flag = 0;
+    char num[24];
+    int len;
+    
+    switch(req->opcode)
+    {
+        case MCACHE_OPCODE_SET:
+            if( req->extra_len >= sizeof(flag) )
+                memcpy(&flag, req->data, sizeof(flag));
+            repl_log(memcached->repl, REPL_OP_SET, MCACHE_SET_REQ_KEY(req), req->key_len, MCACHE_SET_REQ_VAL(req),
+                     req->len - req->key_len - req->extra_len, flag);
+            break;
+        case MCACHE_OPCODE_LEASE_SET:
+            repl_log(memcached->repl, REPL_OP_SET, MCACHE_SET_REQ_KEY(req), req->key_len, MCACHE_SET_REQ_VAL(req),
+                     req->len - req->key_len - req->extra_len, 0);
+            break;
+        case MCACHE_OPCODE_DELETE:
+            repl_log(memcached->repl, REPL_OP_DELETE, MCACHE_SET_REQ_KEY(req), req->key_len, NULL, 0, 0);
+            break;
+        case MCACHE_OPCODE_INCREMENT:
+        case MCACHE_OPCODE_DECREMENT:
+            if( cachedb_get(memcached->cache, &centry, MCACHE_SET_REQ_KEY(req), NULL, req->key_len, NULL) == 0 )
+            {
+                flag = centry->flag;
+                cache_data_release(centry);
+            }
+            len = snprintf(num, sizeof(num), "%" PRIu64, get_be64(rsp->data));
+            repl_log(memcached->repl, REPL_OP_SET, MCACHE_SET_REQ_KEY(req), req->key_len, (uint8_t*)num, len, flag);
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Key of a prefix delete, deleted and sent to replicas under its key lock
+ */
+static int prefix_deleted(void *arg, uint8_t *key, uint32_t key_len)
+{
+    memcached_t *memcached = (memcached_t*)arg;
+    pthread_mutex_t *lock = NULL;
+    int ret;
+    
+    if( repl_active(memcached->repl))
+    {
+        lock = REPL_LOCK(memcached->repl, cache_data_key_hash(key, key_len));
+        pthread_mutex_lock(lock);
+    }
+    
+    if((( ret = cachedb_delete(memcached->cache, key, key_len)) == 0 ) && lock )
+        repl_log(memcached->repl, REPL_OP_DELETE, key, key_len, NULL, 0, 0);
+    
+    if( lock )
+        pthread_mutex_unlock(lock);
+    
+    return ret;
+}
+
+static int process(memcached_worker_t *worker, buffer_t *buffer, memcached_req_t* req, memcached_rsp_t *rsp)
+{
+    memcached_t *memcached = worker->memcached;
+    cache_data_t *centry = NULL;
+    int64_t count;
+    uint64_t value;
+    uint32_t len, expiry, token, lease, delay;
+    pthread_mutex_t *lock;
+    int ahead;
+    int status = 0;
+    int val_len = 0;
+    int ret = PROCESS_REPLY;
+    
+    PROBE3(process__start, req->opcode, req->key_len, req->len);
+    
+    rsp->magic = MCACHE_RSP_MAGIC;
+    rsp->opcode = req->opcode;
+    rsp->data_type = MCACHE_DATA_TYPE;
+    
+    /* Buffer may still hold a STAT reply with a key */
+    rsp->key_len = 0;
+    uint8_t *val, *key;
+    
+    /* Proxy serves itself only requests without a key, but for a flush and prefixes */
+    if( memcached->proxy && ( keyed(req->opcode) || ( req->opcode == MCACHE_OPCODE_FLUSH ) ||
+        ( req->opcode == MCACHE_OPCODE_PREFIX_COUNT ) || ( req->opcode == MCACHE_OPCODE_PREFIX_DELETE )))
+    {
+        ret = keyed(req->opcode) ? proxy_process(worker, req, rsp) : proxy_all(worker, req, rsp);
+        PROBE3(process__done, req->opcode, ret, ( ret == PROCESS_REPLY ) ? rsp->status : 0);
+        return ret;
+    }
+    
+    /* Replicas get the mutations of a key in the order they are applied */
+    if(( lock = repl_lock(memcached, req)))
+        pthread_mutex_lock(lock);
+    
+    switch(req->opcode)
+    {
+        case MCACHE_OPCODE_GET:
+            
+            val_len = -1;
+            rsp->extra_len = 4;
+            val = MCACHE_GET_RSP_VAL(rsp);
             key = MCACHE_GET_REQ_KEY(req);
             HEXDUMP(DEBUG,"Find Key :",key, req->key_len);
-            if((cachedb_get(memcached->cache, &centry, key,val, req->key_len, &val_len )) == 0)
+            len = memcached->max_val_len;
+            
+            /* Key of a multi-get may be looked up already */
+            ahead = ( worker->ahead_pos < worker->ahead_count );
+            if( ahead )
+                centry = worker->ahead[worker->ahead_pos++];
+            
+            if(( centry == NULL ) && ( cachedb_get_tiny(memcached->cache, key, req->key_len, val, &len) == 0 ))
             {
-                TRACE(DEBUG,"Found Value");
-                HEXDUMP(DEBUG,"Found Value :",val, val_len);
-                cache_data_get(centry, MCACHE_GET_RSP_EXTRA(rsp), &rsp->extra_len, rsp->cas);
+                /* Tiny items have no flags and no cas */
+                TRACE(DEBUG,"Found Tiny Value");
+                val_len = len;
+                memset(MCACHE_GET_RSP_EXTRA(rsp), 0, rsp->extra_len);
+                memset(rsp->cas, 0, sizeof(rsp->cas));
                 rsp->status = MCACHE_STATUS_SUCCESS;
                 rsp->len = val_len + rsp->extra_len;
                 dump_rsp(rsp);
             }
-            else
+            else if( centry || (( ahead == 0 ) && ( cachedb_get(memcached->cache, &centry, key, NULL, req->key_len, NULL ) == 0 )))
+            {
+                TRACE(DEBUG,"Found Value");
+                
+                val_len = item_value(worker, buffer, req, rsp, centry);
+                
+                if( val_len >= 0 )
+                {
+                    HEXDUMP(DEBUG,"Found Value :",val, buffer->file_len ? 0 : val_len);
+                    cache_data_get(centry, MCACHE_GET_RSP_EXTRA(rsp), &rsp->extra_len, rsp->cas);
+                    rsp->status = MCACHE_STATUS_SUCCESS;
+                    rsp->len = val_len + rsp->extra_len;
+                    dump_rsp(rsp);
+                }
+                cache_data_release(centry);
+            }
+            
+            if( val_len < 0 )
             {
                 TRACE(DEBUG,"Key Not Found");
                 rsp->status = MCACHE_STATUS_NOT_FOUND;
                 rsp->len = 0;
                 rsp->extra_len = 0;
             }
-            break;
-        case MCACHE_OPCODE_SET:
-            rsp->len = 0;
-            rsp->extra_len = 0;
-            val_len = req->len - req->key_len - req->extra_len;
-            if(( status =  cachedb_set(memcached->cache, &centry, MCACHE_SET_REQ_KEY(req), MCACHE_SET_REQ_VAL(req), req->key_len, val_len  )) == 0 )
+            break;
+        case MCACHE_OPCODE_SET:
+            rsp->len = 0;
+            rsp->extra_len = 0;
+            val_len = req->len - req->key_len - req->extra_len;
+            
+            /* Extras are flags and expiration, reply has the CAS of the item */
+            if(( status =  cachedb_set_extra(memcached->cache, MCACHE_SET_REQ_KEY(req), MCACHE_SET_REQ_VAL(req), req->key_len, val_len,
+                                             req->data, req->extra_len, rsp->cas)) == 0 )
+            {
+                TRACE(DEBUG,"Set Done");
+                rsp->status = MCACHE_STATUS_SUCCESS;
+                dump_rsp(rsp);
+            }
+            else
+            {
+                TRACE(DEBUG,"Set Failed");
+                rsp->status = MCACHE_STATUS_TOO_LARGE;
+            }
+        
+            break;
+        case MCACHE_OPCODE_DELETE:
+            rsp->len = 0;
+            rsp->extra_len = 0;
+            status = cachedb_delete(memcached->cache, MCACHE_SET_REQ_KEY(req), req->key_len);
+            rsp->status = ( status == 0 ) ? MCACHE_STATUS_SUCCESS : MCACHE_STATUS_NOT_FOUND;
+            break;
+        case MCACHE_OPCODE_INCREMENT:
+        case MCACHE_OPCODE_DECREMENT:
+            rsp->len = 0;
+            rsp->extra_len = 0;
+            
+            /* Extras are delta, initial and expiration, reply is the new value */
+            memcpy(&expiry, &req->data[16], sizeof(expiry));
+            status = cachedb_incr(memcached->cache, MCACHE_SET_REQ_KEY(req), req->key_len, get_be64(&req->data[0]),
+                                  ( req->opcode == MCACHE_OPCODE_DECREMENT ), get_be64(&req->data[8]),
+                                  ( ntohl(expiry) != MCACHE_INCR_NO_CREATE ), &value);
+            if( status == 0 )
+            {
+                put_be64(rsp->data, value);
+                rsp->len = 8;
+                rsp->status = MCACHE_STATUS_SUCCESS;
+            }
+            else if( status == 1 )
+                rsp->status = MCACHE_STATUS_NOT_FOUND;
+            else if( status == 2 )
+                rsp->status = MCACHE_STATUS_NON_NUMERIC;
+            else
+                rsp->status = MCACHE_STATUS_NOT_STORED;
+            break;
+        case MCACHE_OPCODE_LEASE_GET:
+            
+            /* Extras are lease flags and token, value follows */
+            val_len = -1;
+            lease = 0;
+            rsp->extra_len = MCACHE_LEASE_EXTRA_LEN;
+            val = MCACHE_GET_RSP_VAL(rsp);
+            key = MCACHE_GET_REQ_KEY(req);
+            len = memcached->max_val_len;
+            if( cachedb_get_tiny(memcached->cache, key, req->key_len, val, &len) == 0 )
+            {
+                val_len = len;
+                token = 0;
+            }
+            else if(( status = cachedb_lease_get(memcached->cache, &centry, key, req->key_len, &token)) >= 0 )
+            {
+                /* Item, or value before delete on a miss */
+                if( centry )
+                {
+                    val_len = item_value(worker, buffer, req, rsp, centry);
+                    cache_data_release(centry);
+                }
+                
+                if( status == 2 )
+                    lease = MCACHE_LEASE_WIN;
+                else if(( status > 2 ) && ( val_len < 0 ))
+                    lease = MCACHE_LEASE_WAIT;
+                
+                if(( status > 1 ) && ( val_len >= 0 ))
+                    lease |= MCACHE_LEASE_STALE;
+            }
+            else
+            {
+                token = 0;
+            }
+            
+            lease = htonl(lease);
+            token = htonl(token);
+            memcpy(&rsp->data[0], &lease, sizeof(lease));
+            memcpy(&rsp->data[4], &token, sizeof(token));
+            memset(rsp->cas, 0, sizeof(rsp->cas));
+            rsp->status = ( val_len >= 0 ) ? MCACHE_STATUS_SUCCESS : MCACHE_STATUS_NOT_FOUND;
+            rsp->len = rsp->extra_len + (( val_len > 0 ) ? val_len : 0 );
+            break;
+        case MCACHE_OPCODE_LEASE_SET:
+            rsp->len = 0;
+            rsp->extra_len = 0;
+            
+            /* Extras are the token of the lease */
+            memcpy(&token, &req->data[0], sizeof(token));
+            val_len = req->len - req->key_len - req->extra_len;
+            status = cachedb_lease_set(memcached->cache, MCACHE_SET_REQ_KEY(req), MCACHE_SET_REQ_VAL(req), req->key_len, val_len, ntohl(token));
+            if( status == 0 )
+                rsp->status = MCACHE_STATUS_SUCCESS;
+            else if( status == 1 )
+                rsp->status = MCACHE_STATUS_NOT_STORED;
+            else
+                rsp->status = MCACHE_STATUS_TOO_LARGE;
+            break;
+        case MCACHE_OPCODE_QUIT:
+            /* Close connection */
+            ret = PROCESS_CLOSE;
+            break;
+        case MCACHE_OPCODE_FLUSH:
+            rsp->len = 0;
+            rsp->extra_len = 0;
+            
+            /* Extras are the delay, a key is the only namespace to flush, at once */
+            delay = 0;
+            if( req->extra_len )
+                memcpy(&delay, &req->data[0], sizeof(delay));
+            
+            if( req->key_len == 0 )
+                status = cachedb_flush(memcached->cache, ntohl(delay));
+            else if( delay )
+                status = 1;
+            else
+                status = cachedb_flush_ns(memcached->cache, MCACHE_SET_REQ_KEY(req), req->key_len);
+            
+            if( status == 0 )
+            {
+                rsp->status = MCACHE_STATUS_SUCCESS;
+                if( repl_active(memcached->repl))
+                    repl_log(memcached->repl, REPL_OP_FLUSH, MCACHE_SET_REQ_KEY(req), req->key_len,
+                             (uint8_t*)&delay, sizeof(delay), 0);
+            }
+            else
+            {
+                rsp->status = ( status == 1 ) ? MCACHE_STATUS_INVALID_ARGS : MCACHE_STATUS_NOT_STORED;
+            }
+            break;
+        case MCACHE_OPCODE_PREFIX_COUNT:
+        case MCACHE_OPCODE_PREFIX_DELETE:
+            rsp->len = 0;
+            rsp->extra_len = 0;
+            
+            /* Key is the prefix, reply is how many keys had it */
+            if( req->opcode == MCACHE_OPCODE_PREFIX_COUNT )
+                count = cachedb_prefix_count(memcached->cache, MCACHE_SET_REQ_KEY(req), req->key_len);
+            else
+                count = cachedb_prefix_delete(memcached->cache, MCACHE_SET_REQ_KEY(req), req->key_len, prefix_deleted, memcached);
+            
+            if( count >= 0 )
+            {
+                put_be64(rsp->data, count);
+                rsp->len = 8;
+                rsp->status = MCACHE_STATUS_SUCCESS;
+            }
+            else
+            {
+                rsp->status = ( count == -2 ) ? MCACHE_STATUS_INVALID_ARGS : MCACHE_STATUS_NOT_STORED;
+            }
+            break;
+        case MCACHE_OPCODE_STAT:
+            ret = process_stat(worker, buffer, req, rsp);
+            break;
+        case MCACHE_OPCODE_SCAN:
+            ret = process_scan(worker, buffer, req);
+            break;
+        case MCACHE_OPCODE_SNAPSHOT:
+            rsp->len = 0;
+            rsp->extra_len = 0;
+            
+            /* Reply at once, snapshot is written in background */
+            if( memcached->snapshot == NULL )
+                rsp->status = MCACHE_STATUS_NOT_STORED;
+            else if(( status = snapshot_start(memcached->snapshot)) == 0 )
+            {
+                /* Writer is maintenance, off the node of this thread */
+                if( memcached->topo )
+                    topo_pin(memcached->topo, memcached->snapshot->tid, 0);
+                rsp->status = MCACHE_STATUS_SUCCESS;
+            }
+            else
+                rsp->status = ( status == 1 ) ? MCACHE_STATUS_EXISTS : MCACHE_STATUS_NOT_STORED;
+            break;
+        default:
+            
+            break;
+    }
+    
+    if( lock )
+    {
+        if( rsp->status == MCACHE_STATUS_SUCCESS )
+            replicate(memcached, req, rsp);
+        pthread_mutex_unlock(lock);
+    }
+    
+    PROBE3(process__done, req->opcode, ret, ( ret == PROCESS_REPLY ) ? rsp->status : 0);
+    
+    return ret;
+}
+
+/*
+ * Sampled request goes to capture log
+ */
+static void capture_sample(memcached_worker_t *worker, uint64_t start, memcached_req_t *req)
+{
+    memcached_t *memcached = worker->memcached;
+    
+    if( memcached->capture && (++worker->captured >= memcached->capture->sample) &&
+        ((req->key_len + req->extra_len) <= req->len ))
+    {
+        worker->captured = 0;
+        capture_record(memcached->capture, start, req->opcode, &req->data[req->extra_len], req->key_len,
+                       req->len - req->key_len - req->extra_len);
+    }
+}
+
+/*
+ * Append len bytes to text reply
+ */
+static int text_append(memcached_t *memcached, buffer_t *buffer, const void *data, int len)
+{
+    if(( buffer->rsp_len + len > buffer->rsp_size ) &&
+       server_buffer_reserve(memcached->server, buffer, ( buffer->rsp_len + len ) * 2 ))
+        return -1;
+    
+    memcpy(&buffer->rsp[buffer->rsp_len], data, len);
+    buffer->rsp_len += len;
+    
+    return 0;
+}
+
+#define TEXT_REPLY(m, b, s)     text_append((m), (b), (s), sizeof(s) - 1)
+
+/*
+ * Binary request of a text command, in host byte order, in worker's buffer.
+ * Callers check key and value against the limits, what would still not fit
+ * the buffer is left out
+ */
+static memcached_req_t* text_request(memcached_worker_t *worker, uint8_t opcode, const uint8_t *extra, int extra_len,
+                                     const ascii_token_t *key, const uint8_t *val, uint32_t val_len)
+{
+    memcached_t *memcached = worker->memcached;
+    memcached_req_t *req = (memcached_req_t*)worker->text_req;
+    
+    if(( key && ( key->len > memcached->max_key_len )) || ( val_len > memcached->max_val_len ))
+    {
+        TRACE(ERROR,"Key or value too large for request");
+        key = NULL;
+        val_len = 0;
+    }
+    
+    memset(req, 0, sizeof(memcached_req_t));
+    req->magic = MCACHE_REQ_MAGIC;
+    req->opcode = opcode;
+    req->extra_len = extra_len;
+    req->key_len = key ? key->len : 0;
+    req->len = extra_len + req->key_len + val_len;
+    
+    if( extra_len )
+        memcpy(req->data, extra, extra_len);
+    if( key )
+        memcpy(&req->data[extra_len], key->data, key->len);
+    if( val_len )
+        memcpy(&req->data[extra_len + req->key_len], val, val_len);
+    
+    return req;
+}
+
+/*
+ * "VALUE key flags bytes [cas]" line and data block of a GET reply
+ */
+static int text_value(memcached_t *memcached, buffer_t *buffer, const ascii_token_t *key, memcached_rsp_t *rsp, int cas)
+{
+    char head[64];
+    uint32_t flags = 0;
+    int val_len = rsp->len - rsp->extra_len;
+    int len;
+    
+    if( rsp->extra_len >= sizeof(flags) )
+    {
+        memcpy(&flags, MCACHE_GET_RSP_EXTRA(rsp), sizeof(flags));
+        flags = ntohl(flags);
+    }
+    
+    if( cas )
+        len = snprintf(head, sizeof(head), " %u %d %" PRIu64 "\r\n", flags, val_len, get_be64((uint8_t*)rsp->cas));
+    else
+        len = snprintf(head, sizeof(head), " %u %d\r\n", flags, val_len);
+    
+    return ( TEXT_REPLY(memcached, buffer, "VALUE ") || text_append(memcached, buffer, key->data, key->len) ||
+             text_append(memcached, buffer, head, len) || text_append(memcached, buffer, MCACHE_GET_RSP_VAL(rsp), val_len) ||
+             TEXT_REPLY(memcached, buffer, "\r\n") ) ? -1 : 0;
+}
+
+/*
+ * Look up next keys of a multi-get together, up to the first one too long.
+ * GETs of them take their items in turn. A proxy sends them to backends
+ * and GETs take the replies
+ */
+static void get_ahead(memcached_worker_t *worker, const ascii_token_t *tok, int count)
+{
+    memcached_t *memcached = worker->memcached;
+    memcached_req_t head;
+    uint8_t *keys[MCACHE_GET_AHEAD];
+    uint32_t key_lens[MCACHE_GET_AHEAD];
+    int n, i;
+    
+    for(n = 0; ( n < count ) && ( n < MCACHE_GET_AHEAD ) && ( tok[n].len <= memcached->max_key_len ); n++)
+    {
+        keys[n] = tok[n].data;
+        key_lens[n] = tok[n].len;
+    }
+    
+    worker->ahead_pos = 0;
+    
+    if( memcached->proxy )
+    {
+        worker->ahead_count = 0;
+        if(( worker->proxy == NULL ) && (( worker->proxy = proxy_conn_create(memcached->proxy)) == NULL ))
+            return;
+        
+        /* Sent to all backends before any reply is read, they work at once */
+        memset(&head, 0, sizeof(head));
+        head.magic = MCACHE_REQ_MAGIC;
+        head.opcode = MCACHE_OPCODE_GET;
+        for(i = 0; i < n; i++)
+        {
+            head.key_len = htons(key_lens[i]);
+            head.len = htonl(key_lens[i]);
+            worker->ahead_backend[i] = proxy_backend(memcached->proxy, keys[i], key_lens[i]);
+            proxy_queue(worker->proxy, worker->ahead_backend[i], &head, sizeof(head), keys[i], key_lens[i]);
+        }
+        proxy_flush(worker->proxy);
+        worker->ahead_count = n;
+    }
+    else
+    {
+        worker->ahead_count = ( cachedb_get_many(memcached->cache, keys, key_lens, n, worker->ahead) >= 0 ) ? n : 0;
+    }
+}
+
+/*
+ * Items looked up ahead which no GET took, or their replies
+ */
+static void ahead_drop(memcached_worker_t *worker)
+{
+    for(; worker->ahead_pos < worker->ahead_count; worker->ahead_pos++)
+    {
+        if( worker->memcached->proxy )
+            proxy_recv(worker->proxy, worker->ahead_backend[worker->ahead_pos], NULL, 0);
+        else
+            cache_data_release(worker->ahead[worker->ahead_pos]);
+    }
+    
+    worker->ahead_pos = worker->ahead_count = 0;
+}
+
+/*
+ * Send what response buffer holds now, the request being served stays
+ */
+static int text_flush(memcached_t *memcached, buffer_t *buffer)
+{
+    int req_len = buffer->req_len;
+    int ret;
+    
+    ret = server_buffer_send(memcached->server, buffer);
+    buffer->req_len = req_len;
+    
+    return ( ret > 0 ) ? 0 : -1;
+}
+
+/*
+ * "KEY" lines of all keys matching pattern, walked a step at a time. Lines
+ * are sent as they add up, so the reply does not hold the whole keyspace
+ */
+static int text_metadump(memcached_worker_t *worker, buffer_t *buffer, const ascii_token_t *pattern)
+{
+    memcached_t *memcached = worker->memcached;
+    uint64_t cursor = 0;
+    stats_t stats;
+    int ret = 0;
+    
+    stats_begin_text(&stats, memcached->server, buffer);
+    
+    do
+    {
+        if(( crawler_step(memcached->cache, &cursor, pattern ? pattern->data : NULL, pattern ? pattern->len : 0,
+                          CRAWLER_COUNT_MAX, scan_key, &stats) < 0 ) ||
+           (( buffer->rsp_len >= MCACHE_METADUMP_FLUSH ) && text_flush(memcached, buffer)))
+            ret = -1;
+    } while(( ret == 0 ) && cursor );
+    
+    return ( ret == 0 ) ? TEXT_REPLY(memcached, buffer, "END\r\n") : -1;
+}
+
+/*
+ * Serve complete text commands at the start of request buffer, each is
+ * made a binary request for process() and its reply turned into text at
+ * the end of response buffer. Value of a set too large to take is skipped
+ * with skip bytes still to come. Returns bytes taken, -1 on failure
+ */
+static int text_batch(memcached_worker_t *worker, buffer_t *buffer, uint64_t start, uint8_t *opcode, uint32_t *skip, int *quit)
+{
+    memcached_t *memcached = worker->memcached;
+    memcached_rsp_t *rsp = (memcached_rsp_t*)worker->text_rsp;
+    memcached_req_t *req;
+    ascii_token_t tok[MCACHE_TEXT_TOKENS];
+    uint8_t extra[MCACHE_INCR_EXTRA_LEN];
+    uint64_t flags, expiry, bytes, delta;
+    uint32_t be;
+    uint8_t *line;
+    char num[CACHE_INCR_DIGITS + 11];
+    int pos = 0, next, eol, len, n, i, noreply;
+    int ret = 0;
+    
+    while(( ret == 0 ) && ( *quit == 0 ) && ( pos < buffer->req_len ) &&
+          (( eol = ascii_eol(&buffer->req[pos], buffer->req_len - pos)) >= 0 ))
+    {
+        line = &buffer->req[pos];
+        len = (( eol > 0 ) && ( line[eol - 1] == '\r' )) ? eol - 1 : eol;
+        next = pos + eol + 1;
+        
+        n = ascii_tokens(line, len, tok, MCACHE_TEXT_TOKENS);
+        noreply = ( n > 1 ) && ascii_is(&tok[n - 1], "noreply");
+        n -= noreply;
+        
+        if(( n > 0 ) && ( *opcode == MCACHE_LATENCY_OPCODES ))
+            *opcode = ascii_is(&tok[0], "set") ? MCACHE_OPCODE_SET : ascii_is(&tok[0], "delete") ? MCACHE_OPCODE_DELETE :
+                      ascii_is(&tok[0], "incr") ? MCACHE_OPCODE_INCREMENT : ascii_is(&tok[0], "decr") ? MCACHE_OPCODE_DECREMENT :
+                      ascii_is(&tok[0], "stats") ? MCACHE_OPCODE_STAT :
+                      ( ascii_is(&tok[0], "flush_all") || ascii_is(&tok[0], "flush_ns")) ? MCACHE_OPCODE_FLUSH :
+                      ( ascii_is(&tok[0], "scan") || ascii_is(&tok[0], "metadump") || ascii_is(&tok[0], "count_prefix") ||
+                        ascii_is(&tok[0], "delete_prefix")) ? MCACHE_LATENCY_OPCODES : MCACHE_OPCODE_GET;
+        
+        if( n < 0 )
+        {
+            ret = TEXT_REPLY(memcached, buffer, "CLIENT_ERROR line too long\r\n");
+        }
+        else if( n == 0 )
+        {
+            ret = TEXT_REPLY(memcached, buffer, "ERROR\r\n");
+        }
+        else if(( ascii_is(&tok[0], "get") || ascii_is(&tok[0], "gets")) && ( n > 1 ))
+        {
+            /* All keys answered in one reply */
+            for(i = 1; ( i < n ) && ( ret == 0 ); i++)
+            {
+                if( tok[i].len > memcached->max_key_len )
+                {
+                    ret = TEXT_REPLY(memcached, buffer, "CLIENT_ERROR bad command line format\r\n");
+                    break;
+                }
+                
+                if(( worker->ahead_pos == worker->ahead_count ) && ( i + 1 < n ))
+                    get_ahead(worker, &tok[i], n - i);
+                
+                req = text_request(worker, MCACHE_OPCODE_GET, NULL, 0, &tok[i], NULL, 0);
+                capture_sample(worker, start, req);
+                
+                if(( process(worker, buffer, req, rsp) == PROCESS_REPLY ) && ( rsp->status == MCACHE_STATUS_SUCCESS ))
+                    ret = text_value(memcached, buffer, &tok[i], rsp, ( tok[0].len == 4 ));
+            }
+            
+            ahead_drop(worker);
+            
+            if(( ret == 0 ) && ( i == n ))
+                ret = TEXT_REPLY(memcached, buffer, "END\r\n");
+        }
+        else if( ascii_is(&tok[0], "set") && ( n == 5 ) )
+        {
+            if( ascii_number(&tok[2], &flags) || ( flags > UINT32_MAX ) || ascii_number(&tok[3], &expiry) ||
+                ( expiry > UINT32_MAX ) || ascii_number(&tok[4], &bytes) || ( bytes > UINT32_MAX - 2 ))
+            {
+                ret = TEXT_REPLY(memcached, buffer, "CLIENT_ERROR bad command line format\r\n");
+            }
+            else if(( tok[1].len > memcached->max_key_len ) || ( bytes > memcached->max_val_len ))
+            {
+                /* Data is skipped, as much as is there now and the rest as it comes */
+                ret = TEXT_REPLY(memcached, buffer, "SERVER_ERROR object too large for cache\r\n");
+                if(( next + bytes + 2 ) > buffer->req_len )
+                {
+                    *skip = ( next + bytes + 2 ) - buffer->req_len;
+                    next = buffer->req_len;
+                }
+                else
+                {
+                    next += bytes + 2;
+                }
+            }
+            else if(( next + bytes + 2 ) > buffer->req_len )
+            {
+                /* Data not all here yet, command is taken again with it */
+                break;
+            }
+            else if( memcmp(&buffer->req[next + bytes], "\r\n", 2) )
+            {
+                ret = TEXT_REPLY(memcached, buffer, "CLIENT_ERROR bad data chunk\r\n");
+                next += bytes + 2;
+            }
+            else
+            {
+                be = htonl(flags);
+                memcpy(&extra[0], &be, sizeof(be));
+                be = htonl(expiry);
+                memcpy(&extra[4], &be, sizeof(be));
+                
+                req = text_request(worker, MCACHE_OPCODE_SET, extra, 8, &tok[1], &buffer->req[next], bytes);
+                capture_sample(worker, start, req);
+                process(worker, buffer, req, rsp);
+                next += bytes + 2;
+                
+                if( noreply )
+                    ret = 0;
+                else if( rsp->status == MCACHE_STATUS_SUCCESS )
+                    ret = TEXT_REPLY(memcached, buffer, "STORED\r\n");
+                else if( rsp->status == MCACHE_STATUS_TOO_LARGE )
+                    ret = TEXT_REPLY(memcached, buffer, "SERVER_ERROR object too large for cache\r\n");
+                else
+                    ret = TEXT_REPLY(memcached, buffer, "NOT_STORED\r\n");
+            }
+        }
+        else if( ascii_is(&tok[0], "delete") && ( n == 2 ) && ( tok[1].len > memcached->max_key_len ))
+        {
+            ret = TEXT_REPLY(memcached, buffer, "CLIENT_ERROR bad command line format\r\n");
+        }
+        else if( ascii_is(&tok[0], "delete") && ( n == 2 ))
+        {
+            req = text_request(worker, MCACHE_OPCODE_DELETE, NULL, 0, &tok[1], NULL, 0);
+            capture_sample(worker, start, req);
+            process(worker, buffer, req, rsp);
+            
+            if( noreply )
+                ret = 0;
+            else if( rsp->status == MCACHE_STATUS_SUCCESS )
+                ret = TEXT_REPLY(memcached, buffer, "DELETED\r\n");
+            else
+                ret = TEXT_REPLY(memcached, buffer, "NOT_FOUND\r\n");
+        }
+        else if(( ascii_is(&tok[0], "incr") || ascii_is(&tok[0], "decr")) && ( n == 3 ))
+        {
+            if( ascii_number(&tok[2], &delta) )
+            {
+                ret = TEXT_REPLY(memcached, buffer, "CLIENT_ERROR invalid numeric delta argument\r\n");
+            }
+            else if( tok[1].len > memcached->max_key_len )
+            {
+                ret = TEXT_REPLY(memcached, buffer, "CLIENT_ERROR bad command line format\r\n");
+            }
+            else
+            {
+                /* Missing key is not created */
+                put_be64(&extra[0], delta);
+                put_be64(&extra[8], 0);
+                be = htonl(MCACHE_INCR_NO_CREATE);
+                memcpy(&extra[16], &be, sizeof(be));
+                
+                req = text_request(worker, ( tok[0].data[0] == 'i' ) ? MCACHE_OPCODE_INCREMENT : MCACHE_OPCODE_DECREMENT,
+                                   extra, MCACHE_INCR_EXTRA_LEN, &tok[1], NULL, 0);
+                capture_sample(worker, start, req);
+                process(worker, buffer, req, rsp);
+                
+                if( noreply )
+                {
+                    ret = 0;
+                }
+                else if( rsp->status == MCACHE_STATUS_SUCCESS )
+                {
+                    len = snprintf(num, sizeof(num), "%" PRIu64 "\r\n", get_be64(rsp->data));
+                    ret = text_append(memcached, buffer, num, len);
+                }
+                else if( rsp->status == MCACHE_STATUS_NOT_FOUND )
+                    ret = TEXT_REPLY(memcached, buffer, "NOT_FOUND\r\n");
+                else if( rsp->status == MCACHE_STATUS_NON_NUMERIC )
+                    ret = TEXT_REPLY(memcached, buffer, "CLIENT_ERROR cannot increment or decrement non-numeric value\r\n");
+                else
+                    ret = TEXT_REPLY(memcached, buffer, "SERVER_ERROR out of memory\r\n");
+            }
+        }
+        else if( ascii_is(&tok[0], "stats") && ( n == 2 ) && ( tok[1].len > memcached->max_key_len ))
+        {
+            ret = TEXT_REPLY(memcached, buffer, "CLIENT_ERROR bad command line format\r\n");
+        }
+        else if( ascii_is(&tok[0], "stats") && ( n <= 2 ))
+        {
+            /* Stats lines are appended by process() itself */
+            req = text_request(worker, MCACHE_OPCODE_STAT, NULL, 0, ( n == 2 ) ? &tok[1] : NULL, NULL, 0);
+            if(( i = process(worker, buffer, req, rsp)) == PROCESS_FAILED )
+                ret = -1;
+            else if( i == PROCESS_REPLY )
+                ret = TEXT_REPLY(memcached, buffer, "ERROR\r\n");
+        }
+        else if( ascii_is(&tok[0], "scan") && ( n >= 2 ) && ( n <= 4 ))
+        {
+            /* scan <cursor> [pattern [count]], lines are appended by process() */
+            if( ascii_number(&tok[1], &delta) || (( n == 4 ) && ( ascii_number(&tok[3], &bytes) || ( bytes > UINT32_MAX ))))
+            {
+                ret = TEXT_REPLY(memcached, buffer, "CLIENT_ERROR bad command line format\r\n");
+            }
+            else if(( n >= 3 ) && ( tok[2].len > memcached->max_key_len ))
+            {
+                ret = TEXT_REPLY(memcached, buffer, "CLIENT_ERROR bad command line format\r\n");
+            }
+            else
+            {
+                put_be64(&extra[0], delta);
+                be = htonl(( n == 4 ) ? bytes : 0);
+                memcpy(&extra[8], &be, sizeof(be));
+                
+                req = text_request(worker, MCACHE_OPCODE_SCAN, extra, MCACHE_SCAN_EXTRA_LEN, ( n >= 3 ) ? &tok[2] : NULL, NULL, 0);
+                ret = ( process(worker, buffer, req, rsp) == PROCESS_SERIALIZED ) ? 0 : -1;
+            }
+        }
+        else if(( ascii_is(&tok[0], "flush_all") && ( n <= 2 )) || ( ascii_is(&tok[0], "flush_ns") && ( n == 2 )))
+        {
+            /* flush_all [delay], flush_ns <namespace> */
+            if(( tok[0].len == 9 ) && ( n == 2 ) && ( ascii_number(&tok[1], &delta) || ( delta > UINT32_MAX )))
+            {
+                ret = TEXT_REPLY(memcached, buffer, "CLIENT_ERROR bad command line format\r\n");
+            }
+            else if(( tok[0].len == 8 ) && ( tok[1].len > memcached->max_key_len ))
+            {
+                ret = TEXT_REPLY(memcached, buffer, "CLIENT_ERROR bad command line format\r\n");
+            }
+            else
+            {
+                be = htonl(( n == 2 ) ? delta : 0);
+                memcpy(&extra[0], &be, sizeof(be));
+                
+                req = ( tok[0].len == 9 ) ? text_request(worker, MCACHE_OPCODE_FLUSH, extra, MCACHE_FLUSH_EXTRA_LEN, NULL, NULL, 0) :
+                                            text_request(worker, MCACHE_OPCODE_FLUSH, NULL, 0, &tok[1], NULL, 0);
+                capture_sample(worker, start, req);
+                process(worker, buffer, req, rsp);
+                
+                if( noreply )
+                    ret = 0;
+                else if( rsp->status == MCACHE_STATUS_SUCCESS )
+                    ret = TEXT_REPLY(memcached, buffer, "OK\r\n");
+                else if( rsp->status == MCACHE_STATUS_INVALID_ARGS )
+                    ret = TEXT_REPLY(memcached, buffer, "CLIENT_ERROR namespaces not enabled\r\n");
+                else
+                    ret = TEXT_REPLY(memcached, buffer, "SERVER_ERROR flush failed\r\n");
+            }
+        }
+        else if(( ascii_is(&tok[0], "count_prefix") || ascii_is(&tok[0], "delete_prefix")) && ( n == 2 ))
+        {
+            /* count_prefix <prefix>, delete_prefix <prefix> */
+            if( tok[1].len > memcached->max_key_len )
             {
-                TRACE(DEBUG,"Set Done");
-                rsp->status = MCACHE_STATUS_SUCCESS;
-                memcpy(rsp->cas, req->cas, 8);
-                dump_rsp(rsp);
+                ret = TEXT_REPLY(memcached, buffer, "CLIENT_ERROR bad command line format\r\n");
             }
             else
             {
-                TRACE(DEBUG,"Set Failed");
-                rsp->status = MCACHE_STATUS_TOO_LARGE;
+                req = text_request(worker, ( tok[0].data[0] == 'c' ) ? MCACHE_OPCODE_PREFIX_COUNT : MCACHE_OPCODE_PREFIX_DELETE,
+                                   NULL, 0, &tok[1], NULL, 0);
+                capture_sample(worker, start, req);
+                process(worker, buffer, req, rsp);
+                
+                if( noreply )
+                {
+                    ret = 0;
+                }
+                else if( rsp->status == MCACHE_STATUS_SUCCESS )
+                {
+                    len = snprintf(num, sizeof(num), "%s %" PRIu64 "\r\n", ( tok[0].data[0] == 'c' ) ? "COUNT" : "DELETED",
+                                   get_be64(rsp->data));
+                    ret = text_append(memcached, buffer, num, len);
+                }
+                else if( rsp->status == MCACHE_STATUS_INVALID_ARGS )
+                    ret = TEXT_REPLY(memcached, buffer, "CLIENT_ERROR prefix index not enabled\r\n");
+                else
+                    ret = TEXT_REPLY(memcached, buffer, "SERVER_ERROR prefix walk failed\r\n");
             }
+        }
+        else if( ascii_is(&tok[0], "metadump") && ( n <= 2 ))
+        {
+            ret = text_metadump(worker, buffer, ( n == 2 ) ? &tok[1] : NULL);
+        }
+        else if( ascii_is(&tok[0], "quit") && ( n == 1 ))
+        {
+            *quit = 1;
+        }
+        else
+        {
+            ret = TEXT_REPLY(memcached, buffer, "ERROR\r\n");
+        }
         
+        pos = next;
+    }
+    
+    return ( ret == 0 ) ? pos : -1;
+}
+
+/*
+ * Serve a text protocol connection until it is closed, commands that came
+ * in together are answered in one send
+ */
+static void serve_text(memcached_worker_t *worker, buffer_t *buffer)
+{
+    memcached_t *memcached = worker->memcached;
+    uint64_t start;
+    uint32_t skip = 0;
+    uint8_t opcode;
+    int taken, left, n;
+    int quit = 0;
+    
+    if((( worker->text_req == NULL ) &&
+        (( worker->text_req = malloc(MCACHE_MAX_REQ_SIZE(memcached) + MCACHE_INCR_EXTRA_LEN)) == NULL )) ||
+       (( worker->text_rsp == NULL ) &&
+        (( worker->text_rsp = malloc(MCACHE_MAX_RSP_SIZE(memcached) + COMPRESS_FRAME_SIZE)) == NULL )))
+    {
+        TRACE(ERROR,"Failed to allocate memory");
+        return;
+    }
+    
+    worker->text = 1;
+    
+    while(( quit == 0 ) && ( memcached->state == MCACHE_STATE_RUNNING ) &&
+          ( server_buffer_read_some(memcached->server, buffer) > 0 ))
+    {
+        /* Rest of a value too large to take */
+        if( skip )
+        {
+            n = ( skip < buffer->req_len ) ? skip : buffer->req_len;
+            memmove(buffer->req, &buffer->req[n], buffer->req_len - n);
+            buffer->req_len -= n;
+            skip -= n;
+        }
+        
+        start = now_ns();
+        opcode = MCACHE_LATENCY_OPCODES;
+        
+        if(( taken = text_batch(worker, buffer, start, &opcode, &skip, &quit)) < 0 )
+        {
+            TRACE(ERROR,"failure processing");
             break;
-        case MCACHE_OPCODE_QUIT:
-            /* Close connection */
-            return 2;
-            break;
-        default:
+        }
+        
+        /* No command in a full buffer, line has no end */
+        if(( taken == 0 ) && ( quit == 0 ) && ( buffer->req_len >= buffer->req_size ))
+        {
+            TEXT_REPLY(memcached, buffer, "CLIENT_ERROR line too long\r\n");
+            quit = 1;
+        }
+        
+        left = buffer->req_len - taken;
+        
+        if( buffer->rsp_len > 0 )
+        {
+            n = server_buffer_send(memcached->server, buffer);
             
-            break;
+            latency_record(worker, opcode, now_ns() - start);
+            
+            if( n <= 0 )
+                break;
+        }
+        
+        /* Part of a command waits for the rest */
+        memmove(buffer->req, &buffer->req[taken], left);
+        buffer->req_len = left;
     }
-    return 0;
+    
+    worker->text = 0;
 }
 
 static void *memcached_main_task( void *args )
 {
-    memcached_t *memcached = (memcached_t*)args;
+    memcached_worker_t *worker = (memcached_worker_t*)args;
+    memcached_t *memcached = worker->memcached;
     buffer_t *buffer= NULL;
     memcached_req_t *req = NULL;
     memcached_rsp_t *rsp = NULL;
+    uint64_t start = 0;
+    uint8_t opcode = 0;
+    uint8_t first = 0;
     int len = 0;
     int ret = 0;
     
+    /* Heap items and histograms this thread allocates come from its node */
+    if( memcached->topo )
+        topo_pin(memcached->topo, pthread_self(), worker->node);
+    
+    latency_create(worker);
+    
     while(memcached->state == MCACHE_STATE_RUNNING)
     {
-        /* Get New Available buffer */
-        if(( buffer != NULL ) || (buffer = server_buffer_get(memcached->server)))
+        /* First byte of a new TCP connection tells text from binary */
+        if(( buffer == NULL ) && (buffer = server_buffer_get(memcached->server)) && ( memcached->server->udp == 0 ) &&
+           ( server_buffer_peek(memcached->server, buffer, &first) == 1 ) && ( first != MCACHE_REQ_MAGIC ))
+        {
+            serve_text(worker, buffer);
+            
+            server_buffer_release(memcached->server, buffer);
+            
+            buffer = NULL;
+            
+            continue;
+        }
+        
+        /* Binary connection */
+        if( buffer != NULL )
         {
             /* Read Bufer Header */
             len = server_buffer_read_bytes( memcached->server, buffer, sizeof(memcached_req_t));
@@ -178,6 +1820,9 @@ static void *memcached_main_task( void *args )
             }
             
                 
+            /* Request latency is measured from here until reply is sent */
+            start = now_ns();
+            
             TRACE(DEBUG,"buffer recvd");
             HEXDUMP(DEBUG,"Req buffer", buffer->req, len);
             
@@ -186,6 +1831,9 @@ static void *memcached_main_task( void *args )
             
             /* Deserialize */
             ntoh_req(req);
+            opcode = req->opcode;
+            
+            PROBE4(request__start, buffer->index, req->opcode, req->key_len, req->len);
             
             TRACE(DEBUG, "Rest of Bytes : %d", req->len);
             dump_req(req);
@@ -211,8 +1859,11 @@ static void *memcached_main_task( void *args )
             /* Validate */
             if((validate(req, buffer))==0)
             {   
+                capture_sample(worker, start, req);
+                
                 /* Process request */
-                if(( ret = process(memcached, req, rsp )))
+                ret = process(worker, buffer, req, rsp );
+                if( ret == PROCESS_FAILED )
                 {
                     /* Failure Process */
                     TRACE(ERROR,"failure processing");
@@ -221,8 +1872,10 @@ static void *memcached_main_task( void *args )
                     server_buffer_release(memcached->server, buffer);
                     
                     buffer = NULL;
+                    
+                    continue;
                 }
-                else if( ret == 2 )
+                else if( ret == PROCESS_CLOSE )
                 {
                     /* Close Socket Request */
                     server_buffer_release(memcached->server, buffer);
@@ -231,10 +1884,14 @@ static void *memcached_main_task( void *args )
                     
                     continue;
                 }
-                else
+                else if( ret == PROCESS_REPLY )
                 {
                     /* Process done prepare response */
-                    buffer->rsp_len = sizeof(memcached_rsp_t) + rsp->len;
+                    /* Part of value may follow from file */
+                    buffer->rsp_len = sizeof(memcached_rsp_t) + rsp->len - buffer->file_len;
+                    
+                    dump_rsp(rsp);
+                    hton_rsp(rsp);
                     
                     TRACE(DEBUG,"Response length : %d", buffer->rsp_len);
                 }
@@ -248,11 +1905,14 @@ static void *memcached_main_task( void *args )
             /* If there is any data to send then send */
             if( buffer->rsp_len > 0 )
             {
-                dump_rsp(rsp);
-                hton_rsp(rsp);
-                
                 HEXDUMP(DEBUG,"Rsp buffer", buffer->rsp, buffer->rsp_len); 
-                if((ret = server_buffer_send(memcached->server, buffer)) <= 0 )
+                ret = server_buffer_send(memcached->server, buffer);
+                
+                latency_record(worker, opcode, now_ns() - start);
+                
+                PROBE3(request__done, buffer->index, opcode, ret);
+                
+                if( ret <= 0 )
                 {
                     if( ret < 0 )
                     {
@@ -276,6 +1936,262 @@ static void *memcached_main_task( void *args )
     pthread_exit(NULL);
 }
 
+/*
+ * Sample requests into capture log, must be set before start
+ */
+int memcached_capture(memcached_t *memcached, capture_t *capture)
+{
+    int ret = -1;
+
+    if(memcached && (memcached->state != MCACHE_STATE_RUNNING))
+    {
+        memcached->capture = capture;
+        ret = 0;
+    }
+
+    return ret;
+}
+
+/*
+ * Enable snapshot requests, must be set before start
+ */
+int memcached_snapshot(memcached_t *memcached, snapshot_t *snapshot)
+{
+    int ret = -1;
+
+    if(memcached && (memcached->state != MCACHE_STATE_RUNNING))
+    {
+        memcached->snapshot = snapshot;
+        ret = 0;
+    }
+
+    return ret;
+}
+
+/*
+ * Limit cache memory, megabytes 0 is unlimited
+ * With admission new items must be more popular than what they evict
+ */
+int memcached_mem_limit(memcached_t *memcached, int megabytes, int admission)
+{
+    int ret = -1;
+    
+    if(memcached && (megabytes >= 0) && (memcached->state != MCACHE_STATE_RUNNING))
+    {
+        ret = cachedb_limit(memcached->cache, (uint64_t)megabytes * 1024 * 1024, admission);
+    }
+    
+    return ret;
+}
+
+/*
+ * Pin workers round robin to NUMA nodes, accept and maintenance threads to
+ * the first, and interleave shared memory over the nodes. Must be set
+ * before arena, storage, tiny table and external store
+ */
+int memcached_numa(memcached_t *memcached)
+{
+    int ret = -1;
+    
+    if(memcached && (memcached->state != MCACHE_STATE_RUNNING) && (memcached->topo == NULL))
+    {
+        if(( memcached->topo = topo_create()) && ( cachedb_numa(memcached->cache, memcached->topo) == 0 ))
+        {
+            ret = 0;
+        }
+        else
+        {
+            topo_destroy(memcached->topo);
+            memcached->topo = NULL;
+        }
+    }
+    
+    return ret;
+}
+
+/*
+ * Back item storage and tables with pages of kind ARENA_PAGES_, fault them
+ * in at start with a thread per cpu, lock them if asked. Before storage
+ */
+int memcached_arena(memcached_t *memcached, int pages, int lock)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int ret = -1;
+    
+    if(memcached && (pages >= ARENA_PAGES_DEFAULT) && (pages <= ARENA_PAGES_1G) && (memcached->state != MCACHE_STATE_RUNNING))
+    {
+        ret = cachedb_arena(memcached->cache, pages, ( cpus > 0 ) ? cpus : 1, lock);
+    }
+    
+    return ret;
+}
+
+/*
+ * Keep items in a mapped file so a restart finds them again, path NULL
+ * keeps them in anonymous memory. Needs a memory limit
+ */
+int memcached_storage(memcached_t *memcached, const char *path)
+{
+    int ret = -1;
+    
+    if(memcached && (memcached->state != MCACHE_STATE_RUNNING))
+    {
+        ret = cachedb_storage(memcached->cache, path);
+    }
+    
+    return ret;
+}
+
+/*
+ * Move large values of evicted items to a file of megabytes, needs a
+ * memory limit
+ */
+int memcached_extstore(memcached_t *memcached, const char *path, int megabytes, int min_value)
+{
+    int ret = -1;
+    
+    if(memcached && (megabytes > 0) && (min_value >= 0) && (memcached->state != MCACHE_STATE_RUNNING))
+    {
+        ret = cachedb_extstore(memcached->cache, path, (uint64_t)megabytes * 1024 * 1024, min_value);
+    }
+    
+    return ret;
+}
+
+/*
+ * Compress values of at least min_value bytes, with a dictionary trained
+ * into or read from dict_path unless it is NULL. Before storage is set
+ */
+int memcached_compress(memcached_t *memcached, int min_value, int level, const char *dict_path)
+{
+    compress_t *comp;
+    int ret = -1;
+    
+    if(memcached && (min_value >= 0) && (memcached->state != MCACHE_STATE_RUNNING))
+    {
+        if(( comp = compress_create(min_value, level, dict_path)) &&
+           (( ret = cachedb_compress(memcached->cache, comp)) != 0 ))
+        {
+            compress_destroy(comp);
+        }
+    }
+    
+    return ret;
+}
+
+/*
+ * Keep items of a few bytes in a table of megabytes, on top of the memory
+ * limit
+ */
+int memcached_tiny(memcached_t *memcached, int megabytes)
+{
+    int ret = -1;
+    
+    if(memcached && (megabytes > 0) && (memcached->state != MCACHE_STATE_RUNNING))
+    {
+        ret = cachedb_tiny(memcached->cache, (uint64_t)megabytes * 1024 * 1024);
+    }
+    
+    return ret;
+}
+
+/*
+ * Misses of lease gets take a lease of lease_ms on the key, deleted values
+ * are served stale for stale_ms while it is held
+ */
+int memcached_leases(memcached_t *memcached, int lease_ms, int stale_ms)
+{
+    int ret = -1;
+    
+    if(memcached && (lease_ms > 0) && (stale_ms >= 0) && (memcached->state != MCACHE_STATE_RUNNING))
+    {
+        ret = cachedb_leases(memcached->cache, lease_ms, stale_ms);
+    }
+    
+    return ret;
+}
+
+/*
+ * Keys up to the first delim are a namespace, a flush of it drops them all
+ */
+int memcached_namespaces(memcached_t *memcached, char delim)
+{
+    int ret = -1;
+    
+    if(memcached && (memcached->state != MCACHE_STATE_RUNNING))
+    {
+        ret = cachedb_namespaces(memcached->cache, (uint8_t)delim);
+    }
+    
+    return ret;
+}
+
+/*
+ * Keep keys in order too, to count and delete the keys of a prefix
+ */
+int memcached_index(memcached_t *memcached)
+{
+    int ret = -1;
+    
+    if(memcached && (memcached->state != MCACHE_STATE_RUNNING))
+    {
+        ret = cachedb_index(memcached->cache);
+    }
+    
+    return ret;
+}
+
+/*
+ * Forward requests with a key to backends host:port[,host:port...] by
+ * consistent hashing of the key, instead of serving them from the cache
+ */
+int memcached_proxy(memcached_t *memcached, const char *backends)
+{
+    int ret = -1;
+    
+    if(memcached && backends && (memcached->proxy == NULL) && (memcached->state != MCACHE_STATE_RUNNING))
+    {
+        if((memcached->proxy = proxy_create(backends)))
+            ret = 0;
+    }
+    
+    return ret;
+}
+
+/*
+ * Stream mutations to replicas that connect to port, after key and value
+ * lengths are set
+ */
+int memcached_replicate(memcached_t *memcached, int port)
+{
+    int ret = -1;
+    
+    if(memcached && (memcached->repl == NULL) && (memcached->state != MCACHE_STATE_RUNNING))
+    {
+        if((memcached->repl = repl_primary(memcached->cache, port, memcached->max_key_len + memcached->max_val_len)))
+            ret = 0;
+    }
+    
+    return ret;
+}
+
+/*
+ * Apply the stream of primary at host:port to the cache, once the cache is
+ * set up
+ */
+int memcached_follow(memcached_t *memcached, const char *primary)
+{
+    int ret = -1;
+    
+    if(memcached && primary && (memcached->repl == NULL) && (memcached->state != MCACHE_STATE_RUNNING))
+    {
+        if((memcached->repl = repl_replica(memcached->cache, primary)))
+            ret = 0;
+    }
+    
+    return ret;
+}
+
 /*
  * Set Maximum Key Len and Val Len, This decides the request and response buffer size
  * 
@@ -292,7 +2208,7 @@ int memcached_max_key_val(memcached_t *memcached, int key_len, int val_len)
         if(val_len > 0)
             memcached->max_val_len = val_len;
         
-        ret = server_set_buffer_size(memcached->server, MCACHE_MAX_REQ_SIZE(memcached), MCACHE_MAX_RSP_SIZE(memcached));
+        ret = server_set_buffer_size(memcached->server, MCACHE_MAX_READ_SIZE(memcached), MCACHE_MAX_RSP_SIZE(memcached));
     }
         
     return ret;
@@ -308,21 +2224,34 @@ memcached_t* memcached_init(server_t *server, int thread_count, int hash_size)
             memcached->max_key_len = MCACHE_KEY_LEN_DEFAULT;
             memcached->max_val_len = MCACHE_VAL_LEN_DEFAULT;
         
-            if(server_set_buffer_size(server,MCACHE_MAX_REQ_SIZE(memcached), MCACHE_MAX_RSP_SIZE(memcached)))
+            if(server_set_buffer_size(server,MCACHE_MAX_READ_SIZE(memcached), MCACHE_MAX_RSP_SIZE(memcached)))
             {
                 TRACE(ERROR,"Failed to set buffer size");
             }
-            if((memcached->tid = calloc(sizeof(pthread_t), thread_count )))
+            memcached->latency_epoch = 0;
+            memcached->capture = NULL;
+            memcached->snapshot = NULL;
+            memcached->sendfile = 0;
+            memcached->topo = NULL;
+            memcached->proxy = NULL;
+            memcached->repl = NULL;
+            memcached->workers = NULL;
+            memcached->tid = NULL;
+            
+            if(((memcached->tid = calloc(sizeof(pthread_t), thread_count ))) &&
+               ((memcached->workers = calloc(sizeof(memcached_worker_t), thread_count ))))
             {
                 if(( memcached->cache  = cachedb_create(hash_size)))
                 {
                     memcached->state = MCACHE_STATE_INIT;
                     memcached->tcount = thread_count;
                     memcached->server = server;
+                    memcached->started = time(NULL);
                 }
                 else
                 {
                     TRACE(ERROR,"failed to create hashtable\n");
+                    free(memcached->workers);
                     free(memcached->tid);
                     free(memcached);
                     memcached = NULL;
@@ -331,6 +2260,7 @@ memcached_t* memcached_init(server_t *server, int thread_count, int hash_size)
             else
             {
                 TRACE(ERROR,"failed to allocate memory\n");
+                free(memcached->tid);
                 free(memcached);
                 memcached = NULL;
             }
@@ -362,9 +2292,17 @@ int memcached_start( memcached_t *memcached )
     {
         memcached->state = MCACHE_STATE_RUNNING;
         
+        /* Accept thread inherits the first node from here */
+        if( memcached->topo )
+            topo_pin(memcached->topo, pthread_self(), 0);
+        
         for( i = 0; i < memcached->tcount; i++ )
         {
-            if((ret = pthread_create( &memcached->tid[i], NULL, memcached_main_task, (void*) memcached)))
+            memcached->workers[i].index = i;
+            memcached->workers[i].memcached = memcached;
+            memcached->workers[i].node = memcached->topo ? ( i % memcached->topo->nodes ) : 0;
+            
+            if((ret = pthread_create( &memcached->tid[i], NULL, memcached_main_task, (void*) &memcached->workers[i])))
             {
                 memcached->state = MCACHE_STATE_INIT;
                 TRACE(ERROR,"Failed to create thread");
@@ -429,6 +2367,8 @@ int memcached_shutdown(memcached_t *memcached )
 
 void memcached_destroy(memcached_t *memcached)
 {
+    int i, j;
+    
     if(memcached && (memcached->state != MCACHE_STATE_NULL))
     {
         TRACE(INFO,"Destroy start");
@@ -439,9 +2379,36 @@ void memcached_destroy(memcached_t *memcached)
             free(memcached->tid);
             
         memcached->tid = NULL;
+        
+        if(memcached->workers)
+        {
+            for(i = 0; i < memcached->tcount; i++)
+            {
+                for(j = 0; j < MCACHE_LATENCY_SLOTS; j++)
+                    histogram_destroy(memcached->workers[i].latency[j]);
+                
+                free(memcached->workers[i].text_req);
+                free(memcached->workers[i].text_rsp);
+                proxy_conn_destroy(memcached->workers[i].proxy);
+            }
+            
+            free(memcached->workers);
+        }
+        memcached->workers = NULL;
+        
+        /* Replica applies to cache until its thread is gone */
+        repl_destroy(memcached->repl);
+        memcached->repl = NULL;
+        
         cachedb_destroy(memcached->cache);
         memcached->cache = NULL;
         
+        topo_destroy(memcached->topo);
+        memcached->topo = NULL;
+        
+        proxy_destroy(memcached->proxy);
+        memcached->proxy = NULL;
+        
         TRACE(INFO,"Destroy Server");
         server_destroy(memcached->server);
         
@@ -0,0 +1,416 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "proxy.h"
+#include "cache_data.h"
+
+#define MODULE "Proxy"
+#include "trace.h"
+
+/*
+ * Ring positions are 32 bits of the key hash of the cache. Its high bits
+ * hardly change with the last bytes of a key, so they are mixed first
+ */
+static uint32_t ring_hash(const uint8_t *key, uint32_t len)
+{
+    uint64_t h = cache_data_key_hash(key, len);
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+static int point_compare(const void *a, const void *b)
+{
+    const proxy_point_t *p1 = a, *p2 = b;
+
+    return ( p1->hash > p2->hash ) - ( p1->hash < p2->hash );
+}
+
+/*
+ * Backend of host:port into proxy
+ */
+static int add_backend(proxy_t *proxy, char *spec)
+{
+    struct addrinfo hints, *res = NULL;
+    char *port;
+    int ret = -1;
+
+    if(( proxy->count < PROXY_BACKENDS_MAX ) && ( port = strrchr(spec, ':')) && ( strlen(spec) < sizeof(proxy->name[0])))
+    {
+        snprintf(proxy->name[proxy->count], sizeof(proxy->name[0]), "%s", spec);
+        *port++ = '\0';
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+
+        if( getaddrinfo(spec, port, &hints, &res) == 0 )
+        {
+            memcpy(&proxy->addr[proxy->count], res->ai_addr, sizeof(proxy->addr[0]));
+            freeaddrinfo(res);
+            TRACE(INFO,"Backend %d : %s", proxy->count, proxy->name[proxy->count]);
+            proxy->count++;
+            ret = 0;
+        }
+        else
+        {
+            TRACE(ERROR,"Failed to resolve backend %s", proxy->name[proxy->count]);
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid backend %s", spec);
+    }
+
+    return ret;
+}
+
+/*
+ * Pool of backends host:port[,host:port...]
+ */
+proxy_t* proxy_create(const char *spec)
+{
+    proxy_t *proxy = NULL;
+    char point[96];
+    char *list = NULL;
+    char *tok, *save;
+    int i, j, len;
+
+    if( spec && ( proxy = calloc(1, sizeof(proxy_t))) && ( list = strdup(spec)))
+    {
+        for(tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+        {
+            if( add_backend(proxy, tok))
+                break;
+        }
+
+        if(( tok == NULL ) && proxy->count &&
+           ( proxy->ring = calloc(proxy->count * PROXY_POINTS, sizeof(proxy_point_t))))
+        {
+            /* Points of a backend are hashes of its name and a number */
+            for(i = 0; i < proxy->count; i++)
+            {
+                for(j = 0; j < PROXY_POINTS; j++)
+                {
+                    len = snprintf(point, sizeof(point), "%s-%d", proxy->name[i], j);
+                    proxy->ring[proxy->points].hash = ring_hash((uint8_t*)point, len);
+                    proxy->ring[proxy->points++].backend = i;
+                }
+            }
+
+            qsort(proxy->ring, proxy->points, sizeof(proxy_point_t), point_compare);
+        }
+        else
+        {
+            TRACE(ERROR,"Invalid backends");
+            proxy_destroy(proxy);
+            proxy = NULL;
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+        free(proxy);
+        proxy = NULL;
+    }
+
+    free(list);
+
+    return proxy;
+}
+
+void proxy_destroy(proxy_t *proxy)
+{
+    if( proxy )
+    {
+        free(proxy->ring);
+        free(proxy);
+    }
+}
+
+/*
+ * Backend of a key, first point of ring at or after its hash
+ */
+int proxy_backend(proxy_t *proxy, const uint8_t *key, uint32_t key_len)
+{
+    uint32_t h;
+    int lo, hi, mid;
+
+    if( proxy == NULL || key == NULL )
+    {
+        TRACE(ERROR,"Invalid args");
+        return -1;
+    }
+
+    h = ring_hash(key, key_len);
+
+    for(lo = 0, hi = proxy->points; lo < hi; )
+    {
+        mid = ( lo + hi ) / 2;
+        if( proxy->ring[mid].hash < h )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    /* Past the last point wraps to the first */
+    return proxy->ring[( lo == proxy->points ) ? 0 : lo].backend;
+}
+
+proxy_conn_t* proxy_conn_create(proxy_t *proxy)
+{
+    proxy_conn_t *conn = NULL;
+    int i;
+
+    if( proxy && ( conn = calloc(1, sizeof(proxy_conn_t))))
+    {
+        conn->proxy = proxy;
+        for(i = 0; i < PROXY_BACKENDS_MAX; i++)
+            conn->fd[i] = -1;
+    }
+    else
+    {
+        TRACE(ERROR,"Memory allocation failure");
+    }
+
+    return conn;
+}
+
+void proxy_conn_destroy(proxy_conn_t *conn)
+{
+    int i;
+
+    if( conn )
+    {
+        for(i = 0; i < PROXY_BACKENDS_MAX; i++)
+        {
+            if( conn->fd[i] >= 0 )
+                close(conn->fd[i]);
+            free(conn->queue[i]);
+        }
+        free(conn);
+    }
+}
+
+/*
+ * Connection to a backend is gone, replies owed on it fail as they are taken
+ */
+static void drop(proxy_conn_t *conn, int backend)
+{
+    TRACE(WARN,"Backend %s : %s", conn->proxy->name[backend], errno ? strerror(errno) : "closed");
+
+    close(conn->fd[backend]);
+    conn->fd[backend] = -1;
+    conn->queued[backend] = 0;
+    __atomic_add_fetch(&conn->proxy->errors, 1, __ATOMIC_RELAXED);
+}
+
+static int open_backend(proxy_conn_t *conn, int backend)
+{
+    struct timeval tv = { PROXY_TIMEOUT_MS / 1000, ( PROXY_TIMEOUT_MS % 1000 ) * 1000 };
+    int one = 1;
+    int fd;
+
+    if(( fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 )
+    {
+        TRACE(ERROR,"Failed to create socket : %s", strerror(errno));
+        return -1;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    if( connect(fd, (struct sockaddr*)&conn->proxy->addr[backend], sizeof(conn->proxy->addr[backend])))
+    {
+        TRACE(WARN,"Failed to connect to %s : %s", conn->proxy->name[backend], strerror(errno));
+        __atomic_add_fetch(&conn->proxy->errors, 1, __ATOMIC_RELAXED);
+        close(fd);
+        return -1;
+    }
+
+    conn->fd[backend] = fd;
+
+    return 0;
+}
+
+static int send_all(proxy_conn_t *conn, int backend, const uint8_t *data, uint32_t len)
+{
+    ssize_t n;
+    uint32_t sent = 0;
+
+    while( sent < len )
+    {
+        if(( n = send(conn->fd[backend], &data[sent], len - sent, MSG_NOSIGNAL)) > 0 )
+            sent += n;
+        else if(( n < 0 ) && ( errno == EINTR ))
+            continue;
+        else
+        {
+            drop(conn, backend);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int flush_backend(proxy_conn_t *conn, int backend)
+{
+    uint32_t len = conn->queued[backend];
+
+    conn->queued[backend] = 0;
+
+    return ( len && ( conn->fd[backend] >= 0 )) ? send_all(conn, backend, conn->queue[backend], len) : 0;
+}
+
+/*
+ * Queue request of head and body to a backend, a reply is owed for it even
+ * if it fails. A connection is opened when there is none and no reply is
+ * owed on the one that failed
+ */
+int proxy_queue(proxy_conn_t *conn, int backend, const void *head, uint32_t head_len, const void *body, uint32_t body_len)
+{
+    int ret = -1;
+
+    if( conn && ( backend >= 0 ) && ( backend < conn->proxy->count ) && head )
+    {
+        conn->pending[backend]++;
+        __atomic_add_fetch(&conn->proxy->forwarded, 1, __ATOMIC_RELAXED);
+
+        if(( conn->fd[backend] < 0 ) && (( conn->pending[backend] > 1 ) || open_backend(conn, backend)))
+            return -1;
+
+        if(( conn->queue[backend] == NULL ) && (( conn->queue[backend] = malloc(PROXY_QUEUE_SIZE)) == NULL ))
+        {
+            TRACE(ERROR,"Memory allocation failure");
+            return -1;
+        }
+
+        /* Full queue goes first, a request larger than the queue goes alone */
+        if(( conn->queued[backend] + head_len + body_len > PROXY_QUEUE_SIZE ) && flush_backend(conn, backend))
+            return -1;
+
+        if( head_len + body_len > PROXY_QUEUE_SIZE )
+        {
+            ret = ( send_all(conn, backend, head, head_len) || send_all(conn, backend, body, body_len)) ? -1 : 0;
+        }
+        else
+        {
+            memcpy(&conn->queue[backend][conn->queued[backend]], head, head_len);
+            if( body_len )
+                memcpy(&conn->queue[backend][conn->queued[backend] + head_len], body, body_len);
+            conn->queued[backend] += head_len + body_len;
+            ret = 0;
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    return ret;
+}
+
+/*
+ * Write queued requests of all backends
+ */
+int proxy_flush(proxy_conn_t *conn)
+{
+    int i;
+    int ret = 0;
+
+    for(i = 0; conn && ( i < conn->proxy->count ); i++)
+    {
+        if( flush_backend(conn, i))
+            ret = -1;
+    }
+
+    return ret;
+}
+
+static int recv_all(proxy_conn_t *conn, int backend, uint8_t *data, uint32_t len)
+{
+    ssize_t n;
+    uint32_t got = 0;
+
+    errno = 0;
+    while( got < len )
+    {
+        if(( n = recv(conn->fd[backend], &data[got], len - got, 0)) > 0 )
+            got += n;
+        else if(( n < 0 ) && ( errno == EINTR ))
+            continue;
+        else
+        {
+            drop(conn, backend);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Next reply of a backend into frame of size bytes, a reply that does not
+ * fit is read and dropped. frame NULL drops it anyway. Requests queued to
+ * the backend are written first
+ */
+int proxy_recv(proxy_conn_t *conn, int backend, uint8_t *frame, uint32_t size)
+{
+    uint8_t head[PROXY_HEADER_SIZE];
+    uint8_t skip[1024];
+    uint32_t body, len, n;
+    int ret = -1;
+
+    if( conn && ( backend >= 0 ) && ( backend < conn->proxy->count ) && conn->pending[backend] )
+    {
+        conn->pending[backend]--;
+
+        if(( flush_backend(conn, backend) == 0 ) && ( conn->fd[backend] >= 0 ) &&
+           ( recv_all(conn, backend, head, sizeof(head)) == 0 ))
+        {
+            memcpy(&body, &head[8], sizeof(body));
+            body = ntohl(body);
+
+            if( frame && ( size >= sizeof(head)) && ( body <= size - sizeof(head)))
+            {
+                memcpy(frame, head, sizeof(head));
+                if(( body == 0 ) || ( recv_all(conn, backend, &frame[sizeof(head)], body) == 0 ))
+                    ret = sizeof(head) + body;
+            }
+            else
+            {
+                for(len = 0; len < body; len += n)
+                {
+                    n = (( body - len ) < sizeof(skip)) ? ( body - len ) : sizeof(skip);
+                    if( recv_all(conn, backend, skip, n))
+                        break;
+                }
+                ret = ( len == body ) ? -2 : -1;
+            }
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    /* >0  : Length of reply
+     * -1  : Failure, backend is down
+     * -2  : Reply is larger than frame, dropped
+     */
+    return ret;
+}
@@ -0,0 +1,555 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+#include "repl.h"
+
+#define MODULE "Repl"
+#include "trace.h"
+
+static void set_timeout(int fd, int ms)
+{
+    struct timeval tv = { ms / 1000, ( ms % 1000 ) * 1000 };
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static int send_all(int fd, const uint8_t *data, uint32_t len)
+{
+    ssize_t n;
+    uint32_t sent = 0;
+
+    while( sent < len )
+    {
+        if(( n = send(fd, &data[sent], len - sent, MSG_NOSIGNAL)) > 0 )
+            sent += n;
+        else if(( n < 0 ) && ( errno == EINTR ))
+            continue;
+        else
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Timeouts only give stop a look, a closed connection or stop fail
+ */
+static int recv_all(repl_t *repl, int fd, uint8_t *data, uint32_t len)
+{
+    ssize_t n;
+    uint32_t got = 0;
+
+    while( got < len )
+    {
+        if(( n = recv(fd, &data[got], len - got, 0)) > 0 )
+            got += n;
+        else if(( n < 0 ) && (( errno == EINTR ) || ( errno == EAGAIN ) || ( errno == EWOULDBLOCK )) &&
+                ( __atomic_load_n(&repl->stop, __ATOMIC_RELAXED) == 0 ))
+            continue;
+        else
+            return -1;
+    }
+
+    return 0;
+}
+
+static repl_t* repl_alloc(cachedb_t *cache)
+{
+    repl_t *repl;
+    int i;
+
+    if(( repl = calloc(1, sizeof(repl_t))))
+    {
+        repl->cache = cache;
+        repl->sock = -1;
+        pthread_mutex_init(&repl->lock, NULL);
+        pthread_cond_init(&repl->ready, NULL);
+        pthread_cond_init(&repl->taken, NULL);
+        for(i = 0; i < REPL_LOCKS; i++)
+            pthread_mutex_init(&repl->key_lock[i], NULL);
+    }
+
+    return repl;
+}
+
+/*
+ * New replicas on the listener, they start with next batch
+ */
+static void accept_replicas(repl_t *repl)
+{
+    int fd;
+
+    while(( fd = accept(repl->sock, NULL, NULL)) >= 0 )
+    {
+        if( repl->replicas < REPL_REPLICAS_MAX )
+        {
+            set_timeout(fd, REPL_TIMEOUT_MS);
+            repl->replica[repl->replicas] = fd;
+            __atomic_store_n(&repl->replicas, repl->replicas + 1, __ATOMIC_RELAXED);
+            TRACE(INFO,"Replica connected, %d replicas", repl->replicas);
+        }
+        else
+        {
+            TRACE(WARN,"Replica refused, %d replicas", repl->replicas);
+            close(fd);
+        }
+    }
+}
+
+/*
+ * Batch of len log bytes to every replica, a replica that fails is dropped
+ */
+static void send_batch(repl_t *repl, const uint8_t *log, uint32_t len)
+{
+    repl_frame_t frame;
+    uLongf comp_len = repl->comp_size;
+    int i;
+
+    if( compress2(repl->comp, &comp_len, log, len, 1) != Z_OK )
+    {
+        TRACE(ERROR,"Failed to deflate batch of %u bytes", len);
+        return;
+    }
+
+    frame.magic = htonl(REPL_MAGIC);
+    frame.seq = htonl(++repl->seq);
+    frame.raw_len = htonl(len);
+    frame.comp_len = htonl(comp_len);
+
+    for(i = 0; i < repl->replicas; )
+    {
+        if( send_all(repl->replica[i], (uint8_t*)&frame, sizeof(frame)) ||
+            send_all(repl->replica[i], repl->comp, comp_len))
+        {
+            TRACE(WARN,"Replica dropped : %s", strerror(errno));
+            close(repl->replica[i]);
+            repl->replica[i] = repl->replica[repl->replicas - 1];
+            __atomic_store_n(&repl->replicas, repl->replicas - 1, __ATOMIC_RELAXED);
+            repl->dropped++;
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    repl->batches++;
+    repl->bytes_sent += sizeof(frame) + comp_len;
+}
+
+static void* sender(void *arg)
+{
+    repl_t *repl = arg;
+    struct timespec ts;
+    uint8_t *log;
+    uint32_t len;
+    int stop = 0;
+
+    while( stop == 0 )
+    {
+        pthread_mutex_lock(&repl->lock);
+
+        if(( repl->used < REPL_BATCH_SIZE ) && ( repl->stop == 0 ))
+        {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += REPL_FLUSH_MS * 1000000L;
+            if( ts.tv_nsec >= 1000000000L )
+            {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&repl->ready, &repl->lock, &ts);
+        }
+
+        /* Workers go on in the other log while this one is sent */
+        log = repl->log[repl->active];
+        len = repl->used;
+        repl->active ^= 1;
+        repl->used = 0;
+        stop = repl->stop;
+        pthread_cond_broadcast(&repl->taken);
+
+        pthread_mutex_unlock(&repl->lock);
+
+        accept_replicas(repl);
+
+        if( len && repl->replicas )
+            send_batch(repl, log, len);
+    }
+
+    return NULL;
+}
+
+/*
+ * Primary streaming to replicas that connect to port, records are at most
+ * max_record bytes of key and value
+ */
+repl_t* repl_primary(cachedb_t *cache, int port, uint32_t max_record)
+{
+    struct sockaddr_in addr;
+    repl_t *repl = NULL;
+    int one = 1;
+    int ok = 0;
+
+    if( cache && ( port > 0 ) && ( port < 65536 ) && ( repl = repl_alloc(cache)))
+    {
+        repl->primary = 1;
+        repl->log_size = REPL_BATCH_SIZE + sizeof(repl_record_t) + max_record;
+        repl->comp_size = compressBound(repl->log_size);
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+
+        if((( repl->log[0] = malloc(repl->log_size)) == NULL ) || (( repl->log[1] = malloc(repl->log_size)) == NULL ) ||
+           (( repl->comp = malloc(repl->comp_size)) == NULL ))
+        {
+            TRACE(ERROR,"Memory allocation failure");
+        }
+        else if((( repl->sock = socket(AF_INET, SOCK_STREAM, 0)) < 0 ) ||
+                setsockopt(repl->sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+                bind(repl->sock, (struct sockaddr*)&addr, sizeof(addr)) || listen(repl->sock, REPL_REPLICAS_MAX) ||
+                fcntl(repl->sock, F_SETFL, O_NONBLOCK))
+        {
+            TRACE(ERROR,"Failed to listen on replication port %d : %s", port, strerror(errno));
+        }
+        else if( pthread_create(&repl->tid, NULL, sender, repl))
+        {
+            TRACE(ERROR,"Failed to create sender thread");
+        }
+        else
+        {
+            TRACE(INFO,"Replicas connect to port %d", port);
+            ok = 1;
+        }
+
+        if( ok == 0 )
+        {
+            repl_destroy(repl);
+            repl = NULL;
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    return repl;
+}
+
+/*
+ * Records of a batch into the cache of replica, a short record ends it
+ */
+static void apply(repl_t *repl, uint8_t *raw, uint32_t len)
+{
+    repl_record_t *rec;
+    uint32_t off = 0;
+    uint32_t key_len, val_len, delay;
+    uint8_t extra[2 * sizeof(uint32_t)] = { 0 };
+
+    while( off + sizeof(repl_record_t) <= len )
+    {
+        rec = (repl_record_t*)&raw[off];
+        key_len = ntohs(rec->key_len);
+        val_len = ntohl(rec->val_len);
+
+        if((( key_len == 0 ) && ( rec->op != REPL_OP_FLUSH )) || ( val_len > len ) || ( off + sizeof(repl_record_t) + key_len + val_len > len ))
+        {
+            TRACE(ERROR,"Invalid record at %u of batch %u", off, repl->seq);
+            break;
+        }
+
+        if( rec->op == REPL_OP_SET )
+        {
+            memcpy(extra, &rec->flag, sizeof(rec->flag));
+            cachedb_set_extra(repl->cache, rec->data, &rec->data[key_len], key_len, val_len, extra, sizeof(extra), NULL);
+        }
+        else if( rec->op == REPL_OP_DELETE )
+            cachedb_delete(repl->cache, rec->data, key_len);
+        else if(( rec->op == REPL_OP_FLUSH ) && key_len )
+            cachedb_flush_ns(repl->cache, rec->data, key_len);
+        else if(( rec->op == REPL_OP_FLUSH ) && ( val_len == sizeof(delay)))
+        {
+            memcpy(&delay, &rec->data[key_len], sizeof(delay));
+            cachedb_flush(repl->cache, ntohl(delay));
+        }
+
+        repl->records++;
+        off += sizeof(repl_record_t) + key_len + val_len;
+    }
+}
+
+/*
+ * Batches of one connection to the primary, until it fails or stop. A
+ * batch out of sequence ends it, one before it was missed
+ */
+static void follow(repl_t *repl, int fd)
+{
+    repl_frame_t frame;
+    uint8_t *raw = NULL, *comp = NULL;
+    uint32_t raw_size = 0, comp_size = 0;
+    uint32_t raw_len, comp_len, seq;
+    uLongf out_len;
+    uint8_t *p;
+    int first = 1;
+
+    while( recv_all(repl, fd, (uint8_t*)&frame, sizeof(frame)) == 0 )
+    {
+        raw_len = ntohl(frame.raw_len);
+        comp_len = ntohl(frame.comp_len);
+
+        seq = ntohl(frame.seq);
+
+        if(( ntohl(frame.magic) != REPL_MAGIC ) || ( raw_len > REPL_FRAME_MAX ) || ( comp_len > compressBound(REPL_FRAME_MAX)))
+        {
+            TRACE(ERROR,"Invalid batch from %s", repl->name);
+            break;
+        }
+
+        if(( first == 0 ) && ( seq != repl->seq + 1 ))
+        {
+            TRACE(WARN,"Batch %u from %s after %u, batches missed", seq, repl->name, repl->seq);
+            break;
+        }
+
+        if( raw_len > raw_size )
+        {
+            if(( p = realloc(raw, raw_len)) == NULL )
+                break;
+            raw = p;
+            raw_size = raw_len;
+        }
+
+        if( comp_len > comp_size )
+        {
+            if(( p = realloc(comp, comp_len)) == NULL )
+                break;
+            comp = p;
+            comp_size = comp_len;
+        }
+
+        if( recv_all(repl, fd, comp, comp_len))
+            break;
+
+        out_len = raw_len;
+        if(( uncompress(raw, &out_len, comp, comp_len) != Z_OK ) || ( out_len != raw_len ))
+        {
+            TRACE(ERROR,"Failed to inflate batch %u from %s", seq, repl->name);
+            break;
+        }
+
+        first = 0;
+        repl->seq = seq;
+        repl->batches++;
+        repl->bytes += raw_len;
+        repl->bytes_sent += sizeof(frame) + comp_len;
+        apply(repl, raw, raw_len);
+    }
+
+    free(raw);
+    free(comp);
+}
+
+/*
+ * Connects to primary until stop. Items of an earlier connection may have
+ * been deleted or changed on the primary since, they are flushed
+ */
+static void* follower(void *arg)
+{
+    repl_t *repl = arg;
+    int followed = 0;
+    int ms;
+
+    while( __atomic_load_n(&repl->stop, __ATOMIC_RELAXED) == 0 )
+    {
+        if(( repl->sock = socket(AF_INET, SOCK_STREAM, 0)) >= 0 )
+        {
+            /* Short timeouts, stop is looked at between reads */
+            set_timeout(repl->sock, REPL_FLUSH_MS * 20);
+
+            if( connect(repl->sock, (struct sockaddr*)&repl->addr, sizeof(repl->addr)) == 0 )
+            {
+                if( followed )
+                {
+                    cachedb_flush(repl->cache, 0);
+                    repl->flushes++;
+                    TRACE(WARN,"Flushed, following %s again", repl->name);
+                }
+                else
+                {
+                    TRACE(INFO,"Following %s", repl->name);
+                }
+
+                followed = 1;
+                follow(repl, repl->sock);
+
+                if( __atomic_load_n(&repl->stop, __ATOMIC_RELAXED) == 0 )
+                {
+                    TRACE(WARN,"Lost %s", repl->name);
+                    repl->dropped++;
+                }
+            }
+
+            close(repl->sock);
+            repl->sock = -1;
+        }
+
+        for(ms = 0; ( ms < REPL_RETRY_MS ) && ( __atomic_load_n(&repl->stop, __ATOMIC_RELAXED) == 0 ); ms += 10)
+            usleep(10 * 1000);
+    }
+
+    return NULL;
+}
+
+/*
+ * Replica following primary at host:port
+ */
+repl_t* repl_replica(cachedb_t *cache, const char *primary)
+{
+    struct addrinfo hints, *res = NULL;
+    char host[sizeof(((repl_t*)0)->name)];
+    repl_t *repl = NULL;
+    char *port;
+    int ok = 0;
+
+    if( cache && primary && ( strlen(primary) < sizeof(host)) && ( repl = repl_alloc(cache)))
+    {
+        snprintf(repl->name, sizeof(repl->name), "%s", primary);
+        snprintf(host, sizeof(host), "%s", primary);
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+
+        if((( port = strrchr(host, ':')) == NULL ) || (( *port++ = '\0' ), getaddrinfo(host, port, &hints, &res)))
+        {
+            TRACE(ERROR,"Invalid primary %s", primary);
+        }
+        else
+        {
+            memcpy(&repl->addr, res->ai_addr, sizeof(repl->addr));
+            freeaddrinfo(res);
+
+            if( pthread_create(&repl->tid, NULL, follower, repl) == 0 )
+                ok = 1;
+            else
+                TRACE(ERROR,"Failed to create follower thread");
+        }
+
+        if( ok == 0 )
+        {
+            repl_destroy(repl);
+            repl = NULL;
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    return repl;
+}
+
+/*
+ * Primary with replicas to log for
+ */
+int repl_active(repl_t *repl)
+{
+    return repl && repl->primary && __atomic_load_n(&repl->replicas, __ATOMIC_RELAXED);
+}
+
+/*
+ * Mutation applied on primary, goes to replicas with next batch. Callers
+ * hold REPL_LOCK of the key, so records of a key are in the order applied
+ */
+void repl_log(repl_t *repl, uint8_t op, const uint8_t *key, uint32_t key_len, const uint8_t *val, uint32_t val_len,
+              uint32_t flag)
+{
+    repl_record_t rec;
+    uint32_t len = sizeof(rec) + key_len + val_len;
+    uint8_t *p;
+
+    if(( repl == NULL ) || ( repl->primary == 0 ) || ( key == NULL ) || ( len > repl->log_size - REPL_BATCH_SIZE ))
+    {
+        TRACE(ERROR,"Invalid args");
+        return;
+    }
+
+    rec.op = op;
+    rec.reserved = 0;
+    rec.key_len = htons(key_len);
+    rec.val_len = htonl(val_len);
+    rec.flag = flag;
+
+    pthread_mutex_lock(&repl->lock);
+
+    /* Full log waits for sender to take it */
+    while(( repl->used >= REPL_BATCH_SIZE ) && ( repl->stop == 0 ))
+    {
+        pthread_cond_signal(&repl->ready);
+        pthread_cond_wait(&repl->taken, &repl->lock);
+    }
+
+    if( repl->used < REPL_BATCH_SIZE )
+    {
+        p = &repl->log[repl->active][repl->used];
+        memcpy(p, &rec, sizeof(rec));
+        memcpy(&p[sizeof(rec)], key, key_len);
+        if( val_len )
+            memcpy(&p[sizeof(rec) + key_len], val, val_len);
+        repl->used += len;
+        repl->records++;
+        repl->bytes += len;
+
+        if( repl->used >= REPL_BATCH_SIZE )
+            pthread_cond_signal(&repl->ready);
+    }
+
+    pthread_mutex_unlock(&repl->lock);
+}
+
+void repl_destroy(repl_t *repl)
+{
+    int i;
+
+    if( repl )
+    {
+        /* Sender writes what is logged before it goes */
+        pthread_mutex_lock(&repl->lock);
+        __atomic_store_n(&repl->stop, 1, __ATOMIC_RELAXED);
+        pthread_cond_broadcast(&repl->ready);
+        pthread_cond_broadcast(&repl->taken);
+        pthread_mutex_unlock(&repl->lock);
+
+        if( repl->tid )
+            pthread_join(repl->tid, NULL);
+
+        for(i = 0; i < repl->replicas; i++)
+            close(repl->replica[i]);
+
+        if( repl->sock >= 0 )
+            close(repl->sock);
+
+        for(i = 0; i < REPL_LOCKS; i++)
+            pthread_mutex_destroy(&repl->key_lock[i]);
+        pthread_cond_destroy(&repl->ready);
+        pthread_cond_destroy(&repl->taken);
+        pthread_mutex_destroy(&repl->lock);
+
+        free(repl->log[0]);
+        free(repl->log[1]);
+        free(repl->comp);
+        free(repl);
+    }
+}
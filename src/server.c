@@ -2,12 +2,15 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
+#include <sys/sendfile.h>
 #include <malloc.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <pthread.h>
 #include "server.h"
+#include "probes.h"
 
 #define MODULE "Server"
 #include "trace.h"
@@ -55,7 +58,7 @@ static buffer_t* get_buffer_wait(server_t *server, int state)
     buffer_t *buffer = NULL;
     pthread_mutex_lock(&server->lock);
     index = get_buffer(server, state);
-    if(index == -1)
+    if(( index == -1 ) && ( server->state == SERVER_STATE_RUNNING ))
     {
         if( state == BUFFER_STATE_FREE)
             pthread_cond_wait(&server->freed, &server->lock);
@@ -309,6 +312,7 @@ server_t* server_init(short port, uint32_t  max_conn, int udp)
 
             for(i=0;i<max_conn;i++)
             {
+                memset(&server->buffers[i], 0, sizeof(buffer_t));
                 server->buffers[i].index = i;
                 server->buffers[i].state = BUFFER_STATE_FREE;
             }
@@ -384,12 +388,23 @@ int server_buffer_read_bytes(server_t *server, buffer_t *buffer, uint32_t size)
             
             TRACE(DEBUG,"Read %d bytes", size);
             
+            if( offset + size > buffer->req_size )
+            {
+                TRACE(ERROR,"Request too large : %u", offset + size);
+                
+                buffer->closed = 1;
+                
+                return -1;
+            }
+            
             while(( len < size ) && (server->state == SERVER_STATE_RUNNING))
             {
-                if((n = recv(buffer->sock, &buffer->req[offset], size, 0)) > 0)
+                if((n = recv(buffer->sock, &buffer->req[offset + len], size - len, 0)) > 0)
                     len += n;
-                else if((errno == EAGAIN) || (errno == EWOULDBLOCK))
-                    n = 0;
+                else if( n == 0 )
+                    break; /* Closed by remote */
+                else if((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+                    continue; /* Receive timeout, check server state */
                 else
                     break; /* Error */
             }
@@ -426,12 +441,146 @@ int server_buffer_read_bytes(server_t *server, buffer_t *buffer, uint32_t size)
                 len = size;
         }
         
-        TRACE(DEBUG, "Total Recvd : %d bytes, %d", len);
+        TRACE(DEBUG, "Total Recvd : %d bytes, %d", len, buffer->req_len);
     }
     
     return len;
 }
 
+/*
+ * Read what has arrived, at least a byte, after req_len bytes already read
+ * TCP only, returns bytes read, 0 when closed by remote
+ */
+int server_buffer_read_some(server_t *server, buffer_t *buffer)
+{
+    int n = -1;
+
+    if( server && buffer && ( server->udp == 0 ))
+    {
+        if( buffer->req_len >= buffer->req_size )
+        {
+            TRACE(ERROR,"Request too large : %d", buffer->req_len);
+            buffer->closed = 1;
+            return -1;
+        }
+
+        while( server->state == SERVER_STATE_RUNNING )
+        {
+            if((n = recv(buffer->sock, &buffer->req[buffer->req_len], buffer->req_size - buffer->req_len, 0)) >= 0)
+                break;
+            else if((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+                break; /* Error */
+        }
+
+        if( server->state != SERVER_STATE_RUNNING )
+            n = -1;
+
+        if( n > 0 )
+            buffer->req_len += n;
+        else
+            buffer->closed = 1;
+
+        TRACE(DEBUG, "Recvd : %d bytes, %d", n, buffer->req_len);
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    return n;
+}
+
+/*
+ * First byte of what has arrived into byte, it is read again later
+ * TCP only, returns 1, 0 when closed by remote
+ */
+int server_buffer_peek(server_t *server, buffer_t *buffer, uint8_t *byte)
+{
+    int n = -1;
+
+    if( server && buffer && byte && ( server->udp == 0 ))
+    {
+        while( server->state == SERVER_STATE_RUNNING )
+        {
+            if((n = recv(buffer->sock, byte, 1, MSG_PEEK)) >= 0)
+                break;
+            else if((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+                break; /* Error */
+        }
+
+        if( server->state != SERVER_STATE_RUNNING )
+            n = -1;
+
+        if( n <= 0 )
+            buffer->closed = 1;
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    return n;
+}
+
+/*
+ * Drop file part of reply, owner is told it is no longer used
+ */
+static void file_detach(buffer_t *buffer)
+{
+    if( buffer->file_len )
+    {
+        if( buffer->file_done )
+            buffer->file_done(buffer->file_arg, buffer->file_tag);
+        
+        buffer->file_len = 0;
+        buffer->file_done = NULL;
+        buffer->file_arg = NULL;
+    }
+}
+
+/*
+ * Append file part to UDP reply, a datagram is sent in one piece
+ */
+static int file_copy(server_t *server, buffer_t *buffer)
+{
+    uint32_t len = 0;
+    ssize_t n;
+    
+    if( server_buffer_reserve(server, buffer, buffer->rsp_len + buffer->file_len) )
+        return -1;
+    
+    while( len < buffer->file_len )
+    {
+        if(( n = pread(buffer->file_fd, &buffer->rsp[buffer->rsp_len + len], buffer->file_len - len, buffer->file_off + len)) <= 0 )
+            return -1;
+        len += n;
+    }
+    
+    buffer->rsp_len += len;
+    
+    return 0;
+}
+
+/*
+ * TCP send of file part straight from page cache
+ */
+static int file_send(server_t *server, buffer_t *buffer)
+{
+    off_t off = buffer->file_off;
+    uint32_t len = 0;
+    ssize_t n;
+    
+    while(( len < buffer->file_len ) && ( server->state == SERVER_STATE_RUNNING ))
+    {
+        if(( n = sendfile(buffer->sock, buffer->file_fd, &off, buffer->file_len - len)) > 0 )
+            len += n;
+        else
+            break;
+    }
+    
+    return ( len == buffer->file_len ) ? 0 : -1;
+}
+
 /*
  * Connection is closed release the buffer in queue 
  * 
@@ -442,6 +591,7 @@ void server_buffer_release(server_t *server, buffer_t* buffer)
     {
         TRACE(DEBUG,"Release Buffer : %d", buffer->index);
         
+        file_detach(buffer);
         buffer->req_len = 0;
         
         close(buffer->sock);
@@ -471,6 +621,7 @@ buffer_t* server_buffer_get(server_t *server)
             {
                 /* Read Data explicityly */
                 buffer->req_len = 0;
+                buffer->closed = 0;
                 
             }
             else
@@ -497,6 +648,8 @@ int server_buffer_send(server_t *server, buffer_t* buffer)
     int len, n;
     if( server && buffer )
     {
+        PROBE2(send__start, buffer->index, buffer->rsp_len);
+        
         if(server->state == SERVER_STATE_RUNNING)
         {
             if( buffer->rsp && buffer->rsp_len > 0)
@@ -505,7 +658,13 @@ int server_buffer_send(server_t *server, buffer_t* buffer)
                 {
                     /* UDP Send Data */
                     slen = sizeof(buffer->addr);
-                    if(( sendto(server->sock, buffer->rsp, buffer->rsp_len, 
+                    if( buffer->file_len && file_copy(server, buffer) )
+                    {
+                        TRACE(ERROR,"Failed to read reply data");
+                        
+                        len = -1;
+                    }
+                    else if(( sendto(server->sock, buffer->rsp, buffer->rsp_len, 
                          0, (struct sockaddr *)&buffer->addr, slen)) < 0 )
                     {
                         TRACE(ERROR,"Failed sendto : %s", strerror(errno));
@@ -524,12 +683,27 @@ int server_buffer_send(server_t *server, buffer_t* buffer)
                    
                    while(( len < buffer->rsp_len ) && ( server->state == SERVER_STATE_RUNNING ))
                    {
-                       if(( n = send(buffer->sock, &buffer->rsp[len], buffer->rsp_len, 0)) > 0 )
+                       /* Header and file part leave in same segments */
+                       if(( n = send(buffer->sock, &buffer->rsp[len], buffer->rsp_len - len,
+                                     MSG_NOSIGNAL | ( buffer->file_len ? MSG_MORE : 0 ))) > 0 )
                         len += n;
                        else
                            break;
                    }
                    
+                   if(( len == buffer->rsp_len ) && buffer->file_len)
+                   {
+                       if( file_send(server, buffer) )
+                       {
+                           TRACE(ERROR,"Failed to send reply data : %s", strerror(errno));
+                           len = -1;
+                       }
+                       else
+                       {
+                           len += buffer->file_len;
+                       }
+                   }
+                   
                    if(server->state != SERVER_STATE_RUNNING)
                        len = -1;
                    else if(buffer->closed)
@@ -549,6 +723,10 @@ int server_buffer_send(server_t *server, buffer_t* buffer)
             len = -2;
         }
         
+        PROBE2(send__done, buffer->index, len);
+        
+        file_detach(buffer);
+        
         /* Reset Buffer Request */
         buffer->rsp_len = 0;        
         buffer->req_len = 0;
@@ -564,16 +742,80 @@ int server_buffer_send(server_t *server, buffer_t* buffer)
     return len;
 }
 
+/*
+ * Reply continues with len bytes of file fd from off, sent without copy
+ * on TCP. done is called with arg and tag once the file is not needed
+ */
+int server_buffer_attach(server_t *server, buffer_t *buffer, int fd, off_t off, uint32_t len,
+                         void (*done)(void *arg, uint64_t tag), void *arg, uint64_t tag)
+{
+    int ret = -1;
+    
+    if( server && buffer && ( fd >= 0 ) && len && ( buffer->file_len == 0 ))
+    {
+        buffer->file_fd = fd;
+        buffer->file_off = off;
+        buffer->file_len = len;
+        buffer->file_done = done;
+        buffer->file_arg = arg;
+        buffer->file_tag = tag;
+        ret = 0;
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+    
+    return ret;
+}
+
+/*
+ * Grow response buffer so that it can hold at least size bytes
+ * Buffer is shrunk back to default size when connection is reused
+ */
+int server_buffer_reserve(server_t *server, buffer_t *buffer, int size)
+{
+    int ret = -1;
+    uint8_t *rsp;
+
+    if( server && buffer && size > 0 )
+    {
+        if( size <= buffer->rsp_size )
+        {
+            ret = 0;
+        }
+        else if((rsp = realloc(buffer->rsp, size)))
+        {
+            buffer->rsp = rsp;
+            buffer->rsp_size = size;
+            ret = 0;
+        }
+        else
+        {
+            TRACE(ERROR,"Failed to allocate memory");
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    return ret;
+}
+
 int server_shutdown(server_t *server)
 {
     int ret = -1;
     if(server && (server->state == SERVER_STATE_RUNNING))
     {
         TRACE(INFO,"Shutdown Server");
+        /* State changes under lock so no waiter misses the wakeup */
+        pthread_mutex_lock(&server->lock);
         server->state = SERVER_STATE_STOPPED;
         
-        pthread_cond_signal(&server->freed);
-        pthread_cond_signal(&server->available);
+        pthread_cond_broadcast(&server->freed);
+        pthread_cond_broadcast(&server->available);
+        pthread_mutex_unlock(&server->lock);
         
         pthread_join(server->tid, NULL);
         
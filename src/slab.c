@@ -0,0 +1,333 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "slab.h"
+#include "arena.h"
+
+#define MODULE "Slab"
+#include "trace.h"
+
+#define ALIGN_UP(x,a)       ((((x) + (a) - 1) / (a)) * (a))
+#define PAGE_UNUSED         0xff
+#define CHUNK(s,off)        ((slab_chunk_t*)((s)->base + (off)))
+#define OFFSET(s,p)         ((uint64_t)((uint8_t*)(p) - (s)->base))
+
+/*
+ * Chunk sizes grow by SLAB_GROWTH, largest class takes a whole page
+ */
+static uint32_t class_sizes(uint32_t *sizes)
+{
+    uint32_t size = SLAB_CHUNK_MIN;
+    uint32_t n = 0;
+
+    while(( n < SLAB_CLASSES_MAX - 1 ) && ( size < SLAB_PAGE_SIZE / 2 ))
+    {
+        sizes[n++] = size;
+        size = ALIGN_UP((uint32_t)(size * SLAB_GROWTH), SLAB_ALIGN);
+    }
+    sizes[n++] = SLAB_PAGE_SIZE;
+
+    return n;
+}
+
+/*
+ * Existing region is reused only when it was detached in order and has
+ * the same geometry
+ */
+static int validate(slab_header_t *header, uint64_t size)
+{
+    uint32_t sizes[SLAB_CLASSES_MAX];
+    uint32_t classes = class_sizes(sizes);
+
+    if( header->magic != SLAB_MAGIC || header->version != SLAB_VERSION ||
+        header->size != size || header->page_size != SLAB_PAGE_SIZE ||
+        header->classes != classes || header->pages_used > header->pages ||
+        memcmp(header->chunk_size, sizes, classes * sizeof(uint32_t)))
+    {
+        TRACE(WARN,"Item storage has other format, starting empty");
+        return -1;
+    }
+
+    if( header->clean == 0 )
+    {
+        TRACE(WARN,"Item storage was not detached cleanly, starting empty");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void format(slab_t *slab, uint64_t size)
+{
+    slab_header_t *header = slab->header;
+    uint32_t max_pages = size / SLAB_PAGE_SIZE;
+
+    memset(header, 0, sizeof(slab_header_t));
+    header->magic = SLAB_MAGIC;
+    header->version = SLAB_VERSION;
+    header->size = size;
+    header->page_size = SLAB_PAGE_SIZE;
+    header->classes = class_sizes(header->chunk_size);
+
+    /* Page table follows header, pages start page aligned */
+    header->pages_offset = ALIGN_UP(sizeof(slab_header_t) + max_pages, 4096);
+    header->pages = (size - header->pages_offset) / SLAB_PAGE_SIZE;
+
+    memset(slab->page_class, PAGE_UNUSED, header->pages);
+}
+
+/*
+ * Region of size bytes, kept in file at path or anonymous in pages of the
+ * ARENA_PAGES_ kind. A file on hugetlbfs has huge pages of its own
+ */
+slab_t* slab_create(const char *path, uint64_t size, int pages, int *attached)
+{
+    slab_t *slab = NULL;
+    struct stat st;
+    void *map;
+    int i;
+
+    if( attached )
+        *attached = 0;
+
+    if( size < SLAB_PAGE_SIZE * 2 )
+    {
+        TRACE(ERROR,"Invalid args");
+        return NULL;
+    }
+
+    if((slab = calloc(1, sizeof(slab_t))) == NULL)
+    {
+        TRACE(ERROR,"Failed to allocate memory");
+        return NULL;
+    }
+
+    slab->fd = -1;
+
+    if( path )
+    {
+        if(((slab->fd = open(path, O_RDWR | O_CREAT, 0644)) < 0 ) || fstat(slab->fd, &st) ||
+           (( st.st_size != size ) && ftruncate(slab->fd, size)))
+        {
+            TRACE(ERROR,"Failed to open %s : %s", path, strerror(errno));
+            if( slab->fd >= 0 )
+                close(slab->fd);
+            free(slab);
+            return NULL;
+        }
+
+        slab->map_size = size;
+        slab->pages = ( pages == ARENA_PAGES_DEFAULT ) ? pages : ARENA_PAGES_THP;
+        if(( map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, slab->fd, 0)) != MAP_FAILED )
+            arena_advise(map, size, slab->pages);
+    }
+    else
+    {
+        slab->map_size = size;
+        slab->pages = pages;
+        if(( map = arena_map(&slab->map_size, &slab->pages)) == NULL )
+            map = MAP_FAILED;
+    }
+
+    if( map == MAP_FAILED )
+    {
+        TRACE(ERROR,"Failed to map item storage : %s", strerror(errno));
+        if( slab->fd >= 0 )
+            close(slab->fd);
+        free(slab);
+        return NULL;
+    }
+
+    slab->base = map;
+    slab->header = (slab_header_t*)map;
+    slab->page_class = slab->base + sizeof(slab_header_t);
+
+    if( path && ( validate(slab->header, size) == 0 ))
+    {
+        TRACE(INFO,"Attached item storage %s, %u pages in use", path, slab->header->pages_used);
+        if( attached )
+            *attached = 1;
+    }
+    else
+    {
+        format(slab, size);
+    }
+
+    /* Dirty until detached again */
+    slab->header->clean = 0;
+
+    pthread_mutex_init(&slab->page_lock, NULL);
+    for(i = 0; i < SLAB_CLASSES_MAX; i++)
+        pthread_mutex_init(&slab->lock[i], NULL);
+
+    return slab;
+}
+
+/*
+ * Unmap region, clean marks it reusable by next slab_create()
+ */
+void slab_destroy(slab_t *slab, int clean)
+{
+    int i;
+
+    if( slab )
+    {
+        if( clean )
+            slab->header->clean = 1;
+
+        if( slab->fd >= 0 )
+        {
+            msync(slab->base, slab->header->size, MS_SYNC);
+            close(slab->fd);
+        }
+
+        munmap(slab->base, slab->map_size);
+
+        pthread_mutex_destroy(&slab->page_lock);
+        for(i = 0; i < SLAB_CLASSES_MAX; i++)
+            pthread_mutex_destroy(&slab->lock[i]);
+
+        free(slab);
+    }
+}
+
+/*
+ * Class for an allocation of size, -1 if too large
+ */
+int slab_class(slab_t *slab, uint32_t size)
+{
+    uint32_t need = size + sizeof(slab_chunk_t);
+    int i;
+
+    for(i = 0; i < slab->header->classes; i++)
+        if( slab->header->chunk_size[i] >= need )
+            return i;
+
+    return -1;
+}
+
+int slab_class_of(slab_t *slab, void *ptr)
+{
+    return ((slab_chunk_t*)((uint8_t*)ptr - offsetof(slab_chunk_t, data)))->cls;
+}
+
+uint32_t slab_chunk_size(slab_t *slab, void *ptr)
+{
+    return slab->header->chunk_size[slab_class_of(slab, ptr)];
+}
+
+/*
+ * Give a free page to class and cut it in chunks, class lock held
+ */
+static int new_page(slab_t *slab, int cls)
+{
+    slab_header_t *header = slab->header;
+    uint32_t size = header->chunk_size[cls];
+    uint64_t page, off;
+    slab_chunk_t *chunk;
+    int32_t i;
+
+    pthread_mutex_lock(&slab->page_lock);
+    if( header->pages_used >= header->pages )
+    {
+        pthread_mutex_unlock(&slab->page_lock);
+        return -1;
+    }
+    page = header->pages_used++;
+    slab->page_class[page] = cls;
+    pthread_mutex_unlock(&slab->page_lock);
+
+    /* Link backwards so chunks are handed out in address order */
+    for(i = (SLAB_PAGE_SIZE / size) - 1; i >= 0; i--)
+    {
+        off = header->pages_offset + (page * SLAB_PAGE_SIZE) + ((uint64_t)i * size);
+        chunk = CHUNK(slab, off);
+        chunk->used = 0;
+        chunk->cls = cls;
+        chunk->len = 0;
+        chunk->next = header->free[cls];
+        header->free[cls] = off;
+    }
+
+    return 0;
+}
+
+void* slab_alloc(slab_t *slab, uint32_t size)
+{
+    slab_chunk_t *chunk = NULL;
+    int cls;
+
+    if(( cls = slab_class(slab, size)) < 0 )
+        return NULL;
+
+    pthread_mutex_lock(&slab->lock[cls]);
+
+    if(( slab->header->free[cls] ) || ( new_page(slab, cls) == 0 ))
+    {
+        chunk = CHUNK(slab, slab->header->free[cls]);
+        slab->header->free[cls] = chunk->next;
+        chunk->used = 1;
+        chunk->len = size;
+        chunk->next = 0;
+    }
+
+    pthread_mutex_unlock(&slab->lock[cls]);
+
+    return chunk ? chunk->data : NULL;
+}
+
+void slab_free(slab_t *slab, void *ptr)
+{
+    slab_chunk_t *chunk;
+
+    if( slab && ptr )
+    {
+        chunk = (slab_chunk_t*)((uint8_t*)ptr - offsetof(slab_chunk_t, data));
+
+        pthread_mutex_lock(&slab->lock[chunk->cls]);
+        chunk->used = 0;
+        chunk->next = slab->header->free[chunk->cls];
+        slab->header->free[chunk->cls] = OFFSET(slab, chunk);
+        pthread_mutex_unlock(&slab->lock[chunk->cls]);
+    }
+}
+
+/*
+ * Visit every allocated chunk, a chunk is freed if walk returns non zero
+ * Not safe against concurrent allocation
+ */
+int slab_walk(slab_t *slab, slab_walk_t walk, void *arg)
+{
+    slab_header_t *header = slab->header;
+    slab_chunk_t *chunk;
+    uint32_t page, i, size;
+    int count = 0;
+
+    for(page = 0; page < header->pages_used; page++)
+    {
+        if( slab->page_class[page] >= header->classes )
+            continue;
+
+        size = header->chunk_size[slab->page_class[page]];
+
+        for(i = 0; i < SLAB_PAGE_SIZE / size; i++)
+        {
+            chunk = CHUNK(slab, header->pages_offset + ((uint64_t)page * SLAB_PAGE_SIZE) + ((uint64_t)i * size));
+
+            if( chunk->used == 0 )
+                continue;
+
+            if( walk(arg, chunk->data, chunk->len) )
+                slab_free(slab, chunk->data);
+            else
+                count++;
+        }
+    }
+
+    return count;
+}
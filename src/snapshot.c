@@ -0,0 +1,640 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "snapshot.h"
+
+#define MODULE "Snapshot"
+#include "trace.h"
+
+#define SNAPSHOT_BUFFER_SIZE    (1024 * 1024)
+
+/* Items of one bucket */
+typedef struct snapshot_batch_s
+{
+    cache_data_t **items;
+    int count;
+    int size;
+} snapshot_batch_t;
+
+/* Shared by load threads */
+typedef struct snapshot_load_s
+{
+    snapshot_t *snapshot;
+    const uint8_t *base;
+    snapshot_header_t *header;
+    snapshot_section_t *table;
+    uint32_t next;              /* Next section to take */
+    uint64_t items;
+    uint64_t skipped;
+    uint32_t corrupt;
+} snapshot_load_t;
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+/*
+ * zlib takes 32 bit lengths
+ */
+static uint32_t checksum(uint32_t crc, const uint8_t *buf, uint64_t len)
+{
+    uInt n;
+
+    while( len )
+    {
+        n = ( len > (1U << 30)) ? (1U << 30) : (uInt)len;
+        crc = crc32(crc, buf, n);
+        buf += n;
+        len -= n;
+    }
+
+    return crc;
+}
+
+/*
+ * Entries of section table, the tiny section is last
+ */
+static uint32_t table_entries(snapshot_header_t *header)
+{
+    return header->sections + (( header->version >= 3 ) ? 1 : 0);
+}
+
+static uint32_t header_crc(snapshot_header_t *header, snapshot_section_t *table)
+{
+    snapshot_header_t h = *header;
+    uint32_t crc;
+
+    h.crc = 0;
+    crc = checksum(crc32(0, NULL, 0), (uint8_t*)table, (uint64_t)table_entries(&h) * sizeof(snapshot_section_t));
+
+    return checksum(crc, (uint8_t*)&h, sizeof(h));
+}
+
+static int batch_reserve(snapshot_batch_t *batch, int count)
+{
+    cache_data_t **items;
+    int size = batch->size ? batch->size : 256;
+
+    while( size < count )
+        size *= 2;
+
+    if( size > batch->size )
+    {
+        if(( items = realloc(batch->items, size * sizeof(cache_data_t*))) == NULL )
+        {
+            TRACE(ERROR,"Memory allocation failure");
+            return -1;
+        }
+
+        batch->items = items;
+        batch->size = size;
+    }
+
+    return 0;
+}
+
+static int batch_add(void *arg, void *data)
+{
+    snapshot_batch_t *batch = (snapshot_batch_t*)arg;
+
+    if( batch_reserve(batch, batch->count + 1) )
+        return -1;
+
+    batch->items[batch->count++] = cache_data_ref((cache_data_t*)data);
+
+    return 0;
+}
+
+/*
+ * Write records of a batch, returns bytes written or -1
+ * Values in external store are read into scratch, items whose value is
+ * gone or that were flushed are left out of count
+ */
+static int64_t write_batch(FILE *f, cachedb_t *cache, snapshot_batch_t *batch, uint8_t **scratch, uint32_t *count, uint32_t *crc)
+{
+    snapshot_record_t rec;
+    cache_data_t *d;
+    uint8_t *val, *buf;
+    int64_t bytes = 0;
+    uint32_t len;
+    int i;
+
+    for(i = 0, *count = 0; i < batch->count; i++)
+    {
+        d = batch->items[i];
+        val = CACHE_VAL(d);
+
+        if( cachedb_flushed(cache, d))
+            continue;
+
+        if( d->ext )
+        {
+            if(( buf = realloc(*scratch, d->val_len ? d->val_len : 1)) == NULL )
+                return -1;
+
+            *scratch = val = buf;
+            len = d->val_len;
+
+            if( cachedb_value(cache, d, val, &len, 1) )
+                continue;
+        }
+
+        /* Compressed values are written as stored */
+        memset(&rec, 0, sizeof(rec));
+        rec.key_len = d->key_len;
+        rec.comp = d->comp;
+        rec.val_len = d->val_len;
+        rec.flag = d->flag;
+        rec.expire = d->expire;
+
+        if(( fwrite(&rec, sizeof(rec), 1, f) != 1 ) ||
+           ( fwrite(CACHE_KEY(d), d->key_len, 1, f) != 1 ) ||
+           ( d->val_len && ( fwrite(val, d->val_len, 1, f) != 1 )))
+        {
+            return -1;
+        }
+
+        *crc = checksum(*crc, (uint8_t*)&rec, sizeof(rec));
+        *crc = checksum(*crc, CACHE_KEY(d), d->key_len);
+        *crc = checksum(*crc, val, d->val_len);
+        bytes += sizeof(rec) + d->key_len + d->val_len;
+        (*count)++;
+    }
+
+    return bytes;
+}
+
+/*
+ * Write records of all tiny items, returns bytes written or -1
+ * Without tiny table the section is empty
+ */
+static int64_t write_tiny(FILE *f, tiny_t *tiny, uint32_t *count, uint32_t *crc)
+{
+    snapshot_record_t rec;
+    tiny_slot_t slots[TINY_WAYS];
+    int64_t bytes = 0;
+    uint32_t set;
+    int i, n;
+
+    memset(&rec, 0, sizeof(rec));
+
+    for(set = 0, *count = 0; set < tiny_sets(tiny); set++)
+    {
+        n = tiny_copy(tiny, set, slots);
+
+        for(i = 0; i < n; i++)
+        {
+            rec.key_len = slots[i].key_len;
+            rec.val_len = slots[i].val_len;
+
+            if( fwrite(&rec, sizeof(rec), 1, f) != 1 ||
+                fwrite(slots[i].data, rec.key_len + rec.val_len, 1, f) != 1 )
+            {
+                return -1;
+            }
+
+            *crc = checksum(*crc, (uint8_t*)&rec, sizeof(rec));
+            *crc = checksum(*crc, slots[i].data, rec.key_len + rec.val_len);
+            bytes += sizeof(rec) + rec.key_len + rec.val_len;
+            (*count)++;
+        }
+    }
+
+    return bytes;
+}
+
+static void* writer(void *arg)
+{
+    snapshot_t *snapshot = (snapshot_t*)arg;
+    hash_table_t *ht = snapshot->cache->ht;
+    snapshot_section_t *table = NULL;
+    snapshot_header_t header;
+    snapshot_batch_t batch;
+    uint64_t start = now_ms();
+    uint64_t offset = sizeof(header);
+    uint64_t items = 0;
+    int64_t bytes;
+    uint8_t *scratch = NULL;
+    char *tmp = NULL;
+    FILE *f = NULL;
+    uint32_t b;
+    int i, ret = -1;
+
+    memset(&header, 0, sizeof(header));
+    memset(&batch, 0, sizeof(batch));
+
+    if((( tmp = malloc(strlen(snapshot->path) + 5)) == NULL ) ||
+       (( table = calloc(ht->size + 1, sizeof(snapshot_section_t))) == NULL ))
+    {
+        TRACE(ERROR,"Memory allocation failure");
+    }
+    else if(( sprintf(tmp, "%s.tmp", snapshot->path) < 0 ) || (( f = fopen(tmp, "w")) == NULL ))
+    {
+        TRACE(ERROR,"Failed to open %s : %s", tmp, strerror(errno));
+    }
+    else
+    {
+        setvbuf(f, NULL, _IOFBF, SNAPSHOT_BUFFER_SIZE);
+
+        /* Header is written again once counts are known */
+        ret = ( fwrite(&header, sizeof(header), 1, f) == 1 ) ? 0 : -1;
+
+        for(b = 0; ( ret == 0 ) && ( b < ht->size ); b++)
+        {
+            if( __atomic_load_n(&snapshot->stop, __ATOMIC_RELAXED) )
+            {
+                TRACE(INFO,"Snapshot aborted");
+                ret = -1;
+                break;
+            }
+
+            batch.count = 0;
+            ret = hash_table_walk(ht, b, batch_add, &batch);
+
+            table[b].offset = offset;
+            table[b].crc = crc32(0, NULL, 0);
+
+            if(( ret == 0 ) && (( bytes = write_batch(f, snapshot->cache, &batch, &scratch, &table[b].count, &table[b].crc)) >= 0 ))
+            {
+                table[b].bytes = bytes;
+                offset += bytes;
+                items += table[b].count;
+            }
+            else
+            {
+                ret = -1;
+            }
+
+            for(i = 0; i < batch.count; i++)
+                cache_data_release(batch.items[i]);
+        }
+
+        /* Tiny section follows buckets */
+        if( ret == 0 )
+        {
+            table[b].offset = offset;
+            table[b].crc = crc32(0, NULL, 0);
+
+            if(( bytes = write_tiny(f, snapshot->cache->tiny, &table[b].count, &table[b].crc)) >= 0 )
+            {
+                table[b].bytes = bytes;
+                offset += bytes;
+                items += table[b].count;
+            }
+            else
+            {
+                ret = -1;
+            }
+        }
+
+        /* Section table is aligned */
+        for(; ( ret == 0 ) && ( offset % sizeof(uint64_t)); offset++)
+            ret = ( fputc(0, f) == EOF ) ? -1 : 0;
+
+        if( ret == 0 )
+        {
+            memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+            header.version = SNAPSHOT_VERSION;
+            header.sections = ht->size;
+            header.items = items;
+            header.table = offset;
+            header.created = time(NULL);
+            header.crc = header_crc(&header, table);
+
+            if(( fwrite(table, sizeof(snapshot_section_t), ht->size + 1, f) != ht->size + 1 ) ||
+               fseek(f, 0, SEEK_SET) || ( fwrite(&header, sizeof(header), 1, f) != 1 ) ||
+               fflush(f) || fsync(fileno(f)))
+            {
+                ret = -1;
+            }
+        }
+
+        if( fclose(f) )
+            ret = -1;
+
+        /* Previous snapshot is replaced only by a complete one */
+        if(( ret == 0 ) && rename(tmp, snapshot->path))
+            ret = -1;
+
+        if( ret )
+        {
+            TRACE(ERROR,"Failed to write %s : %s", snapshot->path, strerror(errno));
+            unlink(tmp);
+        }
+    }
+
+    if( ret == 0 )
+    {
+        __atomic_store_n(&snapshot->items, items, __ATOMIC_RELAXED);
+        __atomic_store_n(&snapshot->bytes, offset + ((ht->size + 1) * sizeof(snapshot_section_t)), __ATOMIC_RELAXED);
+        __atomic_store_n(&snapshot->duration_ms, now_ms() - start, __ATOMIC_RELAXED);
+        __atomic_store_n(&snapshot->last, time(NULL), __ATOMIC_RELAXED);
+
+        TRACE(INFO,"Snapshot of %lu items written in %lu ms", (unsigned long)items,
+              (unsigned long)snapshot->duration_ms);
+    }
+    else
+    {
+        __atomic_add_fetch(&snapshot->failures, 1, __ATOMIC_RELAXED);
+    }
+
+    free(batch.items);
+    free(scratch);
+    free(table);
+    free(tmp);
+
+    __atomic_store_n(&snapshot->running, 0, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+/*
+ * Items of one section, handed to cache as one bucket
+ * Items of the tiny section are set one by one, they go to the tiny table
+ * if there is one
+ */
+static void load_section(snapshot_load_t *load, uint32_t s, snapshot_batch_t *batch)
+{
+    snapshot_section_t *sec = &load->table[s];
+    snapshot_record_t rec;
+    const uint8_t *ptr, *end;
+    cache_data_t *d;
+    int tiny = ( s >= load->header->sections );
+    uint32_t i, set = 0;
+
+    if(( sec->offset < sizeof(snapshot_header_t)) || ( sec->offset > load->header->table ) ||
+       ( sec->bytes > load->header->table - sec->offset ) ||
+       ( checksum(crc32(0, NULL, 0), &load->base[sec->offset], sec->bytes) != sec->crc ))
+    {
+        TRACE(WARN,"Section %u is corrupt, %u items skipped", s, sec->count);
+        __atomic_add_fetch(&load->corrupt, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&load->skipped, sec->count, __ATOMIC_RELAXED);
+        return;
+    }
+
+    ptr = &load->base[sec->offset];
+    end = ptr + sec->bytes;
+    batch->count = 0;
+
+    if( batch_reserve(batch, ( sec->count < sec->bytes / sizeof(rec)) ? sec->count : sec->bytes / sizeof(rec)) )
+        return;
+
+    for(i = 0; i < sec->count; i++)
+    {
+        if( end - ptr < sizeof(rec) )
+            break;
+
+        memcpy(&rec, ptr, sizeof(rec));
+
+        if(( rec.key_len == 0 ) || ( end - ptr - sizeof(rec) < (uint64_t)rec.key_len + rec.val_len ))
+            break;
+
+        /* Compressed with settings not in use, counted as skipped */
+        if( compress_readable(load->snapshot->cache->comp, rec.comp) == 0 )
+        {
+            TRACE(DEBUG,"Compressed value skipped");
+        }
+        else if( tiny )
+        {
+            if( cachedb_set(load->snapshot->cache, NULL, (uint8_t*)&ptr[sizeof(rec)],
+                            (uint8_t*)&ptr[sizeof(rec) + rec.key_len], rec.key_len, rec.val_len) == 0 )
+                set++;
+        }
+        else if(( d = cache_data_item_alloc(rec.key_len, rec.val_len, (uint8_t*)&ptr[sizeof(rec)],
+                                            (uint8_t*)&ptr[sizeof(rec) + rec.key_len])))
+        {
+            d->comp = rec.comp;
+            d->flag = rec.flag;
+            d->expire = rec.expire;
+            batch->items[batch->count++] = d;
+        }
+
+        ptr += sizeof(rec) + rec.key_len + rec.val_len;
+    }
+
+    if( i < sec->count )
+        TRACE(WARN,"Section %u is truncated", s);
+
+    if( tiny )
+    {
+        __atomic_add_fetch(&load->skipped, sec->count - set, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&load->items, set, __ATOMIC_RELAXED);
+        return;
+    }
+
+    __atomic_add_fetch(&load->skipped, sec->count - batch->count, __ATOMIC_RELAXED);
+
+    if( cachedb_load(load->snapshot->cache, s, batch->items, batch->count) == 0 )
+        __atomic_add_fetch(&load->items, batch->count, __ATOMIC_RELAXED);
+}
+
+static void* loader(void *arg)
+{
+    snapshot_load_t *load = (snapshot_load_t*)arg;
+    snapshot_batch_t batch;
+    uint32_t s;
+
+    memset(&batch, 0, sizeof(batch));
+
+    while(( s = __atomic_fetch_add(&load->next, 1, __ATOMIC_RELAXED)) < table_entries(load->header))
+    {
+        load_section(load, s, &batch);
+    }
+
+    free(batch.items);
+
+    return NULL;
+}
+
+snapshot_t* snapshot_create(cachedb_t *cache, const char *path)
+{
+    snapshot_t *snapshot = NULL;
+
+    if( cache && path )
+    {
+        if((snapshot = calloc(1, sizeof(snapshot_t))) && (( snapshot->path = strdup(path))))
+        {
+            snapshot->cache = cache;
+        }
+        else
+        {
+            TRACE(ERROR,"Memory allocation failure");
+            free(snapshot);
+            snapshot = NULL;
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    return snapshot;
+}
+
+/*
+ * Write snapshot in background
+ */
+int snapshot_start(snapshot_t *snapshot)
+{
+    int ret = -1;
+
+    if( snapshot )
+    {
+        if( __atomic_exchange_n(&snapshot->running, 1, __ATOMIC_ACQUIRE) )
+        {
+            TRACE(DEBUG,"Snapshot in progress");
+            ret = 1;
+        }
+        else
+        {
+            /* Previous writer is done, collect it */
+            if( snapshot->joinable )
+                pthread_join(snapshot->tid, NULL);
+            snapshot->joinable = 0;
+
+            if( pthread_create(&snapshot->tid, NULL, writer, snapshot) )
+            {
+                TRACE(ERROR,"Failed to create thread");
+                __atomic_store_n(&snapshot->running, 0, __ATOMIC_RELEASE);
+            }
+            else
+            {
+                snapshot->joinable = 1;
+                ret = 0;
+            }
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    /*  0  : Started
+     *  1  : Already running
+     * -1  : Failure
+     */
+    return ret;
+}
+
+/*
+ * Load snapshot file into cache with threads in parallel, must be done
+ * before cache is used. A missing file is an empty cache
+ */
+int snapshot_load(snapshot_t *snapshot, int threads)
+{
+    snapshot_load_t load;
+    pthread_t *tid = NULL;
+    struct stat st;
+    uint64_t start __attribute__((unused)) = now_ms();  /* Traced only */
+    void *map = MAP_FAILED;
+    int fd = -1;
+    int i, n = 0;
+    int ret = -1;
+
+    memset(&load, 0, sizeof(load));
+
+    if( snapshot == NULL || threads <= 0 )
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+    else if(( fd = open(snapshot->path, O_RDONLY)) < 0 )
+    {
+        if( errno == ENOENT )
+        {
+            TRACE(INFO,"No snapshot %s, starting empty", snapshot->path);
+            ret = 0;
+        }
+        else
+        {
+            TRACE(ERROR,"Failed to open %s : %s", snapshot->path, strerror(errno));
+        }
+    }
+    else if( fstat(fd, &st) || ( st.st_size < sizeof(snapshot_header_t)) ||
+             (( map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED ))
+    {
+        TRACE(ERROR,"Failed to map %s", snapshot->path);
+    }
+    else
+    {
+        load.snapshot = snapshot;
+        load.base = (const uint8_t*)map;
+        load.header = (snapshot_header_t*)map;
+        load.table = (snapshot_section_t*)&load.base[load.header->table];
+
+        if( memcmp(load.header->magic, SNAPSHOT_MAGIC, sizeof(load.header->magic)) ||
+            ( load.header->version == 0 ) || ( load.header->version > SNAPSHOT_VERSION ) ||
+            ( load.header->table < sizeof(snapshot_header_t)) || ( load.header->table > st.st_size ) ||
+            (( st.st_size - load.header->table ) / sizeof(snapshot_section_t) < table_entries(load.header)) ||
+            ( header_crc(load.header, load.table) != load.header->crc ))
+        {
+            TRACE(ERROR,"%s is not a valid snapshot", snapshot->path);
+        }
+        else if(( tid = calloc(threads, sizeof(pthread_t))) == NULL )
+        {
+            TRACE(ERROR,"Memory allocation failure");
+        }
+        else
+        {
+            madvise(map, st.st_size, MADV_WILLNEED);
+
+            for(n = 0; n < threads; n++)
+            {
+                if( pthread_create(&tid[n], NULL, loader, &load) )
+                {
+                    TRACE(ERROR,"Failed to create thread");
+                    break;
+                }
+            }
+
+            /* Without any thread load here */
+            if( n == 0 )
+                loader(&load);
+
+            for(i = 0; i < n; i++)
+                pthread_join(tid[i], NULL);
+
+            TRACE(INFO,"Loaded %lu of %lu items in %lu ms, %d threads", (unsigned long)load.items,
+                  (unsigned long)load.header->items, (unsigned long)(now_ms() - start), n ? n : 1);
+
+            if( load.skipped )
+                TRACE(WARN,"%lu items skipped, %u sections corrupt", (unsigned long)load.skipped, load.corrupt);
+
+            ret = 0;
+        }
+    }
+
+    free(tid);
+
+    if( map != MAP_FAILED )
+        munmap(map, st.st_size);
+
+    if( fd >= 0 )
+        close(fd);
+
+    return ret;
+}
+
+void snapshot_destroy(snapshot_t *snapshot)
+{
+    if( snapshot )
+    {
+        /* Running writer holds item references, wait for it */
+        __atomic_store_n(&snapshot->stop, 1, __ATOMIC_RELAXED);
+
+        if( snapshot->joinable )
+            pthread_join(snapshot->tid, NULL);
+
+        free(snapshot->path);
+        free(snapshot);
+    }
+}
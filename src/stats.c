@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <arpa/inet.h>
+#include "memcached.h"
+#include "stats.h"
+
+#define MODULE "Stats"
+#include "trace.h"
+
+/*
+ * Make room for size more bytes at the end of response buffer
+ */
+static int reserve(stats_t *stats, int size)
+{
+    buffer_t *buffer = stats->buffer;
+
+    if( stats->error )
+        return -1;
+
+    if( buffer->rsp_len + size > buffer->rsp_size )
+    {
+        /* Grow in big steps, stats usually come in long lists */
+        if( server_buffer_reserve(stats->server, buffer, (buffer->rsp_len + size) * 2) )
+        {
+            stats->error = 1;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Append one response packet at the end of response buffer
+ */
+static int append(stats_t *stats, const char *key, int key_len, const char *val, int val_len)
+{
+    memcached_rsp_t *rsp;
+    buffer_t *buffer = stats->buffer;
+    int size = sizeof(memcached_rsp_t) + key_len + val_len;
+
+    if( reserve(stats, size) )
+        return -1;
+
+    rsp = (memcached_rsp_t*)&buffer->rsp[buffer->rsp_len];
+    memset(rsp, 0, sizeof(memcached_rsp_t));
+    rsp->magic = MCACHE_RSP_MAGIC;
+    rsp->opcode = stats->opcode;
+    rsp->data_type = MCACHE_DATA_TYPE;
+    rsp->status = htons(MCACHE_STATUS_SUCCESS);
+    rsp->key_len = htons(key_len);
+    rsp->len = htonl(key_len + val_len);
+    rsp->opaque = stats->opaque;
+
+    memcpy(rsp->data, key, key_len);
+    memcpy(&rsp->data[key_len], val, val_len);
+
+    buffer->rsp_len += size;
+
+    return 0;
+}
+
+/*
+ * Append one "STAT name value" line, or "END" without key
+ */
+static int append_line(stats_t *stats, const char *tag, const char *key, int key_len, const char *val, int val_len)
+{
+    buffer_t *buffer = stats->buffer;
+    int tag_len = key ? strlen(tag) : 0;
+    uint8_t *p;
+
+    if( reserve(stats, key ? ( tag_len + key_len + 1 + val_len + 2 ) : 5 ))
+        return -1;
+
+    p = &buffer->rsp[buffer->rsp_len];
+    if( key )
+    {
+        memcpy(p, tag, tag_len);
+        memcpy(&p[tag_len], key, key_len);
+        p[tag_len + key_len] = ' ';
+        memcpy(&p[tag_len + 1 + key_len], val, val_len);
+        memcpy(&p[tag_len + 1 + key_len + val_len], "\r\n", 2);
+        buffer->rsp_len += tag_len + key_len + 1 + val_len + 2;
+    }
+    else
+    {
+        memcpy(p, "END\r\n", 5);
+        buffer->rsp_len += 5;
+    }
+
+    return 0;
+}
+
+static int append_text(stats_t *stats, const char *key, int key_len, const char *val, int val_len)
+{
+    return append_line(stats, "STAT ", key, key_len, val, val_len);
+}
+
+void stats_begin(stats_t *stats, server_t *server, buffer_t *buffer, uint8_t opcode, uint32_t opaque)
+{
+    stats->server = server;
+    stats->buffer = buffer;
+    stats->opcode = opcode;
+    stats->opaque = opaque;
+    stats->error = 0;
+    stats->text = 0;
+
+    buffer->rsp_len = 0;
+}
+
+/*
+ * Text lines go after what response buffer holds already
+ */
+void stats_begin_text(stats_t *stats, server_t *server, buffer_t *buffer)
+{
+    stats->server = server;
+    stats->buffer = buffer;
+    stats->opcode = 0;
+    stats->opaque = 0;
+    stats->error = 0;
+    stats->text = 1;
+}
+
+int stats_add(stats_t *stats, const char *key, const char *fmt, ...)
+{
+    char val[STATS_VAL_MAX];
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(val, sizeof(val), fmt, args);
+    va_end(args);
+
+    if( len >= sizeof(val) )
+        len = sizeof(val) - 1;
+
+    return ( stats->text ? append_text : append )(stats, key, strlen(key), val, len);
+}
+
+/*
+ * Entry of a list of keys, key as is in binary. Text lines are "KEY key
+ * value", a key that is not printable is shown in hex
+ */
+int stats_add_key(stats_t *stats, const uint8_t *key, int key_len, const char *fmt, ...)
+{
+    char val[STATS_VAL_MAX];
+    char name[(STATS_KEY_MAX * 2) + 3];
+    va_list args;
+    int len, i, printable;
+
+    va_start(args, fmt);
+    len = vsnprintf(val, sizeof(val), fmt, args);
+    va_end(args);
+
+    if( len >= sizeof(val) )
+        len = sizeof(val) - 1;
+
+    if( stats->text == 0 )
+        return append(stats, (const char*)key, key_len, val, len);
+
+    if( key_len > STATS_KEY_MAX )
+        key_len = STATS_KEY_MAX;
+
+    for(i = 0, printable = 1; i < key_len; i++)
+        if( key[i] < 0x21 || key[i] > 0x7e )
+            printable = 0;
+
+    if( printable )
+        return append_line(stats, "KEY ", (const char*)key, key_len, val, len);
+
+    strcpy(name, "0x");
+    for(i = 0; i < key_len; i++)
+        sprintf(&name[2 + (i * 2)], "%02x", key[i]);
+
+    return append_line(stats, "KEY ", name, 2 + (key_len * 2), val, len);
+}
+
+/*
+ * Terminate a list of keys with the cursor to go on from, it is "CURSOR n"
+ * line in text and 8 bytes of extras of the empty packet in binary
+ */
+int stats_end_cursor(stats_t *stats, uint64_t cursor)
+{
+    memcached_rsp_t *rsp;
+    char val[24];
+    int len;
+
+    if( stats->text )
+    {
+        len = snprintf(val, sizeof(val), "%" PRIu64, cursor);
+        if( append_line(stats, "", "CURSOR", 6, val, len) == 0 )
+            return stats_end(stats);
+    }
+    else if(( reserve(stats, sizeof(memcached_rsp_t) + sizeof(cursor)) == 0 ) && ( append(stats, NULL, 0, NULL, 0) == 0 ))
+    {
+        /* Extras of the empty packet, room for them is there */
+        rsp = (memcached_rsp_t*)&stats->buffer->rsp[stats->buffer->rsp_len - sizeof(memcached_rsp_t)];
+        rsp->extra_len = sizeof(cursor);
+        rsp->len = htonl(sizeof(cursor));
+        for(len = 0; len < sizeof(cursor); len++)
+            rsp->data[len] = cursor >> (56 - (len * 8));
+        stats->buffer->rsp_len += sizeof(cursor);
+
+        return stats->buffer->rsp_len;
+    }
+
+    TRACE(ERROR,"Failed to build stats response");
+    stats->buffer->rsp_len = 0;
+    return -1;
+}
+
+/*
+ * Terminate stats list, Returns total response length
+ */
+int stats_end(stats_t *stats)
+{
+    if(( stats->text ? append_text : append )(stats, NULL, 0, NULL, 0) )
+    {
+        TRACE(ERROR,"Failed to build stats response");
+        stats->buffer->rsp_len = 0;
+        return -1;
+    }
+
+    return stats->buffer->rsp_len;
+}
@@ -0,0 +1,293 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tiny.h"
+#include "arena.h"
+
+#define MODULE "Tiny"
+#include "trace.h"
+
+#define SET_SLOTS(t,s)      (&(t)->slots[(uint64_t)(s) * TINY_WAYS])
+#define SET_LOCK(t,s)       (&(t)->lock[(s) & (TINY_LOCKS - 1)])
+
+/* Top hash bits, never 0 as that marks a free slot */
+#define HASH_TAG(h)         ((uint8_t)(((h) >> 56) ? ((h) >> 56) : 1))
+#define HASH_SET(t,h)       ((uint32_t)((h) ^ ((h) >> 32)) & (t)->mask)
+
+/*
+ * Table of size bytes, rounded down to a power of two sets
+ */
+tiny_t* tiny_create(uint64_t size)
+{
+    tiny_t *tiny = NULL;
+    uint64_t sets = 1;
+    int pages = ARENA_PAGES_DEFAULT;
+    int i;
+
+    while(( sets * 2 * TINY_WAYS * sizeof(tiny_slot_t) <= size ) && ( sets < (1ULL << 31)))
+        sets <<= 1;
+
+    if((tiny = calloc(1, sizeof(tiny_t))) && (( tiny->bytes = sets * TINY_WAYS * sizeof(tiny_slot_t))) &&
+       (( tiny->epoch = calloc(sets, sizeof(uint32_t)))) && (( tiny->slots = arena_map(&tiny->bytes, &pages))))
+    {
+        tiny->mask = sets - 1;
+
+        for(i = 0; i < TINY_LOCKS; i++)
+            pthread_mutex_init(&tiny->lock[i], NULL);
+
+        TRACE(INFO,"%lu slots in %lu sets", (unsigned long)(sets * TINY_WAYS), (unsigned long)sets);
+    }
+    else
+    {
+        TRACE(ERROR,"Failed to allocate memory");
+        if( tiny )
+            free(tiny->epoch);
+        free(tiny);
+        tiny = NULL;
+    }
+
+    return tiny;
+}
+
+void tiny_destroy(tiny_t *tiny)
+{
+    int i;
+
+    if( tiny )
+    {
+        for(i = 0; i < TINY_LOCKS; i++)
+            pthread_mutex_destroy(&tiny->lock[i]);
+
+        arena_unmap(tiny->slots, tiny->bytes);
+        free(tiny->epoch);
+        free(tiny);
+    }
+}
+
+/*
+ * Slots of a set, emptied if the table was flushed since the set was last
+ * used. Set lock held
+ */
+static tiny_slot_t* set_slots(tiny_t *tiny, uint32_t set)
+{
+    tiny_slot_t *slots = SET_SLOTS(tiny, set);
+    uint32_t flushed = __atomic_load_n(&tiny->flushed, __ATOMIC_ACQUIRE);
+    int i;
+
+    if( tiny->epoch[set] != flushed )
+    {
+        for(i = 0; i < TINY_WAYS; i++)
+        {
+            if( slots[i].tag )
+            {
+                slots[i].tag = 0;
+                __atomic_sub_fetch(&tiny->items, 1, __ATOMIC_RELAXED);
+            }
+        }
+        tiny->epoch[set] = flushed;
+    }
+
+    return slots;
+}
+
+/*
+ * Slot of key in a set, lock held
+ */
+static tiny_slot_t* find(tiny_slot_t *set, uint8_t tag, const uint8_t *key, uint32_t key_len)
+{
+    int i;
+
+    for(i = 0; i < TINY_WAYS; i++)
+    {
+        if(( set[i].tag == tag ) && ( set[i].key_len == key_len ) && ( memcmp(set[i].data, key, key_len) == 0 ))
+            return &set[i];
+    }
+
+    return NULL;
+}
+
+/*
+ * Copy value of key into val of val_len bytes, val_len is set to its length
+ */
+int tiny_get(tiny_t *tiny, uint64_t hash, const uint8_t *key, uint32_t key_len, uint8_t *val, uint32_t *val_len)
+{
+    uint32_t set;
+    tiny_slot_t *s;
+    int ret = -1;
+
+    if( tiny && key && val && val_len && ( key_len > 0 ))
+    {
+        ret = 1;
+
+        if( key_len <= TINY_DATA_SIZE )
+        {
+            set = HASH_SET(tiny, hash);
+
+            pthread_mutex_lock(SET_LOCK(tiny, set));
+            if(( s = find(set_slots(tiny, set), HASH_TAG(hash), key, key_len)))
+            {
+                s->active = 1;
+                ret = ( s->val_len > *val_len ) ? 2 : 0;
+                if( ret == 0 )
+                    memcpy(val, TINY_VAL(s), s->val_len);
+                *val_len = s->val_len;
+            }
+            pthread_mutex_unlock(SET_LOCK(tiny, set));
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    /*  0  : Found
+     *  1  : Not found
+     *  2  : val too small, val_len is what is needed
+     * -1  : Failure
+     */
+    return ret;
+}
+
+/*
+ * Store key and value, a full set gives up its least recently read slot.
+ * evicted, if given, is set to that slot, its tag is 0 if there was none
+ */
+int tiny_set(tiny_t *tiny, uint64_t hash, const uint8_t *key, uint32_t key_len, const uint8_t *val, uint32_t val_len,
+             tiny_slot_t *evicted)
+{
+    uint32_t set;
+    uint8_t tag = HASH_TAG(hash);
+    tiny_slot_t *slots, *s;
+    int i, ret = -1;
+
+    if( tiny && key && ( val || ( val_len == 0 )) && TINY_FITS(key_len, val_len))
+    {
+        set = HASH_SET(tiny, hash);
+        if( evicted )
+            evicted->tag = 0;
+
+        pthread_mutex_lock(SET_LOCK(tiny, set));
+        slots = set_slots(tiny, set);
+
+        if(( s = find(slots, tag, key, key_len)) == NULL )
+        {
+            for(i = 0; ( i < TINY_WAYS ) && slots[i].tag; i++);
+
+            if( i < TINY_WAYS )
+            {
+                __atomic_add_fetch(&tiny->items, 1, __ATOMIC_RELAXED);
+            }
+            else
+            {
+                /* Second chance, recently read slots are passed over once */
+                for(i = 0; ( i < TINY_WAYS ) && slots[i].active; i++)
+                    slots[i].active = 0;
+
+                if( i == TINY_WAYS )
+                    i = ( hash >> 8 ) % TINY_WAYS;
+
+                if( evicted )
+                    *evicted = slots[i];
+                __atomic_add_fetch(&tiny->evictions, 1, __ATOMIC_RELAXED);
+            }
+
+            s = &slots[i];
+            s->tag = tag;
+            s->key_len = key_len;
+            memcpy(s->data, key, key_len);
+        }
+
+        s->val_len = val_len;
+        s->active = 0;
+        if( val_len )
+            memcpy(TINY_VAL(s), val, val_len);
+
+        pthread_mutex_unlock(SET_LOCK(tiny, set));
+        ret = 0;
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    return ret;
+}
+
+/*
+ * Free slot of key
+ */
+int tiny_delete(tiny_t *tiny, uint64_t hash, const uint8_t *key, uint32_t key_len)
+{
+    uint32_t set;
+    tiny_slot_t *s;
+    int ret = -1;
+
+    if( tiny && key && ( key_len > 0 ))
+    {
+        ret = 1;
+
+        if( key_len <= TINY_DATA_SIZE )
+        {
+            set = HASH_SET(tiny, hash);
+
+            pthread_mutex_lock(SET_LOCK(tiny, set));
+            if(( s = find(set_slots(tiny, set), HASH_TAG(hash), key, key_len)))
+            {
+                s->tag = 0;
+                __atomic_sub_fetch(&tiny->items, 1, __ATOMIC_RELAXED);
+                ret = 0;
+            }
+            pthread_mutex_unlock(SET_LOCK(tiny, set));
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    /*  0  : Deleted
+     *  1  : Not found
+     * -1  : Failure
+     */
+    return ret;
+}
+
+uint32_t tiny_sets(tiny_t *tiny)
+{
+    return tiny ? tiny->mask + 1 : 0;
+}
+
+/*
+ * Copy used slots of a set into out of TINY_WAYS slots, returns how many
+ */
+int tiny_copy(tiny_t *tiny, uint32_t set, tiny_slot_t *out)
+{
+    tiny_slot_t *slots;
+    int i, n = 0;
+
+    if( tiny && out && ( set <= tiny->mask ))
+    {
+        pthread_mutex_lock(SET_LOCK(tiny, set));
+        slots = set_slots(tiny, set);
+        for(i = 0; i < TINY_WAYS; i++)
+        {
+            if( slots[i].tag )
+                out[n++] = slots[i];
+        }
+        pthread_mutex_unlock(SET_LOCK(tiny, set));
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    return n;
+}
+
+/*
+ * Drop all items, sets are emptied as they are next used
+ */
+void tiny_flush(tiny_t *tiny)
+{
+    if( tiny )
+        __atomic_add_fetch(&tiny->flushed, 1, __ATOMIC_RELEASE);
+}
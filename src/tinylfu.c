@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tinylfu.h"
+
+#define MODULE "TinyLFU"
+#include "trace.h"
+
+/* Counter index of a row, double hashing from one 64 bit hash */
+#define SKETCH_INDEX(l,h,i)   (((uint32_t)(h) + (i) * ((uint32_t)((h) >> 32) | 1)) & (l)->mask)
+
+/* Doorkeeper uses 2 bit positions from the other half of the hash */
+#define DOOR_BITS(l)          (((uint64_t)(l)->mask + 1) * 8)
+#define DOOR_BIT(l,h,i)       (((h) >> ((i) * 32)) * 0x9E3779B97F4A7C15ULL % DOOR_BITS(l))
+
+tinylfu_t* tinylfu_create(uint32_t items)
+{
+    tinylfu_t *lfu = NULL;
+    uint32_t width = TINYLFU_WIDTH_MIN;
+
+    while(( width < items ) && ( width < TINYLFU_WIDTH_MAX ))
+        width <<= 1;
+
+    if((lfu = calloc(1, sizeof(tinylfu_t))))
+    {
+        lfu->mask = width - 1;
+        lfu->period = width * 10;
+        lfu->sketch = calloc(TINYLFU_DEPTH, width);
+        lfu->doorkeeper = calloc(width / 8, sizeof(uint64_t));
+
+        if(( lfu->sketch == NULL ) || ( lfu->doorkeeper == NULL ))
+        {
+            TRACE(ERROR,"Failed to allocate memory");
+            tinylfu_destroy(lfu);
+            lfu = NULL;
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Failed to allocate memory");
+    }
+
+    return lfu;
+}
+
+void tinylfu_destroy(tinylfu_t *lfu)
+{
+    if( lfu )
+    {
+        free(lfu->sketch);
+        free(lfu->doorkeeper);
+        free(lfu);
+    }
+}
+
+/*
+ * Halve every counter and clear doorkeeper
+ * Runs concurrently with recording, a lost update only skews an estimate
+ */
+static void age(tinylfu_t *lfu)
+{
+    uint32_t i, width = lfu->mask + 1;
+    uint8_t c;
+
+    for(i = 0; i < TINYLFU_DEPTH * width; i++)
+    {
+        c = __atomic_load_n(&lfu->sketch[i], __ATOMIC_RELAXED);
+        __atomic_store_n(&lfu->sketch[i], c >> 1, __ATOMIC_RELAXED);
+    }
+
+    for(i = 0; i < width / 8; i++)
+        __atomic_store_n(&lfu->doorkeeper[i], 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Set doorkeeper bits, returns 1 if they were all set already
+ */
+static int doorkeeper_add(tinylfu_t *lfu, uint64_t hash)
+{
+    uint64_t bit, old;
+    int i, seen = 1;
+
+    for(i = 0; i < 2; i++)
+    {
+        bit = DOOR_BIT(lfu, hash, i);
+        old = __atomic_fetch_or(&lfu->doorkeeper[bit / 64], 1ULL << (bit % 64), __ATOMIC_RELAXED);
+        if(( old & (1ULL << (bit % 64))) == 0 )
+            seen = 0;
+    }
+
+    return seen;
+}
+
+static int doorkeeper_has(tinylfu_t *lfu, uint64_t hash)
+{
+    uint64_t bit;
+    int i;
+
+    for(i = 0; i < 2; i++)
+    {
+        bit = DOOR_BIT(lfu, hash, i);
+        if(( __atomic_load_n(&lfu->doorkeeper[bit / 64], __ATOMIC_RELAXED) & (1ULL << (bit % 64))) == 0 )
+            return 0;
+    }
+
+    return 1;
+}
+
+void tinylfu_record(tinylfu_t *lfu, uint64_t hash)
+{
+    uint8_t *counter, c;
+    uint32_t min = TINYLFU_COUNTER_MAX;
+    int i;
+
+    /* First access only goes to doorkeeper */
+    if( doorkeeper_add(lfu, hash) )
+    {
+        /* Conservative update, only smallest counters are incremented */
+        for(i = 0; i < TINYLFU_DEPTH; i++)
+        {
+            c = __atomic_load_n(&lfu->sketch[(i * (lfu->mask + 1)) + SKETCH_INDEX(lfu, hash, i)], __ATOMIC_RELAXED);
+            if( c < min )
+                min = c;
+        }
+
+        for(i = 0; ( min < TINYLFU_COUNTER_MAX ) && ( i < TINYLFU_DEPTH ); i++)
+        {
+            counter = &lfu->sketch[(i * (lfu->mask + 1)) + SKETCH_INDEX(lfu, hash, i)];
+            if( __atomic_load_n(counter, __ATOMIC_RELAXED) == min )
+                __atomic_store_n(counter, min + 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    /* Exactly one thread sees the period end */
+    if( __atomic_add_fetch(&lfu->accesses, 1, __ATOMIC_RELAXED) == lfu->period )
+    {
+        age(lfu);
+        __atomic_store_n(&lfu->accesses, 0, __ATOMIC_RELAXED);
+    }
+}
+
+uint32_t tinylfu_estimate(tinylfu_t *lfu, uint64_t hash)
+{
+    uint32_t min = TINYLFU_COUNTER_MAX;
+    uint8_t c;
+    int i;
+
+    for(i = 0; i < TINYLFU_DEPTH; i++)
+    {
+        c = __atomic_load_n(&lfu->sketch[(i * (lfu->mask + 1)) + SKETCH_INDEX(lfu, hash, i)], __ATOMIC_RELAXED);
+        if( c < min )
+            min = c;
+    }
+
+    return min + doorkeeper_has(lfu, hash);
+}
@@ -0,0 +1,241 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "topo.h"
+
+#define MODULE "Topo"
+#include "trace.h"
+
+#define NODE_DIR            "/sys/devices/system/node"
+#define MASK_SET(m,b)       ((m)[(b) / 64] |= (1ULL << ((b) % 64)))
+#define MASK_ISSET(m,b)     ((m)[(b) / 64] & (1ULL << ((b) % 64)))
+
+/*
+ * Read a sysfs list such as 0-3,8-11 into mask of bits, returns bits set
+ */
+static int read_list(const char *path, uint64_t *mask, int bits)
+{
+    FILE *fp;
+    char line[4096];
+    char *p, *end;
+    long first, last;
+    int n = -1;
+
+    if(( fp = fopen(path, "r")))
+    {
+        if( fgets(line, sizeof(line), fp))
+        {
+            n = 0;
+            for(p = line; *p && ( *p != '\n' ); p = ( *end == ',' ) ? end + 1 : end)
+            {
+                first = last = strtol(p, &end, 10);
+                if( end == p )
+                    break;
+
+                if( *end == '-' )
+                {
+                    p = end + 1;
+                    last = strtol(p, &end, 10);
+                    if( end == p )
+                        break;
+                }
+
+                for(; ( first <= last ) && ( first < bits ); first++)
+                {
+                    if( first >= 0 )
+                    {
+                        MASK_SET(mask, first);
+                        n++;
+                    }
+                }
+            }
+        }
+        fclose(fp);
+    }
+
+    return n;
+}
+
+/*
+ * Nodes with cpus this process may use
+ */
+topo_t* topo_create(void)
+{
+    topo_t *topo = NULL;
+    uint64_t online[TOPO_NODES_MAX / 64] = {0};
+    uint64_t cpus[TOPO_CPU_WORDS];
+    cpu_set_t allowed;
+    char path[128];
+    int node, cpu, n;
+
+    CPU_ZERO(&allowed);
+    if( sched_getaffinity(0, sizeof(allowed), &allowed))
+    {
+        TRACE(WARN,"No cpu affinity : %s", strerror(errno));
+        for(cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, &allowed);
+    }
+
+    if(( topo = calloc(1, sizeof(topo_t))))
+    {
+        if( read_list(NODE_DIR "/online", online, TOPO_NODES_MAX) > 0 )
+        {
+            for(node = 0; node < TOPO_NODES_MAX; node++)
+            {
+                if( MASK_ISSET(online, node) == 0 )
+                    continue;
+
+                memset(cpus, 0, sizeof(cpus));
+                snprintf(path, sizeof(path), NODE_DIR "/node%d/cpulist", node);
+                if( read_list(path, cpus, TOPO_CPUS_MAX) <= 0 )
+                    continue;
+
+                /* Memory only nodes and nodes out of reach are left out */
+                for(cpu = n = 0; ( cpu < TOPO_CPUS_MAX ) && ( cpu < CPU_SETSIZE ); cpu++)
+                {
+                    if( MASK_ISSET(cpus, cpu) && CPU_ISSET(cpu, &allowed))
+                    {
+                        MASK_SET(topo->cpu_mask[topo->nodes], cpu);
+                        n++;
+                    }
+                }
+
+                if( n )
+                {
+                    topo->id[topo->nodes] = node;
+                    topo->cpus[topo->nodes++] = n;
+                }
+            }
+        }
+
+        if( topo->nodes == 0 )
+        {
+            TRACE(WARN,"No NUMA nodes, using all cpus as one");
+            memset(topo->cpu_mask[0], 0, sizeof(topo->cpu_mask[0]));
+            for(cpu = n = 0; ( cpu < TOPO_CPUS_MAX ) && ( cpu < CPU_SETSIZE ); cpu++)
+            {
+                if( CPU_ISSET(cpu, &allowed))
+                {
+                    MASK_SET(topo->cpu_mask[0], cpu);
+                    n++;
+                }
+            }
+            topo->id[0] = 0;
+            topo->cpus[0] = n;
+            topo->nodes = 1;
+        }
+
+        for(node = 0; node < topo->nodes; node++)
+            TRACE(INFO,"Node %d : %d cpus", topo->id[node], topo->cpus[node]);
+    }
+    else
+    {
+        TRACE(ERROR,"Memory allocation failure");
+    }
+
+    return topo;
+}
+
+void topo_destroy(topo_t *topo)
+{
+    free(topo);
+}
+
+/*
+ * Run thread tid on cpus of node, node counts from 0 up to topo->nodes
+ */
+int topo_pin(topo_t *topo, pthread_t tid, int node)
+{
+    cpu_set_t set;
+    int cpu;
+    int ret = -1;
+
+    if( topo && ( node >= 0 ) && ( node < topo->nodes ))
+    {
+        CPU_ZERO(&set);
+        for(cpu = 0; ( cpu < TOPO_CPUS_MAX ) && ( cpu < CPU_SETSIZE ); cpu++)
+        {
+            if( MASK_ISSET(topo->cpu_mask[node], cpu))
+                CPU_SET(cpu, &set);
+        }
+
+        if(( ret = pthread_setaffinity_np(tid, sizeof(set), &set)))
+        {
+            TRACE(ERROR,"Failed to pin thread to node %d : %s", topo->id[node], strerror(ret));
+            ret = -1;
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    return ret;
+}
+
+/*
+ * Spread pages of a page aligned region over all nodes, move migrates pages
+ * already faulted in. Nothing to do on one node
+ */
+int topo_interleave(topo_t *topo, void *base, uint64_t size, int move)
+{
+    unsigned long mask[TOPO_NODES_MAX / (8 * sizeof(unsigned long))] = {0};
+    int i;
+    int ret = -1;
+
+    if( topo && base && size )
+    {
+        ret = 0;
+
+        if( topo->nodes > 1 )
+        {
+            for(i = 0; i < topo->nodes; i++)
+                mask[topo->id[i] / (8 * sizeof(unsigned long))] |= 1UL << (topo->id[i] % (8 * sizeof(unsigned long)));
+
+            if( syscall(SYS_mbind, base, size, MPOL_INTERLEAVE, mask, TOPO_NODES_MAX + 1, move ? MPOL_MF_MOVE : 0))
+            {
+                TRACE(WARN,"Failed to interleave %lu bytes : %s", (unsigned long)size, strerror(errno));
+                ret = -1;
+            }
+        }
+    }
+    else
+    {
+        TRACE(ERROR,"Invalid args");
+    }
+
+    return ret;
+}
+
+/*
+ * Node of the page at addr, -1 if not known
+ */
+int topo_node_of(topo_t *topo, const void *addr)
+{
+    int id = -1;
+    int node;
+
+    if( topo && addr )
+    {
+        if( topo->nodes == 1 )
+            return 0;
+
+        if( syscall(SYS_get_mempolicy, &id, NULL, 0, addr, MPOL_F_NODE | MPOL_F_ADDR) == 0 )
+        {
+            for(node = 0; node < topo->nodes; node++)
+            {
+                if( topo->id[node] == id )
+                    return node;
+            }
+        }
+    }
+
+    return -1;
+}
@@ -1,33 +1,103 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <time.h>
+#include <pthread.h>
 
 
 #define MODULE "Trace"
 #include "trace.h"
 
-static int current_trace_level = _TRACE_DUMP_LEVEL_;
+/*
+ * Asynchronous logging
+ *
+ * Every thread owns a single producer, single consumer ring of fixed size
+ * records. Logging thread only captures the format pointer and the raw
+ * arguments ( strings are copied ) into the record, background thread does
+ * the formatting and writes to stdout. When ring is full record is dropped
+ * so logging never blocks a request.
+ */
+#define TRACE_RING_SIZE     1024        /* Records per thread, power of 2 */
+#define TRACE_RECORD_SIZE   256
+#define TRACE_RECORD_ARGS   8
+#define TRACE_LINE_MAX      1024
+#define TRACE_SPEC_MAX      32
+#define TRACE_IDLE_US       1000
 
+enum
+{
+    RECORD_LOG,         /* Format and captured arguments */
+    RECORD_TEXT,        /* Already formatted text */
+    RECORD_HEXDUMP,     /* Title followed by raw bytes */
+};
 
-void hexdump(int level, char * str, uint8_t* data, int len)
+enum
+{
+    ARG_NONE,
+    ARG_INT,
+    ARG_LONG,
+    ARG_LLONG,
+    ARG_DOUBLE,
+    ARG_STR,
+    ARG_PTR,
+    ARG_BAD,
+};
+
+typedef struct trace_record_s
+{
+    uint8_t kind;
+    uint8_t level;
+    uint16_t data_len;
+    uint32_t total_len;
+    const char *fmt;
+    uint64_t args[TRACE_RECORD_ARGS];
+    char data[TRACE_RECORD_SIZE - 16 - (TRACE_RECORD_ARGS * 8)];
+} trace_record_t;
+
+typedef struct trace_ring_s
+{
+    uint32_t head;              /* Written by owner thread only */
+    uint32_t tail;              /* Written by background thread only */
+    uint32_t dropped;
+    uint32_t reported;
+    struct trace_ring_s *next;
+    trace_record_t records[TRACE_RING_SIZE];
+} trace_ring_t;
+
+typedef struct trace_spec_s
+{
+    const char *start;
+    int len;
+    int type;
+} trace_spec_t;
+
+int trace_level = _TRACE_DUMP_LEVEL_;
+
+static __thread trace_ring_t *thread_ring;
+static trace_ring_t *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t async_tid;
+static volatile int async_running;
+
+static void hexdump_print(FILE *out, const char *str, const uint8_t *data, int len)
 {
-    if(level > current_trace_level)
-        return;
     int i = 0;
     int index  = 0;
 
     char msg[18] = {0};
     if(str)
-        printf("%s\n", str);
-        
+        fprintf(out, "%s\n", str);
+
     for(i=0;i<len;i++)
     {
-        if((i)&&(i%8==0))putchar(' ');
+        if((i)&&(i%8==0))fputc(' ', out);
         if(i && i%16==0)
         {
             index = 0;
-            printf("%s\n", msg);
+            fprintf(out, "%s\n", msg);
         }
         if(isgraph(data[i]) || data[i] == ' ')
             msg[index++]=data[i];
@@ -35,33 +105,439 @@ void hexdump(int level, char * str, uint8_t* data, int len)
             msg[index++]='.';
         msg[index]=0;
 
-            
-        printf("%02x ", data[i]);
+
+        fprintf(out, "%02x ", data[i]);
     }
     if(index)
     {
-        while(index--)putchar(' ');
-        printf("%s\n", msg);
+        while(index--)fputc(' ', out);
+        fprintf(out, "%s\n", msg);
+    }
+    fprintf(out, "\n");
+}
+
+/*
+ * Parse next conversion in format, literal text is skipped
+ * Returns 0 at end of format
+ */
+static int next_spec(const char **fmt, trace_spec_t *spec)
+{
+    const char *p = *fmt;
+    int lmod = 0;
+
+    while(*p && *p != '%')
+        p++;
+
+    if(*p == 0)
+    {
+        *fmt = p;
+        return 0;
+    }
+
+    spec->start = p++;
+    spec->type = ARG_BAD;
+
+    if(*p == '%')
+    {
+        spec->type = ARG_NONE;
+    }
+    else
+    {
+        while(*p && strchr("-+ #0'", *p))
+            p++;
+        while(isdigit((unsigned char)*p))
+            p++;
+        if(*p == '.')
+        {
+            p++;
+            while(isdigit((unsigned char)*p))
+                p++;
+        }
+
+        /* Length modifiers, h and hh are promoted to int */
+        while(*p && strchr("hlLqjzt", *p))
+        {
+            if(*p == 'l')
+                lmod++;
+            else if(*p != 'h')
+                lmod = 2;
+            if(*p == 'L')
+                lmod = 3;
+            p++;
+        }
+
+        switch(*p)
+        {
+            case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+                spec->type = (lmod == 0) ? ARG_INT : (lmod == 1) ? ARG_LONG :
+                             (lmod == 2) ? ARG_LLONG : ARG_BAD;
+                break;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+                spec->type = (lmod < 3) ? ARG_DOUBLE : ARG_BAD;
+                break;
+            case 's':
+                spec->type = (lmod == 0) ? ARG_STR : ARG_BAD;
+                break;
+            case 'p':
+                spec->type = ARG_PTR;
+                break;
+            default:
+                /* '*' width, %n and wide chars are not captured */
+                break;
+        }
+    }
+
+    if(*p)
+        p++;
+
+    spec->len = p - spec->start;
+    *fmt = p;
+
+    return 1;
+}
+
+/*
+ * Capture raw arguments of format into record
+ * Returns -1 if format can not be deferred
+ */
+static int capture(trace_record_t *rec, const char *fmt, va_list args)
+{
+    trace_spec_t spec;
+    const char *str;
+    double d;
+    int nargs = 0;
+    int len, room;
+
+    rec->data_len = 0;
+
+    while(next_spec(&fmt, &spec))
+    {
+        if(spec.type == ARG_NONE)
+            continue;
+        if(spec.type == ARG_BAD || nargs == TRACE_RECORD_ARGS || spec.len >= TRACE_SPEC_MAX)
+            return -1;
+
+        switch(spec.type)
+        {
+            case ARG_INT:
+                rec->args[nargs] = (uint64_t)va_arg(args, int);
+                break;
+            case ARG_LONG:
+                rec->args[nargs] = (uint64_t)va_arg(args, long);
+                break;
+            case ARG_LLONG:
+                rec->args[nargs] = (uint64_t)va_arg(args, long long);
+                break;
+            case ARG_DOUBLE:
+                d = va_arg(args, double);
+                memcpy(&rec->args[nargs], &d, sizeof(d));
+                break;
+            case ARG_PTR:
+                rec->args[nargs] = (uint64_t)(uintptr_t)va_arg(args, void*);
+                break;
+            case ARG_STR:
+                /* Strings may not outlive the call, copy them ( truncated ) */
+                if((str = va_arg(args, const char*)) == NULL)
+                    str = "(null)";
+                if((room = sizeof(rec->data) - rec->data_len - 1) < 0)
+                    return -1;
+                len = strlen(str);
+                if(len > room)
+                    len = room;
+                memcpy(&rec->data[rec->data_len], str, len);
+                rec->data[rec->data_len + len] = 0;
+                rec->args[nargs] = rec->data_len;
+                rec->data_len += len + 1;
+                break;
+        }
+        nargs++;
+    }
+
+    return 0;
+}
+
+static int clamp(int size, int n)
+{
+    return (n < size) ? n : size - 1;
+}
+
+/*
+ * Format a captured record back into text
+ */
+static int format_record(trace_record_t *rec, char *out, int size)
+{
+    trace_spec_t spec;
+    const char *fmt = rec->fmt;
+    const char *lit = fmt;
+    char conv[TRACE_SPEC_MAX];
+    double d;
+    int nargs = 0;
+    int n = 0;
+
+    while(next_spec(&fmt, &spec))
+    {
+        /* Literal text before conversion */
+        n = clamp(size, n + snprintf(&out[n], size - n, "%.*s", (int)(spec.start - lit), lit));
+        lit = fmt;
+
+        memcpy(conv, spec.start, spec.len);
+        conv[spec.len] = 0;
+
+        switch(spec.type)
+        {
+            case ARG_NONE:
+                n = clamp(size, n + snprintf(&out[n], size - n, "%%"));
+                break;
+            case ARG_INT:
+                n = clamp(size, n + snprintf(&out[n], size - n, conv, (int)rec->args[nargs++]));
+                break;
+            case ARG_LONG:
+                n = clamp(size, n + snprintf(&out[n], size - n, conv, (long)rec->args[nargs++]));
+                break;
+            case ARG_LLONG:
+                n = clamp(size, n + snprintf(&out[n], size - n, conv, (long long)rec->args[nargs++]));
+                break;
+            case ARG_DOUBLE:
+                memcpy(&d, &rec->args[nargs++], sizeof(d));
+                n = clamp(size, n + snprintf(&out[n], size - n, conv, d));
+                break;
+            case ARG_PTR:
+                n = clamp(size, n + snprintf(&out[n], size - n, conv, (void*)(uintptr_t)rec->args[nargs++]));
+                break;
+            case ARG_STR:
+                n = clamp(size, n + snprintf(&out[n], size - n, conv, &rec->data[rec->args[nargs++]]));
+                break;
+        }
+    }
+
+    n = clamp(size, n + snprintf(&out[n], size - n, "%s", lit));
+
+    return n;
+}
+
+static void write_record(trace_record_t *rec)
+{
+    char line[TRACE_LINE_MAX];
+    int len;
+
+    switch(rec->kind)
+    {
+        case RECORD_LOG:
+            len = format_record(rec, line, sizeof(line));
+            fwrite(line, 1, len, stdout);
+            break;
+        case RECORD_TEXT:
+            fwrite(rec->data, 1, rec->data_len, stdout);
+            break;
+        case RECORD_HEXDUMP:
+            len = strlen(rec->data);
+            hexdump_print(stdout, len ? rec->data : NULL, (uint8_t*)&rec->data[len + 1], rec->data_len);
+            if(rec->data_len < rec->total_len)
+                fprintf(stdout, "(%u of %u bytes)\n", rec->data_len, rec->total_len);
+            break;
+    }
+}
+
+/*
+ * Ring of calling thread, created and registered on first use
+ */
+static trace_ring_t* ring_get(void)
+{
+    trace_ring_t *ring = thread_ring;
+
+    if(ring == NULL && (ring = calloc(1, sizeof(trace_ring_t))))
+    {
+        pthread_mutex_lock(&rings_lock);
+        ring->next = rings;
+        __atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&rings_lock);
+
+        thread_ring = ring;
+    }
+
+    return ring;
+}
+
+/*
+ * Reserve next free record, NULL if ring is full
+ */
+static trace_record_t* record_reserve(trace_ring_t *ring)
+{
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if(ring->head - tail >= TRACE_RING_SIZE)
+    {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    return &ring->records[ring->head & (TRACE_RING_SIZE - 1)];
+}
+
+static void record_commit(trace_ring_t *ring)
+{
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Drain all rings once, Returns number of records written
+ */
+static int drain(void)
+{
+    trace_ring_t *ring;
+    uint32_t head, dropped;
+    int count = 0;
+
+    for(ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next)
+    {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        while(ring->tail != head)
+        {
+            write_record(&ring->records[ring->tail & (TRACE_RING_SIZE - 1)]);
+            __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+            count++;
+        }
+
+        dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if(dropped != ring->reported)
+        {
+            fprintf(stdout, "Trace: %u records dropped\n", dropped - ring->reported);
+            ring->reported = dropped;
+        }
     }
-    printf("\n");
+
+    if(count)
+        fflush(stdout);
+
+    return count;
+}
+
+static void *trace_async_task(void *args)
+{
+    struct timespec idle = { 0, TRACE_IDLE_US * 1000 };
+
+    while(async_running)
+    {
+        if(drain() == 0)
+            nanosleep(&idle, NULL);
+    }
+
+    /* Flush whatever was logged before stop */
+    drain();
+
+    pthread_exit(NULL);
+}
+
+void hexdump(int level, char * str, uint8_t* data, int len)
+{
+    trace_ring_t *ring;
+    trace_record_t *rec;
+    int title, room;
+
+    if(level > trace_level)
+        return;
+
+    if(async_running && (ring = ring_get()))
+    {
+        if((rec = record_reserve(ring)))
+        {
+            /* Title is stored first followed by as many bytes as fit */
+            title = str ? strlen(str) : 0;
+            if(title > sizeof(rec->data) / 2)
+                title = sizeof(rec->data) / 2;
+            memcpy(rec->data, str, title);
+            rec->data[title] = 0;
+
+            room = sizeof(rec->data) - title - 1;
+            rec->kind = RECORD_HEXDUMP;
+            rec->level = level;
+            rec->total_len = len;
+            rec->data_len = (len < room) ? len : room;
+            memcpy(&rec->data[title + 1], data, rec->data_len);
+
+            record_commit(ring);
+        }
+        return;
+    }
+
+    hexdump_print(stdout, str, data, len);
 }
 
 int dump_log(int level, const char *format, ...)
 {
+    trace_ring_t *ring;
+    trace_record_t *rec;
+    va_list args, copy;
     int n = 0;
-    if(level<=current_trace_level)
+
+    if(level<=trace_level)
     {
-        va_list args;
         va_start(args, format);
-        n = vprintf(format, args);
+        if(async_running && (ring = ring_get()))
+        {
+            if((rec = record_reserve(ring)))
+            {
+                rec->kind = RECORD_LOG;
+                rec->level = level;
+                rec->fmt = format;
+
+                va_copy(copy, args);
+                if(capture(rec, format, copy))
+                {
+                    /* Format can not be deferred, format it here */
+                    rec->kind = RECORD_TEXT;
+                    n = vsnprintf(rec->data, sizeof(rec->data), format, args);
+                    rec->data_len = (n < sizeof(rec->data)) ? n : sizeof(rec->data) - 1;
+                }
+                va_end(copy);
+
+                record_commit(ring);
+            }
+        }
+        else
+        {
+            n = vprintf(format, args);
+        }
         va_end(args);
     }
-    
+
     return n;
 }
 
 
 int set_trace_level( int level )
 {
-    return (current_trace_level = level);
+    return (trace_level = level);
+}
+
+/*
+ * Start background logging thread, until then logs are written synchronously
+ */
+int trace_async_start( void )
+{
+    int ret = 0;
+
+    if(async_running == 0)
+    {
+        async_running = 1;
+        if(pthread_create(&async_tid, NULL, trace_async_task, NULL))
+        {
+            async_running = 0;
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * Stop background logging thread after writing all pending records
+ */
+void trace_async_stop( void )
+{
+    if(async_running)
+    {
+        async_running = 0;
+        pthread_join(async_tid, NULL);
+    }
 }
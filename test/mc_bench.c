@@ -0,0 +1,904 @@
+/*
+ * Load generator for the binary protocol
+ *
+ * Every thread drives its share of connections from a poll loop, each
+ * connection keeps up to "depth" requests in flight.
+ *
+ * In open loop mode ( -r rate ) requests are scheduled at fixed intervals
+ * and latency is measured from the scheduled send time, so a stalled
+ * server is charged for every request that should have been sent meanwhile
+ * ( no coordinated omission ). Without a rate connections run closed loop.
+ *
+ * In replay mode ( -f file ) requests come from a server capture log
+ * ( -C option ) and are sent at their captured time, optionally sped up
+ * ( -x factor ). Keys are rebuilt from the captured key hash, so a key keeps
+ * its identity and size, and all requests for a key go to one connection.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "memcached.h"
+#include "histogram.h"
+#include "capture.h"
+
+#define BENCH_MAX_CONN      1024
+#define BENCH_RBUF_SIZE     (256 * 1024)
+#define BENCH_KEY_MAX       250
+#define BENCH_VAL_MAX       (1024 * 1024)
+
+enum
+{
+    DIST_FIXED,
+    DIST_UNIFORM,
+};
+
+enum
+{
+    OP_GET,
+    OP_SET,
+    OP_COUNT,
+};
+
+typedef struct dist_s
+{
+    int type;
+    uint32_t min;
+    uint32_t max;
+} dist_t;
+
+typedef struct zipf_s
+{
+    uint64_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+} zipf_t;
+
+typedef struct conn_s
+{
+    int sock;
+    uint64_t next_send;         /* Scheduled time of next request ( open loop ) */
+    int inflight;
+    int head;                   /* FIFO of scheduled times and opcodes */
+    uint64_t *sched;
+    uint8_t *ops;
+    uint8_t *wbuf;
+    int wlen;
+    int woff;
+    int wsize;
+    uint8_t *rbuf;
+    int rlen;
+    uint32_t *replay;           /* Captured records sent on this connection */
+    uint32_t replay_len;
+    uint32_t replay_pos;
+} conn_t;
+
+typedef struct bench_thread_s
+{
+    int index;
+    int nconn;
+    conn_t *conns;
+    pthread_t tid;
+    uint64_t rng;
+    uint64_t interval;          /* ns between requests per connection, 0 closed loop */
+    uint64_t prefill_next;
+    uint64_t prefill_end;
+    volatile int done;          /* Replay log exhausted and answered */
+    uint64_t ops[OP_COUNT];
+    uint64_t misses;
+    uint64_t errors;
+    histogram_t *latency[OP_COUNT];
+} bench_thread_t;
+
+/* Options */
+static const char *host = "127.0.0.1";
+static int port = 5000;
+static int nthreads = 1;
+static int nconns = 1;
+static int depth = 1;
+static int duration = 10;
+static double rate = 0;
+static double get_ratio = 0.9;
+static uint64_t keyspace = 100000;
+static double zipf_theta = 0;
+static int prefill = 0;
+static dist_t key_dist = { DIST_FIXED, 16, 16 };
+static dist_t val_dist = { DIST_FIXED, 64, 64 };
+static const char *replay_path = NULL;
+static double replay_speed = 1.0;
+
+static zipf_t zipf;
+static uint8_t *value_data;
+static capture_record_t *replay_log;
+static uint32_t replay_count;
+static uint64_t replay_start;
+static volatile int running = 1;
+static volatile int measuring = 0;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static uint64_t rnd(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double rnd01(uint64_t *state)
+{
+    return (rnd(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/*
+ * Zipfian generator, Gray et al. "Quickly Generating Billion-Record
+ * Synthetic Databases"
+ */
+static void zipf_init(zipf_t *z, uint64_t n, double theta)
+{
+    uint64_t i;
+    double zeta2 = 1.0 + pow(0.5, theta);
+
+    z->n = n;
+    z->theta = theta;
+    z->zetan = 0;
+    for(i = 1; i <= n; i++)
+        z->zetan += 1.0 / pow((double)i, theta);
+    z->alpha = 1.0 / (1.0 - theta);
+    z->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+}
+
+static uint64_t zipf_next(zipf_t *z, uint64_t *state)
+{
+    double u = rnd01(state);
+    double uz = u * z->zetan;
+    uint64_t v;
+
+    if( uz < 1.0 )
+        return 0;
+    if( uz < 1.0 + pow(0.5, z->theta) )
+        return 1;
+
+    v = (uint64_t)(z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+
+    return (v < z->n) ? v : z->n - 1;
+}
+
+static uint32_t dist_pick(dist_t *d, uint64_t r)
+{
+    if( d->type == DIST_FIXED || d->max <= d->min )
+        return d->min;
+
+    return d->min + (r % (d->max - d->min + 1));
+}
+
+/*
+ * Key of given id, length is a function of id so a key never changes size
+ */
+static int make_key(uint64_t id, uint8_t *key)
+{
+    char digits[24];
+    int ndigits = snprintf(digits, sizeof(digits), "%lu", (unsigned long)id);
+    int len = dist_pick(&key_dist, mix(id));
+
+    if( len < ndigits )
+        len = ndigits;
+
+    memset(key, '0', len - ndigits);
+    memcpy(&key[len - ndigits], digits, ndigits);
+
+    return len;
+}
+
+static int wbuf_reserve(conn_t *conn, int size)
+{
+    uint8_t *buf;
+
+    if( conn->wlen + size <= conn->wsize )
+        return 0;
+
+    if((buf = realloc(conn->wbuf, (conn->wlen + size) * 2)) == NULL)
+        return -1;
+
+    conn->wbuf = buf;
+    conn->wsize = (conn->wlen + size) * 2;
+
+    return 0;
+}
+
+/*
+ * Key for a captured key hash, hex digits of the hash repeated to length
+ */
+static int replay_key(uint64_t hash, int len, uint8_t *key)
+{
+    static const char hex[] = "0123456789abcdef";
+    int i;
+
+    for(i = 0; i < len; i++)
+        key[i] = hex[(hash >> ((i % 16) * 4)) & 0xf];
+
+    return len;
+}
+
+/*
+ * Append request to connection's write buffer
+ */
+static int queue_packet(conn_t *conn, int op, uint8_t *key, int key_len, int val_len, uint64_t sched)
+{
+    memcached_req_t *req;
+    int extra_len = ( op == OP_SET ) ? 8 : 0;
+    int slot;
+
+    if( wbuf_reserve(conn, sizeof(memcached_req_t) + extra_len + key_len + val_len) )
+        return -1;
+
+    req = (memcached_req_t*)&conn->wbuf[conn->wlen];
+    memset(req, 0, sizeof(memcached_req_t));
+    req->magic = MCACHE_REQ_MAGIC;
+    req->opcode = ( op == OP_SET ) ? MCACHE_OPCODE_SET : MCACHE_OPCODE_GET;
+    req->key_len = htons(key_len);
+    req->extra_len = extra_len;
+    req->data_type = MCACHE_DATA_TYPE;
+    req->len = htonl(extra_len + key_len + val_len);
+
+    /* Flags and expiry are left zero */
+    memset(req->data, 0, extra_len);
+    memcpy(&req->data[extra_len], key, key_len);
+    memcpy(&req->data[extra_len + key_len], value_data, val_len);
+
+    conn->wlen += sizeof(memcached_req_t) + extra_len + key_len + val_len;
+
+    slot = (conn->head + conn->inflight) % depth;
+    conn->sched[slot] = sched;
+    conn->ops[slot] = op;
+    conn->inflight++;
+
+    return 0;
+}
+
+static int queue_request(bench_thread_t *t, conn_t *conn, int op, uint64_t id, uint64_t sched)
+{
+    uint8_t key[BENCH_KEY_MAX];
+    int key_len = make_key(id, key);
+    int val_len = ( op == OP_SET ) ? dist_pick(&val_dist, rnd(&t->rng)) : 0;
+
+    return queue_packet(conn, op, key, key_len, val_len, sched);
+}
+
+/*
+ * Send time of a captured record
+ */
+static uint64_t replay_time(capture_record_t *rec, uint64_t now)
+{
+    if( replay_speed <= 0 )
+        return now;
+
+    return replay_start + (uint64_t)((rec->time - replay_log[0].time) / replay_speed);
+}
+
+/*
+ * Queue captured records of connection which are due, returns time
+ * until the next one, 0 when nothing is left or connection is full
+ */
+static uint64_t replay_requests(conn_t *conn, uint64_t now)
+{
+    capture_record_t *rec;
+    uint8_t key[BENCH_KEY_MAX];
+    uint64_t sched;
+
+    while( conn->replay_pos < conn->replay_len )
+    {
+        rec = &replay_log[conn->replay[conn->replay_pos]];
+        sched = replay_time(rec, now);
+
+        if( sched > now )
+            return sched - now;
+        if( conn->inflight >= depth )
+            return 0;
+
+        replay_key(rec->key_hash, rec->key_len, key);
+        queue_packet(conn, ( rec->opcode == MCACHE_OPCODE_SET ) ? OP_SET : OP_GET,
+                     key, rec->key_len, rec->val_len, sched);
+        conn->replay_pos++;
+    }
+
+    return 0;
+}
+
+static void next_request(bench_thread_t *t, conn_t *conn, uint64_t sched)
+{
+    uint64_t id;
+    int op;
+
+    if( t->prefill_next < t->prefill_end )
+    {
+        /* Prefill every key of this thread's range once */
+        id = t->prefill_next++;
+        op = OP_SET;
+    }
+    else
+    {
+        id = zipf_theta > 0 ? zipf_next(&zipf, &t->rng) : rnd(&t->rng) % keyspace;
+        op = ( rnd01(&t->rng) < get_ratio ) ? OP_GET : OP_SET;
+    }
+
+    queue_request(t, conn, op, id, sched);
+}
+
+/*
+ * Consume complete responses from read buffer
+ */
+static int parse_responses(bench_thread_t *t, conn_t *conn, uint64_t now)
+{
+    memcached_rsp_t *rsp;
+    uint32_t body;
+    int off = 0;
+    int op;
+
+    while( conn->rlen - off >= sizeof(memcached_rsp_t) )
+    {
+        rsp = (memcached_rsp_t*)&conn->rbuf[off];
+        body = ntohl(rsp->len);
+
+        if( rsp->magic != MCACHE_RSP_MAGIC || body > BENCH_RBUF_SIZE - sizeof(memcached_rsp_t) )
+        {
+            fprintf(stderr, "Invalid response\n");
+            return -1;
+        }
+        if( conn->rlen - off < sizeof(memcached_rsp_t) + body )
+            break;
+
+        if( conn->inflight == 0 )
+        {
+            fprintf(stderr, "Unexpected response\n");
+            return -1;
+        }
+
+        op = conn->ops[conn->head];
+        if( measuring )
+        {
+            t->ops[op]++;
+            histogram_record(t->latency[op], now - conn->sched[conn->head]);
+
+            if( ntohs(rsp->status) == MCACHE_STATUS_NOT_FOUND )
+                t->misses++;
+            else if( ntohs(rsp->status) != MCACHE_STATUS_SUCCESS )
+                t->errors++;
+        }
+
+        conn->head = (conn->head + 1) % depth;
+        conn->inflight--;
+        off += sizeof(memcached_rsp_t) + body;
+    }
+
+    if( off )
+    {
+        memmove(conn->rbuf, &conn->rbuf[off], conn->rlen - off);
+        conn->rlen -= off;
+    }
+
+    return 0;
+}
+
+static int conn_open(conn_t *conn)
+{
+    struct addrinfo hints, *res = NULL;
+    char service[8];
+    int one = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+
+    if( getaddrinfo(host, service, &hints, &res) )
+    {
+        fprintf(stderr, "Failed to resolve %s\n", host);
+        return -1;
+    }
+
+    if((conn->sock = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+       connect(conn->sock, res->ai_addr, res->ai_addrlen) < 0)
+    {
+        fprintf(stderr, "Failed to connect %s:%d : %s\n", host, port, strerror(errno));
+        freeaddrinfo(res);
+        return -1;
+    }
+    freeaddrinfo(res);
+
+    setsockopt(conn->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(conn->sock, F_SETFL, fcntl(conn->sock, F_GETFL) | O_NONBLOCK);
+
+    conn->sched = calloc(depth, sizeof(uint64_t));
+    conn->ops = calloc(depth, sizeof(uint8_t));
+    conn->rbuf = malloc(BENCH_RBUF_SIZE);
+
+    return ( conn->sched && conn->ops && conn->rbuf ) ? 0 : -1;
+}
+
+static void *bench_task(void *args)
+{
+    bench_thread_t *t = (bench_thread_t*)args;
+    struct pollfd pfd[BENCH_MAX_CONN];
+    struct timespec timeout;
+    conn_t *conn;
+    uint64_t now, wait;
+    int i, n;
+
+    uint64_t due;
+    int pending;
+
+    now = now_ns();
+    for(i = 0; i < t->nconn; i++)
+        t->conns[i].next_send = now;
+
+    while( running )
+    {
+        now = now_ns();
+        wait = 1000000;
+        pending = 0;
+
+        for(i = 0; i < t->nconn; i++)
+        {
+            conn = &t->conns[i];
+
+            if( replay_log )
+            {
+                if((due = replay_requests(conn, now)) && due < wait)
+                    wait = due;
+
+                pending += ( conn->replay_pos < conn->replay_len ) || conn->inflight;
+            }
+            else if( t->interval && t->prefill_next >= t->prefill_end )
+            {
+                /* Open loop, queue everything that is due */
+                while( conn->inflight < depth && conn->next_send <= now )
+                {
+                    next_request(t, conn, conn->next_send);
+                    conn->next_send += t->interval;
+                }
+
+                /* Requests which are due but can't be queued keep aging */
+                if( conn->inflight < depth && conn->next_send - now < wait )
+                    wait = conn->next_send - now;
+            }
+            else
+            {
+                while( conn->inflight < depth )
+                    next_request(t, conn, now);
+
+                /* Open loop schedule starts once prefill is over */
+                conn->next_send = now;
+            }
+
+            pfd[i].fd = conn->sock;
+            pfd[i].events = POLLIN | (( conn->wlen > conn->woff ) ? POLLOUT : 0);
+            pfd[i].revents = 0;
+        }
+
+        if( replay_log && pending == 0 )
+        {
+            t->done = 1;
+            break;
+        }
+
+        timeout.tv_sec = 0;
+        timeout.tv_nsec = wait;
+        if( ppoll(pfd, t->nconn, &timeout, NULL) < 0 && errno != EINTR )
+            break;
+
+        now = now_ns();
+        for(i = 0; i < t->nconn; i++)
+        {
+            conn = &t->conns[i];
+
+            if( pfd[i].revents & POLLOUT )
+            {
+                if((n = send(conn->sock, &conn->wbuf[conn->woff], conn->wlen - conn->woff, MSG_NOSIGNAL)) > 0)
+                    conn->woff += n;
+                if( conn->woff == conn->wlen )
+                    conn->woff = conn->wlen = 0;
+            }
+
+            if( pfd[i].revents & (POLLIN | POLLERR | POLLHUP) )
+            {
+                n = recv(conn->sock, &conn->rbuf[conn->rlen], BENCH_RBUF_SIZE - conn->rlen, 0);
+                if( n == 0 || ( n < 0 && errno != EAGAIN ))
+                {
+                    fprintf(stderr, "Connection closed by server\n");
+                    running = 0;
+                    break;
+                }
+                if( n > 0 )
+                {
+                    conn->rlen += n;
+                    if( parse_responses(t, conn, now) )
+                    {
+                        running = 0;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    pthread_exit(NULL);
+}
+
+static int replay_compare(const void *a, const void *b)
+{
+    const capture_record_t *ra = a, *rb = b;
+
+    return ( ra->time > rb->time ) - ( ra->time < rb->time );
+}
+
+/*
+ * Load capture log, only GET and SET are replayed
+ * Returns largest value length or -1 on failure
+ */
+static int replay_load(const char *path)
+{
+    capture_header_t *header;
+    capture_record_t *rec;
+    struct stat st;
+    uint64_t i, count;
+    int fd, val_max = 0;
+    void *map;
+
+    if((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) ||
+       st.st_size < sizeof(capture_header_t) ||
+       (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    {
+        fprintf(stderr, "Failed to open %s : %s\n", path, strerror(errno));
+        return -1;
+    }
+    close(fd);
+
+    header = (capture_header_t*)map;
+    if( header->magic != CAPTURE_MAGIC || header->version != CAPTURE_VERSION ||
+        header->record_size != sizeof(capture_record_t) ||
+        st.st_size < sizeof(capture_header_t) + header->capacity * sizeof(capture_record_t) )
+    {
+        fprintf(stderr, "%s is not a capture log\n", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    /* Ring may have wrapped, order is restored by sorting on time */
+    count = ( header->head < header->capacity ) ? header->head : header->capacity;
+    rec = (capture_record_t*)&header[1];
+
+    if((replay_log = malloc(count * sizeof(capture_record_t) + 1)) == NULL)
+        return -1;
+
+    for(i = 0; i < count; i++)
+    {
+        if( rec[i].time == 0 || rec[i].key_len == 0 ||
+            ( rec[i].opcode != MCACHE_OPCODE_GET && rec[i].opcode != MCACHE_OPCODE_SET ))
+            continue;
+
+        replay_log[replay_count] = rec[i];
+        if( replay_log[replay_count].key_len > BENCH_KEY_MAX )
+            replay_log[replay_count].key_len = BENCH_KEY_MAX;
+        if( replay_log[replay_count].val_len > BENCH_VAL_MAX )
+            replay_log[replay_count].val_len = BENCH_VAL_MAX;
+        if( replay_log[replay_count].val_len > val_max )
+            val_max = replay_log[replay_count].val_len;
+        replay_count++;
+    }
+    munmap(map, st.st_size);
+
+    if( replay_count == 0 )
+    {
+        fprintf(stderr, "%s has no GET or SET records\n", path);
+        return -1;
+    }
+
+    qsort(replay_log, replay_count, sizeof(capture_record_t), replay_compare);
+
+    return val_max;
+}
+
+/*
+ * Spread records over connections by key, keeps per key ordering
+ */
+static int replay_assign(bench_thread_t *threads)
+{
+    conn_t **conns;
+    conn_t *conn;
+    uint32_t i;
+    int j, k, n = 0;
+
+    if((conns = calloc(nconns, sizeof(conn_t*))) == NULL)
+        return -1;
+
+    for(j = 0; j < nthreads; j++)
+        for(k = 0; k < threads[j].nconn; k++)
+            conns[n++] = &threads[j].conns[k];
+
+    for(i = 0; i < replay_count; i++)
+        conns[replay_log[i].key_hash % nconns]->replay_len++;
+
+    for(j = 0; j < nconns; j++)
+    {
+        if((conns[j]->replay = malloc(conns[j]->replay_len * sizeof(uint32_t) + 1)) == NULL)
+            return -1;
+        conns[j]->replay_len = 0;
+    }
+
+    for(i = 0; i < replay_count; i++)
+    {
+        conn = conns[replay_log[i].key_hash % nconns];
+        conn->replay[conn->replay_len++] = i;
+    }
+
+    free(conns);
+
+    return 0;
+}
+
+static int parse_dist(const char *str, dist_t *d)
+{
+    unsigned int a, b;
+
+    if( sscanf(str, "uniform:%u-%u", &a, &b) == 2 && a <= b )
+    {
+        d->type = DIST_UNIFORM;
+        d->min = a;
+        d->max = b;
+    }
+    else if( sscanf(str, "fixed:%u", &a) == 1 || sscanf(str, "%u", &a) == 1 )
+    {
+        d->type = DIST_FIXED;
+        d->min = d->max = a;
+    }
+    else
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    printf("usage : %s [options]\n", name);
+    printf("-s host      : server, default %s\n", host);
+    printf("-p port      : port, default %d\n", port);
+    printf("-T threads   : client threads, default %d\n", nthreads);
+    printf("-c conns     : total connections, default %d\n", nconns);
+    printf("               ( server serves one connection per worker thread )\n");
+    printf("-D depth     : requests in flight per connection, default %d\n", depth);
+    printf("-d seconds   : duration, default %d\n", duration);
+    printf("-r rate      : total requests per second ( open loop ), default closed loop\n");
+    printf("-g ratio     : GET ratio 0.0 - 1.0, default %.2f\n", get_ratio);
+    printf("-K keys      : key space, default %lu\n", (unsigned long)keyspace);
+    printf("-z theta     : zipfian key popularity ( 0 < theta < 1 ), default uniform\n");
+    printf("-k dist      : key size, fixed:N or uniform:A-B, default fixed:%u\n", key_dist.min);
+    printf("-v dist      : value size, fixed:N or uniform:A-B, default fixed:%u\n", val_dist.min);
+    printf("-P           : set every key once before measuring\n");
+    printf("-f file      : replay server capture log instead of generated keys\n");
+    printf("-x speed     : replay speed factor, 0 as fast as possible, default %.1f\n", replay_speed);
+    printf("               ( replay runs until log is done unless -d is given )\n");
+}
+
+static void report(const char *name, histogram_t *h, uint64_t ops, double secs)
+{
+    if( h->count == 0 )
+        return;
+
+    printf("%-4s %10lu ops %10.0f ops/s  lat(us) mean %8.1f p50 %8.1f p90 %8.1f p99 %8.1f p999 %8.1f p9999 %8.1f max %8.1f\n",
+           name, (unsigned long)ops, ops / secs,
+           histogram_mean(h) / 1000.0,
+           histogram_percentile(h, 50.0) / 1000.0,
+           histogram_percentile(h, 90.0) / 1000.0,
+           histogram_percentile(h, 99.0) / 1000.0,
+           histogram_percentile(h, 99.9) / 1000.0,
+           histogram_percentile(h, 99.99) / 1000.0,
+           h->max / 1000.0);
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *names[OP_COUNT] = { "get", "set" };
+    bench_thread_t *threads;
+    histogram_t *total[OP_COUNT];
+    uint64_t ops[OP_COUNT] = { 0 };
+    uint64_t misses = 0, errors = 0;
+    uint64_t start, elapsed, prefilled;
+    struct timespec tick = { 0, 10000000 };
+    int duration_set = 0;
+    int done, opt, i, j;
+
+    while((opt = getopt(argc, argv, "s:p:T:c:D:d:r:g:K:z:k:v:Pf:x:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 's': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'T': nthreads = atoi(optarg); break;
+            case 'c': nconns = atoi(optarg); break;
+            case 'D': depth = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); duration_set = 1; break;
+            case 'r': rate = atof(optarg); break;
+            case 'g': get_ratio = atof(optarg); break;
+            case 'K': keyspace = strtoull(optarg, NULL, 10); break;
+            case 'z': zipf_theta = atof(optarg); break;
+            case 'P': prefill = 1; break;
+            case 'f': replay_path = optarg; break;
+            case 'x': replay_speed = atof(optarg); break;
+            case 'k':
+                if( parse_dist(optarg, &key_dist) || key_dist.max > BENCH_KEY_MAX || key_dist.min == 0 )
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'v':
+                if( parse_dist(optarg, &val_dist) || val_dist.max > BENCH_VAL_MAX )
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return ( opt == 'h' ) ? 0 : 1;
+        }
+    }
+
+    if( nthreads < 1 || nconns < nthreads || nconns > BENCH_MAX_CONN || depth < 1 ||
+        keyspace == 0 || zipf_theta < 0 || zipf_theta >= 1.0 )
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if( replay_path )
+    {
+        if((i = replay_load(replay_path)) < 0 )
+            return 1;
+
+        /* Generated load options don't apply */
+        val_dist.max = i;
+        zipf_theta = 0;
+        rate = 0;
+        prefill = 0;
+    }
+
+    if( zipf_theta > 0 )
+        zipf_init(&zipf, keyspace, zipf_theta);
+
+    if((value_data = malloc(val_dist.max + 1)) == NULL)
+        return 1;
+    memset(value_data, 'v', val_dist.max + 1);
+
+    threads = calloc(nthreads, sizeof(bench_thread_t));
+    for(i = 0; i < nthreads; i++)
+    {
+        bench_thread_t *t = &threads[i];
+
+        t->index = i;
+        t->nconn = nconns / nthreads + ( i < nconns % nthreads );
+        t->conns = calloc(t->nconn, sizeof(conn_t));
+        t->rng = mix(i + 1) | 1;
+        t->interval = ( rate > 0 ) ? (uint64_t)(1e9 * nconns / rate) : 0;
+
+        if( prefill )
+        {
+            t->prefill_next = keyspace * i / nthreads;
+            t->prefill_end = keyspace * (i + 1) / nthreads;
+        }
+
+        for(j = 0; j < OP_COUNT; j++)
+            t->latency[j] = histogram_create();
+
+        for(j = 0; j < t->nconn; j++)
+        {
+            if( conn_open(&t->conns[j]) )
+                return 1;
+        }
+    }
+
+    if( replay_log && replay_assign(threads) )
+        return 1;
+
+    /* Nothing to prefill in replay, every request counts */
+    measuring = ( replay_log != NULL );
+    replay_start = now_ns();
+    for(i = 0; i < nthreads; i++)
+        pthread_create(&threads[i].tid, NULL, bench_task, &threads[i]);
+
+    /* Wait for prefill to complete before measuring */
+    for(;;)
+    {
+        prefilled = 1;
+        for(i = 0; i < nthreads; i++)
+            if( threads[i].prefill_next < threads[i].prefill_end )
+                prefilled = 0;
+        if( prefilled || !running )
+            break;
+        nanosleep(&tick, NULL);
+    }
+
+    start = now_ns();
+    measuring = 1;
+    while( running && (( replay_log && !duration_set ) || now_ns() - start < (uint64_t)duration * 1000000000ULL ))
+    {
+        nanosleep(&tick, NULL);
+
+        for(i = 0, done = 0; i < nthreads; i++)
+            done += threads[i].done;
+        if( replay_log && done == nthreads )
+            break;
+    }
+    measuring = 0;
+    elapsed = now_ns() - start;
+    running = 0;
+
+    for(i = 0; i < nthreads; i++)
+        pthread_join(threads[i].tid, NULL);
+
+    for(j = 0; j < OP_COUNT; j++)
+    {
+        total[j] = histogram_create();
+        for(i = 0; i < nthreads; i++)
+        {
+            histogram_merge(total[j], threads[i].latency[j]);
+            ops[j] += threads[i].ops[j];
+        }
+    }
+    for(i = 0; i < nthreads; i++)
+    {
+        misses += threads[i].misses;
+        errors += threads[i].errors;
+    }
+
+    printf("%s:%d threads %d conns %d depth %d %s", host, port, nthreads, nconns, depth,
+           replay_log ? "replay" : ( rate > 0 ) ? "open loop" : "closed loop");
+    if( rate > 0 )
+        printf(" rate %.0f/s", rate);
+    if( replay_log )
+        printf(" %s %u records speed %.1f\n", replay_path, replay_count, replay_speed);
+    else
+        printf(" keys %lu %s\n", (unsigned long)keyspace, ( zipf_theta > 0 ) ? "zipfian" : "uniform");
+
+    for(j = 0; j < OP_COUNT; j++)
+        report(names[j], total[j], ops[j], elapsed / 1e9);
+
+    printf("total %lu ops/s, get misses %lu, errors %lu\n",
+           (unsigned long)((ops[OP_GET] + ops[OP_SET]) / (elapsed / 1e9)),
+           (unsigned long)misses, (unsigned long)errors);
+
+    return 0;
+}
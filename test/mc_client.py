@@ -0,0 +1,79 @@
+# Text protocol client and server helpers of the loopback tests
+import socket
+import subprocess
+import sys
+import time
+
+class Client:
+    def __init__(self, port):
+        self.sock = socket.create_connection(("127.0.0.1", port))
+        self.sock.settimeout(10)
+        self.buf = b""
+
+    def line(self):
+        while b"\r\n" not in self.buf:
+            data = self.sock.recv(65536)
+            if not data:
+                raise IOError("connection closed")
+            self.buf += data
+        line, self.buf = self.buf.split(b"\r\n", 1)
+        return line.decode()
+
+    def cmd(self, text):
+        self.sock.sendall(text.encode() + b"\r\n")
+        return self.line()
+
+    def set(self, key, value):
+        return self.cmd("set %s 0 0 %d\r\n%s" % (key, len(value), value))
+
+    def get_multi(self, keys):
+        self.sock.sendall(("get %s\r\n" % " ".join(keys)).encode())
+        values = []
+        line = self.line()
+        while line != "END":
+            values.append((line.split(" ")[1], self.line()))
+            line = self.line()
+        return values
+
+    def get(self, key):
+        values = self.get_multi([key])
+        return values[0][1] if values else None
+
+    def stats(self):
+        self.sock.sendall(b"stats\r\n")
+        stats = {}
+        line = self.line()
+        while line != "END":
+            _, name, value = line.split(" ", 2)
+            stats[name] = value
+            line = self.line()
+        return stats
+
+    def close(self):
+        self.sock.close()
+
+def start(binary, *args):
+    server = subprocess.Popen([binary, "-l", "4096"] + list(args),
+                              stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    time.sleep(0.5)
+    return server
+
+def wait(what, timeout=5):
+    end = time.time() + timeout
+    while time.time() < end:
+        if what():
+            return True
+        time.sleep(0.05)
+    return False
+
+failed = 0
+
+def check(name, ok):
+    global failed
+    print("%-50s %s" % (name, "pass" if ok else "FAIL"))
+    if not ok:
+        failed += 1
+
+def finish():
+    print("%d failed" % failed)
+    sys.exit(1 if failed else 0)
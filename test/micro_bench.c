@@ -0,0 +1,529 @@
+/*
+ * Microbenchmarks of cache internals
+ *
+ * Drives cache_data_alloc, avl_insert / avl_find and hash_table_insert /
+ * hash_table_search / hash_table_search_many ( batches of MANY_BATCH keys,
+ * as a multi-get ) in isolation over a matrix of key counts, key length
+ * distributions and thread counts. Reports ns/op, hardware cache misses
+ * per op ( when perf events are permitted ) and heap allocations per op
+ * ( malloc family is wrapped at link time ).
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "avl.h"
+#include "cache_data.h"
+#include "hash_table.h"
+#include "trace.h"
+
+#define MAX_LIST        16
+#define MAX_THREADS     64
+#define MANY_BATCH      100
+
+enum
+{
+    OP_ALLOC,
+    OP_AVL_INSERT,
+    OP_AVL_FIND,
+    OP_HT_INSERT,
+    OP_HT_SEARCH,
+    OP_HT_SEARCH_MANY,
+    OP_COUNT,
+};
+
+typedef struct dist_s
+{
+    uint32_t min;
+    uint32_t max;
+    char name[32];
+} dist_t;
+
+typedef struct job_s
+{
+    int op;
+    uint64_t begin;
+    uint64_t end;
+    pthread_barrier_t *barrier;
+    uint64_t ns;
+    uint64_t misses;
+    int perf_ok;
+} job_t;
+
+static const char *op_names[OP_COUNT] =
+{
+    "cache_data_alloc", "avl_insert", "avl_find", "hash_table_insert", "hash_table_search",
+    "hash_table_many"
+};
+
+/* Options */
+static uint64_t key_counts[MAX_LIST] = { 1000, 10000, 100000, 1000000 };
+static int nkey_counts = 4;
+static int thread_counts[MAX_LIST] = { 1, 2, 4 };
+static int nthread_counts = 3;
+static dist_t key_dists[MAX_LIST] = { { 16, 16, "fixed:16" }, { 8, 64, "uniform:8-64" } };
+static int nkey_dists = 2;
+static uint32_t hash_size = 256;
+static int val_len = 32;
+
+/* Shared state of a run */
+static uint8_t **keys;
+static uint32_t *key_lens;
+static uint64_t *order;
+static cache_data_t **items;
+static cache_data_t **probes;
+static avl_tree_t *tree;
+static hash_table_t *ht;
+static uint8_t value[1024];
+
+/* Allocation counters, malloc family is wrapped with -Wl,--wrap */
+static uint64_t alloc_count;
+static uint64_t alloc_bytes;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+void *__wrap_malloc(size_t size)
+{
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&alloc_bytes, size, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&alloc_bytes, n * size, __ATOMIC_RELAXED);
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&alloc_bytes, size, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr)
+{
+    __real_free(ptr);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static uint64_t rnd(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * Per thread hardware cache miss counter, -1 when not permitted
+ */
+static int perf_open(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void run_op(int op, uint64_t i)
+{
+    uint64_t k = order[i];
+    cache_data_t *found;
+
+    switch(op)
+    {
+        case OP_ALLOC:
+            items[k] = cache_data_alloc(key_lens[k], val_len, keys[k], value);
+            break;
+        case OP_AVL_INSERT:
+            avl_insert(tree, &items[k]->node, NULL);
+            break;
+        case OP_AVL_FIND:
+            if( avl_find(tree, &probes[k]->node) == NULL )
+                fprintf(stderr, "avl_find missed key %lu\n", (unsigned long)k);
+            break;
+        case OP_HT_INSERT:
+            hash_table_insert(ht, items[k], NULL);
+            break;
+        case OP_HT_SEARCH:
+            if((found = hash_table_search(ht, probes[k])) == NULL )
+                fprintf(stderr, "hash_table_search missed key %lu\n", (unsigned long)k);
+            cache_data_release(found);
+            break;
+    }
+}
+
+/*
+ * Look up keys begin to end in batches, as a multi-get does
+ */
+static void run_many(uint64_t begin, uint64_t end)
+{
+    uint8_t *batch_keys[MANY_BATCH];
+    uint32_t batch_lens[MANY_BATCH];
+    cache_data_t *found[MANY_BATCH];
+    uint64_t i;
+    int n, j;
+
+    for(i = begin; i < end; i += n)
+    {
+        n = ( end - i < MANY_BATCH ) ? end - i : MANY_BATCH;
+        for(j = 0; j < n; j++)
+        {
+            batch_keys[j] = keys[order[i + j]];
+            batch_lens[j] = key_lens[order[i + j]];
+        }
+
+        if( hash_table_search_many(ht, batch_keys, batch_lens, n, found) != n )
+            fprintf(stderr, "hash_table_search_many missed keys\n");
+
+        for(j = 0; j < n; j++)
+            cache_data_release(found[j]);
+    }
+}
+
+static void *job_task(void *args)
+{
+    job_t *job = (job_t*)args;
+    uint64_t start, i;
+    uint64_t count = 0;
+    int fd = perf_open();
+
+    job->perf_ok = ( fd >= 0 );
+
+    pthread_barrier_wait(job->barrier);
+
+    if( fd >= 0 )
+    {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    start = now_ns();
+    if( job->op == OP_HT_SEARCH_MANY )
+        run_many(job->begin, job->end);
+    else
+    {
+        for(i = job->begin; i < job->end; i++)
+            run_op(job->op, i);
+    }
+    job->ns = now_ns() - start;
+
+    if( fd >= 0 )
+    {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if( read(fd, &count, sizeof(count)) != sizeof(count) )
+            job->perf_ok = 0;
+        close(fd);
+    }
+    job->misses = count;
+
+    return NULL;
+}
+
+/*
+ * Run op over all keys split across threads and print one result line
+ */
+static void measure(int op, uint64_t n, dist_t *dist, int nthreads)
+{
+    pthread_t tids[MAX_THREADS];
+    job_t jobs[MAX_THREADS];
+    pthread_barrier_t barrier;
+    uint64_t allocs, bytes, misses = 0, ns = 0;
+    int perf_ok = 1;
+    int i;
+
+    pthread_barrier_init(&barrier, NULL, nthreads);
+
+    allocs = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+    bytes = __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED);
+
+    for(i = 0; i < nthreads; i++)
+    {
+        jobs[i].op = op;
+        jobs[i].begin = n * i / nthreads;
+        jobs[i].end = n * (i + 1) / nthreads;
+        jobs[i].barrier = &barrier;
+        pthread_create(&tids[i], NULL, job_task, &jobs[i]);
+    }
+
+    for(i = 0; i < nthreads; i++)
+    {
+        pthread_join(tids[i], NULL);
+
+        /* Wall time of the slowest thread */
+        if( jobs[i].ns > ns )
+            ns = jobs[i].ns;
+        misses += jobs[i].misses;
+        perf_ok &= jobs[i].perf_ok;
+    }
+
+    allocs = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED) - allocs;
+    bytes = __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED) - bytes;
+
+    pthread_barrier_destroy(&barrier);
+
+    printf("%-18s %9lu %-14s %3d %9.1f %9.2f ", op_names[op], (unsigned long)n, dist->name, nthreads,
+           (double)ns * nthreads / n, n / (ns / 1e3));
+    if( perf_ok )
+        printf("%9.2f ", (double)misses / n);
+    else
+        printf("%9s ", "-");
+    printf("%9.2f %9.1f\n", (double)allocs / n, (double)bytes / n);
+}
+
+/*
+ * Generate n random keys with lengths from dist
+ */
+static int make_keys(uint64_t n, dist_t *dist)
+{
+    static const char chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    uint64_t rng = 0x9E3779B97F4A7C15ULL;
+    char digits[24];
+    uint64_t i, j, t;
+    uint32_t len;
+
+    keys = calloc(n, sizeof(uint8_t*));
+    key_lens = calloc(n, sizeof(uint32_t));
+    order = calloc(n, sizeof(uint64_t));
+    items = calloc(n, sizeof(cache_data_t*));
+    probes = calloc(n, sizeof(cache_data_t*));
+
+    if( !keys || !key_lens || !order || !items || !probes )
+        return -1;
+
+    for(i = 0; i < n; i++)
+    {
+        len = dist->min + ( dist->max > dist->min ? rnd(&rng) % (dist->max - dist->min + 1) : 0 );
+
+        /* Index is encoded at the end so every key is unique */
+        if( len < 12 )
+            len = 12;
+        if((keys[i] = malloc(len)) == NULL)
+            return -1;
+        for(j = 0; j < len - 11; j++)
+            keys[i][j] = chars[rnd(&rng) % (sizeof(chars) - 1)];
+        snprintf(digits, sizeof(digits), "%011lu", (unsigned long)i);
+        memcpy(&keys[i][len - 11], digits, 11);
+
+        key_lens[i] = len;
+        order[i] = i;
+    }
+
+    /* Random access order */
+    for(i = n - 1; i > 0; i--)
+    {
+        j = rnd(&rng) % (i + 1);
+        t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+
+    /* Lookup keys live in separate memory like request keys do */
+    for(i = 0; i < n; i++)
+    {
+        if((probes[i] = cache_data_alloc(key_lens[i], 0, keys[i], NULL)) == NULL)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void free_keys(uint64_t n)
+{
+    uint64_t i;
+
+    for(i = 0; i < n; i++)
+    {
+        free(keys[i]);
+        cache_data_free(probes[i]);
+    }
+
+    free(keys);
+    free(key_lens);
+    free(order);
+    free(items);
+    free(probes);
+}
+
+static void free_items(uint64_t n)
+{
+    uint64_t i;
+
+    for(i = 0; i < n; i++)
+        cache_data_free(items[i]);
+}
+
+static void run(uint64_t n, dist_t *dist, int nthreads)
+{
+    uint32_t i;
+
+    /* Allocation */
+    measure(OP_ALLOC, n, dist, nthreads);
+
+    /* AVL is not thread safe, single threaded only */
+    if( nthreads == 1 )
+    {
+        tree = avl_create();
+        measure(OP_AVL_INSERT, n, dist, 1);
+        measure(OP_AVL_FIND, n, dist, 1);
+        
+        /* Links are in the items, next insert takes them over */
+        free(tree);
+    }
+
+    /* Hash table with bucket locks */
+    ht = hash_table_create(hash_size);
+    measure(OP_HT_INSERT, n, dist, nthreads);
+    measure(OP_HT_SEARCH, n, dist, nthreads);
+    measure(OP_HT_SEARCH_MANY, n, dist, nthreads);
+    for(i = 0; i < ht->size; i++)
+        ht->table[i].tree->head = NULL;
+    free_items(n);
+
+    /* Items were freed above, destroy only frees empty trees now */
+    hash_table_destroy(ht);
+}
+
+static int parse_list_u64(char *str, uint64_t *list)
+{
+    int n = 0;
+    char *tok;
+
+    for(tok = strtok(str, ","); tok && n < MAX_LIST; tok = strtok(NULL, ","))
+        list[n++] = strtoull(tok, NULL, 10);
+
+    return n;
+}
+
+static int parse_list_int(char *str, int *list)
+{
+    int n = 0;
+    char *tok;
+
+    for(tok = strtok(str, ","); tok && n < MAX_LIST; tok = strtok(NULL, ","))
+    {
+        if((list[n] = atoi(tok)) > 0 && list[n] <= MAX_THREADS)
+            n++;
+    }
+
+    return n;
+}
+
+static int parse_dists(char *str)
+{
+    unsigned int a, b;
+    char *tok;
+    int n = 0;
+
+    for(tok = strtok(str, ","); tok && n < MAX_LIST; tok = strtok(NULL, ","))
+    {
+        if( sscanf(tok, "uniform:%u-%u", &a, &b) == 2 && a <= b )
+            key_dists[n].min = a, key_dists[n].max = b;
+        else if( sscanf(tok, "fixed:%u", &a) == 1 )
+            key_dists[n].min = key_dists[n].max = a;
+        else
+            return -1;
+
+        if( key_dists[n].max > 250 )
+            return -1;
+        snprintf(key_dists[n].name, sizeof(key_dists[n].name), "%s", tok);
+        n++;
+    }
+
+    nkey_dists = n;
+
+    return n ? 0 : -1;
+}
+
+static void usage(const char *name)
+{
+    printf("usage : %s [options]\n", name);
+    printf("-n counts  : key counts, default 1000,10000,100000,1000000\n");
+    printf("-k dists   : key lengths, fixed:N or uniform:A-B list, default fixed:16,uniform:8-64\n");
+    printf("-t threads : thread counts, default 1,2,4\n");
+    printf("-H size    : hash size, default %u\n", hash_size);
+    printf("-l len     : value length, default %d\n", val_len);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, i, j, k;
+
+    while((opt = getopt(argc, argv, "n:k:t:H:l:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n': nkey_counts = parse_list_u64(optarg, key_counts); break;
+            case 't': nthread_counts = parse_list_int(optarg, thread_counts); break;
+            case 'H': hash_size = atoi(optarg); break;
+            case 'l': val_len = atoi(optarg); break;
+            case 'k':
+                if( parse_dists(optarg) == 0 )
+                    break;
+                /* fall through */
+            default:
+                usage(argv[0]);
+                return ( opt == 'h' ) ? 0 : 1;
+        }
+    }
+
+    if( nkey_counts == 0 || nthread_counts == 0 || hash_size == 0 ||
+        val_len < 0 || val_len > sizeof(value) )
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    set_trace_level(TRACE_LEVEL_ERROR);
+    hash_table_init();
+    memset(value, 'v', sizeof(value));
+
+    printf("%-18s %9s %-14s %3s %9s %9s %9s %9s %9s\n",
+           "op", "keys", "key_len", "thr", "ns/op", "Mops/s", "miss/op", "alloc/op", "bytes/op");
+
+    for(i = 0; i < nkey_counts; i++)
+    {
+        for(j = 0; j < nkey_dists; j++)
+        {
+            if( make_keys(key_counts[i], &key_dists[j]) )
+            {
+                fprintf(stderr, "Failed to allocate %lu keys\n", (unsigned long)key_counts[i]);
+                return 1;
+            }
+
+            for(k = 0; k < nthread_counts; k++)
+                run(key_counts[i], &key_dists[j], thread_counts[k]);
+
+            free_keys(key_counts[i]);
+        }
+    }
+
+    return 0;
+}
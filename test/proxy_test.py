@@ -0,0 +1,55 @@
+#!/usr/bin/python
+# Proxy in front of three backends on loopback, run from the top directory
+# after make
+# proxy_test.py [binary [port]], uses port to port + 3
+import sys
+import time
+from mc_client import Client, check, finish, start
+
+binary = sys.argv[1] if len(sys.argv) > 1 else "bin/repo"
+port = int(sys.argv[2]) if len(sys.argv) > 2 else 5200
+proxy_port = port
+backend_ports = [port + 1, port + 2, port + 3]
+proxy_threads = 2
+
+# Backends hold a connection per proxy worker, they get more threads
+backends = [start(binary, "-p", str(p), "-t", str(proxy_threads + 2)) for p in backend_ports]
+proxy = start(binary, "-p", str(proxy_port), "-t", str(proxy_threads),
+              "-P", ",".join("127.0.0.1:%d" % p for p in backend_ports))
+
+try:
+    c = Client(proxy_port)
+    b = [Client(p) for p in backend_ports]
+    keys = ["key%d" % i for i in range(1000)]
+
+    check("sets stored", all(c.set(k, "value" + k) == "STORED" for k in keys))
+    check("gets through proxy", all(c.get(k) == "value" + k for k in keys))
+    check("multi get in key order", c.get_multi(keys[:100]) == [(k, "value" + k) for k in keys[:100]])
+    owners = [sum(1 for x in b if x.get(k) is not None) for k in keys]
+    check("each key on one backend", owners == [1] * len(keys))
+    check("keys on every backend", all(any(x.get(k) for k in keys) for x in b))
+
+    check("delete through proxy", c.cmd("delete key0") == "DELETED" and c.get("key0") is None)
+    c.set("count", "10")
+    check("increment through proxy", c.cmd("incr count 5") == "15")
+    check("flush on every backend", c.cmd("flush_all") == "OK" and all(x.get(k) is None for x in b for k in keys[:50]))
+
+    # Keys of a backend that is down miss, the rest are served
+    for k in keys:
+        c.set(k, "value" + k)
+    lost = [k for k in keys if b[0].get(k) is not None]
+    b[0].close()
+    backends[0].kill()
+    backends[0].wait()
+    start_time = time.time()
+    check("backend down is a miss", c.get(lost[0]) is None and time.time() - start_time < 5)
+    check("other backends served", all(c.get(k) == "value" + k for k in keys[:200] if k not in lost))
+    c.close()
+    for x in b[1:]:
+        x.close()
+finally:
+    proxy.kill()
+    for server in backends:
+        server.kill()
+
+finish()
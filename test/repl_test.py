@@ -0,0 +1,47 @@
+#!/usr/bin/python
+# Primary and replica on loopback, run from the top directory after make
+# repl_test.py [binary [port]], uses port to port + 2
+import sys
+from mc_client import Client, check, finish, start, wait
+
+binary = sys.argv[1] if len(sys.argv) > 1 else "bin/repo"
+port = int(sys.argv[2]) if len(sys.argv) > 2 else 5100
+primary_port = port
+replica_port = port + 1
+repl_port = port + 2
+
+primary = start(binary, "-t", "4", "-p", str(primary_port), "-R", str(repl_port))
+replica = start(binary, "-t", "4", "-p", str(replica_port), "-F", "127.0.0.1:%d" % repl_port)
+
+try:
+    p = Client(primary_port)
+    r = Client(replica_port)
+    check("replica connected", wait(lambda: p.stats().get("repl_replicas") == "1"))
+
+    for i in range(1000):
+        p.set("key%d" % i, "value%d" % i)
+    for i in range(0, 1000, 10):
+        p.cmd("delete key%d" % i)
+    p.set("count", "10")
+    p.cmd("incr count 5")
+    check("increment applied", wait(lambda: r.get("count") == "15"))
+    check("sets and deletes applied", all(r.get("key%d" % i) == (None if i % 10 == 0 else "value%d" % i) for i in range(1000)))
+
+    # Restarted primary has none of the keys, replica must not keep them
+    p.close()
+    primary.kill()
+    primary.wait()
+    primary = start(binary, "-t", "4", "-p", str(primary_port), "-R", str(repl_port))
+    p = Client(primary_port)
+    check("replica connected again", wait(lambda: p.stats().get("repl_replicas") == "1"))
+    p.set("after", "1")
+    check("new set applied", wait(lambda: r.get("after") == "1"))
+    check("old keys flushed", r.get("key1") is None and r.get("count") is None)
+    check("flush counted", r.stats().get("repl_flushes") == "1")
+    p.close()
+    r.close()
+finally:
+    primary.kill()
+    replica.kill()
+
+finish()
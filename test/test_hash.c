@@ -38,18 +38,24 @@ int main()
         //avl_inorder(ht->table[0].tree);
         //printf("\n\n\n");
         //avl_preorder(ht->table[0].tree);
-        hash_data_node_t *h = NULL;
+        cache_data_t *h = NULL;
 
         for(i=0;i<TEST_SZ;i++)
             if((h = hash_table_search(ht, d[i])))
-                cache_data_dump(h->data);
+            {
+                cache_data_dump(h);
+                cache_data_release(h);
+            }
             else
                 printf("Not Found");
 
         cache_data_t *d1 = cache_data_alloc(7,6,"Hello1","Value");
 
         if((h = hash_table_search(ht, d1)))
-                cache_data_dump(h->data);
+            {
+                cache_data_dump(h);
+                cache_data_release(h);
+            }
             else
                 printf("Not Found");
     }